@@ -0,0 +1,930 @@
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "DifferentialTester.h"
+#include "../../vm/Compiler.h"
+#include "../../vm/CompiledModule.h"
+#include "../../vm/JITCompiler.h"
+#include <algorithm>
+#include <chrono>
+#include <charconv>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <random>
+#include <sstream>
+
+namespace AetherVisor {
+    namespace VM {
+
+        namespace {
+            std::string RenderValue(const VMValue& value) {
+                char buffer[32];
+                switch (value.type) {
+                    case VMDataType::INT32: return "i32:" + std::to_string(value.data.i32);
+                    case VMDataType::INT64: return "i64:" + std::to_string(value.data.i64);
+                    case VMDataType::FLOAT32:
+                    case VMDataType::FLOAT64: {
+                        double number = value.type == VMDataType::FLOAT32 ? value.data.f32 : value.data.f64;
+                        auto end = std::to_chars(buffer, buffer + sizeof(buffer), number).ptr;
+                        return (value.type == VMDataType::FLOAT32 ? "f32:" : "f64:") + std::string(buffer, end);
+                    }
+                    case VMDataType::BOOLEAN: return value.data.boolean ? "bool:true" : "bool:false";
+                    case VMDataType::STRING: return "str:" + std::string(value.data.string.data, value.data.string.length);
+                    case VMDataType::UNDEFINED: return "null";
+                    default: return "type" + std::to_string(static_cast<int>(value.type));
+                }
+            }
+
+            const char* GetStateName(VMState state) {
+                switch (state) {
+                    case VMState::READY: return "READY";
+                    case VMState::RUNNING: return "RUNNING";
+                    case VMState::PAUSED: return "PAUSED";
+                    case VMState::HALTED: return "HALTED";
+                    case VMState::ERROR_STATE: return "ERROR";
+                    case VMState::TIMEOUT: return "TIMEOUT";
+                    case VMState::MEMORY_LIMIT_EXCEEDED: return "MEMORY_LIMIT_EXCEEDED";
+                    case VMState::STACK_OVERFLOW: return "STACK_OVERFLOW";
+                    default: return "SECURITY_VIOLATION";
+                }
+            }
+
+            double ElapsedMs(std::chrono::steady_clock::time_point start) {
+                return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            }
+
+            // Source programs terminate by construction: loops have constant trip
+            // counts and functions only call functions declared before them
+            class SourceGenerator {
+            public:
+                SourceGenerator(uint32_t seed, const DifferentialSettings& settings)
+                    : m_random(seed), m_settings(settings), m_next_name(0) {}
+
+                std::string Generate() {
+                    std::vector<std::string> globals;
+                    const uint32_t global_count = 1 + Pick(4);
+                    for (uint32_t i = 0; i < global_count; ++i) {
+                        globals.push_back("g" + std::to_string(i));
+                        m_lines.push_back("var " + globals.back() + " = " + Literal() + ";");
+                    }
+
+                    const uint32_t function_count = Pick(std::max<uint32_t>(m_settings.max_functions, 1) + 1);
+                    for (uint32_t k = 0; k < function_count; ++k) {
+                        const uint32_t param_count = Pick(4);
+                        std::vector<std::string> variables = globals;
+                        std::string params;
+                        for (uint32_t i = 0; i < param_count; ++i) {
+                            variables.push_back("p" + std::to_string(i));
+                            params += (i ? ", " : "") + variables.back();
+                        }
+                        const std::string name = "f" + std::to_string(k);
+                        m_lines.push_back("function " + name + "(" + params + ") {");
+                        Block(variables, variables, 1, true, 1 + Pick(5));
+                        m_lines.push_back("return " + Expression(variables, 0) + ";");
+                        m_lines.push_back("}");
+                        m_functions.push_back({ name, param_count });
+                    }
+
+                    Block(globals, globals, 0, false, 2 + Pick(std::max<uint32_t>(m_settings.max_statements, 2) - 1));
+
+                    std::string summary;
+                    for (const std::string& global : globals) {
+                        summary += (summary.empty() ? "" : ", ") + global;
+                    }
+                    m_lines.push_back("print(" + summary + ");");
+
+                    std::string source;
+                    for (const std::string& line : m_lines) {
+                        source += line + "\n";
+                    }
+                    return source;
+                }
+
+            private:
+                struct Function {
+                    std::string name;
+                    uint32_t param_count;
+                };
+
+                std::mt19937 m_random;
+                const DifferentialSettings& m_settings;
+                std::vector<std::string> m_lines;
+                std::vector<Function> m_functions;
+                uint32_t m_next_name;
+
+                uint32_t Pick(uint32_t count) {
+                    return std::uniform_int_distribution<uint32_t>(0, count - 1)(m_random);
+                }
+
+                std::string Fresh(const char* prefix) {
+                    return prefix + std::to_string(m_next_name++);
+                }
+
+                std::string Literal() {
+                    const uint32_t kind = Pick(100);
+                    if (kind < 8) return "\"s" + std::to_string(Pick(3)) + "\"";
+                    if (kind < 16) return std::to_string(Pick(8)) + ".5";
+                    if (kind < 20) return Pick(2) ? "true" : "false";
+                    return "(" + std::to_string(static_cast<int32_t>(Pick(26)) - 5) + ")";
+                }
+
+                std::string Expression(const std::vector<std::string>& readable, uint32_t depth) {
+                    static const char* const kOperators[] = {
+                        "+", "-", "*", "/", "%", "<", ">", "<=", ">=", "==", "!=",
+                        "&&", "||", "&", "|", "^", "<<", ">>", "+", "-", "*"
+                    };
+                    static const char* const kPrefixes[] = { "-", "!", "~" };
+
+                    const uint32_t kind = Pick(100);
+                    if (depth > 2 || kind < 30) {
+                        return !readable.empty() && Pick(4) ? readable[Pick(static_cast<uint32_t>(readable.size()))] : Literal();
+                    }
+                    if (kind < 75) {
+                        const char* op = kOperators[Pick(sizeof(kOperators) / sizeof(kOperators[0]))];
+                        return "(" + Expression(readable, depth + 1) + " " + op + " " + Expression(readable, depth + 1) + ")";
+                    }
+                    if (kind < 88 && !m_functions.empty()) {
+                        return Call(readable, depth + 1);
+                    }
+                    return std::string("(") + kPrefixes[Pick(3)] + Expression(readable, depth + 1) + ")";
+                }
+
+                std::string Call(const std::vector<std::string>& readable, uint32_t depth) {
+                    const Function& function = m_functions[Pick(static_cast<uint32_t>(m_functions.size()))];
+                    std::string arguments;
+                    for (uint32_t i = 0; i < function.param_count; ++i) {
+                        arguments += (i ? ", " : "") + Expression(readable, depth + 1);
+                    }
+                    return function.name + "(" + arguments + ")";
+                }
+
+                // Variables declared in a block stay readable to its end; loop
+                // counters and catch variables are readable but never assigned
+                void Block(std::vector<std::string> readable, std::vector<std::string> assignable,
+                           uint32_t depth, bool in_function, uint32_t count) {
+                    for (uint32_t i = 0; i < count; ++i) {
+                        const uint32_t kind = Pick(100);
+                        const bool nest = depth < 3;
+                        if (kind < 18) {
+                            const std::string name = Fresh("v");
+                            m_lines.push_back("var " + name + " = " + Expression(readable, 0) + ";");
+                            readable.push_back(name);
+                            assignable.push_back(name);
+                        } else if (kind < 38 && !assignable.empty()) {
+                            m_lines.push_back(assignable[Pick(static_cast<uint32_t>(assignable.size()))] + " = " +
+                                              Expression(readable, 0) + ";");
+                        } else if (kind < 48) {
+                            m_lines.push_back("print(" + Expression(readable, 0) + ", " + Expression(readable, 1) + ");");
+                        } else if (kind < 60 && nest) {
+                            m_lines.push_back("if (" + Expression(readable, 0) + ") {");
+                            Block(readable, assignable, depth + 1, in_function, 1 + Pick(3));
+                            m_lines.push_back("} else {");
+                            Block(readable, assignable, depth + 1, in_function, Pick(3));
+                            m_lines.push_back("}");
+                        } else if (kind < 68 && nest) {
+                            const std::string counter = Fresh("i");
+                            m_lines.push_back("for (var " + counter + " = 0; " + counter + " < " + std::to_string(Pick(5)) +
+                                              "; " + counter + " = " + counter + " + 1) {");
+                            std::vector<std::string> inner = readable;
+                            inner.push_back(counter);
+                            Block(inner, assignable, depth + 1, in_function, 1 + Pick(3));
+                            m_lines.push_back("}");
+                        } else if (kind < 73 && nest) {
+                            const std::string counter = Fresh("w");
+                            m_lines.push_back("var " + counter + " = " + std::to_string(Pick(5)) + ";");
+                            m_lines.push_back("while (" + counter + " > 0) {");
+                            m_lines.push_back(counter + " = " + counter + " - 1;");
+                            std::vector<std::string> inner = readable;
+                            inner.push_back(counter);
+                            Block(inner, assignable, depth + 1, in_function, 1 + Pick(3));
+                            m_lines.push_back("}");
+                        } else if (kind < 81 && nest) {
+                            m_lines.push_back("try {");
+                            Block(readable, assignable, depth + 1, in_function, 1 + Pick(3));
+                            const std::string exception = Fresh("e");
+                            m_lines.push_back("} catch (" + exception + ") {");
+                            std::vector<std::string> inner = readable;
+                            inner.push_back(exception);
+                            Block(inner, assignable, depth + 1, in_function, 1 + Pick(2));
+                            m_lines.push_back("}");
+                        } else if (kind < 87) {
+                            m_lines.push_back("if (" + Expression(readable, 1) + ") {");
+                            m_lines.push_back("throw " + Expression(readable, 1) + ";");
+                            m_lines.push_back("}");
+                        } else if (kind < 92 && in_function) {
+                            m_lines.push_back("if (" + Expression(readable, 1) + ") {");
+                            m_lines.push_back("return " + Expression(readable, 1) + ";");
+                            m_lines.push_back("}");
+                        } else if (!m_functions.empty()) {
+                            m_lines.push_back(Call(readable, 1) + ";");
+                        } else {
+                            m_lines.push_back("print(" + Expression(readable, 0) + ");");
+                        }
+                    }
+                }
+            };
+
+            bool ConfigurationFailed(const DifferentialFailure& failure, const std::string& configuration) {
+                return failure.configuration == configuration;
+            }
+        }
+
+        bool ExecutionSnapshot::Matches(const ExecutionSnapshot& reference, std::string* difference) const {
+            std::ostringstream out;
+            if (state != reference.state || error != reference.error) {
+                out << "ended " << GetStateName(state) << " \"" << error << "\", expected "
+                    << GetStateName(reference.state) << " \"" << reference.error << "\"";
+            } else if (output != reference.output) {
+                size_t line = 0;
+                while (line < output.size() && line < reference.output.size() && output[line] == reference.output[line]) {
+                    ++line;
+                }
+                out << "output line " << line + 1 << " is \""
+                    << (line < output.size() ? output[line] : std::string("<missing>")) << "\", expected \""
+                    << (line < reference.output.size() ? reference.output[line] : std::string("<missing>")) << "\"";
+            } else if (globals != reference.globals) {
+                for (const auto& [name, value] : reference.globals) {
+                    auto it = globals.find(name);
+                    const std::string actual = it == globals.end() ? std::string("<missing>") : it->second;
+                    if (actual != value) {
+                        out << "global " << name << " is " << actual << ", expected " << value;
+                        break;
+                    }
+                }
+                if (out.tellp() == 0) out << "globals differ";
+            } else if (state == VMState::HALTED && stack != reference.stack) {
+                out << "stack depth " << stack.size() << ", expected " << reference.stack.size();
+            } else {
+                return true;
+            }
+            if (difference) *difference = out.str();
+            return false;
+        }
+
+        std::string DifferentialReport::Format() const {
+            std::ostringstream out;
+            out << "Programs: " << programs_run << " run, " << programs_skipped << " skipped, "
+                << failures.size() << " failed\n";
+            for (const DifferentialFailure& failure : failures) {
+                out << "\nFAIL seed " << failure.seed << " [" << failure.configuration << "]: "
+                    << failure.difference << "\n" << failure.program;
+                if (!failure.program.empty() && failure.program.back() != '\n') out << "\n";
+            }
+            if (benchmarks.empty()) {
+                return out.str();
+            }
+
+            // Speedups are against O0 over the same passing programs
+            const ConfigurationBenchmark& baseline = benchmarks.front();
+            out << "\n" << std::left << std::setw(12) << "Config" << std::right
+                << std::setw(14) << "Instructions" << std::setw(10) << "Run ms"
+                << std::setw(10) << "Speedup" << std::setw(12) << "Code bytes"
+                << std::setw(12) << "Compile ms" << "\n";
+            out << std::fixed << std::setprecision(2);
+            for (const ConfigurationBenchmark& benchmark : benchmarks) {
+                out << std::left << std::setw(12) << benchmark.name << std::right << std::setw(14);
+                if (benchmark.instructions || benchmark.run_time_ms > 0.0) {
+                    out << benchmark.instructions << std::setw(10) << benchmark.run_time_ms << std::setw(9)
+                        << (benchmark.run_time_ms > 0.0 ? baseline.run_time_ms / benchmark.run_time_ms : 0.0) << "x";
+                } else {
+                    out << "-" << std::setw(10) << "-" << std::setw(10) << "-";
+                }
+                out << std::setw(12) << benchmark.code_size << std::setw(12) << benchmark.compile_time_ms << "\n";
+            }
+            return out.str();
+        }
+
+        DifferentialTester::DifferentialTester(const DifferentialSettings& settings)
+            : m_settings(settings)
+        {
+        }
+
+        DifferentialReport DifferentialTester::Run() {
+            DifferentialReport report;
+            for (uint32_t i = 0; i < m_settings.iterations; ++i) {
+                const uint32_t seed = m_settings.seed + i;
+                const bool bytecode = std::mt19937(seed)() % 100 < m_settings.bytecode_percent;
+
+                DifferentialFailure failure{};
+                CheckResult result;
+                std::vector<BytecodeStatement> statements;
+                std::string source;
+                if (bytecode) {
+                    statements = GenerateStatements(seed);
+                    result = TestBytecode(EncodeStatements(statements), seed, failure, &report.benchmarks);
+                } else {
+                    source = GenerateSource(seed);
+                    result = TestSource(source, seed, failure, &report.benchmarks);
+                }
+
+                if (result == CheckResult::SKIPPED) {
+                    ++report.programs_skipped;
+                    continue;
+                }
+                ++report.programs_run;
+                if (result == CheckResult::PASSED) {
+                    continue;
+                }
+
+                // Re-run the reduced case so the report shows its own difference
+                if (m_settings.shrink_failures) {
+                    const std::string configuration = failure.configuration;
+                    DifferentialFailure reduced{};
+                    if (bytecode) {
+                        statements = ShrinkStatements(std::move(statements), configuration);
+                        TestBytecode(EncodeStatements(statements), seed, reduced, nullptr);
+                    } else {
+                        TestSource(ShrinkSource(source, configuration), seed, reduced, nullptr);
+                    }
+                    if (ConfigurationFailed(reduced, configuration)) {
+                        failure = std::move(reduced);
+                    }
+                }
+                report.failures.push_back(std::move(failure));
+            }
+            return report;
+        }
+
+        bool DifferentialTester::CheckSource(const std::string& source, uint32_t seed, DifferentialFailure& failure,
+                                             std::vector<ConfigurationBenchmark>* benchmarks) {
+            return TestSource(source, seed, failure, benchmarks) != CheckResult::FAILED;
+        }
+
+        bool DifferentialTester::CheckBytecode(const std::vector<uint8_t>& bytecode, uint32_t seed, DifferentialFailure& failure,
+                                               std::vector<ConfigurationBenchmark>* benchmarks) {
+            return TestBytecode(bytecode, seed, failure, benchmarks) != CheckResult::FAILED;
+        }
+
+        std::string DifferentialTester::GenerateSource(uint32_t seed) const {
+            return SourceGenerator(seed, m_settings).Generate();
+        }
+
+        std::vector<uint8_t> DifferentialTester::GenerateBytecode(uint32_t seed) const {
+            return EncodeStatements(GenerateStatements(seed));
+        }
+
+        ExecutionSnapshot DifferentialTester::Execute(const std::vector<uint8_t>& image, uint32_t max_instructions,
+                                                      const std::map<std::string, uint32_t>& global_names, uint32_t repeats,
+                                                      int32_t jit_level) {
+            ExecutionSnapshot snapshot;
+            for (uint32_t run = 0; run < std::max<uint32_t>(repeats, 1); ++run) {
+                VMSecurityContext context{};
+                context.allow_native_calls = true;
+                context.allow_memory_alloc = true;
+                context.max_execution_time = 600000;
+                context.max_memory_usage = 64 * 1024 * 1024;
+                context.max_stack_depth = 256;
+
+                std::vector<std::string> output;
+                VirtualMachine vm;
+                vm.Initialize(context);
+                vm.RegisterNativeFunction("print", [&output](const std::vector<VMValue>& arguments) {
+                    std::string line;
+                    for (const VMValue& argument : arguments) {
+                        line += (line.empty() ? "" : " ") + RenderValue(argument);
+                    }
+                    output.push_back(line);
+                    return VMValue{};
+                });
+                if (!vm.LoadBytecode(image)) {
+                    snapshot.state = VMState::ERROR_STATE;
+                    snapshot.error = std::string("Load failed: ") + vm.GetLastError();
+                    return snapshot;
+                }
+                if (jit_level >= 0) {
+                    JITTierSettings tiers;
+                    tiers.baseline_threshold = TIERED_BASELINE_THRESHOLD;
+                    tiers.optimized_threshold = TIERED_OPTIMIZED_THRESHOLD;
+                    tiers.osr_threshold = TIERED_OSR_THRESHOLD;
+                    tiers.background_compilation = false;     // Tier-ups at reproducible points
+                    const auto compile_start = std::chrono::steady_clock::now();
+                    if (!(jit_level == JIT_TIERED ? vm.EnableTieredJIT(tiers) : vm.EnableJIT(true, static_cast<uint32_t>(jit_level)))) {
+                        snapshot.state = VMState::ERROR_STATE;
+                        snapshot.error = std::string("JIT unavailable: ") + vm.GetLastError();
+                        return snapshot;
+                    }
+                    snapshot.jit_compile_time_ms = ElapsedMs(compile_start);
+                    snapshot.native_code_size = vm.GetNativeCodeSize();
+                }
+
+                const auto start = std::chrono::steady_clock::now();
+                vm.RunSecure(max_instructions);
+                const double elapsed = ElapsedMs(start);
+                if (jit_level == JIT_TIERED) {
+                    // Compiled while running, which the run time includes
+                    const JITTierStatistics& statistics = vm.GetTierStatistics();
+                    snapshot.jit_compile_time_ms = statistics.compile_time_ms[static_cast<size_t>(JITTier::BASELINE)] +
+                                                   statistics.compile_time_ms[static_cast<size_t>(JITTier::OPTIMIZED)];
+                    snapshot.native_code_size = vm.GetNativeCodeSize();
+                }
+                if (run > 0) {
+                    snapshot.run_time_ms = std::min(snapshot.run_time_ms, elapsed);
+                    continue;
+                }
+
+                snapshot.state = vm.GetState();
+                snapshot.error = snapshot.state == VMState::HALTED ? std::string() : vm.GetLastError();
+                for (size_t i = vm.GetStackSize(); i > 0; --i) {
+                    snapshot.stack.push_back(RenderValue(vm.PeekValue(i - 1)));
+                }
+                const std::vector<VMValue>& globals = vm.GetGlobals();
+                if (global_names.empty()) {
+                    for (size_t slot = 0; slot < globals.size(); ++slot) {
+                        snapshot.globals["g" + std::to_string(slot)] = RenderValue(globals[slot]);
+                    }
+                } else {
+                    for (const auto& [name, slot] : global_names) {
+                        snapshot.globals[name] = slot < globals.size() ? RenderValue(globals[slot]) : std::string("null");
+                    }
+                }
+                snapshot.output = std::move(output);
+                snapshot.instructions = vm.GetInstructionCount();
+                snapshot.run_time_ms = elapsed;
+                uint32_t code_size = 0;
+                vm.GetModule()->GetCode(code_size);
+                snapshot.code_size = code_size;
+            }
+            return snapshot;
+        }
+
+        bool DifferentialTester::CompareBytecode(const std::vector<uint8_t>& original, const std::vector<uint8_t>& optimized,
+                                                 const std::vector<VMFunction>& functions,
+                                                 const std::map<uint32_t, uint32_t>& translation,
+                                                 uint32_t max_instructions, std::string* difference) {
+            std::vector<VMFunction> moved = functions;
+            if (!translation.empty()) {
+                for (VMFunction& function : moved) {
+                    if (function.is_native) continue;
+                    auto it = translation.find(function.address);
+                    if (it == translation.end()) {
+                        if (difference) *difference = "function entry was not preserved";
+                        return false;
+                    }
+                    function.address = it->second;
+                }
+            }
+
+            const ExecutionSnapshot expected = Execute(WrapBytecode(original, functions).image, max_instructions);
+            if (expected.state == VMState::TIMEOUT) {
+                return true; // Nothing complete to compare against
+            }
+            return Execute(WrapBytecode(optimized, moved).image, max_instructions).Matches(expected, difference);
+        }
+
+        // O0 compiles with every optimisation off; O1-O3 run the SSA passes and
+        // the bytecode optimiser at that level, as the compiler does by default
+        DifferentialTester::CheckResult DifferentialTester::TestSource(const std::string& source, uint32_t seed,
+                                                                       DifferentialFailure& failure,
+                                                                       std::vector<ConfigurationBenchmark>* benchmarks) {
+            const CompiledProgram reference = CompileSource(source, OptimizationLevel::NONE, false);
+            if (!reference.compiled) {
+                return CheckResult::SKIPPED;
+            }
+            const ExecutionSnapshot expected = Execute(reference.image, m_settings.max_instructions,
+                                                       reference.global_names, m_settings.benchmark_repeats);
+            if (expected.state == VMState::TIMEOUT) {
+                return CheckResult::SKIPPED;
+            }
+
+            std::vector<ConfigurationBenchmark> results;
+            AddBenchmark(results, "O0", expected.instructions, expected.run_time_ms, reference.compile_time_ms, reference.code.size());
+
+            const OptimizationLevel levels[] = { OptimizationLevel::BASIC, OptimizationLevel::MEDIUM, OptimizationLevel::AGGRESSIVE };
+            CompiledProgram optimized;
+            ExecutionSnapshot optimized_expected;
+            for (OptimizationLevel level : levels) {
+                const std::string name = "O" + std::to_string(static_cast<int>(level));
+                failure = { seed, name, source, std::string() };
+
+                CompiledProgram program = CompileSource(source, level, true);
+                if (!program.compiled) {
+                    failure.difference = std::string("compile failed: ") + program.error;
+                    return CheckResult::FAILED;
+                }
+                ExecutionSnapshot snapshot = Execute(program.image, m_settings.max_instructions,
+                                                     program.global_names, m_settings.benchmark_repeats);
+                if (!snapshot.Matches(expected, &failure.difference)) {
+                    return CheckResult::FAILED;
+                }
+                AddBenchmark(results, name, snapshot.instructions, snapshot.run_time_ms, program.compile_time_ms, program.code.size());
+                optimized = std::move(program);
+                optimized_expected = std::move(snapshot);
+            }
+
+            if (m_settings.test_jit && (!TestJIT(reference, expected, "", seed, source, failure, results) ||
+                                        !TestJIT(optimized, optimized_expected, "O3+", seed, source, failure, results))) {
+                return CheckResult::FAILED;
+            }
+
+            failure = DifferentialFailure{};
+            if (benchmarks) {
+                for (const ConfigurationBenchmark& result : results) {
+                    AddBenchmark(*benchmarks, result.name, result.instructions, result.run_time_ms,
+                                 result.compile_time_ms, result.code_size);
+                }
+            }
+            return CheckResult::PASSED;
+        }
+
+        // Raw bytecode goes straight to the optimiser, which has no function
+        // table for it and infers entries
+        DifferentialTester::CheckResult DifferentialTester::TestBytecode(const std::vector<uint8_t>& code, uint32_t seed,
+                                                                         DifferentialFailure& failure,
+                                                                         std::vector<ConfigurationBenchmark>* benchmarks) {
+            const ExecutionSnapshot expected = Execute(WrapBytecode(code, {}).image, m_settings.max_instructions, {},
+                                                       m_settings.benchmark_repeats);
+            if (expected.state == VMState::TIMEOUT) {
+                return CheckResult::SKIPPED;
+            }
+
+            std::vector<ConfigurationBenchmark> results;
+            AddBenchmark(results, "O0", expected.instructions, expected.run_time_ms, 0.0, code.size());
+
+            const OptimizationLevel levels[] = { OptimizationLevel::BASIC, OptimizationLevel::MEDIUM, OptimizationLevel::AGGRESSIVE };
+            std::vector<uint8_t> optimized_code;
+            ExecutionSnapshot optimized_expected;
+            for (OptimizationLevel level : levels) {
+                const std::string name = "O" + std::to_string(static_cast<int>(level));
+                failure = { seed, name, Disassemble(code), std::string() };
+
+                BytecodeOptimizer optimizer;
+                const auto start = std::chrono::steady_clock::now();
+                const std::vector<uint8_t> optimized = optimizer.Optimize(code, level);
+                const double compile_time_ms = ElapsedMs(start);
+                if (!optimizer.ValidateBytecode(optimized)) {
+                    failure.difference = "optimiser produced invalid bytecode";
+                    return CheckResult::FAILED;
+                }
+
+                ExecutionSnapshot snapshot = Execute(WrapBytecode(optimized, {}).image, m_settings.max_instructions, {},
+                                                     m_settings.benchmark_repeats);
+                if (!snapshot.Matches(expected, &failure.difference)) {
+                    return CheckResult::FAILED;
+                }
+                AddBenchmark(results, name, snapshot.instructions, snapshot.run_time_ms, compile_time_ms, optimized.size());
+                optimized_code = optimized;
+                optimized_expected = std::move(snapshot);
+            }
+
+            if (m_settings.test_jit &&
+                (!TestJIT(WrapBytecode(code, {}), expected, "", seed, Disassemble(code), failure, results) ||
+                 !TestJIT(WrapBytecode(optimized_code, {}), optimized_expected, "O3+", seed, Disassemble(code), failure, results))) {
+                return CheckResult::FAILED;
+            }
+
+            failure = DifferentialFailure{};
+            if (benchmarks) {
+                for (const ConfigurationBenchmark& result : results) {
+                    AddBenchmark(*benchmarks, result.name, result.instructions, result.run_time_ms,
+                                 result.compile_time_ms, result.code_size);
+                }
+            }
+            return CheckResult::PASSED;
+        }
+
+        // Runs one compiled configuration under every JIT mode, named with the
+        // given prefix; expected is the interpreter's run of the same code.
+        // Native code must also account for exactly the instructions the
+        // interpreter executes, or timeouts would land elsewhere.
+        bool DifferentialTester::TestJIT(const CompiledProgram& compiled, const ExecutionSnapshot& expected, const std::string& prefix,
+                                         uint32_t seed, const std::string& program, DifferentialFailure& failure,
+                                         std::vector<ConfigurationBenchmark>& benchmarks) const {
+            for (uint32_t level = 0; level <= JIT_LEVELS; ++level) {
+                const bool tiered = level == JIT_LEVELS;
+                const std::string name = prefix + (tiered ? std::string("Tiered") : "JIT" + std::to_string(level));
+                failure = { seed, name, program, std::string() };
+
+                const ExecutionSnapshot snapshot = Execute(compiled.image, m_settings.max_instructions, compiled.global_names,
+                                                           m_settings.benchmark_repeats,
+                                                           tiered ? JIT_TIERED : static_cast<int32_t>(level));
+                if (!snapshot.Matches(expected, &failure.difference)) {
+                    return false;
+                }
+                if (snapshot.instructions != expected.instructions) {
+                    failure.difference = std::string("executed ") + std::to_string(snapshot.instructions) +
+                                         " instructions, expected " + std::to_string(expected.instructions);
+                    return false;
+                }
+                AddBenchmark(benchmarks, name, snapshot.instructions, snapshot.run_time_ms, snapshot.jit_compile_time_ms,
+                             snapshot.native_code_size);
+            }
+            return true;
+        }
+
+        DifferentialTester::CompiledProgram DifferentialTester::CompileSource(const std::string& source, OptimizationLevel level,
+                                                                              bool optimize) const {
+            CompiledProgram program;
+            Compiler compiler;
+            CompilationContext context;
+            context.compile_threads = 1;
+            context.enable_optimization = optimize;
+            context.optimization_level = level;
+
+            const auto start = std::chrono::steady_clock::now();
+            program.compiled = compiler.Compile(source, context);
+            program.compile_time_ms = ElapsedMs(start);
+            if (!program.compiled) {
+                program.error = context.errors.empty() ? std::string() : context.errors.front();
+                return program;
+            }
+
+            program.code = context.bytecode;
+            program.image = CompiledModule::Serialize(context);
+            for (const auto& [name, symbol] : context.global_scope->GetSymbols()) {
+                if (symbol.is_global && !symbol.is_function) {
+                    program.global_names[name] = symbol.address;
+                }
+            }
+            return program;
+        }
+
+        DifferentialTester::CompiledProgram DifferentialTester::WrapBytecode(const std::vector<uint8_t>& code,
+                                                                             const std::vector<VMFunction>& functions) {
+            CompilationContext context;
+            context.bytecode = code;
+            context.functions = functions;
+
+            CompiledProgram program;
+            program.compiled = true;
+            program.code = code;
+            program.image = CompiledModule::Serialize(context);
+            return program;
+        }
+
+        std::vector<DifferentialTester::BytecodeStatement> DifferentialTester::GenerateStatements(uint32_t seed) const {
+            static const VMOpcode kOperators[] = {
+                VMOpcode::ADD, VMOpcode::SUB, VMOpcode::MUL, VMOpcode::DIV, VMOpcode::MOD,
+                VMOpcode::BIT_AND, VMOpcode::BIT_OR, VMOpcode::BIT_XOR, VMOpcode::SHL, VMOpcode::SHR,
+                VMOpcode::CMP_EQ, VMOpcode::CMP_NE, VMOpcode::CMP_LT, VMOpcode::CMP_LE, VMOpcode::CMP_GT, VMOpcode::CMP_GE,
+                VMOpcode::ADD_I32, VMOpcode::SUB_I32, VMOpcode::MUL_I32, VMOpcode::CMP_LT_I32, VMOpcode::CMP_EQ_I32
+            };
+
+            std::mt19937 random(seed);
+            auto pick = [&random](uint32_t count) { return std::uniform_int_distribution<uint32_t>(0, count - 1)(random); };
+            auto immediate = [&pick]() { return static_cast<int32_t>(pick(48)) - 8; };
+
+            std::function<std::vector<BytecodeStatement>(uint32_t, uint32_t)> generate =
+                [&](uint32_t depth, uint32_t count) {
+                std::vector<BytecodeStatement> statements;
+                for (uint32_t i = 0; i < count; ++i) {
+                    BytecodeStatement statement{};
+                    statement.target = pick(BYTECODE_GLOBALS);
+                    statement.left = pick(BYTECODE_GLOBALS);
+                    statement.use_immediate = true;
+                    statement.immediate = immediate();
+                    statement.opcode = VMOpcode::NOP;
+
+                    const uint32_t kind = pick(100);
+                    if (kind < 20) {
+                        statement.kind = BytecodeStatement::Kind::ASSIGN;
+                    } else if (kind < 70 || depth >= BYTECODE_MAX_DEPTH) {
+                        statement.kind = BytecodeStatement::Kind::BINARY;
+                        statement.opcode = kOperators[pick(sizeof(kOperators) / sizeof(kOperators[0]))];
+                        if (pick(2)) {
+                            statement.use_immediate = false;
+                            statement.immediate = static_cast<int32_t>(pick(BYTECODE_GLOBALS));
+                        }
+                    } else if (kind < 82) {
+                        statement.kind = BytecodeStatement::Kind::IF;
+                        statement.body = generate(depth + 1, 1 + pick(4));
+                    } else if (kind < 94) {
+                        statement.kind = BytecodeStatement::Kind::LOOP;
+                        statement.target = BYTECODE_GLOBALS + depth;
+                        statement.immediate = static_cast<int32_t>(pick(6));
+                        statement.body = generate(depth + 1, 1 + pick(4));
+                    } else {
+                        statement.kind = BytecodeStatement::Kind::THROW_IF;
+                    }
+                    statements.push_back(std::move(statement));
+                }
+                return statements;
+            };
+            return generate(0, 3 + pick(12));
+        }
+
+        // The program stores every global first, then runs its statements inside
+        // a TRY whose handler stores the exception in the last global
+        std::vector<uint8_t> DifferentialTester::EncodeStatements(const std::vector<BytecodeStatement>& program) {
+            const uint32_t caught = BYTECODE_GLOBALS + BYTECODE_MAX_DEPTH;
+            std::vector<uint8_t> code;
+            for (uint32_t slot = 0; slot <= caught; ++slot) {
+                EncodeInstruction(VMOpcode::PUSH_INT, slot, 0, code);
+                EncodeInstruction(VMOpcode::STORE_GLOBAL, slot, 0, code);
+            }
+
+            const size_t try_offset = code.size();
+            EncodeInstruction(VMOpcode::TRY, 0, 0, code);
+            for (const BytecodeStatement& statement : program) {
+                EncodeStatement(statement, code);
+            }
+            EncodeInstruction(VMOpcode::FINALLY, 0, 0, code);
+            EncodeInstruction(VMOpcode::HALT, 0, 0, code);
+
+            const uint32_t handler = static_cast<uint32_t>(code.size());
+            std::memcpy(&code[try_offset + 1], &handler, sizeof(handler));
+            EncodeInstruction(VMOpcode::CATCH, 0, 0, code);
+            EncodeInstruction(VMOpcode::STORE_GLOBAL, caught, 0, code);
+            EncodeInstruction(VMOpcode::HALT, 0, 0, code);
+            return code;
+        }
+
+        void DifferentialTester::EncodeStatement(const BytecodeStatement& statement, std::vector<uint8_t>& code) {
+            auto patch = [&code](size_t branch_offset, size_t target) {
+                const uint32_t address = static_cast<uint32_t>(target);
+                std::memcpy(&code[branch_offset + 1], &address, sizeof(address));
+            };
+
+            switch (statement.kind) {
+                case BytecodeStatement::Kind::ASSIGN:
+                    EncodeInstruction(VMOpcode::PUSH_INT, static_cast<uint32_t>(statement.immediate), 0, code);
+                    EncodeInstruction(VMOpcode::STORE_GLOBAL, statement.target, 0, code);
+                    break;
+
+                case BytecodeStatement::Kind::BINARY:
+                    EncodeInstruction(VMOpcode::LOAD_GLOBAL, statement.left, 0, code);
+                    EncodeInstruction(statement.use_immediate ? VMOpcode::PUSH_INT : VMOpcode::LOAD_GLOBAL,
+                                      static_cast<uint32_t>(statement.immediate), 0, code);
+                    EncodeInstruction(statement.opcode, 0, 0, code);
+                    EncodeInstruction(VMOpcode::STORE_GLOBAL, statement.target, 0, code);
+                    break;
+
+                case BytecodeStatement::Kind::IF: {
+                    EncodeInstruction(VMOpcode::LOAD_GLOBAL, statement.left, 0, code);
+                    const size_t branch = code.size();
+                    EncodeInstruction(VMOpcode::JMP_IF_ZERO, 0, 0, code);
+                    for (const BytecodeStatement& inner : statement.body) {
+                        EncodeStatement(inner, code);
+                    }
+                    patch(branch, code.size());
+                    break;
+                }
+
+                case BytecodeStatement::Kind::LOOP: {
+                    EncodeInstruction(VMOpcode::PUSH_INT, static_cast<uint32_t>(statement.immediate), 0, code);
+                    EncodeInstruction(VMOpcode::STORE_GLOBAL, statement.target, 0, code);
+                    const size_t header = code.size();
+                    EncodeInstruction(VMOpcode::LOAD_GLOBAL, statement.target, 0, code);
+                    const size_t exit = code.size();
+                    EncodeInstruction(VMOpcode::JMP_IF_ZERO, 0, 0, code);
+                    for (const BytecodeStatement& inner : statement.body) {
+                        EncodeStatement(inner, code);
+                    }
+                    EncodeInstruction(VMOpcode::LOAD_GLOBAL, statement.target, 0, code);
+                    EncodeInstruction(VMOpcode::PUSH_INT, 1, 0, code);
+                    EncodeInstruction(VMOpcode::SUB, 0, 0, code);
+                    EncodeInstruction(VMOpcode::STORE_GLOBAL, statement.target, 0, code);
+                    EncodeInstruction(VMOpcode::JMP, static_cast<uint32_t>(header), 0, code);
+                    patch(exit, code.size());
+                    break;
+                }
+
+                case BytecodeStatement::Kind::THROW_IF: {
+                    EncodeInstruction(VMOpcode::LOAD_GLOBAL, statement.left, 0, code);
+                    const size_t branch = code.size();
+                    EncodeInstruction(VMOpcode::JMP_IF_ZERO, 0, 0, code);
+                    EncodeInstruction(VMOpcode::PUSH_INT, static_cast<uint32_t>(statement.immediate), 0, code);
+                    EncodeInstruction(VMOpcode::THROW, 0, 0, code);
+                    patch(branch, code.size());
+                    break;
+                }
+            }
+        }
+
+        std::string DifferentialTester::Disassemble(const std::vector<uint8_t>& code) {
+            std::ostringstream out;
+            for (size_t pc = 0; pc < code.size();) {
+                const VMOpcode opcode = static_cast<VMOpcode>(code[pc]);
+                uint32_t operand = 0;
+                uint32_t operand2 = 0;
+                out << pc << ": op" << static_cast<int>(opcode);
+                if (!DecodeOperands(&code[pc], code.size() - pc, operand, operand2)) {
+                    out << " <truncated>\n";
+                    break;
+                }
+                if (GetOpcodeInfo(opcode).format != VMOperandFormat::NONE) {
+                    out << " " << static_cast<int32_t>(operand);
+                }
+                out << "\n";
+                pc += 1 + GetOpcodeInfo(opcode).operand_size;
+            }
+            return out.str();
+        }
+
+        // Greedy line reduction: whole blocks first (a line opening a brace up
+        // to the line that closes it), then single lines, until nothing more can
+        // go. Candidates that no longer compile simply do not fail.
+        std::string DifferentialTester::ShrinkSource(const std::string& source, const std::string& configuration) {
+            std::vector<std::string> lines;
+            std::istringstream in(source);
+            for (std::string line; std::getline(in, line);) {
+                lines.push_back(line);
+            }
+            auto join = [](const std::vector<std::string>& parts) {
+                std::string text;
+                for (const std::string& part : parts) text += part + "\n";
+                return text;
+            };
+
+            const uint32_t repeats = m_settings.benchmark_repeats;
+            m_settings.benchmark_repeats = 1;
+            bool progress = true;
+            while (progress) {
+                progress = false;
+                for (size_t i = 0; i < lines.size(); ++i) {
+                    size_t end = i;
+                    if (!lines[i].empty() && lines[i].back() == '{') {
+                        int depth = 0;
+                        for (end = i; end < lines.size(); ++end) {
+                            depth += static_cast<int>(std::count(lines[end].begin(), lines[end].end(), '{')) -
+                                     static_cast<int>(std::count(lines[end].begin(), lines[end].end(), '}'));
+                            if (depth <= 0 && end > i) break;
+                        }
+                        if (end == lines.size()) end = i;
+                    }
+
+                    for (size_t last : { end, i }) {
+                        std::vector<std::string> candidate(lines.begin(), lines.begin() + i);
+                        candidate.insert(candidate.end(), lines.begin() + last + 1, lines.end());
+                        DifferentialFailure failure{};
+                        if (TestSource(join(candidate), 0, failure, nullptr) == CheckResult::FAILED &&
+                            ConfigurationFailed(failure, configuration)) {
+                            lines = std::move(candidate);
+                            progress = true;
+                            --i;
+                            break;
+                        }
+                        if (last == i) break;
+                    }
+                }
+            }
+            m_settings.benchmark_repeats = repeats;
+            return join(lines);
+        }
+
+        std::vector<DifferentialTester::BytecodeStatement> DifferentialTester::ShrinkStatements(
+            std::vector<BytecodeStatement> program, const std::string& configuration) {
+            const uint32_t repeats = m_settings.benchmark_repeats;
+            m_settings.benchmark_repeats = 1;
+            while (ShrinkStatementList(program, program, configuration)) {
+            }
+            m_settings.benchmark_repeats = repeats;
+            return program;
+        }
+
+        // Tries removing each statement of list, then replacing a compound one by
+        // its body, then recurses into bodies. list is part of program.
+        bool DifferentialTester::ShrinkStatementList(std::vector<BytecodeStatement>& list, std::vector<BytecodeStatement>& program,
+                                                     const std::string& configuration) {
+            auto still_fails = [&]() {
+                DifferentialFailure failure{};
+                return TestBytecode(EncodeStatements(program), 0, failure, nullptr) == CheckResult::FAILED &&
+                       ConfigurationFailed(failure, configuration);
+            };
+
+            bool progress = false;
+            for (size_t i = 0; i < list.size(); ++i) {
+                std::vector<BytecodeStatement> saved = list;
+                list.erase(list.begin() + i);
+                if (still_fails()) {
+                    progress = true;
+                    --i;
+                    continue;
+                }
+                list = saved;
+
+                if (!list[i].body.empty()) {
+                    std::vector<BytecodeStatement> body = list[i].body;
+                    list.erase(list.begin() + i);
+                    list.insert(list.begin() + i, body.begin(), body.end());
+                    if (still_fails()) {
+                        progress = true;
+                        --i;
+                        continue;
+                    }
+                    list = std::move(saved);
+                }
+
+                if (ShrinkStatementList(list[i].body, program, configuration)) {
+                    progress = true;
+                }
+            }
+            return progress;
+        }
+
+        void DifferentialTester::AddBenchmark(std::vector<ConfigurationBenchmark>& totals, const std::string& name,
+                                              uint64_t instructions, double run_time_ms, double compile_time_ms, size_t code_size) {
+            auto it = std::find_if(totals.begin(), totals.end(),
+                                   [&name](const ConfigurationBenchmark& benchmark) { return benchmark.name == name; });
+            if (it == totals.end()) {
+                totals.push_back(ConfigurationBenchmark{ name });
+                it = totals.end() - 1;
+            }
+            it->instructions += instructions;
+            it->run_time_ms += run_time_ms;
+            it->compile_time_ms += compile_time_ms;
+            it->code_size += code_size;
+        }
+
+    } // namespace VM
+} // namespace AetherVisor
@@ -0,0 +1,167 @@
+#pragma once
+
+#include "../../vm/VMOpcodes.h"
+#include "../../vm/VirtualMachine.h"
+#include "../../vm/BytecodeOptimizer.h"
+#include <vector>
+#include <string>
+#include <map>
+#include <cstdint>
+
+namespace AetherVisor {
+    namespace VM {
+
+        // Everything a run can be observed by. Values are rendered with their
+        // type ("i32:5", "str:abc", "null") so runs compare as text.
+        struct ExecutionSnapshot {
+            VMState state = VMState::READY;
+            std::string error;
+            std::vector<std::string> stack;                 // Bottom first; only compared after HALT
+            std::map<std::string, std::string> globals;     // Declared globals by name, or "g<slot>" for raw bytecode
+            std::vector<std::string> output;                // One line per print() call
+            uint64_t instructions = 0;
+            double run_time_ms = 0.0;                       // Best of the benchmark repeats
+            size_t code_size = 0;
+            size_t native_code_size = 0;
+            double jit_compile_time_ms = 0.0;               // Enabling the JIT on the loaded module
+
+            bool Matches(const ExecutionSnapshot& reference, std::string* difference = nullptr) const;
+        };
+
+        struct DifferentialSettings {
+            uint32_t seed = 1;
+            uint32_t iterations = 100;          // Programs per Run
+            uint32_t bytecode_percent = 25;     // Share of raw bytecode programs, the rest are source
+            uint32_t max_statements = 12;       // Top-level statements of a source program
+            uint32_t max_functions = 4;
+            uint32_t max_instructions = 200000; // Per run; the reference timing out skips the program
+            uint32_t benchmark_repeats = 3;     // Runs per configuration, the fastest is kept
+            bool test_jit = true;
+            bool shrink_failures = true;
+        };
+
+        // Totals over the programs that passed, per configuration
+        struct ConfigurationBenchmark {
+            std::string name;                   // "O0".."O3", "JIT0".."JIT3", "Tiered", then the same JIT modes on O3 as "O3+JIT0".."O3+Tiered"
+            uint64_t instructions = 0;
+            double run_time_ms = 0.0;
+            double compile_time_ms = 0.0;
+            size_t code_size = 0;
+        };
+
+        struct DifferentialFailure {
+            uint32_t seed;
+            std::string configuration;
+            std::string program;                // Source text, or a disassembly for bytecode
+            std::string difference;
+        };
+
+        struct DifferentialReport {
+            uint32_t programs_run = 0;
+            uint32_t programs_skipped = 0;      // Rejected by the compiler or timed out unoptimised
+            std::vector<DifferentialFailure> failures;
+            std::vector<ConfigurationBenchmark> benchmarks;     // O0 first
+
+            std::string Format() const;         // Failures, then speedups over O0
+        };
+
+        // Differential tester for the optimiser and the JIT. Programs are
+        // generated from a seed, either as source or as raw bytecode, and run
+        // on the interpreter unoptimised (O0) and at every OptimizationLevel;
+        // every configuration must end the same way as O0. The unoptimised
+        // and the O3 program also run under the JIT at each of its levels and
+        // tiered, which must end the same way too. A failing program is shrunk
+        // to a minimal case that still fails the same configuration.
+        class DifferentialTester {
+        public:
+            explicit DifferentialTester(const DifferentialSettings& settings = DifferentialSettings());
+
+            DifferentialReport Run();
+
+            // Single programs, for replaying a seed or a reported case. Returns
+            // false with the failure filled in when a configuration differs.
+            bool CheckSource(const std::string& source, uint32_t seed, DifferentialFailure& failure,
+                             std::vector<ConfigurationBenchmark>* benchmarks = nullptr);
+            bool CheckBytecode(const std::vector<uint8_t>& bytecode, uint32_t seed, DifferentialFailure& failure,
+                               std::vector<ConfigurationBenchmark>* benchmarks = nullptr);
+
+            std::string GenerateSource(uint32_t seed) const;
+            std::vector<uint8_t> GenerateBytecode(uint32_t seed) const;
+
+            // Runs a module image on a fresh VM with print() as the only native,
+            // with the JIT at jit_level or, when negative, interpreted. JIT_TIERED
+            // runs the tiered JIT, compiling in the foreground, with thresholds
+            // low enough for small programs to pass through every tier and OSR.
+            static constexpr int32_t JIT_TIERED = 0x100;
+            static ExecutionSnapshot Execute(const std::vector<uint8_t>& image, uint32_t max_instructions,
+                                             const std::map<std::string, uint32_t>& global_names = {},
+                                             uint32_t repeats = 1, int32_t jit_level = -1);
+
+            // Runs raw bytecode before and after optimisation, with the
+            // optimiser's address translation to match up functions
+            static bool CompareBytecode(const std::vector<uint8_t>& original, const std::vector<uint8_t>& optimized,
+                                        const std::vector<VMFunction>& functions,
+                                        const std::map<uint32_t, uint32_t>& translation,
+                                        uint32_t max_instructions, std::string* difference = nullptr);
+
+        private:
+            DifferentialSettings m_settings;
+
+            enum class CheckResult { PASSED, FAILED, SKIPPED };
+
+            // One compiled configuration of a program
+            struct CompiledProgram {
+                bool compiled = false;
+                std::string error;
+                std::vector<uint8_t> image;
+                std::vector<uint8_t> code;
+                std::map<std::string, uint32_t> global_names;
+                double compile_time_ms = 0.0;
+            };
+
+            // Raw bytecode is generated as a tree of stack-neutral statements so
+            // it can be shrunk by removing whole statements
+            struct BytecodeStatement {
+                enum class Kind { ASSIGN, BINARY, IF, LOOP, THROW_IF } kind;
+                uint32_t target;                // Global written, or the loop's counter
+                uint32_t left;                  // Global read
+                int32_t immediate;              // Right operand (a global unless use_immediate), thrown value, or trip count
+                bool use_immediate;
+                VMOpcode opcode;                // BINARY operator
+                std::vector<BytecodeStatement> body;
+            };
+            static constexpr uint32_t BYTECODE_GLOBALS = 6;     // Then one loop counter per nesting level
+            static constexpr uint32_t BYTECODE_MAX_DEPTH = 2;
+            static constexpr uint32_t JIT_LEVELS = 4;
+            static constexpr uint32_t TIERED_BASELINE_THRESHOLD = 2;
+            static constexpr uint32_t TIERED_OPTIMIZED_THRESHOLD = 12;
+            static constexpr uint32_t TIERED_OSR_THRESHOLD = 5;
+
+            CheckResult TestSource(const std::string& source, uint32_t seed, DifferentialFailure& failure,
+                                   std::vector<ConfigurationBenchmark>* benchmarks);
+            CheckResult TestBytecode(const std::vector<uint8_t>& code, uint32_t seed, DifferentialFailure& failure,
+                                     std::vector<ConfigurationBenchmark>* benchmarks);
+            bool TestJIT(const CompiledProgram& compiled, const ExecutionSnapshot& expected, const std::string& prefix,
+                         uint32_t seed, const std::string& program, DifferentialFailure& failure,
+                         std::vector<ConfigurationBenchmark>& benchmarks) const;
+
+            CompiledProgram CompileSource(const std::string& source, OptimizationLevel level, bool optimize) const;
+            static CompiledProgram WrapBytecode(const std::vector<uint8_t>& code, const std::vector<VMFunction>& functions);
+
+            std::vector<BytecodeStatement> GenerateStatements(uint32_t seed) const;
+            static std::vector<uint8_t> EncodeStatements(const std::vector<BytecodeStatement>& program);
+            static void EncodeStatement(const BytecodeStatement& statement, std::vector<uint8_t>& code);
+            static std::string Disassemble(const std::vector<uint8_t>& code);
+
+            // Shrinking keeps a reduction while the same configuration still fails
+            std::string ShrinkSource(const std::string& source, const std::string& configuration);
+            std::vector<BytecodeStatement> ShrinkStatements(std::vector<BytecodeStatement> program, const std::string& configuration);
+            bool ShrinkStatementList(std::vector<BytecodeStatement>& list, std::vector<BytecodeStatement>& program,
+                                     const std::string& configuration);
+
+            static void AddBenchmark(std::vector<ConfigurationBenchmark>& totals, const std::string& name,
+                                     uint64_t instructions, double run_time_ms, double compile_time_ms, size_t code_size);
+        };
+
+    } // namespace VM
+} // namespace AetherVisor
@@ -0,0 +1,84 @@
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "DifferentialTester.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace AetherVisor::VM;
+
+namespace {
+    void PrintUsage() {
+        std::printf(
+            "usage: aether_difftest [options]\n"
+            "  --seed N             first program seed (1)\n"
+            "  --iterations N       programs to run (100)\n"
+            "  --bytecode-percent N share of raw bytecode programs (25)\n"
+            "  --max-instructions N per run (200000)\n"
+            "  --repeats N          benchmark runs per configuration (3)\n"
+            "  --no-jit             interpreter configurations only\n"
+            "  --no-shrink          report failing programs as generated\n"
+            "  --print-source N     print the source program of seed N and exit\n");
+    }
+
+    bool ParseCount(const char* text, uint32_t& value) {
+        char* end = nullptr;
+        const unsigned long parsed = std::strtoul(text, &end, 10);
+        if (!*text || *end) {
+            return false;
+        }
+        value = static_cast<uint32_t>(parsed);
+        return true;
+    }
+}
+
+// Generates and checks programs, then prints failures and the speedups of
+// each configuration over O0. Exits with 1 when any program failed.
+int main(int argc, char** argv) {
+    DifferentialSettings settings;
+    bool print_source = false;
+    uint32_t print_seed = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        const char* option = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : "";
+        uint32_t* count = nullptr;
+        if (!std::strcmp(option, "--seed")) count = &settings.seed;
+        else if (!std::strcmp(option, "--iterations")) count = &settings.iterations;
+        else if (!std::strcmp(option, "--bytecode-percent")) count = &settings.bytecode_percent;
+        else if (!std::strcmp(option, "--max-instructions")) count = &settings.max_instructions;
+        else if (!std::strcmp(option, "--repeats")) count = &settings.benchmark_repeats;
+        else if (!std::strcmp(option, "--print-source")) count = &print_seed;
+
+        if (count) {
+            if (!ParseCount(value, *count)) {
+                PrintUsage();
+                return 2;
+            }
+            print_source = print_source || count == &print_seed;
+            ++i;
+        } else if (!std::strcmp(option, "--no-jit")) {
+            settings.test_jit = false;
+        } else if (!std::strcmp(option, "--no-shrink")) {
+            settings.shrink_failures = false;
+        } else if (!std::strcmp(option, "--help")) {
+            PrintUsage();
+            return 0;
+        } else {
+            PrintUsage();
+            return 2;
+        }
+    }
+
+    DifferentialTester tester(settings);
+    if (print_source) {
+        std::printf("%s", tester.GenerateSource(print_seed).c_str());
+        return 0;
+    }
+
+    const DifferentialReport report = tester.Run();
+    std::printf("%s", report.Format().c_str());
+    return report.failures.empty() ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "A64Assembler.h"
+#include "../security/XorStr.h"
+#include "JITCompiler.h"
+#include <stdexcept>
+
+namespace AetherVisor {
+    namespace VM {
+
+        using namespace A64;
+
+        namespace {
+            static_assert(CONTEXT_BUDGET % 8 == 0 && CONTEXT_TIER_COUNTDOWN % 8 == 0 && CONTEXT_LOOP_COUNTS % 8 == 0 &&
+                          CONTEXT_STEP % 8 == 0 && CONTEXT_CALL % 8 == 0 && CONTEXT_CALL_CACHES % 8 == 0 &&
+                          CONTEXT_PC % 4 == 0, "context fields are reached by scaled offsets");
+        }
+
+        void A64Assembler::EmitJump(uint32_t target_label) {
+            AddRelocation(static_cast<uint32_t>(machine_code.size()), target_label, BRANCH26);
+            EmitDWord(0x14000000);                                          // b label
+        }
+
+        void A64Assembler::EmitJumpIf(uint8_t condition, uint32_t target_label) {
+            AddRelocation(static_cast<uint32_t>(machine_code.size()), target_label, BRANCH19);
+            EmitDWord(0x54000000 | condition);                              // b.cond label
+        }
+
+        void A64Assembler::EmitJumpIfNonZero(uint8_t reg, uint32_t target_label) {
+            AddRelocation(static_cast<uint32_t>(machine_code.size()), target_label, BRANCH19);
+            EmitDWord(0x35000000 | reg);                                    // cbnz wN, label
+        }
+
+        // Branch offsets count instructions from the branch itself
+        void A64Assembler::PatchRelocation(const Relocation& relocation, uint32_t target) {
+            const int64_t delta = (static_cast<int64_t>(target) - relocation.offset) / 4;
+            const int64_t reach = relocation.kind == BRANCH26 ? (1 << 25) : (1 << 18);
+            if (delta < -reach || delta >= reach) {
+                throw std::runtime_error(XorS("Branch out of range"));
+            }
+
+            uint32_t instruction = 0;
+            for (uint32_t k = 0; k < 4; ++k) {
+                instruction |= static_cast<uint32_t>(machine_code[relocation.offset + k]) << (8 * k);
+            }
+            if (relocation.kind == BRANCH26) {
+                instruction |= static_cast<uint32_t>(delta) & 0x03FFFFFF;
+            } else {
+                instruction |= (static_cast<uint32_t>(delta) & 0x7FFFF) << 5;
+            }
+            for (uint32_t k = 0; k < 4; ++k) {
+                machine_code[relocation.offset + k] = static_cast<uint8_t>(instruction >> (8 * k));
+            }
+        }
+
+        void A64Assembler::EmitLoadStore(uint32_t opcode, uint8_t reg, uint8_t base, int32_t offset, uint32_t size) {
+            if (offset < 0 || offset % size != 0 || offset / size > 0xFFF) {
+                throw std::runtime_error(XorS("Offset out of range"));
+            }
+            const uint32_t wide = size == 8 ? 0x40000000 : 0;
+            EmitDWord(opcode | wide | (static_cast<uint32_t>(offset / size) << 10) | (base << 5) | reg);
+        }
+
+        void A64Assembler::EmitLoad(uint8_t reg, uint8_t base, int32_t offset, uint32_t size) {
+            EmitLoadStore(0xB9400000, reg, base, offset, size);             // ldr
+        }
+
+        void A64Assembler::EmitStore(uint8_t reg, uint8_t base, int32_t offset, uint32_t size) {
+            EmitLoadStore(0xB9000000, reg, base, offset, size);             // str
+        }
+
+        void A64Assembler::EmitMove(uint8_t to, uint8_t from) {
+            EmitDWord(0xAA0003E0 | (from << 16) | to);                      // orr xTo, xzr, xFrom
+        }
+
+        void A64Assembler::EmitMoveImmediate(uint8_t reg, uint64_t value) {
+            EmitDWord(0xD2800000 | (static_cast<uint32_t>(value & 0xFFFF) << 5) | reg);        // movz
+            for (uint32_t shift = 1; shift < 4; ++shift) {
+                const uint32_t part = static_cast<uint32_t>(value >> (16 * shift)) & 0xFFFF;
+                if (part) {
+                    EmitDWord(0xF2800000 | (shift << 21) | (part << 5) | reg);                 // movk, lsl 16 * shift
+                }
+            }
+        }
+
+        void A64Assembler::EmitAddImmediate(uint8_t to, uint8_t from, uint32_t value, bool subtract, bool set_flags) {
+            const uint32_t operation = (subtract ? 0x40000000 : 0) | (set_flags ? 0x20000000 : 0);
+            if (value <= 0xFFF) {
+                EmitDWord(0x91000000 | operation | (value << 10) | (from << 5) | to);
+            } else if ((value & 0xFFF) == 0 && value <= 0xFFF000) {
+                EmitDWord(0x91400000 | operation | ((value >> 12) << 10) | (from << 5) | to);  // lsl 12
+            } else if (to == SP || from == SP) {
+                EmitMoveImmediate(X17, value);
+                EmitDWord(0x8B206000 | operation | (X17 << 16) | (from << 5) | to);            // extended register, uxtx
+            } else {
+                EmitMoveImmediate(X17, value);
+                EmitDWord(0x8B000000 | operation | (X17 << 16) | (from << 5) | to);            // shifted register
+            }
+        }
+
+        // Saves the frame record and x19, which pins the context. Spill slots
+        // sit at [sp], below the saved registers.
+        void A64Assembler::EmitPrologue(uint32_t spill_slots) {
+            frame_size = (spill_slots + 1) / 2 * 16;
+            EmitDWord(0xA9BE7BFD);                                          // stp x29, x30, [sp, #-32]!
+            EmitStore(X19, SP, 16, 8);                                      // str x19, [sp, #16]
+            EmitAddImmediate(X29, SP, 0);                                   // mov x29, sp
+            if (frame_size) {
+                EmitAddImmediate(SP, SP, frame_size, true);                 // sub sp, sp, frame
+            }
+            EmitMove(X19, X0);                                              // mov x19, context
+            EmitDWord(0xD61F0000 | (X1 << 5));                              // br entry
+        }
+
+        void A64Assembler::EmitEpilogue() {
+            EmitDWord(0x52800000);                                          // mov w0, #0
+            EmitAddImmediate(SP, X29, 0);                                   // mov sp, x29
+            EmitLoad(X19, SP, 16, 8);                                       // ldr x19, [sp, #16]
+            EmitDWord(0xA8C27BFD);                                          // ldp x29, x30, [sp], #32
+            EmitDWord(0xD65F03C0);                                          // ret
+        }
+
+        void A64Assembler::EmitStep(uint32_t pc, uint32_t stopped_label) {
+            EmitMove(X0, X19);                                              // mov x0, context
+            EmitMoveImmediate(X1, pc);                                      // mov w1, pc
+            EmitLoad(X16, X19, CONTEXT_STEP, 8);                            // ldr x16, [x19, #step]
+            EmitDWord(0xD63F0000 | (X16 << 5));                             // blr x16
+            EmitJumpIfNonZero(X0, stopped_label);                           // cbnz w0, stopped
+        }
+
+        void A64Assembler::EmitNativeCall(uint32_t pc, uint32_t cache, uint32_t stopped_label) {
+            EmitMove(X0, X19);                                              // mov x0, context
+            EmitMoveImmediate(X1, pc);                                      // mov w1, pc
+            EmitLoad(X2, X19, CONTEXT_CALL_CACHES, 8);                      // ldr x2, [x19, #call_caches]
+            if (cache) {
+                EmitAddImmediate(X2, X2, cache * static_cast<uint32_t>(sizeof(JITInlineCache)));
+            }
+            EmitLoad(X16, X19, CONTEXT_CALL, 8);                            // ldr x16, [x19, #call]
+            EmitDWord(0xD63F0000 | (X16 << 5));                             // blr x16
+            EmitJumpIfNonZero(X0, stopped_label);                           // cbnz w0, stopped
+        }
+
+        void A64Assembler::EmitBlockCharge(uint32_t length, uint32_t exhausted_label) {
+            EmitLoad(X16, X19, CONTEXT_BUDGET, 8);
+            EmitAddImmediate(X16, X16, length, true, true);                 // subs x16, x16, length
+            EmitStore(X16, X19, CONTEXT_BUDGET, 8);
+            EmitJumpIf(COND_LT, exhausted_label);
+        }
+
+        void A64Assembler::EmitRefund(uint32_t count) {
+            EmitLoad(X16, X19, CONTEXT_BUDGET, 8);
+            EmitAddImmediate(X16, X16, count);
+            EmitStore(X16, X19, CONTEXT_BUDGET, 8);
+        }
+
+        void A64Assembler::EmitSetPc(uint32_t address) {
+            EmitMoveImmediate(X16, address);
+            EmitStore(X16, X19, CONTEXT_PC, 4);                             // str w16, [x19, #pc]
+        }
+
+        void A64Assembler::EmitCountBackEdge(uint32_t header, uint32_t countdown_label) {
+            int32_t offset = static_cast<int32_t>(header * sizeof(uint32_t));
+            EmitLoad(X16, X19, CONTEXT_LOOP_COUNTS, 8);                     // ldr x16, [x19, #loop_counts]
+            if (offset / 4 > 0xFFF) {
+                EmitAddImmediate(X16, X16, static_cast<uint32_t>(offset));
+                offset = 0;
+            }
+            EmitLoad(X17, X16, offset, 4);                                  // ldr w17, [x16, #header]
+            EmitAddImmediate(X17, X17, 1);
+            EmitStore(X17, X16, offset, 4);
+            EmitLoad(X16, X19, CONTEXT_TIER_COUNTDOWN, 8);
+            EmitAddImmediate(X16, X16, 1, true, true);                      // subs x16, x16, #1
+            EmitStore(X16, X19, CONTEXT_TIER_COUNTDOWN, 8);
+            EmitJumpIf(COND_LT, countdown_label);
+        }
+
+    } // namespace VM
+} // namespace AetherVisor
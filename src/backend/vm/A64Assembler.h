@@ -0,0 +1,54 @@
+#pragma once
+
+#include "JITAssembler.h"
+
+namespace AetherVisor {
+    namespace VM {
+
+        namespace A64 {
+            // Registers by number; 31 is sp or zr by instruction
+            constexpr uint8_t X0 = 0, X1 = 1, X2 = 2, X16 = 16, X17 = 17, X19 = 19, X29 = 29, X30 = 30, SP = 31, ZR = 31;
+
+            // Condition codes of B.cond
+            constexpr uint8_t COND_EQ = 0x0, COND_NE = 0x1, COND_HS = 0x2, COND_LO = 0x3, COND_HI = 0x8, COND_LS = 0x9,
+                              COND_GE = 0xA, COND_LT = 0xB, COND_GT = 0xC, COND_LE = 0xD;
+        }
+
+        // AArch64 encodings, AAPCS64. The context is pinned in x19; x16 and
+        // x17 are scratch. Conditional branches reach 1MB, others 128MB.
+        struct A64Assembler : JITAssembler {
+            uint32_t frame_size = 0;                // Spill slots below the saved registers
+
+            void EmitJump(uint32_t target_label) override;
+            void EmitJumpIf(uint8_t condition, uint32_t target_label);
+            void EmitJumpIfNonZero(uint8_t reg, uint32_t target_label);     // cbnz w
+
+            // Loads and stores at [base + offset], scaled unsigned offsets only;
+            // size is 4 or 8
+            void EmitLoad(uint8_t reg, uint8_t base, int32_t offset, uint32_t size);
+            void EmitStore(uint8_t reg, uint8_t base, int32_t offset, uint32_t size);
+            void EmitMove(uint8_t to, uint8_t from);                         // Between general registers, not sp
+            void EmitMoveImmediate(uint8_t reg, uint64_t value);             // movz and movk, 64-bit
+            // 64-bit add or subtract; values past a shifted imm12 go through x17
+            void EmitAddImmediate(uint8_t to, uint8_t from, uint32_t value, bool subtract = false, bool set_flags = false);
+
+            void EmitPrologue(uint32_t spill_slots) override;
+            void EmitEpilogue() override;
+            void EmitStep(uint32_t pc, uint32_t stopped_label) override;
+            void EmitNativeCall(uint32_t pc, uint32_t cache, uint32_t stopped_label) override;
+            void EmitBlockCharge(uint32_t length, uint32_t exhausted_label) override;
+            void EmitRefund(uint32_t count) override;
+            void EmitSetPc(uint32_t address) override;
+            void EmitCountBackEdge(uint32_t header, uint32_t countdown_label) override;
+
+        protected:
+            enum RelocationKind : uint8_t {
+                BRANCH26,                           // b
+                BRANCH19                            // b.cond, cbnz
+            };
+            void PatchRelocation(const Relocation& relocation, uint32_t target) override;
+            void EmitLoadStore(uint32_t opcode, uint8_t reg, uint8_t base, int32_t offset, uint32_t size);
+        };
+
+    } // namespace VM
+} // namespace AetherVisor
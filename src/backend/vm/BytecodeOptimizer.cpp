@@ -7,18 +7,315 @@
 #include "VMOpcodes.h"
 #include <algorithm>
 #include <chrono>
-#include <unordered_set>
+#include <cstring>
+#include <limits>
 #include <queue>
+#include <unordered_map>
 
 namespace AetherVisor {
     namespace VM {
 
+        // --- BytecodeProgram ---
+
+        uint32_t BytecodeProgram::GetOperandSize(VMOpcode opcode) {
+            return GetOpcodeInfo(opcode).operand_size;
+        }
+
+        bool BytecodeProgram::IsBranch(VMOpcode opcode) {
+            return GetOpcodeInfo(opcode).is_branch;
+        }
+
+        bool BytecodeProgram::FallsThrough(VMOpcode opcode) {
+            return GetOpcodeInfo(opcode).falls_through;
+        }
+
+        bool BytecodeProgram::Decode(const std::vector<uint8_t>& bytecode, const std::vector<uint32_t>& entry_points) {
+            m_instructions.clear();
+            m_entries.clear();
+            m_valid_analyses = BytecodeAnalysis::NONE;
+            m_live_count = 0;
+            if (bytecode.size() >= NO_INDEX) return false;
+
+            m_code_size = static_cast<uint32_t>(bytecode.size());
+            m_instructions.reserve(bytecode.size() / 2 + 1);
+            std::vector<uint32_t> index_of(bytecode.size() + 1, NO_INDEX);
+
+            uint32_t address = 0;
+            while (address < m_code_size) {
+                DecodedInstruction instruction;
+                instruction.opcode = static_cast<VMOpcode>(bytecode[address]);
+                instruction.removed = false;
+                instruction.address = address;
+                if (!DecodeOperands(&bytecode[address], m_code_size - address, instruction.operand, instruction.operand2)) {
+                    return false; // Truncated operand
+                }
+
+                index_of[address] = Size();
+                m_instructions.push_back(instruction);
+                address += 1 + GetOperandSize(instruction.opcode);
+            }
+            index_of[m_code_size] = Size();
+
+            // Branch operands become instruction indices; a target inside an
+            // instruction means this is not bytecode we understand
+            for (DecodedInstruction& instruction : m_instructions) {
+                if (!IsBranch(instruction.opcode)) continue;
+                if (instruction.operand > m_code_size || index_of[instruction.operand] == NO_INDEX) return false;
+                instruction.operand = index_of[instruction.operand];
+            }
+
+            if (!m_instructions.empty()) m_entries.push_back(0);
+            for (uint32_t entry : entry_points) {
+                if (entry >= m_code_size || index_of[entry] == NO_INDEX) return false;
+                m_entries.push_back(index_of[entry]);
+            }
+            m_infer_entries = entry_points.empty();
+            m_live_count = Size();
+            return true;
+        }
+
+        void BytecodeProgram::Encode(std::vector<uint8_t>& output, std::map<uint32_t, uint32_t>* address_translation) const {
+            // A removed instruction takes the address of the next live one, so
+            // branches to it land where execution would have continued
+            std::vector<uint32_t> new_address(m_instructions.size() + 1);
+            uint32_t cursor = 0;
+            for (size_t i = 0; i < m_instructions.size(); ++i) {
+                new_address[i] = cursor;
+                if (!m_instructions[i].removed) {
+                    cursor += 1 + GetOperandSize(m_instructions[i].opcode);
+                }
+            }
+            new_address[m_instructions.size()] = cursor;
+
+            output.clear();
+            output.reserve(cursor);
+            for (const DecodedInstruction& instruction : m_instructions) {
+                if (instruction.removed) continue;
+
+                const uint32_t operand = IsBranch(instruction.opcode) ? new_address[instruction.operand] : instruction.operand;
+                EncodeInstruction(instruction.opcode, operand, instruction.operand2, output);
+            }
+
+            if (address_translation) {
+                address_translation->clear();
+                for (size_t i = 0; i < m_instructions.size(); ++i) {
+                    if (m_instructions[i].address == NO_INDEX) continue; // Inserted by a pass
+                    address_translation->emplace(m_instructions[i].address, new_address[i]);
+                }
+                address_translation->emplace(m_code_size, cursor);
+            }
+        }
+
+        uint32_t BytecodeProgram::NextLive(uint32_t index) const {
+            while (index < Size() && m_instructions[index].removed) {
+                ++index;
+            }
+            return index < Size() ? index : Size();
+        }
+
+        uint32_t BytecodeProgram::PreviousLive(uint32_t index) const {
+            while (index > 0) {
+                --index;
+                if (!m_instructions[index].removed) return index;
+            }
+            return Size();
+        }
+
+        void BytecodeProgram::Remove(uint32_t index) {
+            DecodedInstruction& instruction = m_instructions[index];
+            if (instruction.removed) return;
+            instruction.removed = true;
+            --m_live_count;
+
+            // Branches into a removed instruction now enter its successor
+            if ((m_valid_analyses & BytecodeAnalysis::BRANCH_TARGETS) && m_branch_targets[index]) {
+                m_branch_targets[index] = false;
+                m_branch_targets[NextLive(index + 1)] = true;
+            }
+        }
+
+        void BytecodeProgram::SetTarget(uint32_t index, uint32_t target) {
+            m_instructions[index].operand = target;
+            // Stale marks on the old target only make later passes more conservative
+            if (m_valid_analyses & BytecodeAnalysis::BRANCH_TARGETS) {
+                m_branch_targets[NextLive(target)] = true;
+            }
+        }
+
+        void BytecodeProgram::Insert(uint32_t index, const std::vector<DecodedInstruction>& instructions) {
+            const uint32_t count = static_cast<uint32_t>(instructions.size());
+            if (count == 0) return;
+
+            for (DecodedInstruction& instruction : m_instructions) {
+                if (IsBranch(instruction.opcode) && instruction.operand >= index) {
+                    instruction.operand += count;
+                }
+            }
+            for (uint32_t& entry : m_entries) {
+                if (entry >= index) entry += count;
+            }
+
+            m_instructions.insert(m_instructions.begin() + index, instructions.begin(), instructions.end());
+            for (const DecodedInstruction& instruction : instructions) {
+                if (!instruction.removed) ++m_live_count;
+            }
+            m_valid_analyses = BytecodeAnalysis::NONE;
+        }
+
+        void BytecodeProgram::Reorder(const std::vector<uint32_t>& order, const std::vector<DecodedInstruction>& added) {
+            const uint32_t size = Size();
+            std::vector<uint32_t> new_index(size + 1);
+            for (uint32_t i = 0; i < order.size(); ++i) {
+                if (order[i] < size) new_index[order[i]] = i;
+            }
+            new_index[size] = static_cast<uint32_t>(order.size());  // End of the code
+
+            std::vector<DecodedInstruction> instructions;
+            instructions.reserve(order.size());
+            m_live_count = 0;
+            for (uint32_t index : order) {
+                instructions.push_back(index < size ? m_instructions[index] : added[index - size]);
+                DecodedInstruction& instruction = instructions.back();
+                if (IsBranch(instruction.opcode)) instruction.operand = new_index[instruction.operand];
+                if (!instruction.removed) ++m_live_count;
+            }
+            for (uint32_t& entry : m_entries) {
+                entry = new_index[entry];
+            }
+
+            m_instructions = std::move(instructions);
+            m_valid_analyses = BytecodeAnalysis::NONE;
+        }
+
+        bool BytecodeProgram::IsEntry(uint32_t index) const {
+            for (uint32_t entry : m_entries) {
+                if (NextLive(entry) == index) return true;
+            }
+            if (m_infer_entries) {
+                const uint32_t previous = PreviousLive(index);
+                if (previous < Size()) {
+                    const VMOpcode opcode = m_instructions[previous].opcode;
+                    return opcode == VMOpcode::RET || opcode == VMOpcode::RET_VAL || opcode == VMOpcode::HALT;
+                }
+            }
+            return false;
+        }
+
+        bool BytecodeProgram::IsBlockStart(uint32_t index) {
+            if (m_instructions[index].removed) return false;
+            const uint32_t previous = PreviousLive(index);
+            return previous == Size() || IsBranchTarget(index) || IsBranch(m_instructions[previous].opcode) ||
+                   !FallsThrough(m_instructions[previous].opcode);
+        }
+
+        bool BytecodeProgram::IsBranchTarget(uint32_t index) {
+            if (!(m_valid_analyses & BytecodeAnalysis::BRANCH_TARGETS)) {
+                ComputeBranchTargets();
+            }
+            return m_branch_targets[index];
+        }
+
+        bool BytecodeProgram::IsReachable(uint32_t index) {
+            if (!(m_valid_analyses & BytecodeAnalysis::REACHABILITY)) {
+                ComputeReachability();
+            }
+            return m_reachable[index];
+        }
+
+        void BytecodeProgram::Invalidate(uint32_t preserved) {
+            m_valid_analyses &= preserved;
+        }
+
+        void BytecodeProgram::ComputeBranchTargets() {
+            // One extra entry for branches to the end of the code
+            m_branch_targets.assign(m_instructions.size() + 1, false);
+            for (uint32_t entry : m_entries) {
+                m_branch_targets[NextLive(entry)] = true;
+            }
+            for (uint32_t i = 0; i < Size(); ++i) {
+                const DecodedInstruction& instruction = m_instructions[i];
+                if (instruction.removed) continue;
+                if (IsBranch(instruction.opcode)) {
+                    m_branch_targets[ResolveTarget(i)] = true;
+                } else if (m_infer_entries && (instruction.opcode == VMOpcode::RET ||
+                           instruction.opcode == VMOpcode::RET_VAL || instruction.opcode == VMOpcode::HALT)) {
+                    m_branch_targets[NextLive(i + 1)] = true;
+                }
+            }
+            m_valid_analyses |= BytecodeAnalysis::BRANCH_TARGETS;
+        }
+
+        void BytecodeProgram::ComputeReachability() {
+            m_reachable.assign(m_instructions.size(), false);
+            std::vector<uint32_t> worklist;
+
+            auto visit = [this, &worklist](uint32_t index) {
+                index = NextLive(index);
+                if (index < Size() && !m_reachable[index]) {
+                    m_reachable[index] = true;
+                    worklist.push_back(index);
+                }
+            };
+
+            for (uint32_t entry : m_entries) {
+                visit(entry);
+            }
+            if (m_infer_entries) {
+                for (uint32_t i = 0; i < Size(); ++i) {
+                    const VMOpcode opcode = m_instructions[i].opcode;
+                    if (!m_instructions[i].removed &&
+                        (opcode == VMOpcode::RET || opcode == VMOpcode::RET_VAL || opcode == VMOpcode::HALT)) {
+                        visit(i + 1);
+                    }
+                }
+            }
+
+            while (!worklist.empty()) {
+                const uint32_t index = worklist.back();
+                worklist.pop_back();
+                const DecodedInstruction& instruction = m_instructions[index];
+                if (IsBranch(instruction.opcode)) {
+                    visit(instruction.operand);
+                }
+                if (FallsThrough(instruction.opcode)) {
+                    visit(index + 1);
+                }
+            }
+            m_valid_analyses |= BytecodeAnalysis::REACHABILITY;
+        }
+
+        // --- BytecodeOptimizer ---
+
         BytecodeOptimizer::BytecodeOptimizer() 
-            : m_profiling_enabled(false)
+            : m_last_stats{}, m_profiling_enabled(false), m_global_count(0)
         {
+            InitializePasses();
             InitializeOptimizationPatterns();
         }
 
+        void BytecodeOptimizer::InitializePasses() {
+            m_passes = {
+                // Level 1: Basic optimizations. Propagation goes first so dead code
+                // elimination and folding see the branches and loads it resolved.
+                { OptimizationLevel::BASIC, XorS("Constant Propagation"), &BytecodeOptimizer::RunConstantPropagation },
+                { OptimizationLevel::BASIC, XorS("Dead Code Elimination"), &BytecodeOptimizer::RunDeadCodeElimination },
+                { OptimizationLevel::BASIC, XorS("Constant Folding"), &BytecodeOptimizer::RunConstantFolding },
+                { OptimizationLevel::BASIC, XorS("Stack Optimization"), &BytecodeOptimizer::RunStackOptimization },
+
+                // Level 2: Medium optimizations
+                { OptimizationLevel::MEDIUM, XorS("Jump Optimization"), &BytecodeOptimizer::RunJumpOptimization },
+                { OptimizationLevel::MEDIUM, XorS("Peephole Optimization"), &BytecodeOptimizer::RunPeepholeOptimization },
+                { OptimizationLevel::MEDIUM, XorS("Redundant Load Elimination"), &BytecodeOptimizer::RunRedundantLoadElimination },
+
+                // Level 3: Aggressive optimizations
+                { OptimizationLevel::AGGRESSIVE, XorS("Function Inlining"), &BytecodeOptimizer::RunFunctionInlining },
+                { OptimizationLevel::AGGRESSIVE, XorS("Loop Optimization"), &BytecodeOptimizer::RunLoopOptimization },
+
+                // Layout runs last: unrolling and inlining match code by its order
+                { OptimizationLevel::MEDIUM, XorS("Block Layout"), &BytecodeOptimizer::RunBlockLayout },
+            };
+        }
+
         std::vector<uint8_t> BytecodeOptimizer::Optimize(const std::vector<uint8_t>& bytecode, OptimizationLevel level) {
             auto start_time = std::chrono::high_resolution_clock::now();
             
@@ -26,65 +323,55 @@ namespace AetherVisor {
             m_last_stats = OptimizationStats{};
             m_last_stats.original_size = bytecode.size();
             m_address_translation.clear();
+            m_inverted_branches.clear();
 
             if (bytecode.empty() || level == OptimizationLevel::NONE) {
                 return bytecode;
             }
 
-            if (!ValidateBytecode(bytecode)) {
+            // Decode once; every pass works on the same program
+            BytecodeProgram program;
+            if (!program.Decode(bytecode, m_entry_points)) {
                 return bytecode; // Return original if validation fails
             }
 
-            std::vector<uint8_t> optimized = bytecode;
-
-            try {
-                // Level 1: Basic optimizations
-                if (level >= OptimizationLevel::BASIC) {
-                    optimized = EliminateDeadCode(optimized);
-                    RecordOptimizationApplication(XorS("Dead Code Elimination"));
-                    
-                    optimized = FoldConstants(optimized);
-                    RecordOptimizationApplication(XorS("Constant Folding"));
-                    
-                    optimized = OptimizeStackOperations(optimized);
-                    RecordOptimizationApplication(XorS("Stack Optimization"));
+            // Jump optimisation and block layout invert conditional branches in
+            // place, which swaps what their profiled outcomes mean
+            m_branch_senses.clear();
+            for (uint32_t i = 0; i < program.Size(); ++i) {
+                const VMOpcode opcode = program[i].opcode;
+                if (opcode == VMOpcode::JMP_IF_ZERO || opcode == VMOpcode::JMP_IF_NOT_ZERO) {
+                    m_branch_senses[program[i].address] = opcode;
                 }
+            }
 
-                // Level 2: Medium optimizations
-                if (level >= OptimizationLevel::MEDIUM) {
-                    optimized = OptimizeJumps(optimized);
-                    RecordOptimizationApplication(XorS("Jump Optimization"));
-                    
-                    optimized = PeepholeOptimization(optimized);
-                    RecordOptimizationApplication(XorS("Peephole Optimization"));
-                    
-                    optimized = EliminateRedundantLoads(optimized);
-                    RecordOptimizationApplication(XorS("Redundant Load Elimination"));
-                }
+            std::vector<uint8_t> optimized;
 
-                // Level 3: Aggressive optimizations
-                if (level >= OptimizationLevel::AGGRESSIVE) {
-                    optimized = InlineSmallFunctions(optimized);
-                    RecordOptimizationApplication(XorS("Function Inlining"));
-                    
-                    optimized = OptimizeLoops(optimized);
-                    RecordOptimizationApplication(XorS("Loop Optimization"));
-                    
-                    optimized = InlineConstantPropagation(optimized);
-                    RecordOptimizationApplication(XorS("Constant Propagation"));
-                    
-                    optimized = VectorizeOperations(optimized);
-                    RecordOptimizationApplication(XorS("Vectorization"));
+            try {
+                for (const OptimizationPass& pass : m_passes) {
+                    if (level < pass.level) continue;
+                    program.Invalidate((this->*pass.run)(program));
+                    RecordOptimizationApplication(pass.name);
                 }
 
-                // Final validation
-                if (!ValidateBytecode(optimized) || !VerifyOptimizationCorrectness(bytecode, optimized)) {
-                    optimized = bytecode; // Fallback to original
+                for (uint32_t i = program.NextLive(0); i < program.Size(); i = program.NextLive(i + 1)) {
+                    auto sense = m_branch_senses.find(program[i].address);
+                    const VMOpcode opcode = program[i].opcode;
+                    if (sense != m_branch_senses.end() && opcode != sense->second &&
+                        (opcode == VMOpcode::JMP_IF_ZERO || opcode == VMOpcode::JMP_IF_NOT_ZERO)) {
+                        m_inverted_branches.insert(program[i].address);
+                    }
                 }
 
+                // Encode once. Branches are held as instruction indices, so the
+                // output cannot contain a jump into the middle of an instruction.
+                program.Encode(optimized, &m_address_translation);
+
             } catch (const std::exception& e) {
                 // If optimization fails, return original bytecode
                 optimized = bytecode;
+                m_address_translation.clear();
+                m_inverted_branches.clear();
             }
 
             auto end_time = std::chrono::high_resolution_clock::now();
@@ -94,434 +381,1978 @@ namespace AetherVisor {
             return optimized;
         }
 
+        std::vector<uint8_t> BytecodeOptimizer::RunStandalonePass(const std::vector<uint8_t>& bytecode, PassFunction pass) {
+            m_address_translation.clear();
+            BytecodeProgram program;
+            if (bytecode.empty() || !program.Decode(bytecode, m_entry_points)) {
+                return bytecode;
+            }
+
+            (this->*pass)(program);
+
+            std::vector<uint8_t> result;
+            program.Encode(result, &m_address_translation);
+            return result;
+        }
+
         std::vector<uint8_t> BytecodeOptimizer::EliminateDeadCode(const std::vector<uint8_t>& bytecode) {
-            auto instructions = AnalyzeInstructions(bytecode);
-            auto reachable = FindReachableInstructions(instructions);
-            
-            std::vector<uint8_t> optimized;
+            return RunStandalonePass(bytecode, &BytecodeOptimizer::RunDeadCodeElimination);
+        }
+
+        // Propagation first, so values carried through slots and across branches
+        // reach the folder, and the code behind decided branches is dropped
+        std::vector<uint8_t> BytecodeOptimizer::FoldConstants(const std::vector<uint8_t>& bytecode) {
+            m_address_translation.clear();
+            BytecodeProgram program;
+            if (bytecode.empty() || !program.Decode(bytecode, m_entry_points)) {
+                return bytecode;
+            }
+
+            program.Invalidate(RunConstantPropagation(program));
+            program.Invalidate(RunDeadCodeElimination(program));
+            RunConstantFolding(program);
+
+            std::vector<uint8_t> result;
+            program.Encode(result, &m_address_translation);
+            return result;
+        }
+
+        std::vector<uint8_t> BytecodeOptimizer::OptimizeJumps(const std::vector<uint8_t>& bytecode) {
+            return RunStandalonePass(bytecode, &BytecodeOptimizer::RunJumpOptimization);
+        }
+
+        std::vector<uint8_t> BytecodeOptimizer::PeepholeOptimization(const std::vector<uint8_t>& bytecode) {
+            return RunStandalonePass(bytecode, &BytecodeOptimizer::RunPeepholeOptimization);
+        }
+
+        std::vector<uint8_t> BytecodeOptimizer::OptimizeStackOperations(const std::vector<uint8_t>& bytecode) {
+            return RunStandalonePass(bytecode, &BytecodeOptimizer::RunStackOptimization);
+        }
+
+        std::vector<uint8_t> BytecodeOptimizer::InlineSmallFunctions(const std::vector<uint8_t>& bytecode) {
+            return RunStandalonePass(bytecode, &BytecodeOptimizer::RunFunctionInlining);
+        }
+
+        std::vector<uint8_t> BytecodeOptimizer::EliminateRedundantLoads(const std::vector<uint8_t>& bytecode) {
+            return RunStandalonePass(bytecode, &BytecodeOptimizer::RunRedundantLoadElimination);
+        }
+
+        std::map<uint32_t, std::set<uint32_t>> BytecodeOptimizer::AnalyzeDataFlow(const std::vector<uint8_t>& bytecode) {
+            std::map<uint32_t, std::set<uint32_t>> data_flow;
+            BytecodeProgram program;
+            if (bytecode.empty() || !program.Decode(bytecode, m_entry_points)) {
+                return data_flow;
+            }
+
+            for (const auto& [load, stores] : ComputeReachingStores(program)) {
+                std::set<uint32_t>& addresses = data_flow[program[load].address];
+                for (uint32_t store : stores) {
+                    addresses.insert(store == OUTSIDE_VALUE ? OUTSIDE_VALUE : program[store].address);
+                }
+            }
+            return data_flow;
+        }
+
+        std::vector<uint8_t> BytecodeOptimizer::OptimizeDataFlow(const std::vector<uint8_t>& bytecode,
+                                                                 const std::map<uint32_t, std::set<uint32_t>>& data_flow) {
+            m_address_translation.clear();
+            BytecodeProgram program;
+            if (bytecode.empty() || !program.Decode(bytecode, m_entry_points)) {
+                return bytecode;
+            }
+
+            std::map<uint32_t, uint32_t> index_of;
+            for (uint32_t i = 0; i < program.Size(); ++i) {
+                index_of.emplace(program[i].address, i);
+            }
+            std::map<uint32_t, std::set<uint32_t>> reaching;
+            for (const auto& [load, stores] : data_flow) {
+                auto it = index_of.find(load);
+                if (it == index_of.end()) return bytecode;
+                std::set<uint32_t>& indices = reaching[it->second];
+                for (uint32_t store : stores) {
+                    auto found = index_of.find(store);
+                    if (store != OUTSIDE_VALUE && found == index_of.end()) return bytecode;
+                    indices.insert(store == OUTSIDE_VALUE ? OUTSIDE_VALUE : found->second);
+                }
+            }
+
+            m_last_stats.loads_eliminated += ForwardStoredConstants(program, reaching);
+            std::vector<uint8_t> result;
+            program.Encode(result, &m_address_translation);
+            return result;
+        }
+
+        std::vector<uint8_t> BytecodeOptimizer::OptimizeLoops(const std::vector<uint8_t>& bytecode) {
+            return RunStandalonePass(bytecode, &BytecodeOptimizer::RunLoopOptimization);
+        }
+
+        std::vector<uint8_t> BytecodeOptimizer::InlineConstantPropagation(const std::vector<uint8_t>& bytecode) {
+            return RunStandalonePass(bytecode, &BytecodeOptimizer::RunConstantPropagation);
+        }
+
+        std::vector<uint8_t> BytecodeOptimizer::VectorizeOperations(const std::vector<uint8_t>& bytecode) {
+            return RunStandalonePass(bytecode, &BytecodeOptimizer::RunVectorization);
+        }
+
+        std::vector<uint8_t> BytecodeOptimizer::UnrollLoops(const std::vector<uint8_t>& bytecode, uint32_t max_unroll_factor) {
+            m_address_translation.clear();
+            BytecodeProgram program;
+            if (bytecode.empty() || !program.Decode(bytecode, m_entry_points)) {
+                return bytecode;
+            }
+
+            UnrollHotLoops(program, max_unroll_factor);
+
+            std::vector<uint8_t> result;
+            program.Encode(result, &m_address_translation);
+            return result;
+        }
+
+        std::vector<uint8_t> BytecodeOptimizer::OptimizeMemoryAccess(const std::vector<uint8_t>& bytecode) {
+            // Memory access optimization requires alias analysis
+            return bytecode;
+        }
+
+        uint32_t BytecodeOptimizer::RunDeadCodeElimination(BytecodeProgram& program) {
             uint32_t removed_count = 0;
-            
-            for (size_t i = 0; i < instructions.size(); ++i) {
-                if (reachable.find(instructions[i].address) != reachable.end()) {
-                    // Instruction is reachable, keep it
-                    EmitInstruction(optimized, instructions[i].opcode);
-                    for (uint32_t operand : instructions[i].operands) {
-                        // Emit operand bytes (simplified)
-                        optimized.push_back(operand & 0xFF);
-                        optimized.push_back((operand >> 8) & 0xFF);
-                        optimized.push_back((operand >> 16) & 0xFF);
-                        optimized.push_back((operand >> 24) & 0xFF);
-                    }
-                } else {
+            for (uint32_t i = 0; i < program.Size(); ++i) {
+                if (!program[i].removed && (program[i].opcode == VMOpcode::NOP || !program.IsReachable(i))) {
+                    program.Remove(i);
                     removed_count++;
                 }
             }
             
             m_last_stats.instructions_removed += removed_count;
-            return optimized;
+            // Unreachable branches may have been the only way into some targets
+            return BytecodeAnalysis::REACHABILITY;
         }
 
-        std::vector<uint8_t> BytecodeOptimizer::FoldConstants(const std::vector<uint8_t>& bytecode) {
-            auto instructions = AnalyzeInstructions(bytecode);
-            auto constants = AnalyzeConstants(instructions);
-            
-            std::vector<InstructionInfo> optimized_instructions;
+        uint32_t BytecodeOptimizer::RunConstantFolding(BytecodeProgram& program) {
+            const uint32_t end = program.Size();
             uint32_t folded_count = 0;
-            
-            for (size_t i = 0; i < instructions.size(); ++i) {
-                const auto& inst = instructions[i];
-                
-                // Look for constant arithmetic operations
-                if ((inst.opcode == VMOpcode::ADD || inst.opcode == VMOpcode::SUB || 
-                     inst.opcode == VMOpcode::MUL || inst.opcode == VMOpcode::DIV) &&
-                    i >= 2) {
+
+            // The two live instructions before the current one
+            uint32_t first = end;
+            uint32_t second = end;
+
+            for (uint32_t i = program.NextLive(0); i < end; i = program.NextLive(i + 1)) {
+                DecodedInstruction& inst = program[i];
+
+                // Operands must reach the operation along the straight-line path only
+                const bool second_push = second < end && program[second].opcode == VMOpcode::PUSH_INT &&
+                                         !program.IsBranchTarget(second) && !program.IsBranchTarget(i);
+
+                if (second_push && first < end && program[first].opcode == VMOpcode::PUSH_INT) {
+                    ConstantValue a, b;
+                    a.type = VMDataType::INT32;
+                    a.int_val = static_cast<int32_t>(program[first].operand);
+                    a.is_known = true;
                     
-                    // Check if the two previous instructions push constants
-                    if (instructions[i-2].opcode == VMOpcode::PUSH_INT && 
-                        instructions[i-1].opcode == VMOpcode::PUSH_INT) {
-                        
-                        ConstantValue a, b;
-                        a.type = VMDataType::INT32;
-                        a.int_val = static_cast<int32_t>(instructions[i-2].operands[0]);
-                        a.is_known = true;
-                        
-                        b.type = VMDataType::INT32;
-                        b.int_val = static_cast<int32_t>(instructions[i-1].operands[0]);
-                        b.is_known = true;
-                        
-                        if (CanFoldConstantOperation(inst.opcode, a, b)) {
-                            ConstantValue result = FoldConstantOperation(inst.opcode, a, b);
-                            
-                            // Remove the two push instructions and the operation
-                            optimized_instructions.pop_back(); // Remove second PUSH_INT
-                            optimized_instructions.pop_back(); // Remove first PUSH_INT
-                            
-                            // Add a single PUSH_INT with the folded result
-                            InstructionInfo folded_inst;
-                            folded_inst.opcode = VMOpcode::PUSH_INT;
-                            folded_inst.operands = {static_cast<uint32_t>(result.int_val)};
-                            folded_inst.address = inst.address;
-                            folded_inst.size = 5; // 1 byte opcode + 4 bytes operand
-                            optimized_instructions.push_back(folded_inst);
-                            
-                            folded_count++;
-                            continue;
-                        }
+                    b.type = VMDataType::INT32;
+                    b.int_val = static_cast<int32_t>(program[second].operand);
+                    b.is_known = true;
+                    
+                    if (CanFoldConstantOperation(inst.opcode, a, b)) {
+                        ConstantValue result = FoldConstantOperation(inst.opcode, a, b);
+
+                        // The operation itself becomes the push, so a branch
+                        // into the first operand now enters the folded result
+                        program.Remove(first);
+                        program.Remove(second);
+                        inst.opcode = VMOpcode::PUSH_INT;
+                        inst.operand = static_cast<uint32_t>(result.int_val);
+
+                        folded_count++;
+                        second = i;
+                        first = program.PreviousLive(i);
+                        continue;
                     }
                 }
-                
-                optimized_instructions.push_back(inst);
+
+                if (second_push && inst.opcode == VMOpcode::NEG &&
+                    program[second].operand != static_cast<uint32_t>(std::numeric_limits<int32_t>::min())) {
+                    const int32_t value = static_cast<int32_t>(program[second].operand);
+                    program.Remove(second);
+                    inst.opcode = VMOpcode::PUSH_INT;
+                    inst.operand = static_cast<uint32_t>(-value);
+
+                    folded_count++;
+                    second = i;
+                    first = program.PreviousLive(i);
+                    continue;
+                }
+
+                first = second;
+                second = i;
             }
             
             m_last_stats.constants_folded += folded_count;
-            
-            std::vector<uint8_t> result;
-            EmitInstructionSequence(result, optimized_instructions);
-            return result;
+            m_last_stats.instructions_removed += folded_count * 2;
+            return BytecodeAnalysis::ALL;
         }
 
-        std::vector<uint8_t> BytecodeOptimizer::OptimizeJumps(const std::vector<uint8_t>& bytecode) {
-            auto instructions = AnalyzeInstructions(bytecode);
-            auto jump_targets = FindJumpTargets(instructions);
+        uint32_t BytecodeOptimizer::RunJumpOptimization(BytecodeProgram& program) {
+            const uint32_t end = program.Size();
             uint32_t optimized_count = 0;
-            
-            // Optimize jump chains
-            for (auto& inst : instructions) {
-                if (inst.is_jump && !inst.operands.empty()) {
-                    uint32_t original_target = inst.operands[0];
-                    uint32_t optimized_target = ResolveJumpChain(jump_targets, original_target);
-                    
-                    if (optimized_target != original_target) {
-                        inst.operands[0] = optimized_target;
-                        optimized_count++;
+
+            for (uint32_t i = program.NextLive(0); i < end; i = program.NextLive(i + 1)) {
+                DecodedInstruction& inst = program[i];
+                if (!BytecodeProgram::IsBranch(inst.opcode)) continue;
+
+                // Thread jump chains; the hop limit stops on JMP cycles
+                uint32_t target = program.ResolveTarget(i);
+                for (uint32_t hops = 0; hops < 32 && target < end && program[target].opcode == VMOpcode::JMP; ++hops) {
+                    const uint32_t next = program.ResolveTarget(target);
+                    if (next == target) break;
+                    target = next;
+                }
+                if (target != program.ResolveTarget(i)) {
+                    program.SetTarget(i, target);
+                    optimized_count++;
+                }
+                if (inst.opcode == VMOpcode::TRY) continue;
+
+                const uint32_t next = program.NextLive(i + 1);
+
+                // JZ L1; JMP L2; L1: -> JNZ L2
+                if (inst.opcode != VMOpcode::JMP && next < end && program[next].opcode == VMOpcode::JMP &&
+                    !program.IsBranchTarget(next) && program.NextLive(next + 1) == target) {
+                    inst.opcode = inst.opcode == VMOpcode::JMP_IF_ZERO ? VMOpcode::JMP_IF_NOT_ZERO : VMOpcode::JMP_IF_ZERO;
+                    program.SetTarget(i, program.ResolveTarget(next));
+                    program.Remove(next);
+                    optimized_count++;
+                    continue;
+                }
+
+                // Branches to the next instruction
+                if (target == next) {
+                    if (inst.opcode == VMOpcode::JMP) {
+                        program.Remove(i);
+                    } else {
+                        inst.opcode = VMOpcode::POP; // The condition is still consumed
+                        inst.operand = 0;
                     }
+                    optimized_count++;
                 }
             }
             
-            // Remove unreachable jumps
-            auto unreachable_jumps = FindUnreachableJumps(instructions);
-            auto filtered_instructions = instructions;
-            filtered_instructions.erase(
-                std::remove_if(filtered_instructions.begin(), filtered_instructions.end(),
-                    [&unreachable_jumps](const InstructionInfo& inst) {
-                        return unreachable_jumps.find(inst.address) != unreachable_jumps.end();
-                    }),
-                filtered_instructions.end()
-            );
-            
             m_last_stats.jumps_optimized += optimized_count;
-            
-            std::vector<uint8_t> result;
-            EmitInstructionSequence(result, filtered_instructions);
-            return result;
+            return BytecodeAnalysis::NONE;
         }
 
-        std::vector<uint8_t> BytecodeOptimizer::PeepholeOptimization(const std::vector<uint8_t>& bytecode) {
-            auto instructions = AnalyzeInstructions(bytecode);
-            std::vector<InstructionInfo> optimized_instructions;
-            uint32_t combined_count = 0;
-            
-            size_t i = 0;
-            while (i < instructions.size()) {
-                bool pattern_matched = false;
-                
-                // Try to match optimization patterns
-                for (const auto& pattern : m_peephole_patterns) {
-                    if (MatchPattern(instructions, i, pattern)) {
-                        // Apply the pattern replacement
-                        for (VMOpcode replacement_opcode : pattern.replacement) {
-                            InstructionInfo replacement_inst;
-                            replacement_inst.opcode = replacement_opcode;
-                            replacement_inst.address = instructions[i].address;
-                            optimized_instructions.push_back(replacement_inst);
+        uint32_t BytecodeOptimizer::RunPeepholeOptimization(BytecodeProgram& program) {
+            const uint32_t end = program.Size();
+            uint32_t combined_count = 0;
+            uint32_t window[MAX_PATTERN_LENGTH];
+
+            uint32_t i = program.NextLive(0);
+            while (i < end) {
+                size_t window_size = 0;
+                for (uint32_t j = i; j < end && window_size < MAX_PATTERN_LENGTH; j = program.NextLive(j + 1)) {
+                    window[window_size++] = j;
+                }
+
+                bool pattern_matched = false;
+                for (const auto& pattern : m_peephole_patterns) {
+                    if (!MatchPattern(program, window, window_size, pattern)) continue;
+
+                    // Apply the pattern replacement
+                    for (size_t k = 0; k < pattern.pattern.size(); ++k) {
+                        if (k < pattern.replacement.size()) {
+                            program[window[k]].opcode = pattern.replacement[k];
+                        } else {
+                            program.Remove(window[k]);
+                        }
+                    }
+                    
+                    combined_count++;
+                    pattern_matched = true;
+                    break;
+                }
+
+                if (pattern_matched) {
+                    // Every pattern shrinks the code, so backing up terminates
+                    const uint32_t previous = program.PreviousLive(window[0]);
+                    i = previous < end ? previous : program.NextLive(0);
+                } else {
+                    i = program.NextLive(i + 1);
+                }
+            }
+            
+            m_last_stats.instructions_combined += combined_count;
+            return BytecodeAnalysis::ALL;
+        }
+
+        uint32_t BytecodeOptimizer::RunStackOptimization(BytecodeProgram& program) {
+            const uint32_t end = program.Size();
+            uint32_t removed_count = 0;
+            uint32_t previous = end;
+
+            for (uint32_t i = program.NextLive(0); i < end; i = program.NextLive(i + 1)) {
+                // A value pushed without side effects and popped straight away
+                if (program[i].opcode == VMOpcode::POP && previous < end && !program.IsBranchTarget(i)) {
+                    switch (program[previous].opcode) {
+                        case VMOpcode::PUSH_INT:
+                        case VMOpcode::PUSH_FLOAT:
+                        case VMOpcode::PUSH_DOUBLE:
+                        case VMOpcode::PUSH_CONST:
+                        case VMOpcode::PUSH_CONST_W:
+                        case VMOpcode::LOAD_LOCAL:
+                        case VMOpcode::LOAD_GLOBAL:
+                        case VMOpcode::DUP:
+                            program.Remove(previous);
+                            program.Remove(i);
+                            removed_count += 2;
+                            previous = program.PreviousLive(i);
+                            continue;
+                        default:
+                            break;
+                    }
+                }
+                previous = i;
+            }
+
+            m_last_stats.instructions_removed += removed_count;
+            return BytecodeAnalysis::ALL;
+        }
+
+        // Placeholder implementations for complex optimizations
+
+        uint32_t BytecodeOptimizer::RunLoopOptimization(BytecodeProgram& program) {
+            // Invariant code motion and strength reduction need free slots for
+            // the hoisted values, so the compiler does them on the SSA form
+            // (SSAOptimizer::OptimizeLoops). What is left here is unrolling.
+            return UnrollHotLoops(program, 4);
+        }
+
+        // Not implemented, so not in m_passes: the VM has no vector operations
+        // to rewrite into
+        uint32_t BytecodeOptimizer::RunVectorization(BytecodeProgram& /*program*/) {
+            return BytecodeAnalysis::NONE;
+        }
+
+        // --- Control flow and loops ---
+
+        std::vector<CFGNode> BytecodeOptimizer::BuildControlFlowGraph(const std::vector<uint8_t>& bytecode) {
+            BytecodeProgram program;
+            if (bytecode.empty() || !program.Decode(bytecode, m_entry_points)) {
+                return {};
+            }
+
+            // Same graph, keyed by byte address instead of instruction index
+            std::vector<CFGNode> cfg = BuildControlFlowGraph(program);
+            auto to_address = [&program](uint32_t index) { return program[index].address; };
+            for (CFGNode& node : cfg) {
+                const uint32_t end = node.end_address;
+                node.start_address = to_address(node.start_address);
+                node.end_address = to_address(end);
+                const uint32_t limit = node.end_address + 1 + BytecodeProgram::GetOperandSize(program[end].opcode);
+                node.instructions.assign(bytecode.begin() + node.start_address, bytecode.begin() + limit);
+
+                std::set<uint32_t> predecessors, successors;
+                for (uint32_t index : node.predecessors) predecessors.insert(to_address(index));
+                for (uint32_t index : node.successors) successors.insert(to_address(index));
+                node.predecessors = std::move(predecessors);
+                node.successors = std::move(successors);
+            }
+
+            std::set<uint32_t> headers;
+            for (const LoopInfo& loop : DetectLoops(cfg)) {
+                headers.insert(loop.header_address);
+            }
+            for (CFGNode& node : cfg) {
+                node.is_loop_header = headers.count(node.start_address) != 0;
+            }
+            return cfg;
+        }
+
+        std::vector<CFGNode> BytecodeOptimizer::BuildControlFlowGraph(BytecodeProgram& program) {
+            std::vector<CFGNode> cfg;
+            const uint32_t end = program.Size();
+
+            for (uint32_t i = program.NextLive(0); i < end; i = program.NextLive(i + 1)) {
+                if (program.IsBlockStart(i)) {
+                    CFGNode node{};
+                    node.start_address = i;
+                    node.is_entry_point = program.IsEntry(i);
+                    auto count = m_execution_counts.find(program[i].address);
+                    node.execution_frequency = count != m_execution_counts.end() ? count->second : 0;
+                    cfg.push_back(std::move(node));
+                }
+                cfg.back().end_address = i;
+            }
+
+            std::map<uint32_t, size_t> block_of;
+            for (size_t b = 0; b < cfg.size(); ++b) {
+                block_of[cfg[b].start_address] = b;
+            }
+            for (CFGNode& node : cfg) {
+                const uint32_t last = node.end_address;
+                const VMOpcode opcode = program[last].opcode;
+                node.is_exit_point = opcode == VMOpcode::RET || opcode == VMOpcode::RET_VAL ||
+                                     opcode == VMOpcode::HALT || opcode == VMOpcode::THROW;
+                if (BytecodeProgram::IsBranch(opcode) && program.ResolveTarget(last) < end) {
+                    node.successors.insert(program.ResolveTarget(last));
+                }
+                if (BytecodeProgram::FallsThrough(opcode) && program.NextLive(last + 1) < end) {
+                    node.successors.insert(program.NextLive(last + 1));
+                }
+            }
+            for (const CFGNode& node : cfg) {
+                for (uint32_t successor : node.successors) {
+                    cfg[block_of[successor]].predecessors.insert(node.start_address);
+                }
+            }
+            return cfg;
+        }
+
+        std::vector<BytecodeOptimizer::LoopInfo> BytecodeOptimizer::DetectLoops(const std::vector<CFGNode>& cfg) {
+            std::vector<LoopInfo> loops;
+            const size_t count = cfg.size();
+            if (count == 0) return loops;
+
+            constexpr size_t NONE = std::numeric_limits<size_t>::max();
+            const size_t root = count; // Virtual root above every entry
+
+            std::map<uint32_t, size_t> block_of;
+            for (size_t b = 0; b < count; ++b) {
+                block_of[cfg[b].start_address] = b;
+            }
+            std::vector<std::vector<size_t>> successors(count + 1), predecessors(count + 1);
+            for (size_t b = 0; b < count; ++b) {
+                for (uint32_t address : cfg[b].successors) {
+                    auto it = block_of.find(address);
+                    if (it == block_of.end()) continue;
+                    successors[b].push_back(it->second);
+                    predecessors[it->second].push_back(b);
+                }
+                if (cfg[b].is_entry_point) {
+                    successors[root].push_back(b);
+                    predecessors[b].push_back(root);
+                }
+            }
+            if (successors[root].empty()) {
+                successors[root].push_back(0);
+                predecessors[0].push_back(root);
+            }
+
+            // Reverse postorder from the virtual root
+            std::vector<size_t> order;
+            std::vector<size_t> position(count + 1, NONE);
+            {
+                std::vector<bool> visited(count + 1, false);
+                std::vector<std::pair<size_t, size_t>> stack{ { root, 0 } };
+                visited[root] = true;
+                while (!stack.empty()) {
+                    auto& [block, next] = stack.back();
+                    if (next < successors[block].size()) {
+                        const size_t successor = successors[block][next++];
+                        if (!visited[successor]) {
+                            visited[successor] = true;
+                            stack.push_back({ successor, 0 });
+                        }
+                    } else {
+                        order.push_back(block);
+                        stack.pop_back();
+                    }
+                }
+                std::reverse(order.begin(), order.end());
+                for (size_t i = 0; i < order.size(); ++i) {
+                    position[order[i]] = i;
+                }
+            }
+
+            // Immediate dominators (Cooper, Harvey and Kennedy)
+            std::vector<size_t> idom(count + 1, NONE);
+            idom[root] = root;
+            auto intersect = [&](size_t a, size_t b) {
+                while (a != b) {
+                    while (position[a] > position[b]) a = idom[a];
+                    while (position[b] > position[a]) b = idom[b];
+                }
+                return a;
+            };
+            for (bool changed = true; changed;) {
+                changed = false;
+                for (size_t block : order) {
+                    if (block == root) continue;
+                    size_t new_idom = NONE;
+                    for (size_t predecessor : predecessors[block]) {
+                        if (idom[predecessor] == NONE) continue;
+                        new_idom = new_idom == NONE ? predecessor : intersect(predecessor, new_idom);
+                    }
+                    if (idom[block] != new_idom) {
+                        idom[block] = new_idom;
+                        changed = true;
+                    }
+                }
+            }
+            auto dominates = [&](size_t a, size_t b) {
+                for (;;) {
+                    if (b == a) return true;
+                    if (b == root) return false;
+                    b = idom[b];
+                }
+            };
+
+            // A back edge enters a block that dominates its source. A dominator
+            // comes first in reverse postorder, so forward edges need no walk.
+            std::map<size_t, std::vector<size_t>> latches;
+            for (size_t block : order) {
+                if (block == root) continue;
+                for (size_t successor : successors[block]) {
+                    if (position[successor] <= position[block] && dominates(successor, block)) {
+                        latches[successor].push_back(block);
+                    }
+                }
+            }
+
+            std::vector<std::set<size_t>> bodies;
+            for (const auto& [header, sources] : latches) {
+                std::set<size_t> body{ header };
+                std::vector<size_t> worklist(sources.begin(), sources.end());
+                while (!worklist.empty()) {
+                    const size_t block = worklist.back();
+                    worklist.pop_back();
+                    if (!body.insert(block).second) continue;
+                    for (size_t predecessor : predecessors[block]) {
+                        if (predecessor != root && position[predecessor] != NONE) worklist.push_back(predecessor);
+                    }
+                }
+
+                LoopInfo loop{};
+                loop.header_address = cfg[header].start_address;
+                loop.end_address = cfg[header].end_address;
+                uint32_t entering = 0;
+                for (size_t block : body) {
+                    loop.body_addresses.insert(cfg[block].start_address);
+                    loop.end_address = std::max(loop.end_address, cfg[block].end_address);
+                    for (size_t successor : successors[block]) {
+                        if (!body.count(successor)) loop.exit_addresses.insert(cfg[successor].start_address);
+                    }
+                }
+                for (size_t predecessor : predecessors[header]) {
+                    if (predecessor != root && !body.count(predecessor)) entering += cfg[predecessor].execution_frequency;
+                }
+                // Header executions per entry into the loop, 0 without a profile
+                loop.estimated_iterations = entering ? cfg[header].execution_frequency / entering : 0;
+                loops.push_back(std::move(loop));
+                bodies.push_back(std::move(body));
+            }
+
+            // Inner loops hold no header but their own
+            std::vector<bool> is_header(count + 1, false);
+            for (const auto& entry : latches) {
+                is_header[entry.first] = true;
+            }
+            for (size_t i = 0; i < loops.size(); ++i) {
+                const size_t header = block_of[loops[i].header_address];
+                loops[i].is_inner_loop = std::none_of(bodies[i].begin(), bodies[i].end(),
+                                                      [&](size_t block) { return block != header && is_header[block]; });
+            }
+            return loops;
+        }
+
+        uint32_t BytecodeOptimizer::UnrollHotLoops(BytecodeProgram& program, uint32_t max_unroll_factor) {
+            if (max_unroll_factor < 2 || !m_profiling_enabled || m_execution_counts.empty()) {
+                return BytecodeAnalysis::ALL;
+            }
+
+            const std::vector<CFGNode> cfg = BuildControlFlowGraph(program);
+            std::vector<LoopInfo> loops = DetectLoops(cfg);
+
+            // Inner loops are disjoint; going backwards keeps the indices of the
+            // loops still to be processed valid across insertions
+            std::sort(loops.begin(), loops.end(), [](const LoopInfo& a, const LoopInfo& b) {
+                return a.header_address > b.header_address;
+            });
+
+            uint32_t unrolled = 0;
+            for (const LoopInfo& loop : loops) {
+                const uint32_t header = loop.header_address;
+                const uint32_t latch = loop.end_address;
+                if (!loop.is_inner_loop) continue;
+
+                auto count = m_execution_counts.find(program[header].address);
+                if (count == m_execution_counts.end() || count->second < HOT_LOOP_THRESHOLD) continue;
+
+                // Only loops laid out as [header ... JMP header] with the jump as
+                // the sole back edge can be unrolled by copying the range
+                if (program[latch].opcode != VMOpcode::JMP || program.ResolveTarget(latch) != header) continue;
+                size_t blocks_in_range = 0;
+                bool entered = false;
+                for (const CFGNode& node : cfg) {
+                    if (node.start_address < header || node.start_address > latch) continue;
+                    ++blocks_in_range;
+                    entered |= node.start_address != header && node.is_entry_point;
+                }
+                if (entered || blocks_in_range != loop.body_addresses.size() ||
+                    *loop.body_addresses.begin() != header) continue;
+
+                bool single_entry = true;
+                for (uint32_t i = program.NextLive(0); i < program.Size() && single_entry; i = program.NextLive(i + 1)) {
+                    if (!BytecodeProgram::IsBranch(program[i].opcode)) continue;
+                    const uint32_t target = program.ResolveTarget(i);
+                    const bool inside = i >= header && i <= latch;
+                    if (inside ? (target == header && i != latch) : (target > header && target <= latch)) {
+                        single_entry = false;
+                    }
+                }
+                if (!single_entry) continue;
+
+                std::vector<uint32_t> rank(latch - header, 0);
+                uint32_t length = 0;
+                for (uint32_t i = program.NextLive(header); i < latch; i = program.NextLive(i + 1)) {
+                    rank[i - header] = length++;
+                }
+
+                if (length == 0) continue;
+                uint32_t factor = std::min(max_unroll_factor, loop.estimated_iterations / 2);
+                factor = std::min(factor, 1 + MAX_UNROLLED_INSTRUCTIONS / length);
+                if (factor < 2) continue;
+
+                // Copy c starts at latch + c * length; the back edge follows the last copy
+                const uint32_t added = length * (factor - 1);
+                std::vector<DecodedInstruction> copies;
+                copies.reserve(added);
+                for (uint32_t c = 0; c + 1 < factor; ++c) {
+                    const uint32_t base = latch + c * length;
+                    for (uint32_t i = program.NextLive(header); i < latch; i = program.NextLive(i + 1)) {
+                        DecodedInstruction copy = program[i];
+                        copy.address = BytecodeProgram::NO_INDEX;
+                        if (BytecodeProgram::IsBranch(copy.opcode)) {
+                            const uint32_t target = program.ResolveTarget(i);
+                            if (target >= header && target < latch) {
+                                copy.operand = base + rank[target - header];
+                            } else if (target == latch) {
+                                copy.operand = base + length;
+                            } else if (target > latch) {
+                                copy.operand = target + added;
+                            } else {
+                                copy.operand = target;
+                            }
+                        }
+                        copies.push_back(copy);
+                    }
+                }
+                program.Insert(latch, copies);
+
+                // Early continues in the original body go on to the first copy
+                for (uint32_t i = program.NextLive(header); i < latch; i = program.NextLive(i + 1)) {
+                    if (BytecodeProgram::IsBranch(program[i].opcode) && program.ResolveTarget(i) == latch + added) {
+                        program.SetTarget(i, latch);
+                    }
+                }
+
+                m_last_stats.loops_unrolled++;
+                unrolled++;
+            }
+
+            return unrolled ? BytecodeAnalysis::NONE : BytecodeAnalysis::ALL;
+        }
+
+        bool BytecodeOptimizer::GetBranchProbability(const BytecodeProgram& program, uint32_t branch, double& taken) const {
+            const DecodedInstruction& instruction = program[branch];
+            if (!m_profiling_enabled || instruction.address == BytecodeProgram::NO_INDEX) return false;
+
+            auto profile = m_branch_profile.find(instruction.address);
+            auto sense = m_branch_senses.find(instruction.address);
+            if (profile == m_branch_profile.end() || sense == m_branch_senses.end()) return false;
+            const double total = static_cast<double>(profile->second.taken) + profile->second.not_taken;
+            if (total == 0.0) return false;
+
+            taken = profile->second.taken / total;
+            if (sense->second != instruction.opcode) taken = 1.0 - taken;
+            return true;
+        }
+
+        // Pettis-Hansen layout within each function. Blocks are chained along
+        // their heaviest edges so the likely successor falls through, preferring
+        // edges that delete a JMP; chains are then placed by how strongly the
+        // code already placed leads into them, and chains that never run go last.
+        uint32_t BytecodeOptimizer::RunBlockLayout(BytecodeProgram& program) {
+            const std::vector<CFGNode> cfg = BuildControlFlowGraph(program);
+            const size_t count = cfg.size();
+            if (count < 2) return BytecodeAnalysis::ALL;
+
+            constexpr size_t NONE = std::numeric_limits<size_t>::max();
+            std::map<uint32_t, size_t> block_of;
+            for (size_t b = 0; b < count; ++b) {
+                block_of[cfg[b].start_address] = b;
+            }
+            auto block_at = [&block_of](uint32_t index) {
+                auto it = block_of.find(index);
+                return it != block_of.end() ? it->second : NONE;    // End of the code
+            };
+
+            std::vector<size_t> taken(count, NONE), fall(count, NONE);
+            for (size_t b = 0; b < count; ++b) {
+                const uint32_t last = cfg[b].end_address;
+                const VMOpcode opcode = program[last].opcode;
+                if (BytecodeProgram::IsBranch(opcode)) taken[b] = block_at(program.ResolveTarget(last));
+                if (BytecodeProgram::FallsThrough(opcode)) fall[b] = block_at(program.NextLive(last + 1));
+            }
+            auto opcode_of = [&](size_t b) { return program[cfg[b].end_address].opcode; };
+            auto is_conditional = [&](size_t b) {
+                const VMOpcode opcode = opcode_of(b);
+                return (opcode == VMOpcode::JMP_IF_ZERO || opcode == VMOpcode::JMP_IF_NOT_ZERO) && taken[b] != fall[b];
+            };
+
+            // Blocks from which every path ends in THROW
+            std::vector<bool> must_throw(count, false);
+            for (bool changed = true; changed;) {
+                changed = false;
+                for (size_t b = count; b-- > 0;) {
+                    if (must_throw[b]) continue;
+                    const VMOpcode opcode = opcode_of(b);
+                    bool throws = opcode == VMOpcode::THROW;
+                    if (opcode != VMOpcode::THROW && opcode != VMOpcode::RET && opcode != VMOpcode::RET_VAL &&
+                        opcode != VMOpcode::HALT) {
+                        const bool taken_throws = opcode == VMOpcode::TRY || !BytecodeProgram::IsBranch(opcode) ||
+                                                  (taken[b] != NONE && must_throw[taken[b]]);
+                        const bool fall_throws = !BytecodeProgram::FallsThrough(opcode) ||
+                                                 (fall[b] != NONE && must_throw[fall[b]]);
+                        throws = taken_throws && fall_throws;
+                    }
+                    if (throws) {
+                        must_throw[b] = true;
+                        changed = true;
+                    }
+                }
+            }
+
+            // Innermost loop of each block
+            const std::vector<LoopInfo> loops = DetectLoops(cfg);
+            std::vector<const LoopInfo*> innermost(count, nullptr);
+            std::vector<bool> is_header(count, false);
+            for (const LoopInfo& loop : loops) {
+                is_header[block_of[loop.header_address]] = true;
+                for (uint32_t address : loop.body_addresses) {
+                    const size_t b = block_of[address];
+                    if (!innermost[b] || loop.body_addresses.size() < innermost[b]->body_addresses.size()) {
+                        innermost[b] = &loop;
+                    }
+                }
+            }
+            auto stays_in_loop = [&](size_t from, size_t to) {
+                return innermost[from] && innermost[from]->body_addresses.count(cfg[to].start_address) != 0;
+            };
+
+            // Probability of each edge; TRY never takes its handler edge here
+            struct LayoutEdge {
+                size_t from;
+                size_t to;
+                double probability;
+                double weight;
+            };
+            std::vector<LayoutEdge> edges;
+            for (size_t b = 0; b < count; ++b) {
+                const VMOpcode opcode = opcode_of(b);
+                if (is_conditional(b)) {
+                    double probability;
+                    if (!GetBranchProbability(program, cfg[b].end_address, probability)) {
+                        const size_t t = taken[b], f = fall[b];
+                        if (t == NONE || f == NONE) {
+                            probability = 0.5;
+                        } else if (must_throw[t] != must_throw[f]) {
+                            probability = must_throw[t] ? 0.0 : 1.0;
+                        } else if (stays_in_loop(b, t) != stays_in_loop(b, f)) {
+                            probability = stays_in_loop(b, t) ? LOOP_STAY_PROBABILITY : 1.0 - LOOP_STAY_PROBABILITY;
+                        } else {
+                            probability = 0.5;
+                        }
+                    }
+                    edges.push_back({ b, taken[b], probability, 0.0 });
+                    edges.push_back({ b, fall[b], 1.0 - probability, 0.0 });
+                } else if (opcode == VMOpcode::TRY) {
+                    edges.push_back({ b, taken[b], 0.0, 0.0 });
+                    edges.push_back({ b, fall[b], 1.0, 0.0 });
+                } else if (BytecodeProgram::IsBranch(opcode)) {
+                    edges.push_back({ b, taken[b], 1.0, 0.0 });
+                } else if (BytecodeProgram::FallsThrough(opcode)) {
+                    edges.push_back({ b, fall[b], 1.0, 0.0 });
+                }
+            }
+            edges.erase(std::remove_if(edges.begin(), edges.end(), [NONE](const LayoutEdge& edge) { return edge.to == NONE; }),
+                        edges.end());
+            std::vector<std::vector<size_t>> incoming(count), outgoing(count);
+            for (size_t e = 0; e < edges.size(); ++e) {
+                incoming[edges[e].to].push_back(e);
+                outgoing[edges[e].from].push_back(e);
+            }
+
+            std::vector<uint32_t> order;
+            std::vector<DecodedInstruction> added;
+            order.reserve(program.Size());
+            uint32_t moved = 0;
+            uint32_t jumps_removed = 0;
+
+            auto range_start = [&cfg](size_t b) { return b == 0 ? 0u : cfg[b - 1].end_address + 1; };
+            auto append_range = [&order, &cfg, &range_start](size_t b) {
+                for (uint32_t i = range_start(b); i <= cfg[b].end_address; ++i) {
+                    order.push_back(i);
+                }
+            };
+
+            for (size_t first = 0; first < count;) {
+                size_t last = first;
+                while (last + 1 < count && !cfg[last + 1].is_entry_point) ++last;
+                const size_t region_end = last + 1;
+                auto inside = [first, last](size_t b) { return b >= first && b <= last; };
+
+                bool movable = region_end - first > 2;
+                for (size_t b = first; b <= last && movable; ++b) {
+                    if (BytecodeProgram::FallsThrough(opcode_of(b)) && !inside(fall[b])) movable = false;
+                }
+                if (!movable) {
+                    for (size_t b = first; b <= last; ++b) append_range(b);
+                    first = region_end;
+                    continue;
+                }
+
+                // Frequencies in reverse postorder, from forward edges only; a
+                // block the profile covers takes its count. Per-region arrays
+                // are indexed by b - first.
+                const size_t region_size = region_end - first;
+                std::vector<size_t> rpo;
+                std::vector<size_t> position(region_size, NONE);
+                {
+                    std::vector<bool> visited(region_size, false);
+                    std::vector<std::pair<size_t, size_t>> stack{ { first, 0 } };
+                    visited[0] = true;
+                    while (!stack.empty()) {
+                        auto& [block, next] = stack.back();
+                        if (next < outgoing[block].size()) {
+                            const size_t successor = edges[outgoing[block][next++]].to;
+                            if (inside(successor) && !visited[successor - first]) {
+                                visited[successor - first] = true;
+                                stack.push_back({ successor, 0 });
+                            }
+                        } else {
+                            rpo.push_back(block);
+                            stack.pop_back();
+                        }
+                    }
+                    std::reverse(rpo.begin(), rpo.end());
+                    for (size_t i = 0; i < rpo.size(); ++i) position[rpo[i] - first] = i;
+                }
+
+                std::vector<double> frequency(region_size, 0.0);
+                for (size_t b : rpo) {
+                    double& block_frequency = frequency[b - first];
+                    auto profiled = m_execution_counts.end();
+                    if (m_profiling_enabled && program[cfg[b].start_address].address != BytecodeProgram::NO_INDEX) {
+                        profiled = m_execution_counts.find(program[cfg[b].start_address].address);
+                    }
+                    if (profiled != m_execution_counts.end()) {
+                        block_frequency = profiled->second;
+                    } else if (b == first) {
+                        block_frequency = 1.0;
+                    } else {
+                        for (size_t e : incoming[b]) {
+                            const LayoutEdge& edge = edges[e];
+                            if (inside(edge.from) && position[edge.from - first] < position[b - first]) {
+                                block_frequency += frequency[edge.from - first] * edge.probability;
+                            }
+                        }
+                        if (is_header[b]) block_frequency *= LOOP_WEIGHT;
+                    }
+                }
+
+                // Chain along the heaviest edges
+                std::vector<size_t> region_edges;
+                for (size_t b = first; b <= last; ++b) {
+                    for (size_t e : outgoing[b]) {
+                        edges[e].weight = frequency[b - first] * edges[e].probability;
+                        if (inside(edges[e].to) && edges[e].weight > 0.0) region_edges.push_back(e);
+                    }
+                }
+                std::stable_sort(region_edges.begin(), region_edges.end(), [&](size_t a, size_t b) {
+                    if (edges[a].weight != edges[b].weight) return edges[a].weight > edges[b].weight;
+                    return opcode_of(edges[a].from) == VMOpcode::JMP && opcode_of(edges[b].from) != VMOpcode::JMP;
+                });
+
+                // Chain heat is the hottest block's frequency, kept up to date as chains merge
+                std::vector<std::vector<size_t>> chains;
+                std::vector<double> heat;
+                std::vector<size_t> chain_of(region_size, NONE);
+                for (size_t b = first; b <= last; ++b) {
+                    chain_of[b - first] = chains.size();
+                    chains.push_back({ b });
+                    heat.push_back(frequency[b - first]);
+                }
+                for (size_t e : region_edges) {
+                    const size_t from = chain_of[edges[e].from - first], to = chain_of[edges[e].to - first];
+                    if (from == to || edges[e].to == first || chains[from].back() != edges[e].from ||
+                        chains[to].front() != edges[e].to) continue;
+                    for (size_t b : chains[to]) chain_of[b - first] = from;
+                    chains[from].insert(chains[from].end(), chains[to].begin(), chains[to].end());
+                    chains[to].clear();
+                    heat[from] = std::max(heat[from], heat[to]);
+                }
+
+                // Without explicit entry points the next function is found after
+                // the RET or HALT that ends this one, so that block stays last
+                const size_t final_chain = m_entry_points.empty() && region_end < count ? chain_of[last - first] : NONE;
+                std::vector<double> connection(chains.size(), 0.0);
+                std::vector<bool> placed(chains.size(), false);
+                std::vector<size_t> sequence;
+
+                // Hot chains wait in a queue by connection to what is placed, the
+                // lowest index first on a tie; an entry is stale once its chain's
+                // connection has grown
+                auto less_connected = [](const std::pair<double, size_t>& a, const std::pair<double, size_t>& b) {
+                    return a.first != b.first ? a.first < b.first : a.second > b.second;
+                };
+                std::priority_queue<std::pair<double, size_t>, std::vector<std::pair<double, size_t>>,
+                                    decltype(less_connected)> candidates(less_connected);
+                auto eligible = [&](size_t chain) {
+                    return !placed[chain] && !chains[chain].empty() && chain != final_chain && heat[chain] != 0.0;
+                };
+                auto place = [&](size_t chain) {
+                    placed[chain] = true;
+                    for (size_t b : chains[chain]) {
+                        sequence.push_back(b);
+                        for (size_t e : outgoing[b]) {
+                            if (!inside(edges[e].to)) continue;
+                            const size_t target = chain_of[edges[e].to - first];
+                            connection[target] += edges[e].weight;
+                            if (eligible(target)) candidates.push({ connection[target], target });
+                        }
+                    }
+                };
+                for (size_t c = 0; c < chains.size(); ++c) {
+                    if (eligible(c) && c != chain_of[0]) candidates.push({ 0.0, c });
+                }
+                place(chain_of[0]);
+                while (!candidates.empty()) {
+                    const auto [weight, chain] = candidates.top();
+                    candidates.pop();
+                    if (!eligible(chain) || weight != connection[chain]) continue;
+                    place(chain);
+                }
+                for (size_t c = 0; c < chains.size(); ++c) {
+                    if (!placed[c] && !chains[c].empty() && c != final_chain) place(c);
+                }
+                if (final_chain != NONE && !placed[final_chain]) place(final_chain);
+
+                bool changed = false;
+                for (size_t k = 0; k < sequence.size(); ++k) {
+                    if (sequence[k] != first + k) {
+                        changed = true;
+                        ++moved;
+                    }
+                }
+                if (!changed) {
+                    for (size_t b = first; b <= last; ++b) append_range(b);
+                    first = region_end;
+                    continue;
+                }
+
+                // Make each block reach its successors from the new position
+                for (size_t k = 0; k < sequence.size(); ++k) {
+                    const size_t b = sequence[k];
+                    const size_t next = k + 1 < sequence.size() ? sequence[k + 1] : NONE;
+                    const uint32_t end = cfg[b].end_address;
+                    DecodedInstruction& instruction = program[end];
+                    append_range(b);
+
+                    size_t jump_to = NONE;
+                    if (instruction.opcode == VMOpcode::JMP) {
+                        if (next != NONE && taken[b] == next) {
+                            instruction.address = BytecodeProgram::NO_INDEX; // Its address would translate to the target
+                            program.Remove(end);
+                            ++jumps_removed;
+                        }
+                    } else if (is_conditional(b)) {
+                        if (next != NONE && taken[b] == next) {
+                            instruction.opcode = instruction.opcode == VMOpcode::JMP_IF_ZERO ? VMOpcode::JMP_IF_NOT_ZERO
+                                                                                               : VMOpcode::JMP_IF_ZERO;
+                            program.SetTarget(end, cfg[fall[b]].start_address);
+                        } else if (fall[b] != next) {
+                            jump_to = fall[b];
+                        }
+                    } else if (BytecodeProgram::FallsThrough(instruction.opcode) && fall[b] != next) {
+                        jump_to = fall[b];
+                    }
+
+                    if (jump_to != NONE) {
+                        DecodedInstruction jump;
+                        jump.opcode = VMOpcode::JMP;
+                        jump.removed = false;
+                        jump.address = BytecodeProgram::NO_INDEX;
+                        jump.operand = cfg[jump_to].start_address;
+                        jump.operand2 = 0;
+                        order.push_back(program.Size() + static_cast<uint32_t>(added.size()));
+                        added.push_back(jump);
+                    }
+                }
+                first = region_end;
+            }
+
+            if (moved == 0) return BytecodeAnalysis::ALL;
+            for (uint32_t i = cfg.back().end_address + 1; i < program.Size(); ++i) {
+                order.push_back(i);
+            }
+            program.Reorder(order, added);
+
+            m_last_stats.blocks_moved += moved;
+            m_last_stats.jumps_optimized += jumps_removed;
+            return BytecodeAnalysis::NONE;
+        }
+
+        // --- Data flow ---
+
+        uint32_t BytecodeOptimizer::RunRedundantLoadElimination(BytecodeProgram& program) {
+            uint32_t eliminated = ForwardStoredConstants(program, ComputeReachingStores(program));
+
+            // A load of the value just stored or just loaded copies the stack top
+            const uint32_t end = program.Size();
+            uint32_t previous = end;
+            for (uint32_t i = program.NextLive(0); i < end; i = program.NextLive(i + 1)) {
+                DecodedInstruction& inst = program[i];
+                const bool local = inst.opcode == VMOpcode::LOAD_LOCAL;
+                if ((local || inst.opcode == VMOpcode::LOAD_GLOBAL) && previous < end && !program.IsBranchTarget(i) &&
+                    program[previous].operand == inst.operand) {
+                    DecodedInstruction& before = program[previous];
+                    const VMOpcode store = local ? VMOpcode::STORE_LOCAL : VMOpcode::STORE_GLOBAL;
+                    if (before.opcode == inst.opcode) {
+                        // LOAD x; LOAD x -> LOAD x; DUP
+                        inst.opcode = VMOpcode::DUP;
+                        inst.operand = 0;
+                        eliminated++;
+                    } else if (before.opcode == store) {
+                        // STORE x; LOAD x -> DUP; STORE x
+                        inst.opcode = store;
+                        before.opcode = VMOpcode::DUP;
+                        before.operand = 0;
+                        eliminated++;
+                    }
+                }
+                previous = i;
+            }
+
+            m_last_stats.loads_eliminated += eliminated;
+            return BytecodeAnalysis::ALL;
+        }
+
+        std::vector<BytecodeOptimizer::FlowBlock> BytecodeOptimizer::BuildFlowBlocks(BytecodeProgram& program,
+                                                                                    std::vector<uint32_t>& block_of) {
+            std::vector<FlowBlock> blocks;
+            block_of.assign(program.Size() + 1, BytecodeProgram::NO_INDEX);
+            for (uint32_t i = program.NextLive(0); i < program.Size(); i = program.NextLive(i + 1)) {
+                if (program.IsBlockStart(i)) {
+                    blocks.push_back(FlowBlock{ {}, {}, program.IsEntry(i), false });
+                }
+                blocks.back().instructions.push_back(i);
+                block_of[i] = static_cast<uint32_t>(blocks.size() - 1);
+            }
+            for (FlowBlock& block : blocks) {
+                const uint32_t last = block.instructions.back();
+                const DecodedInstruction& instruction = program[last];
+                if (BytecodeProgram::IsBranch(instruction.opcode)) {
+                    const uint32_t target = block_of[program.ResolveTarget(last)];
+                    if (target != BytecodeProgram::NO_INDEX) {
+                        if (instruction.opcode == VMOpcode::TRY) blocks[target].handler = true;
+                        block.successors.push_back(target);
+                    }
+                }
+                const uint32_t next = block_of[program.NextLive(last + 1)];
+                if (BytecodeProgram::FallsThrough(instruction.opcode) && next != BytecodeProgram::NO_INDEX) {
+                    block.successors.push_back(next);
+                }
+            }
+            return blocks;
+        }
+
+        uint32_t BytecodeOptimizer::GetSlotKey(const DecodedInstruction& instruction) {
+            const bool global = instruction.opcode == VMOpcode::LOAD_GLOBAL || instruction.opcode == VMOpcode::STORE_GLOBAL;
+            return (global ? 0x10000u : 0u) | (instruction.operand & 0xFFFF);
+        }
+
+        std::map<uint32_t, std::set<uint32_t>> BytecodeOptimizer::ComputeReachingStores(BytecodeProgram& program) {
+            std::vector<uint32_t> block_of;
+            const std::vector<FlowBlock> blocks = BuildFlowBlocks(program, block_of);
+
+            // A region runs from an entry block to the next entry that no branch
+            // crosses, so each function is solved on its own and its locals
+            // never meet another function's slots of the same number
+            std::vector<int32_t> crossing(blocks.size() + 1, 0);
+            for (size_t b = 0; b < blocks.size(); ++b) {
+                for (uint32_t successor : blocks[b].successors) {
+                    crossing[std::min<size_t>(b, successor) + 1]++;
+                    crossing[std::max<size_t>(b, successor) + 1]--;
+                }
+            }
+
+            std::map<uint32_t, std::set<uint32_t>> reaching;
+            int32_t open_edges = 0;
+            size_t first = 0;
+            for (size_t b = 0; b <= blocks.size(); ++b) {
+                open_edges += crossing[b];
+                if (b == blocks.size() || (b > first && blocks[b].entry && open_edges == 0)) {
+                    if (b > first) ComputeRegionReachingStores(program, blocks, first, b, reaching);
+                    first = b;
+                }
+            }
+            return reaching;
+        }
+
+        void BytecodeOptimizer::ComputeRegionReachingStores(BytecodeProgram& program, const std::vector<FlowBlock>& blocks,
+                                                            size_t first, size_t end,
+                                                            std::map<uint32_t, std::set<uint32_t>>& reaching) {
+            const uint32_t base = blocks[first].instructions.front();
+            const uint32_t span = blocks[end - 1].instructions.back() + 1 - base;
+
+            // Definitions: per loaded slot one outside value, which the entry and
+            // (for globals) calls bring back, then every store to it. Stores to
+            // slots the region never loads cannot reach anything.
+            std::unordered_map<uint32_t, uint32_t> slot_of;         // Slot key -> region slot
+            std::vector<std::vector<uint32_t>> definitions;         // Region slot -> its definitions, outside value first
+            std::vector<uint32_t> definition_index;                 // Instruction index, or OUTSIDE_VALUE
+            std::vector<uint32_t> global_slots;
+            for (size_t b = first; b < end; ++b) {
+                for (uint32_t i : blocks[b].instructions) {
+                    const VMOpcode opcode = program[i].opcode;
+                    if (opcode != VMOpcode::LOAD_LOCAL && opcode != VMOpcode::LOAD_GLOBAL) continue;
+                    const uint32_t key = GetSlotKey(program[i]);
+                    if (!slot_of.emplace(key, static_cast<uint32_t>(definitions.size())).second) continue;
+                    if (key & 0x10000) global_slots.push_back(static_cast<uint32_t>(definitions.size()));
+                    definitions.push_back({ static_cast<uint32_t>(definition_index.size()) });
+                    definition_index.push_back(OUTSIDE_VALUE);
+                }
+            }
+            if (definitions.empty()) return;
+
+            std::vector<uint32_t> slot_at(span, BytecodeProgram::NO_INDEX);
+            std::vector<uint32_t> definition_at(span, BytecodeProgram::NO_INDEX);
+            for (size_t b = first; b < end; ++b) {
+                for (uint32_t i : blocks[b].instructions) {
+                    const VMOpcode opcode = program[i].opcode;
+                    if (opcode != VMOpcode::LOAD_LOCAL && opcode != VMOpcode::LOAD_GLOBAL &&
+                        opcode != VMOpcode::STORE_LOCAL && opcode != VMOpcode::STORE_GLOBAL) continue;
+                    auto it = slot_of.find(GetSlotKey(program[i]));
+                    if (it == slot_of.end()) continue;
+                    slot_at[i - base] = it->second;
+                    if (opcode == VMOpcode::STORE_LOCAL || opcode == VMOpcode::STORE_GLOBAL) {
+                        definition_at[i - base] = static_cast<uint32_t>(definition_index.size());
+                        definitions[it->second].push_back(definition_at[i - base]);
+                        definition_index.push_back(i);
+                    }
+                }
+            }
+
+            // Bitsets over this region's definitions only
+            using Bits = std::vector<uint64_t>;
+            const size_t words = (definition_index.size() + 63) / 64;
+            auto set_bit = [](Bits& bits, uint32_t d) { bits[d >> 6] |= uint64_t(1) << (d & 63); };
+            auto clear_bit = [](Bits& bits, uint32_t d) { bits[d >> 6] &= ~(uint64_t(1) << (d & 63)); };
+            auto test_bit = [](const Bits& bits, uint32_t d) { return ((bits[d >> 6] >> (d & 63)) & 1) != 0; };
+
+            Bits outside(words, 0), globals(words, 0), global_outside(words, 0);
+            for (const std::vector<uint32_t>& slot : definitions) {
+                set_bit(outside, slot.front());
+            }
+            for (uint32_t slot : global_slots) {
+                for (uint32_t d : definitions[slot]) set_bit(globals, d);
+                set_bit(global_outside, definitions[slot].front());
+            }
+
+            auto transfer = [&](const FlowBlock& block, Bits& state, std::map<uint32_t, std::set<uint32_t>>* loads) {
+                for (uint32_t i : block.instructions) {
+                    switch (program[i].opcode) {
+                        case VMOpcode::LOAD_LOCAL:
+                        case VMOpcode::LOAD_GLOBAL:
+                            if (loads) {
+                                std::set<uint32_t>& stores = (*loads)[i];
+                                for (uint32_t d : definitions[slot_at[i - base]]) {
+                                    if (test_bit(state, d)) stores.insert(definition_index[d]);
+                                }
+                            }
+                            break;
+                        case VMOpcode::STORE_LOCAL:
+                        case VMOpcode::STORE_GLOBAL:
+                            if (slot_at[i - base] == BytecodeProgram::NO_INDEX) break;
+                            for (uint32_t d : definitions[slot_at[i - base]]) {
+                                clear_bit(state, d);
+                            }
+                            set_bit(state, definition_at[i - base]);
+                            break;
+                        case VMOpcode::CALL:
+                        case VMOpcode::CALL_NATIVE:
+                        case VMOpcode::CALL_NATIVE_W:
+                            for (size_t w = 0; w < words; ++w) {
+                                state[w] = (state[w] & ~globals[w]) | global_outside[w];
+                            }
+                            break;
+                        default:
+                            break;
+                    }
+                }
+            };
+
+            const size_t count = end - first;
+            std::vector<Bits> in(count, Bits(words, 0));
+            std::vector<Bits> out(count, Bits(words, 0));
+            std::vector<size_t> worklist;
+            std::vector<bool> queued(count, true);
+            for (size_t k = count; k-- > 0;) {
+                if (blocks[first + k].handler) {
+                    in[k].assign(words, ~uint64_t(0));
+                } else if (blocks[first + k].entry) {
+                    in[k] = outside;
+                }
+                worklist.push_back(k);
+            }
+            Bits state;
+            while (!worklist.empty()) {
+                const size_t k = worklist.back();
+                worklist.pop_back();
+                queued[k] = false;
+                state = in[k];
+                transfer(blocks[first + k], state, nullptr);
+                if (state == out[k]) continue;
+                out[k].swap(state);
+                for (uint32_t successor : blocks[first + k].successors) {
+                    Bits& successor_in = in[successor - first];
+                    bool grown = false;
+                    for (size_t w = 0; w < words; ++w) {
+                        const uint64_t merged = successor_in[w] | out[k][w];
+                        grown = grown || merged != successor_in[w];
+                        successor_in[w] = merged;
+                    }
+                    if (grown && !queued[successor - first]) {
+                        queued[successor - first] = true;
+                        worklist.push_back(successor - first);
+                    }
+                }
+            }
+
+            for (size_t k = 0; k < count; ++k) {
+                transfer(blocks[first + k], in[k], &reaching);
+            }
+        }
+
+        // A load reached only by stores of one PUSH_INT constant becomes that push
+        uint32_t BytecodeOptimizer::ForwardStoredConstants(BytecodeProgram& program,
+                                                           const std::map<uint32_t, std::set<uint32_t>>& reaching) {
+            uint32_t forwarded = 0;
+            for (const auto& [load, stores] : reaching) {
+                if (stores.empty() || stores.count(OUTSIDE_VALUE) || load >= program.Size() || program[load].removed ||
+                    (program[load].opcode != VMOpcode::LOAD_LOCAL && program[load].opcode != VMOpcode::LOAD_GLOBAL)) continue;
+
+                bool known = true;
+                const uint32_t first = program.PreviousLive(*stores.begin());
+                const uint32_t value = first < program.Size() ? program[first].operand : 0;
+                for (uint32_t store : stores) {
+                    const uint32_t push = program.PreviousLive(store);
+                    if (store >= program.Size() || push >= program.Size() || program[push].opcode != VMOpcode::PUSH_INT ||
+                        program[push].operand != value || program.IsBranchTarget(store)) {
+                        known = false;
+                        break;
+                    }
+                }
+                if (!known) continue;
+
+                program[load].opcode = VMOpcode::PUSH_INT;
+                program[load].operand = value;
+                forwarded++;
+            }
+            return forwarded;
+        }
+
+        // Sparse conditional constant propagation over the stack and the slots.
+        // Only INT32 values are tracked, and a block is only evaluated once a
+        // branch that can actually be taken leads to it, so a constant that
+        // decides a branch also keeps the other side's stores out of the join.
+        uint32_t BytecodeOptimizer::RunConstantPropagation(BytecodeProgram& program) {
+            struct Lattice {
+                bool known;
+                int32_t value;
+                bool operator==(const Lattice& other) const {
+                    return known == other.known && (!known || value == other.value);
+                }
+            };
+            // Missing stack entries and slots are unknown values
+            struct State {
+                std::vector<Lattice> stack;
+                std::map<uint32_t, int32_t> slots;
+                bool operator==(const State& other) const { return stack == other.stack && slots == other.slots; }
+            };
+            const Lattice varying{ false, 0 };
+
+            std::vector<uint32_t> block_of;
+            const std::vector<FlowBlock> blocks = BuildFlowBlocks(program, block_of);
+            std::vector<std::vector<uint32_t>> predecessors(blocks.size());
+            for (uint32_t b = 0; b < blocks.size(); ++b) {
+                for (uint32_t successor : blocks[b].successors) {
+                    predecessors[successor].push_back(b);
+                }
+            }
+
+            std::vector<State> out(blocks.size());
+            std::vector<std::vector<uint32_t>> taken(blocks.size());    // Successors the block can reach
+            std::vector<bool> visited(blocks.size(), false);
+            std::vector<Lattice> fact(program.Size(), varying);         // Value loaded, or branch condition
+
+            auto meet = [](State& state, const State& other) {
+                const size_t height = std::min(state.stack.size(), other.stack.size());
+                state.stack.erase(state.stack.begin(), state.stack.end() - height);
+                for (size_t k = 0; k < height; ++k) {
+                    if (!(state.stack[k] == other.stack[other.stack.size() - height + k])) state.stack[k] = Lattice{ false, 0 };
+                }
+                for (auto it = state.slots.begin(); it != state.slots.end();) {
+                    auto found = other.slots.find(it->first);
+                    it = found == other.slots.end() || found->second != it->second ? state.slots.erase(it) : std::next(it);
+                }
+            };
+
+            std::vector<uint32_t> worklist;
+            std::vector<bool> queued(blocks.size(), false);
+            for (uint32_t b = 0; b < blocks.size(); ++b) {
+                if (blocks[b].entry) {
+                    worklist.push_back(b);
+                    queued[b] = true;
+                }
+            }
+            while (!worklist.empty()) {
+                const uint32_t b = worklist.back();
+                worklist.pop_back();
+                queued[b] = false;
+                const FlowBlock& block = blocks[b];
+
+                // Entries and handlers start from nothing known
+                State state;
+                if (!block.entry && !block.handler) {
+                    bool first = true;
+                    for (uint32_t predecessor : predecessors[b]) {
+                        const std::vector<uint32_t>& edges = taken[predecessor];
+                        if (!visited[predecessor] || std::find(edges.begin(), edges.end(), b) == edges.end()) continue;
+                        if (first) {
+                            state = out[predecessor];
+                            first = false;
+                        } else {
+                            meet(state, out[predecessor]);
+                        }
+                    }
+                }
+
+                auto pop = [&state, &varying]() {
+                    if (state.stack.empty()) return varying;
+                    const Lattice value = state.stack.back();
+                    state.stack.pop_back();
+                    return value;
+                };
+                for (uint32_t i : block.instructions) {
+                    const DecodedInstruction& instruction = program[i];
+                    switch (instruction.opcode) {
+                        case VMOpcode::PUSH_INT:
+                            state.stack.push_back(Lattice{ true, static_cast<int32_t>(instruction.operand) });
+                            break;
+                        case VMOpcode::LOAD_LOCAL:
+                        case VMOpcode::LOAD_GLOBAL: {
+                            auto it = state.slots.find(GetSlotKey(instruction));
+                            fact[i] = it != state.slots.end() ? Lattice{ true, it->second } : varying;
+                            state.stack.push_back(fact[i]);
+                            break;
+                        }
+                        case VMOpcode::STORE_LOCAL:
+                        case VMOpcode::STORE_GLOBAL: {
+                            const Lattice value = pop();
+                            if (value.known) {
+                                state.slots[GetSlotKey(instruction)] = value.value;
+                            } else {
+                                state.slots.erase(GetSlotKey(instruction));
+                            }
+                            break;
+                        }
+                        case VMOpcode::DUP: {
+                            const Lattice value = pop();
+                            state.stack.push_back(value);
+                            state.stack.push_back(value);
+                            break;
+                        }
+                        case VMOpcode::SWAP: {
+                            const Lattice top = pop();
+                            const Lattice below = pop();
+                            state.stack.push_back(top);
+                            state.stack.push_back(below);
+                            break;
+                        }
+                        case VMOpcode::NEG: {
+                            const Lattice value = pop();
+                            const bool known = value.known && value.value != std::numeric_limits<int32_t>::min();
+                            state.stack.push_back(known ? Lattice{ true, -value.value } : varying);
+                            break;
+                        }
+                        case VMOpcode::NOT: {
+                            const Lattice value = pop();
+                            state.stack.push_back(value.known ? Lattice{ true, value.value == 0 ? 1 : 0 } : varying);
+                            break;
+                        }
+                        case VMOpcode::JMP_IF_ZERO:
+                        case VMOpcode::JMP_IF_NOT_ZERO:
+                            fact[i] = pop();
+                            break;
+                        default: {
+                            uint32_t pops, pushes;
+                            if (!GetStackEffect(instruction, pops, pushes)) {
+                                state.stack.clear();
+                                state.slots.clear();
+                                break;
+                            }
+                            const bool call = instruction.opcode == VMOpcode::CALL || instruction.opcode == VMOpcode::CALL_NATIVE ||
+                                              instruction.opcode == VMOpcode::CALL_NATIVE_W;
+                            if (pops == 2 && pushes == 1 && !call) {
+                                const Lattice right = pop();
+                                const Lattice left = pop();
+                                ConstantValue a{}, b{};
+                                a.type = b.type = VMDataType::INT32;
+                                a.is_known = left.known;
+                                a.int_val = left.value;
+                                b.is_known = right.known;
+                                b.int_val = right.value;
+                                const bool known = CanFoldConstantOperation(instruction.opcode, a, b);
+                                state.stack.push_back(known ? Lattice{ true, FoldConstantOperation(instruction.opcode, a, b).int_val } : varying);
+                                break;
+                            }
+                            for (uint32_t k = 0; k < pops; ++k) pop();
+                            state.stack.insert(state.stack.end(), pushes, varying);
+
+                            // A script function may store to any global
+                            if (call) {
+                                state.slots.erase(state.slots.lower_bound(0x10000u), state.slots.end());
+                            }
+                            break;
+                        }
+                    }
+                }
+
+                // A known condition leaves one way out of the block
+                std::vector<uint32_t> edges = block.successors;
+                const uint32_t last = block.instructions.back();
+                const VMOpcode opcode = program[last].opcode;
+                if ((opcode == VMOpcode::JMP_IF_ZERO || opcode == VMOpcode::JMP_IF_NOT_ZERO) && fact[last].known) {
+                    const bool jumps = (fact[last].value == 0) == (opcode == VMOpcode::JMP_IF_ZERO);
+                    const uint32_t next = block_of[jumps ? program.ResolveTarget(last) : program.NextLive(last + 1)];
+                    edges.assign(next == BytecodeProgram::NO_INDEX ? 0 : 1, next);
+                }
+
+                if (visited[b] && state == out[b] && edges == taken[b]) continue;
+                visited[b] = true;
+                out[b] = std::move(state);
+                taken[b] = std::move(edges);
+                for (uint32_t successor : taken[b]) {
+                    if (!queued[successor]) {
+                        worklist.push_back(successor);
+                        queued[successor] = true;
+                    }
+                }
+            }
+
+            // Known loads become pushes for the folding pass; decided branches
+            // drop their condition and jump, leaving the other side unreachable
+            uint32_t propagated = 0;
+            std::vector<std::pair<uint32_t, bool>> branches;   // Index, whether it jumps
+            for (uint32_t b = 0; b < blocks.size(); ++b) {
+                if (!visited[b]) continue;
+                for (uint32_t i : blocks[b].instructions) {
+                    DecodedInstruction& instruction = program[i];
+                    if (!fact[i].known) continue;
+                    if (instruction.opcode == VMOpcode::LOAD_LOCAL || instruction.opcode == VMOpcode::LOAD_GLOBAL) {
+                        instruction.opcode = VMOpcode::PUSH_INT;
+                        instruction.operand = static_cast<uint32_t>(fact[i].value);
+                        propagated++;
+                    } else if (instruction.opcode == VMOpcode::JMP_IF_ZERO || instruction.opcode == VMOpcode::JMP_IF_NOT_ZERO) {
+                        branches.emplace_back(i, (fact[i].value == 0) == (instruction.opcode == VMOpcode::JMP_IF_ZERO));
+                    }
+                }
+            }
+
+            // Backwards, so each insertion leaves the branches still to visit in place
+            std::sort(branches.begin(), branches.end());
+            for (auto it = branches.rbegin(); it != branches.rend(); ++it) {
+                const uint32_t branch = it->first;
+                const uint32_t target = program[branch].operand;
+                if (it->second && program.NextLive(target) != program.NextLive(branch + 1)) {
+                    program.Insert(branch + 1, { DecodedInstruction{ VMOpcode::JMP, false, BytecodeProgram::NO_INDEX,
+                                                                     target > branch ? target + 1 : target, 0 } });
+                }
+                program[branch].opcode = VMOpcode::POP;
+                program[branch].operand = 0;
+                propagated++;
+            }
+
+            m_last_stats.constants_propagated += propagated;
+            return propagated == 0 ? BytecodeAnalysis::ALL : BytecodeAnalysis::NONE;
+        }
+
+        // --- Function inlining ---
+
+        uint32_t BytecodeOptimizer::RunFunctionInlining(BytecodeProgram& program) {
+            // Function boundaries and frame sizes come from the function table
+            if (m_functions.empty() || program.GetEntries().size() != m_entry_points.size() + 1) {
+                return BytecodeAnalysis::ALL;
+            }
+
+            // Position of each script function in the program's entry list, and back
+            std::vector<uint32_t> entry_of(m_functions.size(), BytecodeProgram::NO_INDEX);
+            std::vector<uint32_t> function_at(m_entry_points.size() + 1, BytecodeProgram::NO_INDEX);
+            for (uint32_t k = 0; k < m_functions.size(); ++k) {
+                if (m_functions[k].is_native) continue;
+                auto it = std::find(m_entry_points.begin(), m_entry_points.end(), m_functions[k].address);
+                if (it == m_entry_points.end()) continue;
+                entry_of[k] = static_cast<uint32_t>(it - m_entry_points.begin()) + 1;
+                if (function_at[entry_of[k]] == BytecodeProgram::NO_INDEX) function_at[entry_of[k]] = k;
+            }
+
+            // Top-level code has no frame of its own; bodies inlined there get
+            // global slots past every one the program declares or uses
+            uint32_t next_global = m_global_count;
+            for (uint32_t i = program.NextLive(0); i < program.Size(); i = program.NextLive(i + 1)) {
+                if (program[i].opcode == VMOpcode::LOAD_GLOBAL || program[i].opcode == VMOpcode::STORE_GLOBAL) {
+                    next_global = std::max(next_global, program[i].operand + 1);
+                }
+            }
+
+            const uint32_t growth_limit = std::max(MIN_INLINE_GROWTH, program.GetLiveCount());
+            uint32_t growth = 0;
+            uint32_t inlined = 0;
+
+            // Calls copied in by one round are considered by the next
+            for (uint32_t round = 0; round < MAX_INLINE_DEPTH; ++round) {
+                std::vector<uint32_t> call_sites(m_functions.size(), 0);
+                std::vector<uint32_t> calls;
+                for (uint32_t i = program.NextLive(0); i < program.Size(); i = program.NextLive(i + 1)) {
+                    if (program[i].opcode != VMOpcode::CALL || program[i].operand >= m_functions.size() ||
+                        !program.IsReachable(i)) continue;
+                    call_sites[program[i].operand]++;
+                    calls.push_back(i);
+                }
+
+                // Backwards, so insertions leave the sites still to visit in place
+                const uint32_t inlined_before = inlined;
+                for (auto site_it = calls.rbegin(); site_it != calls.rend(); ++site_it) {
+                    const uint32_t site = *site_it;
+                    const uint32_t callee = program[site].operand;
+                    if (entry_of[callee] == BytecodeProgram::NO_INDEX) continue;
+
+                    // The caller is the function whose entry last precedes the
+                    // site; the callee runs up to the next entry
+                    const std::vector<uint32_t>& entries = program.GetEntries();
+                    const uint32_t begin = entries[entry_of[callee]];
+                    uint32_t end = program.Size();
+                    uint32_t caller_position = 0;
+                    for (uint32_t e = 0; e < entries.size(); ++e) {
+                        if (entries[e] <= site && entries[e] >= entries[caller_position]) caller_position = e;
+                        if (entries[e] > begin) end = std::min(end, entries[e]);
+                    }
+                    const uint32_t caller = function_at[caller_position];
+                    if (caller == callee || (caller == BytecodeProgram::NO_INDEX && caller_position != 0)) continue;
+
+                    InlineCandidate candidate;
+                    if (!AnalyzeInlineCandidate(program, callee, begin, end, candidate)) continue;
+                    const uint32_t size = static_cast<uint32_t>(candidate.body.size());
+
+                    uint32_t executions = 0;
+                    const bool profiled = GetBlockCount(program, site, executions);
+                    if (profiled && executions == 0) continue;
+                    const bool hot = profiled && executions >= HOT_CALL_THRESHOLD;
+                    if (!(candidate.is_leaf && size <= SMALL_FUNCTION_SIZE) && call_sites[callee] != 1 && !hot) continue;
+
+                    // A callee that can return without a value is only inlined
+                    // where the call's result is dropped straight away
+                    const uint32_t next = program.NextLive(site + 1);
+                    const bool discarded = next < program.Size() && program[next].opcode == VMOpcode::POP &&
+                                           !program.IsBranchTarget(next);
+                    if (candidate.has_bare_return && !discarded) continue;
+
+                    // Layout: arguments popped into the new slots, then the body
+                    // with each return turned into a jump past the copy
+                    const uint32_t param_count = m_functions[callee].param_count;
+                    const uint32_t first = site + 1;
+                    std::vector<uint32_t> position(size + 1);
+                    uint32_t count = param_count;
+                    for (uint32_t j = 0; j < size; ++j) {
+                        position[j] = first + count;
+                        const VMOpcode opcode = program[candidate.body[j]].opcode;
+                        const bool last = j + 1 == size;
+                        if (opcode == VMOpcode::RET_VAL) {
+                            count += (discarded ? 1 : 0) + (last ? 0 : 1);
+                        } else if (opcode == VMOpcode::RET) {
+                            count += last ? 0 : 1;
+                        } else {
+                            count++;
+                        }
+                    }
+                    position[size] = first + count;
+                    const uint32_t continuation = first + count;
+                    if (growth + count > growth_limit) continue;
+
+                    const bool in_globals = caller == BytecodeProgram::NO_INDEX;
+                    uint32_t base = in_globals ? next_global
+                                               : std::max(m_functions[caller].local_count, m_functions[caller].param_count);
+                    if (static_cast<uint64_t>(base) + candidate.slot_count > 0x10000) continue;
+                    const VMOpcode load = in_globals ? VMOpcode::LOAD_GLOBAL : VMOpcode::LOAD_LOCAL;
+                    const VMOpcode store = in_globals ? VMOpcode::STORE_GLOBAL : VMOpcode::STORE_LOCAL;
+
+                    auto make = [](VMOpcode opcode, uint32_t operand) {
+                        DecodedInstruction instruction;
+                        instruction.opcode = opcode;
+                        instruction.removed = false;
+                        instruction.address = BytecodeProgram::NO_INDEX;
+                        instruction.operand = operand;
+                        instruction.operand2 = 0;
+                        return instruction;
+                    };
+                    auto position_of = [&candidate, &position](uint32_t index) {
+                        auto it = std::lower_bound(candidate.body.begin(), candidate.body.end(), index);
+                        return position[it - candidate.body.begin()];
+                    };
+
+                    std::vector<DecodedInstruction> sequence;
+                    sequence.reserve(count);
+                    for (uint32_t p = param_count; p > 0; --p) {
+                        sequence.push_back(make(store, base + p - 1));
+                    }
+                    for (uint32_t j = 0; j < size; ++j) {
+                        const uint32_t index = candidate.body[j];
+                        DecodedInstruction copy = program[index];
+                        copy.address = BytecodeProgram::NO_INDEX;
+                        const bool last = j + 1 == size;
+                        switch (copy.opcode) {
+                            case VMOpcode::RET_VAL:
+                                if (discarded) sequence.push_back(make(VMOpcode::POP, 0));
+                                if (!last) sequence.push_back(make(VMOpcode::JMP, continuation));
+                                continue;
+                            case VMOpcode::RET:
+                                if (!last) sequence.push_back(make(VMOpcode::JMP, continuation));
+                                continue;
+                            case VMOpcode::LOAD_LOCAL:
+                                copy.opcode = load;
+                                copy.operand += base;
+                                break;
+                            case VMOpcode::STORE_LOCAL:
+                                copy.opcode = store;
+                                copy.operand += base;
+                                break;
+                            default:
+                                if (BytecodeProgram::IsBranch(copy.opcode)) {
+                                    copy.operand = position_of(program.ResolveTarget(index));
+                                }
+                                break;
                         }
-                        
-                        i += pattern.pattern.size();
-                        combined_count++;
-                        pattern_matched = true;
-                        break;
+                        sequence.push_back(copy);
                     }
-                }
-                
-                if (!pattern_matched) {
-                    optimized_instructions.push_back(instructions[i]);
-                    i++;
-                }
-            }
-            
-            m_last_stats.instructions_combined += combined_count;
-            
-            std::vector<uint8_t> result;
-            EmitInstructionSequence(result, optimized_instructions);
-            return result;
-        }
 
-        std::vector<uint8_t> BytecodeOptimizer::OptimizeStackOperations(const std::vector<uint8_t>& bytecode) {
-            auto instructions = AnalyzeInstructions(bytecode);
-            auto stack_states = AnalyzeStackStates(instructions);
-            
-            std::vector<InstructionInfo> optimized_instructions;
-            
-            for (size_t i = 0; i < instructions.size(); ++i) {
-                const auto& inst = instructions[i];
-                
-                // Optimize push/pop pairs
-                if (inst.opcode == VMOpcode::PUSH_INT && i + 1 < instructions.size() &&
-                    instructions[i + 1].opcode == VMOpcode::POP) {
-                    // Skip both instructions if the value is not used
-                    i++; // Skip the POP as well
-                    continue;
-                }
-                
-                // Optimize duplicate stack operations
-                if (inst.opcode == VMOpcode::DUP && i + 1 < instructions.size() &&
-                    instructions[i + 1].opcode == VMOpcode::POP) {
-                    // DUP followed by POP is redundant
-                    i++; // Skip the POP
-                    continue;
+                    program.Insert(first, sequence);
+                    program.Remove(site);
+                    if (discarded) program.Remove(continuation);
+
+                    if (in_globals) {
+                        next_global = base + candidate.slot_count;
+                    } else {
+                        m_functions[caller].local_count = base + candidate.slot_count;
+                    }
+                    growth += count;
+                    inlined++;
+                    m_last_stats.calls_inlined++;
                 }
-                
-                optimized_instructions.push_back(inst);
+                if (inlined == inlined_before) break;
             }
-            
-            std::vector<uint8_t> result;
-            EmitInstructionSequence(result, optimized_instructions);
-            return result;
-        }
 
-        // Placeholder implementations for complex optimizations
-        std::vector<uint8_t> BytecodeOptimizer::InlineSmallFunctions(const std::vector<uint8_t>& bytecode) {
-            // Function inlining is complex and would require function boundary detection
-            return bytecode;
+            return inlined ? BytecodeAnalysis::NONE : BytecodeAnalysis::ALL;
         }
 
-        std::vector<uint8_t> BytecodeOptimizer::EliminateRedundantLoads(const std::vector<uint8_t>& bytecode) {
-            // Redundant load elimination requires data flow analysis
-            return bytecode;
-        }
+        bool BytecodeOptimizer::AnalyzeInlineCandidate(BytecodeProgram& program, uint32_t function_index,
+                                                       uint32_t begin, uint32_t end, InlineCandidate& candidate) const {
+            const VMFunction& function = m_functions[function_index];
+            candidate.body.clear();
+            candidate.slot_count = std::max(function.local_count, function.param_count);
+            candidate.has_bare_return = false;
+            candidate.is_leaf = true;
 
-        std::vector<uint8_t> BytecodeOptimizer::OptimizeLoops(const std::vector<uint8_t>& bytecode) {
-            // Loop optimization requires loop detection and analysis
-            return bytecode;
-        }
+            // Walk the reachable code with its operand stack depth, which every
+            // path must agree on and which must never dip into the caller's values
+            std::map<uint32_t, uint32_t> depth;
+            std::vector<uint32_t> worklist;
+            auto visit = [&](uint32_t index, uint32_t stack_depth) {
+                index = program.NextLive(index);
+                if (index < begin || index >= end) return false;
+                auto [it, inserted] = depth.emplace(index, stack_depth);
+                if (!inserted) return it->second == stack_depth;
+                worklist.push_back(index);
+                return depth.size() <= MAX_INLINE_SIZE;
+            };
 
-        std::vector<uint8_t> BytecodeOptimizer::InlineConstantPropagation(const std::vector<uint8_t>& bytecode) {
-            // Constant propagation requires SSA form or similar analysis
-            return bytecode;
-        }
+            if (!visit(begin, 0)) return false;
+            while (!worklist.empty()) {
+                const uint32_t index = worklist.back();
+                worklist.pop_back();
+                const DecodedInstruction& instruction = program[index];
+                const uint32_t stack_depth = depth[index];
 
-        std::vector<uint8_t> BytecodeOptimizer::VectorizeOperations(const std::vector<uint8_t>& bytecode) {
-            // Vectorization requires detecting vectorizable patterns
-            return bytecode;
-        }
+                switch (instruction.opcode) {
+                    case VMOpcode::RET:
+                        if (stack_depth != 0) return false;
+                        candidate.has_bare_return = true;
+                        continue;
+                    case VMOpcode::RET_VAL:
+                        if (stack_depth != 1) return false;
+                        continue;
+                    case VMOpcode::TRY:
+                    case VMOpcode::CATCH:
+                    case VMOpcode::FINALLY:
+                    case VMOpcode::HALT:
+                        return false;   // Handler frames and halting are the caller's
+                    case VMOpcode::CALL:
+                        if (instruction.operand == function_index) return false;
+                        candidate.is_leaf = false;
+                        break;
+                    case VMOpcode::LOAD_LOCAL:
+                    case VMOpcode::STORE_LOCAL:
+                        candidate.slot_count = std::max(candidate.slot_count, instruction.operand + 1);
+                        break;
+                    default:
+                        break;
+                }
 
-        std::vector<uint8_t> BytecodeOptimizer::UnrollLoops(const std::vector<uint8_t>& bytecode, uint32_t max_unroll_factor) {
-            // Loop unrolling requires loop detection and transformation
-            return bytecode;
-        }
+                uint32_t pops, pushes;
+                if (!GetStackEffect(instruction, pops, pushes) || pops > stack_depth) return false;
+                const uint32_t after = stack_depth - pops + pushes;
+                if (BytecodeProgram::IsBranch(instruction.opcode) && !visit(instruction.operand, after)) return false;
+                if (BytecodeProgram::FallsThrough(instruction.opcode) && !visit(index + 1, after)) return false;
+            }
 
-        std::vector<uint8_t> BytecodeOptimizer::OptimizeMemoryAccess(const std::vector<uint8_t>& bytecode) {
-            // Memory access optimization requires alias analysis
-            return bytecode;
-        }
+            for (const auto& entry : depth) {
+                candidate.body.push_back(entry.first);
+            }
 
-        // Helper method implementations
-        std::vector<BytecodeOptimizer::InstructionInfo> BytecodeOptimizer::AnalyzeInstructions(const std::vector<uint8_t>& bytecode) {
-            std::vector<InstructionInfo> instructions;
-            
-            uint32_t address = 0;
-            while (address < bytecode.size()) {
-                InstructionInfo info = DecodeInstruction(bytecode.data(), address, bytecode.size() - address);
-                if (info.size == 0) break; // Invalid instruction
-                
-                instructions.push_back(info);
-                address += info.size;
+            // The caller's slots keep their values between inlined calls, so
+            // every local but the parameters must be written before it is read
+            const uint32_t size = static_cast<uint32_t>(candidate.body.size());
+            auto position_of = [&candidate](uint32_t index) {
+                return static_cast<uint32_t>(std::lower_bound(candidate.body.begin(), candidate.body.end(), index) -
+                                             candidate.body.begin());
+            };
+            std::vector<std::vector<bool>> written(size);
+            written[0].assign(candidate.slot_count, false);
+            for (uint32_t p = 0; p < function.param_count; ++p) {
+                written[0][p] = true;
             }
-            
-            return instructions;
-        }
-
-        BytecodeOptimizer::InstructionInfo BytecodeOptimizer::DecodeInstruction(const uint8_t* code, uint32_t address, uint32_t max_size) {
-            InstructionInfo info;
-            info.address = address;
-            info.size = 0;
-            info.is_jump = false;
-            info.is_conditional_jump = false;
-            info.modifies_stack = false;
-            info.reads_memory = false;
-            info.writes_memory = false;
-            
-            if (max_size == 0) return info;
-            
-            info.opcode = static_cast<VMOpcode>(code[0]);
-            info.size = 1;
-            
-            // Decode operands based on instruction type
-            switch (info.opcode) {
+
+            std::vector<uint32_t> pending = { 0 };
+            while (!pending.empty()) {
+                const uint32_t j = pending.back();
+                pending.pop_back();
+                const DecodedInstruction& instruction = program[candidate.body[j]];
+                std::vector<bool> state = written[j];
+                if (instruction.opcode == VMOpcode::STORE_LOCAL) {
+                    state[instruction.operand] = true;
+                }
+
+                auto flow = [&](uint32_t successor) {
+                    std::vector<bool>& into = written[successor];
+                    if (into.empty()) {
+                        into = state;
+                        pending.push_back(successor);
+                        return;
+                    }
+                    bool changed = false;
+                    for (uint32_t s = 0; s < candidate.slot_count; ++s) {
+                        if (into[s] && !state[s]) {
+                            into[s] = false;
+                            changed = true;
+                        }
+                    }
+                    if (changed) pending.push_back(successor);
+                };
+                if (BytecodeProgram::IsBranch(instruction.opcode)) {
+                    flow(position_of(program.ResolveTarget(candidate.body[j])));
+                }
+                if (BytecodeProgram::FallsThrough(instruction.opcode) && instruction.opcode != VMOpcode::RET &&
+                    instruction.opcode != VMOpcode::RET_VAL) {
+                    flow(position_of(program.NextLive(candidate.body[j] + 1)));
+                }
+            }
+
+            for (uint32_t j = 0; j < size; ++j) {
+                const DecodedInstruction& instruction = program[candidate.body[j]];
+                if (instruction.opcode == VMOpcode::LOAD_LOCAL && !written[j][instruction.operand]) return false;
+            }
+            return true;
+        }
+
+        bool BytecodeOptimizer::GetStackEffect(const DecodedInstruction& instruction, uint32_t& pops, uint32_t& pushes) const {
+            pops = 0;
+            pushes = 0;
+            switch (instruction.opcode) {
                 case VMOpcode::PUSH_INT:
                 case VMOpcode::PUSH_FLOAT:
                 case VMOpcode::PUSH_DOUBLE:
-                    if (max_size >= 5) {
-                        uint32_t operand = *reinterpret_cast<const uint32_t*>(&code[1]);
-                        info.operands.push_back(operand);
-                        info.size = 5;
-                        info.modifies_stack = true;
-                    }
-                    break;
-                    
-                case VMOpcode::JMP:
-                    if (max_size >= 5) {
-                        uint32_t target = *reinterpret_cast<const uint32_t*>(&code[1]);
-                        info.operands.push_back(target);
-                        info.size = 5;
-                        info.is_jump = true;
-                        info.jump_targets.insert(target);
-                    }
-                    break;
-                    
+                case VMOpcode::PUSH_CONST:
+                case VMOpcode::PUSH_CONST_W:
+                case VMOpcode::LOAD_LOCAL:
+                case VMOpcode::LOAD_GLOBAL:
+                    pushes = 1;
+                    return true;
+                case VMOpcode::POP:
+                case VMOpcode::STORE_LOCAL:
+                case VMOpcode::STORE_GLOBAL:
                 case VMOpcode::JMP_IF_ZERO:
                 case VMOpcode::JMP_IF_NOT_ZERO:
-                    if (max_size >= 5) {
-                        uint32_t target = *reinterpret_cast<const uint32_t*>(&code[1]);
-                        info.operands.push_back(target);
-                        info.size = 5;
-                        info.is_jump = true;
-                        info.is_conditional_jump = true;
-                        info.modifies_stack = true;
-                        info.jump_targets.insert(target);
-                    }
-                    break;
-                    
-                case VMOpcode::ADD:
-                case VMOpcode::SUB:
-                case VMOpcode::MUL:
-                case VMOpcode::DIV:
-                case VMOpcode::MOD:
-                    info.modifies_stack = true;
-                    break;
-                    
-                case VMOpcode::LOAD_MEM:
-                    info.reads_memory = true;
-                    info.modifies_stack = true;
-                    break;
-                    
-                case VMOpcode::STORE_MEM:
-                    info.writes_memory = true;
-                    info.modifies_stack = true;
-                    break;
-                    
+                case VMOpcode::THROW:
+                case VMOpcode::RET_VAL:
+                    pops = 1;
+                    return true;
+                case VMOpcode::DUP:
+                    pops = 1;
+                    pushes = 2;
+                    return true;
+                case VMOpcode::SWAP:
+                    pops = 2;
+                    pushes = 2;
+                    return true;
+                case VMOpcode::NOP:
+                case VMOpcode::JMP:
+                case VMOpcode::RET:
+                    return true;
+                case VMOpcode::NEG:
+                case VMOpcode::INC:
+                case VMOpcode::DEC:
+                case VMOpcode::NOT:
+                case VMOpcode::BIT_NOT:
+                case VMOpcode::CAST_INT:
+                case VMOpcode::CAST_FLOAT:
+                case VMOpcode::CAST_STR:
+                case VMOpcode::TYPE_OF:
+                    pops = 1;
+                    pushes = 1;
+                    return true;
+                case VMOpcode::ADD: case VMOpcode::SUB: case VMOpcode::MUL: case VMOpcode::DIV: case VMOpcode::MOD:
+                case VMOpcode::BIT_AND: case VMOpcode::BIT_OR: case VMOpcode::BIT_XOR: case VMOpcode::SHL: case VMOpcode::SHR:
+                case VMOpcode::AND: case VMOpcode::OR:
+                case VMOpcode::CMP_EQ: case VMOpcode::CMP_NE: case VMOpcode::CMP_GT:
+                case VMOpcode::CMP_GE: case VMOpcode::CMP_LT: case VMOpcode::CMP_LE:
+                case VMOpcode::ADD_I32: case VMOpcode::SUB_I32: case VMOpcode::MUL_I32: case VMOpcode::DIV_I32: case VMOpcode::MOD_I32:
+                case VMOpcode::ADD_F64: case VMOpcode::SUB_F64: case VMOpcode::MUL_F64: case VMOpcode::DIV_F64:
+                case VMOpcode::CMP_EQ_I32: case VMOpcode::CMP_NE_I32: case VMOpcode::CMP_GT_I32:
+                case VMOpcode::CMP_GE_I32: case VMOpcode::CMP_LT_I32: case VMOpcode::CMP_LE_I32:
+                case VMOpcode::CMP_EQ_F64: case VMOpcode::CMP_NE_F64: case VMOpcode::CMP_GT_F64:
+                case VMOpcode::CMP_GE_F64: case VMOpcode::CMP_LT_F64: case VMOpcode::CMP_LE_F64:
+                case VMOpcode::STR_CONCAT:
+                case VMOpcode::ARRAY_GET:
+                    pops = 2;
+                    pushes = 1;
+                    return true;
+                case VMOpcode::ARRAY_SET:
+                    pops = 3;
+                    pushes = 1;
+                    return true;
+                case VMOpcode::CALL:
+                    if (instruction.operand >= m_functions.size()) return false;
+                    pops = m_functions[instruction.operand].param_count;
+                    pushes = 1;
+                    return true;
+                case VMOpcode::CALL_NATIVE:
+                case VMOpcode::CALL_NATIVE_W:
+                    pops = instruction.operand2;
+                    pushes = 1;
+                    return true;
                 default:
-                    // Default to 1-byte instruction
-                    break;
+                    return false;   // Not modelled
             }
-            
-            return info;
         }
 
-        std::set<uint32_t> BytecodeOptimizer::FindReachableInstructions(const std::vector<InstructionInfo>& instructions) {
-            std::set<uint32_t> reachable;
-            std::queue<uint32_t> worklist;
-            
-            // Start from entry point (address 0)
-            if (!instructions.empty()) {
-                worklist.push(instructions[0].address);
-            }
-            
-            while (!worklist.empty()) {
-                uint32_t address = worklist.front();
-                worklist.pop();
-                
-                if (reachable.find(address) != reachable.end()) {
-                    continue; // Already processed
-                }
-                
-                reachable.insert(address);
-                
-                // Find instruction at this address
-                auto it = std::find_if(instructions.begin(), instructions.end(),
-                    [address](const InstructionInfo& inst) { return inst.address == address; });
-                
-                if (it != instructions.end()) {
-                    // Add jump targets
-                    for (uint32_t target : it->jump_targets) {
-                        worklist.push(target);
-                    }
-                    
-                    // Add next instruction if not an unconditional jump
-                    if (!it->is_jump || it->is_conditional_jump) {
-                        uint32_t next_address = it->address + it->size;
-                        worklist.push(next_address);
-                    }
-                }
-            }
-            
-            return reachable;
-        }
+        bool BytecodeOptimizer::GetBlockCount(BytecodeProgram& program, uint32_t index, uint32_t& count) {
+            count = 0;
+            if (!m_profiling_enabled || m_execution_counts.empty()) return false;
 
-        std::map<uint32_t, BytecodeOptimizer::ConstantValue> BytecodeOptimizer::AnalyzeConstants(const std::vector<InstructionInfo>& instructions) {
-            std::map<uint32_t, ConstantValue> constants;
-            
-            for (const auto& inst : instructions) {
-                if (inst.opcode == VMOpcode::PUSH_INT && !inst.operands.empty()) {
-                    ConstantValue value;
-                    value.type = VMDataType::INT32;
-                    value.int_val = static_cast<int32_t>(inst.operands[0]);
-                    value.is_known = true;
-                    constants[inst.address] = value;
-                }
-                // Add support for other constant types as needed
+            while (!program.IsBlockStart(index)) {
+                index = program.PreviousLive(index);
             }
-            
-            return constants;
+            if (program[index].address == BytecodeProgram::NO_INDEX) return false; // Code added by a pass
+
+            auto it = m_execution_counts.find(program[index].address);
+            if (it != m_execution_counts.end()) count = it->second;
+            return true;
         }
 
+        // Helper method implementations
         bool BytecodeOptimizer::CanFoldConstantOperation(VMOpcode opcode, const ConstantValue& a, const ConstantValue& b) {
             if (!a.is_known || !b.is_known) return false;
             if (a.type != VMDataType::INT32 || b.type != VMDataType::INT32) return false;
             
-            switch (opcode) {
-                case VMOpcode::ADD:
-                case VMOpcode::SUB:
-                case VMOpcode::MUL:
-                    return true;
-                case VMOpcode::DIV:
-                case VMOpcode::MOD:
-                    return b.int_val != 0; // Avoid division by zero
-                default:
-                    return false;
-            }
+            // Anything the VM would throw on stays unfolded
+            return FoldConstantOperation(opcode, a, b).is_known;
         }
 
         BytecodeOptimizer::ConstantValue BytecodeOptimizer::FoldConstantOperation(VMOpcode opcode, const ConstantValue& a, const ConstantValue& b) {
             ConstantValue result;
             result.type = VMDataType::INT32;
             result.is_known = true;
+
+            // Generic operations on two INT32s take the checked INT32 path in the VM
+            const int64_t x = a.int_val;
+            const int64_t y = b.int_val;
+            int64_t value = 0;
             
             switch (opcode) {
                 case VMOpcode::ADD:
-                    result.int_val = a.int_val + b.int_val;
+                case VMOpcode::ADD_I32:
+                    value = x + y;
                     break;
                 case VMOpcode::SUB:
-                    result.int_val = a.int_val - b.int_val;
+                case VMOpcode::SUB_I32:
+                    value = x - y;
                     break;
                 case VMOpcode::MUL:
-                    result.int_val = a.int_val * b.int_val;
+                case VMOpcode::MUL_I32:
+                    value = x * y;
                     break;
                 case VMOpcode::DIV:
-                    result.int_val = a.int_val / b.int_val;
+                case VMOpcode::DIV_I32:
+                    if (y == 0) { result.is_known = false; break; }
+                    value = x / y;
                     break;
                 case VMOpcode::MOD:
-                    result.int_val = a.int_val % b.int_val;
+                case VMOpcode::MOD_I32:
+                    if (y == 0) { result.is_known = false; break; }
+                    value = y == -1 ? 0 : x % y;
+                    break;
+                case VMOpcode::BIT_AND: value = x & y; break;
+                case VMOpcode::BIT_OR: value = x | y; break;
+                case VMOpcode::BIT_XOR: value = x ^ y; break;
+                case VMOpcode::SHL:
+                    value = static_cast<int32_t>(static_cast<uint32_t>(a.int_val) << (b.int_val & 31));
                     break;
+                case VMOpcode::SHR: value = a.int_val >> (b.int_val & 31); break;
+                case VMOpcode::CMP_EQ: case VMOpcode::CMP_EQ_I32: value = x == y; break;
+                case VMOpcode::CMP_NE: case VMOpcode::CMP_NE_I32: value = x != y; break;
+                case VMOpcode::CMP_GT: case VMOpcode::CMP_GT_I32: value = x > y; break;
+                case VMOpcode::CMP_GE: case VMOpcode::CMP_GE_I32: value = x >= y; break;
+                case VMOpcode::CMP_LT: case VMOpcode::CMP_LT_I32: value = x < y; break;
+                case VMOpcode::CMP_LE: case VMOpcode::CMP_LE_I32: value = x <= y; break;
                 default:
                     result.is_known = false;
                     break;
             }
-            
+
+            // Overflow throws at run time
+            if (value < std::numeric_limits<int32_t>::min() || value > std::numeric_limits<int32_t>::max()) {
+                result.is_known = false;
+            }
+            result.int_val = result.is_known ? static_cast<int32_t>(value) : 0;
             return result;
         }
 
         void BytecodeOptimizer::InitializeOptimizationPatterns() {
+            // Every replacement is shorter than its pattern
+            auto same_operand = [](const BytecodeProgram& program, const uint32_t* window) {
+                return program[window[0]].operand == program[window[1]].operand;
+            };
+
             // Pattern: PUSH x; POP -> (nothing)
             OptimizationPattern pattern1;
             pattern1.pattern = {VMOpcode::PUSH_INT, VMOpcode::POP};
@@ -536,248 +2367,71 @@ namespace AetherVisor {
             pattern2.description = XorS("Remove dup/pop pair");
             m_peephole_patterns.push_back(pattern2);
             
-            // Add more patterns as needed
+            // Pattern: SWAP; SWAP -> (nothing)
+            OptimizationPattern pattern3;
+            pattern3.pattern = {VMOpcode::SWAP, VMOpcode::SWAP};
+            pattern3.replacement = {};
+            pattern3.description = XorS("Remove swap/swap pair");
+            m_peephole_patterns.push_back(pattern3);
+
+            // Pattern: LOAD_LOCAL n; STORE_LOCAL n -> (nothing)
+            OptimizationPattern pattern4;
+            pattern4.pattern = {VMOpcode::LOAD_LOCAL, VMOpcode::STORE_LOCAL};
+            pattern4.replacement = {};
+            pattern4.condition = same_operand;
+            pattern4.description = XorS("Remove local self-assignment");
+            m_peephole_patterns.push_back(pattern4);
+
+            // Pattern: LOAD_GLOBAL n; STORE_GLOBAL n -> (nothing)
+            OptimizationPattern pattern5;
+            pattern5.pattern = {VMOpcode::LOAD_GLOBAL, VMOpcode::STORE_GLOBAL};
+            pattern5.replacement = {};
+            pattern5.condition = same_operand;
+            pattern5.description = XorS("Remove global self-assignment");
+            m_peephole_patterns.push_back(pattern5);
         }
 
-        bool BytecodeOptimizer::MatchPattern(const std::vector<InstructionInfo>& instructions, 
-                                           size_t start_index, const OptimizationPattern& pattern) {
-            if (start_index + pattern.pattern.size() > instructions.size()) {
+        bool BytecodeOptimizer::MatchPattern(BytecodeProgram& program, const uint32_t* window, size_t window_size,
+                                           const OptimizationPattern& pattern) {
+            if (pattern.pattern.size() > window_size) {
                 return false;
             }
             
             for (size_t i = 0; i < pattern.pattern.size(); ++i) {
-                if (instructions[start_index + i].opcode != pattern.pattern[i]) {
+                if (program[window[i]].opcode != pattern.pattern[i]) {
+                    return false;
+                }
+                // Only the first instruction may be entered from elsewhere
+                if (i > 0 && program.IsBranchTarget(window[i])) {
                     return false;
                 }
             }
             
             // Apply additional condition if present
             if (pattern.condition) {
-                return pattern.condition(instructions, start_index);
+                return pattern.condition(program, window);
             }
             
             return true;
         }
 
-        std::map<uint32_t, uint32_t> BytecodeOptimizer::FindJumpTargets(const std::vector<InstructionInfo>& instructions) {
-            std::map<uint32_t, uint32_t> jump_map;
-            
-            for (const auto& inst : instructions) {
-                if (inst.is_jump && !inst.operands.empty()) {
-                    jump_map[inst.address] = inst.operands[0];
-                }
-            }
-            
-            return jump_map;
-        }
-
-        std::set<uint32_t> BytecodeOptimizer::FindUnreachableJumps(const std::vector<InstructionInfo>& instructions) {
-            auto reachable = FindReachableInstructions(instructions);
-            std::set<uint32_t> unreachable;
-            
-            for (const auto& inst : instructions) {
-                if (inst.is_jump && reachable.find(inst.address) == reachable.end()) {
-                    unreachable.insert(inst.address);
-                }
-            }
-            
-            return unreachable;
-        }
-
-        uint32_t BytecodeOptimizer::ResolveJumpChain(const std::map<uint32_t, uint32_t>& jump_map, uint32_t target) {
-            std::set<uint32_t> visited;
-            uint32_t current = target;
-            
-            while (visited.find(current) == visited.end()) {
-                visited.insert(current);
-                auto it = jump_map.find(current);
-                if (it != jump_map.end()) {
-                    current = it->second;
-                } else {
-                    break;
-                }
-            }
-            
-            return current;
-        }
-
-        std::map<uint32_t, BytecodeOptimizer::StackState> BytecodeOptimizer::AnalyzeStackStates(const std::vector<InstructionInfo>& instructions) {
-            std::map<uint32_t, StackState> states;
-            
-            StackState current_state;
-            current_state.is_valid = true;
-            
-            for (const auto& inst : instructions) {
-                states[inst.address] = current_state;
-                current_state = SimulateStackOperation(current_state, inst);
-            }
-            
-            return states;
-        }
-
-        BytecodeOptimizer::StackState BytecodeOptimizer::SimulateStackOperation(const StackState& current_state, const InstructionInfo& instruction) {
-            StackState new_state = current_state;
-            
-            if (!current_state.is_valid) {
-                return new_state;
-            }
-            
-            switch (instruction.opcode) {
-                case VMOpcode::PUSH_INT:
-                    if (!instruction.operands.empty()) {
-                        ConstantValue value;
-                        value.type = VMDataType::INT32;
-                        value.int_val = static_cast<int32_t>(instruction.operands[0]);
-                        value.is_known = true;
-                        new_state.stack.push_back(value);
-                    }
-                    break;
-                    
-                case VMOpcode::POP:
-                    if (!new_state.stack.empty()) {
-                        new_state.stack.pop_back();
-                    } else {
-                        new_state.is_valid = false;
-                    }
-                    break;
-                    
-                case VMOpcode::DUP:
-                    if (!new_state.stack.empty()) {
-                        new_state.stack.push_back(new_state.stack.back());
-                    } else {
-                        new_state.is_valid = false;
-                    }
-                    break;
-                    
-                case VMOpcode::ADD:
-                case VMOpcode::SUB:
-                case VMOpcode::MUL:
-                case VMOpcode::DIV:
-                    if (new_state.stack.size() >= 2) {
-                        ConstantValue b = new_state.stack.back(); new_state.stack.pop_back();
-                        ConstantValue a = new_state.stack.back(); new_state.stack.pop_back();
-                        
-                        if (CanFoldConstantOperation(instruction.opcode, a, b)) {
-                            ConstantValue result = FoldConstantOperation(instruction.opcode, a, b);
-                            new_state.stack.push_back(result);
-                        } else {
-                            // Unknown result
-                            ConstantValue unknown;
-                            unknown.is_known = false;
-                            new_state.stack.push_back(unknown);
-                        }
-                    } else {
-                        new_state.is_valid = false;
-                    }
-                    break;
-                    
-                default:
-                    // For unknown instructions, invalidate stack analysis
-                    new_state.is_valid = false;
-                    break;
-            }
-            
-            return new_state;
-        }
-
-        void BytecodeOptimizer::EmitInstruction(std::vector<uint8_t>& output, VMOpcode opcode) {
-            output.push_back(static_cast<uint8_t>(opcode));
-        }
-
-        void BytecodeOptimizer::EmitInstruction(std::vector<uint8_t>& output, VMOpcode opcode, uint32_t operand) {
-            output.push_back(static_cast<uint8_t>(opcode));
-            output.push_back(operand & 0xFF);
-            output.push_back((operand >> 8) & 0xFF);
-            output.push_back((operand >> 16) & 0xFF);
-            output.push_back((operand >> 24) & 0xFF);
-        }
-
-        void BytecodeOptimizer::EmitInstructionSequence(std::vector<uint8_t>& output, const std::vector<InstructionInfo>& instructions) {
-            for (const auto& inst : instructions) {
-                if (inst.operands.empty()) {
-                    EmitInstruction(output, inst.opcode);
-                } else {
-                    EmitInstruction(output, inst.opcode, inst.operands[0]);
-                }
-            }
-        }
-
         bool BytecodeOptimizer::ValidateBytecode(const std::vector<uint8_t>& bytecode) {
             if (bytecode.empty()) return true;
             
-            return ValidateStackBalance(bytecode) && 
-                   ValidateJumpTargets(bytecode) && 
-                   ValidateInstructionSequence(bytecode);
-        }
-
-        bool BytecodeOptimizer::ValidateStackBalance(const std::vector<uint8_t>& bytecode) {
-            // Simplified stack balance validation
-            int32_t stack_depth = 0;
-            auto instructions = AnalyzeInstructions(bytecode);
-            
-            for (const auto& inst : instructions) {
-                switch (inst.opcode) {
-                    case VMOpcode::PUSH_INT:
-                    case VMOpcode::PUSH_FLOAT:
-                    case VMOpcode::PUSH_DOUBLE:
-                        stack_depth++;
-                        break;
-                    case VMOpcode::POP:
-                        stack_depth--;
-                        if (stack_depth < 0) return false;
-                        break;
-                    case VMOpcode::ADD:
-                    case VMOpcode::SUB:
-                    case VMOpcode::MUL:
-                    case VMOpcode::DIV:
-                        stack_depth--; // Two pops, one push
-                        if (stack_depth < 0) return false;
-                        break;
-                    default:
-                        break;
-                }
-            }
-            
-            return true; // Stack depth can be non-zero at the end
-        }
-
-        bool BytecodeOptimizer::ValidateJumpTargets(const std::vector<uint8_t>& bytecode) {
-            auto instructions = AnalyzeInstructions(bytecode);
-            std::set<uint32_t> valid_addresses;
-            
-            for (const auto& inst : instructions) {
-                valid_addresses.insert(inst.address);
-            }
-            
-            for (const auto& inst : instructions) {
-                for (uint32_t target : inst.jump_targets) {
-                    if (valid_addresses.find(target) == valid_addresses.end()) {
-                        return false; // Invalid jump target
-                    }
-                }
-            }
-            
-            return true;
-        }
-
-        bool BytecodeOptimizer::ValidateInstructionSequence(const std::vector<uint8_t>& bytecode) {
-            auto instructions = AnalyzeInstructions(bytecode);
-            
-            uint32_t expected_address = 0;
-            for (const auto& inst : instructions) {
-                if (inst.address != expected_address) {
-                    return false; // Address mismatch
-                }
-                expected_address += inst.size;
-            }
-            
-            return expected_address <= bytecode.size();
+            // Decoding checks operand bounds and that every branch lands on an instruction
+            BytecodeProgram program;
+            return program.Decode(bytecode, m_entry_points);
         }
 
-        bool BytecodeOptimizer::VerifyOptimizationCorrectness(const std::vector<uint8_t>& original, 
+        bool BytecodeOptimizer::VerifyOptimizationCorrectness(const std::vector<uint8_t>& /*original*/, 
                                                             const std::vector<uint8_t>& optimized) {
-            // Basic correctness verification
-            return ValidateBytecode(optimized);
+            std::vector<uint32_t> entry_points;
+            for (uint32_t entry : m_entry_points) {
+                auto it = m_address_translation.find(entry);
+                entry_points.push_back(it != m_address_translation.end() ? it->second : entry);
+            }
+            BytecodeProgram program;
+            return program.Decode(optimized, entry_points);
         }
 
         void BytecodeOptimizer::RecordOptimizationApplication(const std::string& optimization_name) {
@@ -788,6 +2442,20 @@ namespace AetherVisor {
             m_execution_counts = execution_counts;
         }
 
+        void BytecodeOptimizer::SetProfile(const ExecutionProfile& profile) {
+            m_execution_counts = profile.block_counts;
+            m_branch_profile = profile.branches;
+            m_profiling_enabled = true;
+        }
+
+        void BytecodeOptimizer::SetFunctions(const std::vector<VMFunction>& functions) {
+            m_functions = functions;
+            m_entry_points.clear();
+            for (const VMFunction& function : functions) {
+                if (!function.is_native) m_entry_points.push_back(function.address);
+            }
+        }
+
         // BytecodeAnalyzer static methods (simplified implementations)
         std::vector<uint32_t> BytecodeAnalyzer::FindFunctionBoundaries(const std::vector<uint8_t>& bytecode) {
             std::vector<uint32_t> boundaries;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "VMOpcodes.h"
+#include "ExecutionProfile.h"
 #include "../security/XorStr.h"
 #include <vector>
 #include <map>
@@ -27,7 +28,12 @@ namespace AetherVisor {
             size_t instructions_removed;
             size_t instructions_combined;
             size_t constants_folded;
+            size_t constants_propagated;
             size_t jumps_optimized;
+            size_t loops_unrolled;
+            size_t calls_inlined;
+            size_t loads_eliminated;
+            size_t blocks_moved;
             double optimization_time_ms;
             std::vector<std::string> applied_optimizations;
         };
@@ -45,6 +51,87 @@ namespace AetherVisor {
             uint32_t execution_frequency; // For profile-guided optimization
         };
 
+        // One decoded instruction. Operands are held inline so decoding makes no
+        // per-instruction allocation; branch operands hold the target's index in
+        // the program rather than a byte address.
+        struct DecodedInstruction {
+            VMOpcode opcode;
+            bool removed;               // Tombstone, dropped when the program is encoded
+            uint32_t address;           // Byte offset in the decoded bytecode, NO_INDEX when inserted by a pass
+            uint32_t operand;           // Immediate, slot, pool or function index, or branch target index
+            uint32_t operand2;          // Argument count of CALL_NATIVE / CALL_NATIVE_W, high half of a U64 operand
+        };
+
+        // Analyses cached on a BytecodeProgram. A pass returns the set it left
+        // valid and the pass manager drops the rest.
+        namespace BytecodeAnalysis {
+            constexpr uint32_t NONE = 0;
+            constexpr uint32_t BRANCH_TARGETS = 1u << 0;
+            constexpr uint32_t REACHABILITY = 1u << 1;
+            constexpr uint32_t ALL = BRANCH_TARGETS | REACHABILITY;
+        }
+
+        // Flat instruction list shared by every optimisation pass. Bytecode is
+        // decoded once, passes rewrite the list in place (deleting by tombstone,
+        // so branch target indices stay stable) and the result is encoded once,
+        // at which point final addresses are assigned. A branch to a removed
+        // instruction lands on the next live one.
+        class BytecodeProgram {
+        public:
+            static constexpr uint32_t NO_INDEX = 0xFFFFFFFF;
+
+            bool Decode(const std::vector<uint8_t>& bytecode, const std::vector<uint32_t>& entry_points);
+            void Encode(std::vector<uint8_t>& output, std::map<uint32_t, uint32_t>* address_translation = nullptr) const;
+
+            static uint32_t GetOperandSize(VMOpcode opcode);
+            static bool IsBranch(VMOpcode opcode);
+            static bool FallsThrough(VMOpcode opcode);
+
+            uint32_t Size() const { return static_cast<uint32_t>(m_instructions.size()); }
+            DecodedInstruction& operator[](uint32_t index) { return m_instructions[index]; }
+            const DecodedInstruction& operator[](uint32_t index) const { return m_instructions[index]; }
+            uint32_t GetLiveCount() const { return m_live_count; }
+            const std::vector<uint32_t>& GetEntries() const { return m_entries; }  // Program start, then the entry points as given
+
+            // Navigation over live instructions; both return Size() when there is none
+            uint32_t NextLive(uint32_t index) const;
+            uint32_t PreviousLive(uint32_t index) const;
+
+            void Remove(uint32_t index);
+            void SetTarget(uint32_t index, uint32_t target);
+
+            // Inserts before index; existing branches to index or later move with
+            // their targets. Branch operands of the new instructions must already
+            // be indices in the resulting program.
+            void Insert(uint32_t index, const std::vector<DecodedInstruction>& instructions);
+
+            // Rebuilds the program in the given order, which lists every index
+            // once; an index from Size() on places added[index - Size()]. Branch
+            // operands, of added instructions too, are indices before the move.
+            void Reorder(const std::vector<uint32_t>& order, const std::vector<DecodedInstruction>& added);
+            uint32_t ResolveTarget(uint32_t index) const { return NextLive(m_instructions[index].operand); }
+
+            // Cached analyses, recomputed on demand after invalidation
+            bool IsBranchTarget(uint32_t index);    // Entered other than by falling through
+            bool IsReachable(uint32_t index);
+            bool IsEntry(uint32_t index) const;     // Program or function entry
+            bool IsBlockStart(uint32_t index);      // Live and first in its basic block
+            void Invalidate(uint32_t preserved);
+
+        private:
+            std::vector<DecodedInstruction> m_instructions;
+            std::vector<uint32_t> m_entries;        // Instruction indices
+            bool m_infer_entries = false;           // No entry points given, see SetEntryPoints
+            uint32_t m_code_size = 0;
+            uint32_t m_live_count = 0;
+            uint32_t m_valid_analyses = BytecodeAnalysis::NONE;
+            std::vector<bool> m_branch_targets;
+            std::vector<bool> m_reachable;
+
+            void ComputeBranchTargets();
+            void ComputeReachability();
+        };
+
         // Advanced bytecode optimizer with sophisticated analysis
         class BytecodeOptimizer {
         public:
@@ -69,7 +156,10 @@ namespace AetherVisor {
             std::vector<CFGNode> BuildControlFlowGraph(const std::vector<uint8_t>& bytecode);
             std::vector<uint8_t> OptimizeControlFlow(const std::vector<CFGNode>& cfg);
             
-            // Data flow analysis
+            // Data flow analysis: the stores that may reach each LOAD_LOCAL and
+            // LOAD_GLOBAL, by byte address. OUTSIDE_VALUE stands for a value from
+            // before the function's entry or written by a call.
+            static constexpr uint32_t OUTSIDE_VALUE = 0xFFFFFFFF;
             std::map<uint32_t, std::set<uint32_t>> AnalyzeDataFlow(const std::vector<uint8_t>& bytecode);
             std::vector<uint8_t> OptimizeDataFlow(const std::vector<uint8_t>& bytecode, 
                                                 const std::map<uint32_t, std::set<uint32_t>>& data_flow);
@@ -89,9 +179,38 @@ namespace AetherVisor {
             OptimizationStats GetLastOptimizationStats() const { return m_last_stats; }
             void EnableProfiling(bool enable) { m_profiling_enabled = enable; }
             void SetProfilingData(const std::map<uint32_t, uint32_t>& execution_counts);
+            void SetProfile(const ExecutionProfile& profile);   // Counts and branch outcomes; enables profiling
+
+            // Function entry addresses besides 0. Without them every instruction
+            // after a RET, RET_VAL or HALT is treated as a possible entry.
+            void SetEntryPoints(const std::vector<uint32_t>& entry_points) { m_entry_points = entry_points; }
+
+            // Function table of the code, which also supplies the entry points.
+            // Inlining needs it; callers' local_count grows by the frames of
+            // what was inlined into them, so read the table back after Optimize.
+            void SetFunctions(const std::vector<VMFunction>& functions);
+            const std::vector<VMFunction>& GetFunctions() const { return m_functions; }
+
+            // Global slots the program declares. Inlining into top-level code
+            // places callee frames after them, as declared globals whose stores
+            // were optimised away are still visible to the host.
+            void SetGlobalCount(uint32_t global_count) { m_global_count = global_count; }
+
+            // Original -> optimised address of every instruction from the last
+            // Optimize or single pass, for remapping function tables and line
+            // tables. Empty when the input came back unchanged.
+            const std::map<uint32_t, uint32_t>& GetAddressTranslation() const { return m_address_translation; }
+
+            // Original addresses of the conditional branches the last Optimize
+            // inverted (JMP_IF_ZERO <-> JMP_IF_NOT_ZERO), so the taken edge of
+            // the output is the not-taken edge of the input
+            const std::set<uint32_t>& GetInvertedBranches() const { return m_inverted_branches; }
             
             // Validation
             bool ValidateBytecode(const std::vector<uint8_t>& bytecode);
+            // Checks that optimized decodes from the remapped entry points.
+            // Behaviour is compared by the aether_difftest harness instead,
+            // which keeps the optimiser free of the VM.
             bool VerifyOptimizationCorrectness(const std::vector<uint8_t>& original, 
                                              const std::vector<uint8_t>& optimized);
 
@@ -99,41 +218,106 @@ namespace AetherVisor {
             OptimizationStats m_last_stats;
             bool m_profiling_enabled;
             std::map<uint32_t, uint32_t> m_execution_counts;
+            std::map<uint32_t, BranchProfile> m_branch_profile;
             
-            // Instruction analysis helpers
-            struct InstructionInfo {
-                VMOpcode opcode;
-                std::vector<uint32_t> operands;
-                uint32_t address;
-                uint32_t size;
-                bool is_jump;
-                bool is_conditional_jump;
-                bool modifies_stack;
-                bool reads_memory;
-                bool writes_memory;
-                std::set<uint32_t> jump_targets;
+            std::vector<uint32_t> m_entry_points;
+            std::vector<VMFunction> m_functions;
+            uint32_t m_global_count;
+
+            // Pass manager. Each pass rewrites the shared program in place and
+            // returns the BytecodeAnalysis set it preserved.
+            using PassFunction = uint32_t (BytecodeOptimizer::*)(BytecodeProgram& program);
+            struct OptimizationPass {
+                OptimizationLevel level;
+                std::string name;
+                PassFunction run;
             };
-            
-            std::vector<InstructionInfo> AnalyzeInstructions(const std::vector<uint8_t>& bytecode);
-            InstructionInfo DecodeInstruction(const uint8_t* code, uint32_t address, uint32_t max_size);
-            
-            // Pattern matching for optimizations
+
+            std::vector<OptimizationPass> m_passes;
+            void InitializePasses();
+            std::vector<uint8_t> RunStandalonePass(const std::vector<uint8_t>& bytecode, PassFunction pass);
+            // Node addresses are instruction indices into the program
+            std::vector<CFGNode> BuildControlFlowGraph(BytecodeProgram& program);
+
+            // Profile-guided unrolling of contiguous inner loops
+            static constexpr uint32_t HOT_LOOP_THRESHOLD = 1000;        // Header executions
+            static constexpr uint32_t MAX_UNROLLED_INSTRUCTIONS = 64;   // Added per loop
+            uint32_t UnrollHotLoops(BytecodeProgram& program, uint32_t max_unroll_factor);
+
+            // Block layout. Frequencies come from the profile where it covers a
+            // block and are estimated otherwise: LOOP_WEIGHT entries per loop
+            // header, LOOP_STAY_PROBABILITY for the edge that stays in a loop,
+            // and nothing into exception handlers or paths that can only throw.
+            static constexpr double LOOP_WEIGHT = 8.0;
+            static constexpr double LOOP_STAY_PROBABILITY = 0.875;
+            std::map<uint32_t, VMOpcode> m_branch_senses;    // Conditional branch address -> opcode in the input
+            std::set<uint32_t> m_inverted_branches;
+            bool GetBranchProbability(const BytecodeProgram& program, uint32_t branch, double& taken) const;
+
+            // Inlining cost model. Small leaf callees are inlined everywhere,
+            // larger ones only at their single call site or at hot sites, and
+            // never at sites the profile shows were not executed.
+            static constexpr uint32_t SMALL_FUNCTION_SIZE = 16;         // Instructions
+            static constexpr uint32_t MAX_INLINE_SIZE = 64;             // Instructions
+            static constexpr uint32_t HOT_CALL_THRESHOLD = 100;         // Call site executions
+            static constexpr uint32_t MIN_INLINE_GROWTH = 256;          // Instructions added per program, at least
+            static constexpr uint32_t MAX_INLINE_DEPTH = 3;             // Rounds over calls in inlined code
+            struct InlineCandidate {
+                std::vector<uint32_t> body;     // Reachable instructions in address order
+                uint32_t slot_count;            // Frame slots the body uses
+                bool has_bare_return;           // Reaches RET, so the call's result must be unused
+                bool is_leaf;                   // Makes no script calls
+            };
+            bool AnalyzeInlineCandidate(BytecodeProgram& program, uint32_t function_index,
+                                        uint32_t begin, uint32_t end, InlineCandidate& candidate) const;
+            bool GetStackEffect(const DecodedInstruction& instruction, uint32_t& pops, uint32_t& pushes) const;
+            bool GetBlockCount(BytecodeProgram& program, uint32_t index, uint32_t& count);
+
+            // Basic blocks over the live instructions, for the data flow passes.
+            // block_of maps an instruction index to its block, NO_INDEX if dead.
+            struct FlowBlock {
+                std::vector<uint32_t> instructions;
+                std::vector<uint32_t> successors;   // Block indices, TRY handlers included
+                bool entry;         // Function entry: every slot holds an outside value
+                bool handler;       // TRY target: entered from anywhere in the protected code
+            };
+            std::vector<FlowBlock> BuildFlowBlocks(BytecodeProgram& program, std::vector<uint32_t>& block_of);
+            static uint32_t GetSlotKey(const DecodedInstruction& instruction);     // Slot, bit 16 set for globals
+
+            // Same analysis keyed by instruction index, solved one function region at a time
+            std::map<uint32_t, std::set<uint32_t>> ComputeReachingStores(BytecodeProgram& program);
+            void ComputeRegionReachingStores(BytecodeProgram& program, const std::vector<FlowBlock>& blocks,
+                                             size_t first, size_t end, std::map<uint32_t, std::set<uint32_t>>& reaching);
+            uint32_t ForwardStoredConstants(BytecodeProgram& program, const std::map<uint32_t, std::set<uint32_t>>& reaching);
+
+            uint32_t RunDeadCodeElimination(BytecodeProgram& program);
+            uint32_t RunConstantFolding(BytecodeProgram& program);
+            uint32_t RunStackOptimization(BytecodeProgram& program);
+            uint32_t RunJumpOptimization(BytecodeProgram& program);
+            uint32_t RunPeepholeOptimization(BytecodeProgram& program);
+            uint32_t RunRedundantLoadElimination(BytecodeProgram& program);
+            uint32_t RunFunctionInlining(BytecodeProgram& program);
+            uint32_t RunLoopOptimization(BytecodeProgram& program);
+            uint32_t RunConstantPropagation(BytecodeProgram& program);
+            uint32_t RunVectorization(BytecodeProgram& program);
+            uint32_t RunBlockLayout(BytecodeProgram& program);
+
+            // Pattern matching for optimizations. A pattern matches consecutive
+            // live instructions, none of which but the first may be a branch
+            // target; the replacement opcodes overwrite the leading matches
+            // (keeping their operands) and the remainder are removed.
+            static constexpr size_t MAX_PATTERN_LENGTH = 4;
             struct OptimizationPattern {
                 std::vector<VMOpcode> pattern;
                 std::vector<VMOpcode> replacement;
-                std::function<bool(const std::vector<InstructionInfo>&, size_t)> condition;
+                std::function<bool(const BytecodeProgram&, const uint32_t*)> condition;
                 std::string description;
             };
             
             std::vector<OptimizationPattern> m_peephole_patterns;
             void InitializeOptimizationPatterns();
-            bool MatchPattern(const std::vector<InstructionInfo>& instructions, 
-                            size_t start_index, const OptimizationPattern& pattern);
-            
-            // Dead code analysis
-            std::set<uint32_t> FindReachableInstructions(const std::vector<InstructionInfo>& instructions);
-            std::set<uint32_t> FindLiveVariables(const std::vector<InstructionInfo>& instructions, 
-                                               uint32_t instruction_index);
+            bool MatchPattern(BytecodeProgram& program, const uint32_t* window, size_t window_size,
+                            const OptimizationPattern& pattern);
             
             // Constant folding helpers
             struct ConstantValue {
@@ -146,15 +330,9 @@ namespace AetherVisor {
                 bool is_known;
             };
             
-            std::map<uint32_t, ConstantValue> AnalyzeConstants(const std::vector<InstructionInfo>& instructions);
             bool CanFoldConstantOperation(VMOpcode opcode, const ConstantValue& a, const ConstantValue& b);
             ConstantValue FoldConstantOperation(VMOpcode opcode, const ConstantValue& a, const ConstantValue& b);
             
-            // Jump optimization helpers
-            std::map<uint32_t, uint32_t> FindJumpTargets(const std::vector<InstructionInfo>& instructions);
-            std::set<uint32_t> FindUnreachableJumps(const std::vector<InstructionInfo>& instructions);
-            uint32_t ResolveJumpChain(const std::map<uint32_t, uint32_t>& jump_map, uint32_t target);
-            
             // Loop analysis
             struct LoopInfo {
                 uint32_t header_address;
@@ -166,37 +344,15 @@ namespace AetherVisor {
             };
             
             std::vector<LoopInfo> DetectLoops(const std::vector<CFGNode>& cfg);
-            bool IsLoopInvariant(const InstructionInfo& instruction, const LoopInfo& loop);
             
-            // Stack simulation for optimization
-            struct StackState {
-                std::vector<ConstantValue> stack;
-                bool is_valid;
-            };
-            
-            StackState SimulateStackOperation(const StackState& current_state, const InstructionInfo& instruction);
-            std::map<uint32_t, StackState> AnalyzeStackStates(const std::vector<InstructionInfo>& instructions);
-            
-            // Code generation helpers
-            void EmitInstruction(std::vector<uint8_t>& output, VMOpcode opcode);
-            void EmitInstruction(std::vector<uint8_t>& output, VMOpcode opcode, uint32_t operand);
-            void EmitInstruction(std::vector<uint8_t>& output, VMOpcode opcode, uint32_t op1, uint32_t op2);
-            void EmitInstructionSequence(std::vector<uint8_t>& output, const std::vector<InstructionInfo>& instructions);
-            
-            // Address translation for jump fixup
+            // Address translation from the last encode
             std::map<uint32_t, uint32_t> m_address_translation;
-            void UpdateJumpTargets(std::vector<uint8_t>& bytecode, const std::map<uint32_t, uint32_t>& translation);
             
             // Security and anti-analysis
             std::vector<uint8_t> InsertJunkInstructions(const std::vector<uint8_t>& bytecode, double density = 0.1);
             std::vector<uint8_t> SplitBasicBlocks(const std::vector<uint8_t>& bytecode);
             std::vector<uint8_t> InsertFakeJumps(const std::vector<uint8_t>& bytecode);
             
-            // Validation helpers
-            bool ValidateStackBalance(const std::vector<uint8_t>& bytecode);
-            bool ValidateJumpTargets(const std::vector<uint8_t>& bytecode);
-            bool ValidateInstructionSequence(const std::vector<uint8_t>& bytecode);
-            
             // Metrics and statistics
             void UpdateStatistics(const std::string& optimization_name, 
                                 size_t original_size, size_t optimized_size);
@@ -0,0 +1,635 @@
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "CompiledModule.h"
+#include "Compiler.h"
+#include "../security/XorStr.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace AetherVisor {
+    namespace VM {
+
+        namespace {
+            enum SectionState : uint8_t {
+                SECTION_UNCHECKED = 0,
+                SECTION_VALID = 1,
+                SECTION_INVALID = 2
+            };
+
+            size_t AlignSection(size_t offset) {
+                return (offset + 7) & ~static_cast<size_t>(7);
+            }
+
+            size_t SectionIndex(ModuleSectionKind kind) {
+                return static_cast<size_t>(kind);
+            }
+
+            template <typename T>
+            void AppendPod(std::vector<uint8_t>& out, const T& value) {
+                const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+                out.insert(out.end(), bytes, bytes + sizeof(T));
+            }
+        }
+
+        CompiledModule::~CompiledModule() {
+            if (!m_mapping) return;
+#ifdef _WIN32
+            UnmapViewOfFile(m_mapping);
+#else
+            munmap(m_mapping, m_size);
+#endif
+        }
+
+        std::shared_ptr<CompiledModule> CompiledModule::MapFile(const std::string& path, std::string* error) {
+            std::shared_ptr<CompiledModule> module(new CompiledModule());
+
+#ifdef _WIN32
+            HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE) {
+                if (error) *error = XorS("Failed to open module file");
+                return nullptr;
+            }
+            LARGE_INTEGER file_size{};
+            if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0 || file_size.QuadPart > 0xFFFFFFFFLL) {
+                CloseHandle(file);
+                if (error) *error = XorS("Invalid module file size");
+                return nullptr;
+            }
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            CloseHandle(file);
+            if (!mapping) {
+                if (error) *error = XorS("Failed to map module file");
+                return nullptr;
+            }
+            void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping); // The view keeps the mapping alive
+            if (!view) {
+                if (error) *error = XorS("Failed to map module file");
+                return nullptr;
+            }
+            module->m_mapping = view;
+            module->m_size = static_cast<size_t>(file_size.QuadPart);
+#else
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                if (error) *error = XorS("Failed to open module file");
+                return nullptr;
+            }
+            struct stat info{};
+            if (fstat(fd, &info) != 0 || info.st_size <= 0 || info.st_size > 0xFFFFFFFFLL) {
+                close(fd);
+                if (error) *error = XorS("Invalid module file size");
+                return nullptr;
+            }
+            void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd); // The mapping keeps the file referenced
+            if (view == MAP_FAILED) {
+                if (error) *error = XorS("Failed to map module file");
+                return nullptr;
+            }
+            module->m_mapping = view;
+            module->m_size = static_cast<size_t>(info.st_size);
+#endif
+
+            module->m_data = static_cast<const uint8_t*>(module->m_mapping);
+            if (!module->ValidateHeader()) {
+                if (error) *error = module->m_last_error;
+                return nullptr;
+            }
+            return module;
+        }
+
+        std::shared_ptr<CompiledModule> CompiledModule::FromImage(std::vector<uint8_t> image, std::string* error) {
+            std::shared_ptr<CompiledModule> module(new CompiledModule());
+            module->m_owned = std::move(image);
+            module->m_data = module->m_owned.data();
+            module->m_size = module->m_owned.size();
+
+            if (!module->ValidateHeader()) {
+                if (error) *error = module->m_last_error;
+                return nullptr;
+            }
+            return module;
+        }
+
+        bool CompiledModule::IsModuleImage(const uint8_t* data, size_t size) {
+            return data && size >= sizeof(ModuleHeader) && std::memcmp(data, kModuleMagic, sizeof(kModuleMagic)) == 0;
+        }
+
+        std::vector<uint8_t> CompiledModule::Serialize(const CompilationContext& context) {
+            std::vector<uint8_t> strings;
+            auto add_string = [&strings](const char* data, size_t length) {
+                uint32_t offset = static_cast<uint32_t>(strings.size());
+                strings.insert(strings.end(), data, data + length);
+                strings.push_back(0);
+                return offset;
+            };
+
+            // The packed pools are only usable when the compiler laid constants out
+            // pool by pool; otherwise everything is written boxed, in pool order
+            bool grouped = true;
+            for (size_t i = 1; i < context.constant_pool.size(); ++i) {
+                if (GetConstantPool(context.constant_pool[i].value.type) < GetConstantPool(context.constant_pool[i - 1].value.type)) {
+                    grouped = false;
+                    break;
+                }
+            }
+
+            std::vector<uint8_t> ints;
+            std::vector<uint8_t> doubles;
+            std::vector<uint8_t> string_refs;
+            std::vector<uint8_t> constants;
+            for (const auto& constant : context.constant_pool) {
+                const VMValue& value = constant.value;
+                switch (grouped ? GetConstantPool(value.type) : ModuleConstantPool::OTHER) {
+                    case ModuleConstantPool::INT:
+                        AppendPod(ints, value.data.i64);
+                        continue;
+                    case ModuleConstantPool::DOUBLE:
+                        AppendPod(doubles, value.data.f64);
+                        continue;
+                    case ModuleConstantPool::STRING:
+                        AppendPod(string_refs, ModuleStringRef{
+                            add_string(value.data.string.data, value.data.string.length),
+                            static_cast<uint32_t>(value.data.string.length) });
+                        continue;
+                    default:
+                        break;
+                }
+
+                ModuleConstant entry{};
+                entry.type = value.type;
+                switch (value.type) {
+                    case VMDataType::INT32:
+                        entry.payload = static_cast<uint64_t>(static_cast<int64_t>(value.data.i32));
+                        break;
+                    case VMDataType::INT64:
+                        entry.payload = static_cast<uint64_t>(value.data.i64);
+                        break;
+                    case VMDataType::FLOAT32: {
+                        uint32_t bits;
+                        std::memcpy(&bits, &value.data.f32, sizeof(bits));
+                        entry.payload = bits;
+                        break;
+                    }
+                    case VMDataType::FLOAT64:
+                        std::memcpy(&entry.payload, &value.data.f64, sizeof(entry.payload));
+                        break;
+                    case VMDataType::BOOLEAN:
+                        entry.payload = value.data.boolean ? 1 : 0;
+                        break;
+                    case VMDataType::STRING:
+                        entry.length = static_cast<uint32_t>(value.data.string.length);
+                        entry.payload = add_string(value.data.string.data, value.data.string.length);
+                        break;
+                    default:
+                        entry.type = VMDataType::UNDEFINED;
+                        break;
+                }
+                AppendPod(constants, entry);
+            }
+
+            std::vector<uint8_t> functions;
+            for (const auto& function : context.functions) {
+                ModuleFunction entry{};
+                entry.address = function.address;
+                entry.local_count = function.local_count;
+                entry.param_count = function.param_count;
+                entry.name_offset = add_string(function.name, std::strlen(function.name));
+                AppendPod(functions, entry);
+            }
+
+            std::vector<uint8_t> lines;
+            for (const auto& line : context.line_table) {
+                AppendPod(lines, ModuleLineEntry{ line.first, line.second });
+            }
+
+            std::vector<uint8_t> profile_addresses;
+            for (const auto& entry : context.profile_addresses) {
+                AppendPod(profile_addresses, ModuleAddressEntry{ entry.first, entry.second });
+            }
+
+            std::vector<uint8_t> inverted_branches;
+            for (uint32_t pc : context.inverted_branches) {
+                AppendPod(inverted_branches, pc);
+            }
+
+            const std::pair<ModuleSectionKind, const std::vector<uint8_t>*> payloads[] = {
+                { ModuleSectionKind::CODE, &context.bytecode },
+                { ModuleSectionKind::INT_CONSTANTS, &ints },
+                { ModuleSectionKind::DOUBLE_CONSTANTS, &doubles },
+                { ModuleSectionKind::STRING_CONSTANTS, &string_refs },
+                { ModuleSectionKind::CONSTANTS, &constants },
+                { ModuleSectionKind::FUNCTIONS, &functions },
+                { ModuleSectionKind::STRINGS, &strings },
+                { ModuleSectionKind::DEBUG_LINES, &lines },
+                { ModuleSectionKind::PROFILE_ADDRESSES, &profile_addresses },
+                { ModuleSectionKind::INVERTED_BRANCHES, &inverted_branches },
+            };
+            const size_t section_count = sizeof(payloads) / sizeof(payloads[0]);
+
+            ModuleHeader header{};
+            std::memcpy(header.magic, kModuleMagic, sizeof(kModuleMagic));
+            header.version = kModuleFormatVersion;
+            header.section_count = static_cast<uint16_t>(section_count);
+            header.entry_point = 0;
+            header.profile_key = context.profile_key ? context.profile_key :
+                                 Checksum(context.bytecode.data(), context.bytecode.size());
+
+            std::vector<ModuleSection> sections;
+            size_t offset = AlignSection(sizeof(ModuleHeader) + section_count * sizeof(ModuleSection));
+            for (const auto& payload : payloads) {
+                ModuleSection section{};
+                section.kind = payload.first;
+                section.offset = static_cast<uint32_t>(offset);
+                section.size = static_cast<uint32_t>(payload.second->size());
+                section.checksum = Checksum(payload.second->data(), payload.second->size());
+                sections.push_back(section);
+                offset = AlignSection(offset + payload.second->size());
+            }
+            header.image_size = static_cast<uint32_t>(offset);
+
+            std::vector<uint8_t> image;
+            image.reserve(offset);
+            AppendPod(image, header);
+            for (const auto& section : sections) {
+                AppendPod(image, section);
+            }
+            for (size_t i = 0; i < section_count; ++i) {
+                image.resize(sections[i].offset, 0);
+                image.insert(image.end(), payloads[i].second->begin(), payloads[i].second->end());
+            }
+            image.resize(offset, 0);
+
+            uint32_t checksum = Checksum(image.data(), sizeof(ModuleHeader) + section_count * sizeof(ModuleSection));
+            std::memcpy(image.data() + offsetof(ModuleHeader, header_checksum), &checksum, sizeof(checksum));
+            return image;
+        }
+
+        bool CompiledModule::WriteFile(const std::string& path, const CompilationContext& context) {
+            std::vector<uint8_t> image = Serialize(context);
+            std::ofstream file(path, std::ios::binary | std::ios::trunc);
+            if (!file) {
+                return false;
+            }
+            file.write(reinterpret_cast<const char*>(image.data()), static_cast<std::streamsize>(image.size()));
+            return static_cast<bool>(file);
+        }
+
+        // Eager checks are limited to the header and section table so that opening
+        // a large module costs the same as opening a small one
+        bool CompiledModule::ValidateHeader() {
+            if (!IsModuleImage(m_data, m_size)) {
+                m_last_error = XorS("Not a compiled module");
+                return false;
+            }
+
+            ModuleHeader header;
+            std::memcpy(&header, m_data, sizeof(header));
+            if (header.version != kModuleFormatVersion) {
+                m_last_error = XorS("Unsupported module version");
+                return false;
+            }
+            if (header.image_size != m_size) {
+                m_last_error = XorS("Module size mismatch");
+                return false;
+            }
+
+            size_t table_end = sizeof(ModuleHeader) + static_cast<size_t>(header.section_count) * sizeof(ModuleSection);
+            if (table_end > m_size) {
+                m_last_error = XorS("Truncated module section table");
+                return false;
+            }
+
+            header.header_checksum = 0;
+            std::vector<uint8_t> table(m_data, m_data + table_end);
+            std::memcpy(table.data(), &header, sizeof(header));
+            if (Checksum(table.data(), table.size()) != GetHeader().header_checksum) {
+                m_last_error = XorS("Module header checksum mismatch");
+                return false;
+            }
+
+            const ModuleSection* sections = reinterpret_cast<const ModuleSection*>(m_data + sizeof(ModuleHeader));
+            for (uint16_t i = 0; i < header.section_count; ++i) {
+                const ModuleSection& section = sections[i];
+                size_t index = SectionIndex(section.kind);
+                if (index == 0 || index >= SectionIndex(ModuleSectionKind::COUNT) || m_sections[index]) {
+                    m_last_error = XorS("Invalid module section table");
+                    return false;
+                }
+                if (section.offset < table_end || section.offset % 8 != 0 ||
+                    static_cast<size_t>(section.offset) + section.size > m_size) {
+                    m_last_error = XorS("Module section out of bounds");
+                    return false;
+                }
+                m_sections[index] = &section;
+            }
+
+            if (!m_sections[SectionIndex(ModuleSectionKind::CODE)] ||
+                header.entry_point > m_sections[SectionIndex(ModuleSectionKind::CODE)]->size) {
+                m_last_error = XorS("Module has no valid code section");
+                return false;
+            }
+            return true;
+        }
+
+        const uint8_t* CompiledModule::GetSection(ModuleSectionKind kind, uint32_t& size) const {
+            size = 0;
+            size_t index = SectionIndex(kind);
+            const ModuleSection* section = m_sections[index];
+            if (!section) {
+                return nullptr;
+            }
+
+            const uint8_t* data = m_data + section->offset;
+            uint8_t state = m_section_state[index].load(std::memory_order_acquire);
+            if (state == SECTION_UNCHECKED) {
+                // Concurrent first accesses may both validate; the outcome is identical
+                state = ValidateSectionContents(kind, data, section->size) ? SECTION_VALID : SECTION_INVALID;
+                m_section_state[index].store(state, std::memory_order_release);
+            }
+            if (state != SECTION_VALID) {
+                return nullptr;
+            }
+
+            size = section->size;
+            return data;
+        }
+
+        bool CompiledModule::ValidateSectionContents(ModuleSectionKind kind, const uint8_t* data, uint32_t size) const {
+            const ModuleSection* section = m_sections[SectionIndex(kind)];
+            if (Checksum(data, size) != section->checksum) {
+                m_last_error = XorS("Module section checksum mismatch");
+                return false;
+            }
+
+            uint32_t strings_size = 0;
+            switch (kind) {
+                case ModuleSectionKind::STRINGS:
+                    return size == 0 || data[size - 1] == 0;
+
+                case ModuleSectionKind::CONSTANTS: {
+                    if (size % sizeof(ModuleConstant) != 0) return false;
+                    const ModuleConstant* constants = reinterpret_cast<const ModuleConstant*>(data);
+                    for (uint32_t i = 0; i < size / sizeof(ModuleConstant); ++i) {
+                        if (constants[i].type == VMDataType::STRING &&
+                            !GetString(static_cast<uint32_t>(constants[i].payload), constants[i].length)) {
+                            m_last_error = XorS("Module constant references invalid string");
+                            return false;
+                        }
+                    }
+                    return true;
+                }
+
+                case ModuleSectionKind::FUNCTIONS: {
+                    if (size % sizeof(ModuleFunction) != 0) return false;
+                    const uint32_t code_size = m_sections[SectionIndex(ModuleSectionKind::CODE)]->size;
+                    const uint8_t* strings = GetSection(ModuleSectionKind::STRINGS, strings_size);
+                    const ModuleFunction* functions = reinterpret_cast<const ModuleFunction*>(data);
+                    for (uint32_t i = 0; i < size / sizeof(ModuleFunction); ++i) {
+                        if (functions[i].address >= code_size || !strings || functions[i].name_offset >= strings_size) {
+                            m_last_error = XorS("Module function table entry out of range");
+                            return false;
+                        }
+                    }
+                    return true;
+                }
+
+                case ModuleSectionKind::INVERTED_BRANCHES: {
+                    if (size % sizeof(uint32_t) != 0) return false;
+                    const uint32_t* pcs = reinterpret_cast<const uint32_t*>(data);
+                    for (uint32_t i = 1; i < size / sizeof(uint32_t); ++i) {
+                        if (pcs[i] <= pcs[i - 1]) {
+                            m_last_error = XorS("Module inverted branch list is not sorted");
+                            return false;
+                        }
+                    }
+                    return true;
+                }
+
+                case ModuleSectionKind::STRING_CONSTANTS: {
+                    if (size % sizeof(ModuleStringRef) != 0) return false;
+                    const ModuleStringRef* refs = reinterpret_cast<const ModuleStringRef*>(data);
+                    for (uint32_t i = 0; i < size / sizeof(ModuleStringRef); ++i) {
+                        if (!GetString(refs[i].offset, refs[i].length)) {
+                            m_last_error = XorS("Module constant references invalid string");
+                            return false;
+                        }
+                    }
+                    return true;
+                }
+
+                case ModuleSectionKind::INT_CONSTANTS:
+                case ModuleSectionKind::DOUBLE_CONSTANTS:
+                    return size % sizeof(uint64_t) == 0;
+
+                case ModuleSectionKind::DEBUG_LINES:
+                    return size % sizeof(ModuleLineEntry) == 0;
+
+                case ModuleSectionKind::PROFILE_ADDRESSES: {
+                    if (size % sizeof(ModuleAddressEntry) != 0) return false;
+                    const ModuleAddressEntry* entries = reinterpret_cast<const ModuleAddressEntry*>(data);
+                    for (uint32_t i = 1; i < size / sizeof(ModuleAddressEntry); ++i) {
+                        if (entries[i].pc <= entries[i - 1].pc) {
+                            m_last_error = XorS("Module profile address map is not sorted");
+                            return false;
+                        }
+                    }
+                    return true;
+                }
+
+                default:
+                    return true;
+            }
+        }
+
+        const char* CompiledModule::GetString(uint32_t offset, uint32_t length) const {
+            uint32_t size = 0;
+            const uint8_t* strings = GetSection(ModuleSectionKind::STRINGS, size);
+            if (!strings || static_cast<uint64_t>(offset) + length >= size || strings[offset + length] != 0) {
+                return nullptr;
+            }
+            return reinterpret_cast<const char*>(strings + offset);
+        }
+
+        const uint8_t* CompiledModule::GetCode(uint32_t& size) const {
+            return GetSection(ModuleSectionKind::CODE, size);
+        }
+
+        uint32_t CompiledModule::GetSectionEntryCount(ModuleSectionKind kind, size_t entry_size) const {
+            const ModuleSection* section = m_sections[SectionIndex(kind)];
+            return section ? static_cast<uint32_t>(section->size / entry_size) : 0;
+        }
+
+        const int64_t* CompiledModule::GetIntConstants(uint32_t& count) const {
+            uint32_t size = 0;
+            const uint8_t* data = GetSection(ModuleSectionKind::INT_CONSTANTS, size);
+            count = size / sizeof(int64_t);
+            return reinterpret_cast<const int64_t*>(data);
+        }
+
+        const double* CompiledModule::GetDoubleConstants(uint32_t& count) const {
+            uint32_t size = 0;
+            const uint8_t* data = GetSection(ModuleSectionKind::DOUBLE_CONSTANTS, size);
+            count = size / sizeof(double);
+            return reinterpret_cast<const double*>(data);
+        }
+
+        uint32_t CompiledModule::GetConstantCount() const {
+            return GetSectionEntryCount(ModuleSectionKind::INT_CONSTANTS, sizeof(int64_t)) +
+                   GetSectionEntryCount(ModuleSectionKind::DOUBLE_CONSTANTS, sizeof(double)) +
+                   GetSectionEntryCount(ModuleSectionKind::STRING_CONSTANTS, sizeof(ModuleStringRef)) +
+                   GetSectionEntryCount(ModuleSectionKind::CONSTANTS, sizeof(ModuleConstant));
+        }
+
+        bool CompiledModule::ReadConstant(uint32_t index, VMValue& value) const {
+            value = VMValue{};
+
+            const uint32_t int_count = GetSectionEntryCount(ModuleSectionKind::INT_CONSTANTS, sizeof(int64_t));
+            if (index < int_count) {
+                uint32_t count = 0;
+                const int64_t* ints = GetIntConstants(count);
+                if (!ints) return false;
+                value = VMValue(ints[index]);
+                return true;
+            }
+            index -= int_count;
+
+            const uint32_t double_count = GetSectionEntryCount(ModuleSectionKind::DOUBLE_CONSTANTS, sizeof(double));
+            if (index < double_count) {
+                uint32_t count = 0;
+                const double* doubles = GetDoubleConstants(count);
+                if (!doubles) return false;
+                value = VMValue(doubles[index]);
+                return true;
+            }
+            index -= double_count;
+
+            const uint32_t string_count = GetSectionEntryCount(ModuleSectionKind::STRING_CONSTANTS, sizeof(ModuleStringRef));
+            if (index < string_count) {
+                uint32_t size = 0;
+                const uint8_t* data = GetSection(ModuleSectionKind::STRING_CONSTANTS, size);
+                if (!data) return false;
+                const ModuleStringRef& ref = reinterpret_cast<const ModuleStringRef*>(data)[index];
+                // Points into the read-only image; string values are never written through
+                value.type = VMDataType::STRING;
+                value.data.string.data = const_cast<char*>(GetString(ref.offset, ref.length));
+                value.data.string.length = ref.length;
+                return true;
+            }
+            index -= string_count;
+
+            uint32_t size = 0;
+            const uint8_t* data = GetSection(ModuleSectionKind::CONSTANTS, size);
+            if (!data || index >= size / sizeof(ModuleConstant)) {
+                return false;
+            }
+
+            const ModuleConstant& constant = reinterpret_cast<const ModuleConstant*>(data)[index];
+            value.type = constant.type;
+            switch (constant.type) {
+                case VMDataType::INT32:
+                    value.data.i32 = static_cast<int32_t>(constant.payload);
+                    break;
+                case VMDataType::INT64:
+                    value.data.i64 = static_cast<int64_t>(constant.payload);
+                    break;
+                case VMDataType::FLOAT32: {
+                    uint32_t bits = static_cast<uint32_t>(constant.payload);
+                    std::memcpy(&value.data.f32, &bits, sizeof(bits));
+                    break;
+                }
+                case VMDataType::FLOAT64:
+                    std::memcpy(&value.data.f64, &constant.payload, sizeof(value.data.f64));
+                    break;
+                case VMDataType::BOOLEAN:
+                    value.data.boolean = constant.payload != 0;
+                    break;
+                case VMDataType::STRING:
+                    value.data.string.data = const_cast<char*>(GetString(static_cast<uint32_t>(constant.payload), constant.length));
+                    value.data.string.length = constant.length;
+                    break;
+                default:
+                    value.type = VMDataType::UNDEFINED;
+                    break;
+            }
+            return true;
+        }
+
+        uint32_t CompiledModule::GetFunctionCount() const {
+            return GetSectionEntryCount(ModuleSectionKind::FUNCTIONS, sizeof(ModuleFunction));
+        }
+
+        bool CompiledModule::ReadFunction(uint32_t index, VMFunction& function) const {
+            uint32_t size = 0;
+            const uint8_t* data = GetSection(ModuleSectionKind::FUNCTIONS, size);
+            if (!data || index >= size / sizeof(ModuleFunction)) {
+                return false;
+            }
+
+            const ModuleFunction& entry = reinterpret_cast<const ModuleFunction*>(data)[index];
+            uint32_t strings_size = 0;
+            const char* strings = reinterpret_cast<const char*>(GetSection(ModuleSectionKind::STRINGS, strings_size));
+
+            function = VMFunction{};
+            function.address = entry.address;
+            function.local_count = entry.local_count;
+            function.param_count = entry.param_count;
+            function.is_native = false;
+            function.native_ptr = nullptr;
+            std::strncpy(function.name, strings + entry.name_offset, sizeof(function.name) - 1);
+            return true;
+        }
+
+        uint32_t CompiledModule::LookupLine(uint32_t pc) const {
+            uint32_t size = 0;
+            const uint8_t* data = GetSection(ModuleSectionKind::DEBUG_LINES, size);
+            if (!data || size == 0) {
+                return 0;
+            }
+
+            const ModuleLineEntry* begin = reinterpret_cast<const ModuleLineEntry*>(data);
+            const ModuleLineEntry* end = begin + size / sizeof(ModuleLineEntry);
+            auto it = std::upper_bound(begin, end, pc,
+                [](uint32_t value, const ModuleLineEntry& entry) { return value < entry.pc; });
+            return it == begin ? 0 : (it - 1)->line;
+        }
+
+        const ModuleAddressEntry* CompiledModule::GetProfileAddresses(uint32_t& count) const {
+            uint32_t size = 0;
+            const uint8_t* data = GetSection(ModuleSectionKind::PROFILE_ADDRESSES, size);
+            count = size / sizeof(ModuleAddressEntry);
+            return count ? reinterpret_cast<const ModuleAddressEntry*>(data) : nullptr;
+        }
+
+        bool CompiledModule::IsInvertedBranch(uint32_t pc) const {
+            uint32_t size = 0;
+            const uint32_t* begin = reinterpret_cast<const uint32_t*>(GetSection(ModuleSectionKind::INVERTED_BRANCHES, size));
+            if (!begin) return false;
+            const uint32_t* end = begin + size / sizeof(uint32_t);
+            return std::binary_search(begin, end, pc);
+        }
+
+        uint32_t CompiledModule::Checksum(const uint8_t* data, size_t size) {
+            // FNV-1a
+            uint32_t hash = 2166136261u;
+            for (size_t i = 0; i < size; ++i) {
+                hash ^= data[i];
+                hash *= 16777619u;
+            }
+            return hash;
+        }
+
+    } // namespace VM
+} // namespace AetherVisor
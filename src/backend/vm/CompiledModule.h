@@ -0,0 +1,172 @@
+#pragma once
+
+#include "VMOpcodes.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+namespace AetherVisor {
+    namespace VM {
+
+        struct CompilationContext;
+
+        // On-disk compiled module layout (little-endian, offsets from image start):
+        //   ModuleHeader | ModuleSection[section_count] | section payloads (8-byte aligned)
+        // Every structure is fixed-size and naturally aligned so a read-only mapping
+        // of the file can be used in place.
+        constexpr uint8_t kModuleMagic[4] = { 0xAE, 0x7E, 0xE7, 0x5E };
+        constexpr uint16_t kModuleFormatVersion = 5;
+
+        // Constant indices are laid out pool by pool in this order, so a PUSH_CONST
+        // index selects a pool by range and indexes a packed array within it
+        enum class ModuleSectionKind : uint32_t {
+            CODE = 1,               // Raw bytecode, top-level code at entry_point
+            CONSTANTS = 2,          // ModuleConstant[] for values without a packed pool
+            FUNCTIONS = 3,          // ModuleFunction[]
+            STRINGS = 4,            // NUL-terminated string data
+            DEBUG_LINES = 5,        // ModuleLineEntry[] sorted by pc
+            INT_CONSTANTS = 6,      // int64_t[]
+            DOUBLE_CONSTANTS = 7,   // double[]
+            STRING_CONSTANTS = 8,   // ModuleStringRef[]
+            PROFILE_ADDRESSES = 9,  // ModuleAddressEntry[] sorted by pc, after profile-guided layout
+            INVERTED_BRANCHES = 10, // uint32_t[] sorted pcs of conditional branches with the profiled code's sense flipped
+            COUNT
+        };
+
+        enum class ModuleConstantPool : uint8_t {
+            INT,
+            DOUBLE,
+            STRING,
+            OTHER
+        };
+
+        inline ModuleConstantPool GetConstantPool(VMDataType type) {
+            switch (type) {
+                case VMDataType::INT64: return ModuleConstantPool::INT;
+                case VMDataType::FLOAT64: return ModuleConstantPool::DOUBLE;
+                case VMDataType::STRING: return ModuleConstantPool::STRING;
+                default: return ModuleConstantPool::OTHER;
+            }
+        }
+
+        struct ModuleHeader {
+            uint8_t magic[4];
+            uint16_t version;
+            uint16_t section_count;
+            uint32_t flags;
+            uint32_t image_size;
+            uint32_t entry_point;
+            uint32_t header_checksum;   // FNV-1a of header and section table with this field zeroed
+            uint32_t profile_key;       // ExecutionProfile::code_key for profiles of this module
+            uint32_t reserved;
+        };
+
+        struct ModuleSection {
+            ModuleSectionKind kind;
+            uint32_t offset;
+            uint32_t size;
+            uint32_t checksum;          // FNV-1a of the payload, checked on first access
+        };
+
+        struct ModuleConstant {
+            VMDataType type;
+            uint8_t flags;
+            uint16_t reserved;
+            uint32_t length;            // String length in bytes
+            uint64_t payload;           // Integer/float bits, or string offset into STRINGS
+        };
+
+        struct ModuleStringRef {
+            uint32_t offset;            // Offset into STRINGS
+            uint32_t length;
+        };
+
+        struct ModuleFunction {
+            uint32_t address;
+            uint32_t local_count;
+            uint32_t param_count;
+            uint32_t name_offset;       // Offset into STRINGS
+        };
+
+        struct ModuleLineEntry {
+            uint32_t pc;
+            uint32_t line;
+        };
+
+        // Maps an instruction of profile-guided code back to the address the
+        // module's profiles are keyed by
+        struct ModuleAddressEntry {
+            uint32_t pc;
+            uint32_t profile_pc;
+        };
+
+        static_assert(sizeof(ModuleHeader) == 32, "ModuleHeader layout changed");
+        static_assert(sizeof(ModuleSection) == 16, "ModuleSection layout changed");
+        static_assert(sizeof(ModuleConstant) == 16, "ModuleConstant layout changed");
+        static_assert(sizeof(ModuleFunction) == 16, "ModuleFunction layout changed");
+
+        // Read-only view of a compiled module, either memory-mapped from disk or
+        // backed by an owned buffer. Header and section bounds are validated when
+        // the module is opened; section contents are validated on first access.
+        // A module is immutable once opened and may be shared between VMs.
+        class CompiledModule {
+        public:
+            ~CompiledModule();
+
+            CompiledModule(const CompiledModule&) = delete;
+            CompiledModule& operator=(const CompiledModule&) = delete;
+
+            // Loading
+            static std::shared_ptr<CompiledModule> MapFile(const std::string& path, std::string* error = nullptr);
+            static std::shared_ptr<CompiledModule> FromImage(std::vector<uint8_t> image, std::string* error = nullptr);
+            static bool IsModuleImage(const uint8_t* data, size_t size);
+
+            // Writing
+            static std::vector<uint8_t> Serialize(const CompilationContext& context);
+            static bool WriteFile(const std::string& path, const CompilationContext& context);
+
+            // Section access (validated lazily)
+            const ModuleHeader& GetHeader() const { return *reinterpret_cast<const ModuleHeader*>(m_data); }
+            const uint8_t* GetImage() const { return m_data; }
+            size_t GetImageSize() const { return m_size; }
+            bool IsMapped() const { return m_mapping != nullptr; }
+
+            const uint8_t* GetCode(uint32_t& size) const;
+            const int64_t* GetIntConstants(uint32_t& count) const;
+            const double* GetDoubleConstants(uint32_t& count) const;
+            uint32_t GetConstantCount() const;
+            bool ReadConstant(uint32_t index, VMValue& value) const;
+            uint32_t GetFunctionCount() const;
+            bool ReadFunction(uint32_t index, VMFunction& function) const;
+            uint32_t LookupLine(uint32_t pc) const;    // 0 when unknown
+            uint32_t GetProfileKey() const { return GetHeader().profile_key; }
+            const ModuleAddressEntry* GetProfileAddresses(uint32_t& count) const;   // Null when identity
+            bool IsInvertedBranch(uint32_t pc) const;  // Its taken outcome is the profiled branch's not-taken one
+
+            const std::string& GetLastError() const { return m_last_error; }
+
+            static uint32_t Checksum(const uint8_t* data, size_t size);    // FNV-1a
+
+        private:
+            CompiledModule() = default;
+
+            const uint8_t* m_data = nullptr;
+            size_t m_size = 0;
+            std::vector<uint8_t> m_owned;
+            void* m_mapping = nullptr;              // Platform mapping handle/base
+            const ModuleSection* m_sections[static_cast<size_t>(ModuleSectionKind::COUNT)] = {};
+            mutable std::atomic<uint8_t> m_section_state[static_cast<size_t>(ModuleSectionKind::COUNT)] = {};
+            mutable std::string m_last_error;
+
+            bool ValidateHeader();
+            const uint8_t* GetSection(ModuleSectionKind kind, uint32_t& size) const;
+            bool ValidateSectionContents(ModuleSectionKind kind, const uint8_t* data, uint32_t size) const;
+            const char* GetString(uint32_t offset, uint32_t length) const;
+            uint32_t GetSectionEntryCount(ModuleSectionKind kind, size_t entry_size) const;
+        };
+
+    } // namespace VM
+} // namespace AetherVisor
@@ -2,6 +2,9 @@
 #define WIN32_LEAN_AND_MEAN
 #endif
 #include "Compiler.h"
+#include "CompiledModule.h"
+#include "SSA.h"
+#include "BytecodeOptimizer.h"
 #include "../security/XorStr.h"
 #include <sstream>
 #include <stack>
@@ -12,6 +15,12 @@
 #include <chrono>
 #include <random>
 #include <unordered_map>
+#include <unordered_set>
+#include <limits>
+#include <thread>
+#include <atomic>
+#include <array>
+#include <numeric>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -25,6 +34,99 @@ namespace AetherVisor {
 
         // VMValue special members are not defined here; see VMOpcodes.h structure
 
+        namespace {
+            // Runs fn(0..count-1) on a pool of worker threads. Each index is handed out
+            // exactly once, so callers stay deterministic as long as fn(i) only touches
+            // state owned by index i.
+            template <typename Fn>
+            void ParallelFor(size_t count, uint32_t requested_threads, Fn&& fn) {
+                size_t thread_count = requested_threads ? requested_threads : std::thread::hardware_concurrency();
+                thread_count = std::max<size_t>(1, std::min(thread_count, count));
+
+                if (thread_count == 1) {
+                    for (size_t i = 0; i < count; ++i) {
+                        fn(i);
+                    }
+                    return;
+                }
+
+                std::atomic<size_t> next_index{0};
+                auto worker = [&]() {
+                    for (size_t i = next_index++; i < count; i = next_index++) {
+                        fn(i);
+                    }
+                };
+
+                std::vector<std::thread> workers;
+                workers.reserve(thread_count - 1);
+                for (size_t t = 1; t < thread_count; ++t) {
+                    workers.emplace_back(worker);
+                }
+                worker();
+                for (auto& thread : workers) {
+                    thread.join();
+                }
+            }
+
+            uint32_t ReadUInt32(const std::vector<uint8_t>& code, uint32_t offset) {
+                return static_cast<uint32_t>(code[offset]) |
+                       (static_cast<uint32_t>(code[offset + 1]) << 8) |
+                       (static_cast<uint32_t>(code[offset + 2]) << 16) |
+                       (static_cast<uint32_t>(code[offset + 3]) << 24);
+            }
+
+            // Locals stored inside a protected region, and catch variables, must be in
+            // their frame slot when a handler runs, so they are not renamed into SSA
+            void CollectHandlerLocals(const ASTNode* node, bool in_try, std::unordered_set<const Symbol*>& symbols) {
+                if (!node) return;
+                if (in_try) {
+                    if (node->type == ASTNodeType::VAR_DECL && node->symbol && !node->children.empty()) {
+                        symbols.insert(node->symbol);
+                    } else if (node->type == ASTNodeType::ASSIGNMENT && node->children[0]->symbol) {
+                        symbols.insert(node->children[0]->symbol);
+                    }
+                }
+                if (node->type == ASTNodeType::TRY_CATCH) {
+                    CollectHandlerLocals(node->children[0].get(), true, symbols);
+                    if (node->children[1]->symbol) {
+                        symbols.insert(node->children[1]->symbol);
+                    }
+                    CollectHandlerLocals(node->children[2].get(), in_try, symbols);
+                    return;
+                }
+                for (const auto& child : node->children) {
+                    CollectHandlerLocals(child.get(), in_try, symbols);
+                }
+            }
+
+            // Byte-exact key, so 0.0 and -0.0 (and distinct NaN payloads) stay separate constants
+            std::string ConstantKey(const VMValue& value) {
+                std::string key(1, static_cast<char>(value.type));
+                switch (value.type) {
+                    case VMDataType::INT32:
+                    case VMDataType::FLOAT32:
+                        key.append(reinterpret_cast<const char*>(&value.data.i32), sizeof(int32_t));
+                        break;
+                    case VMDataType::INT64:
+                    case VMDataType::FLOAT64:
+                        key.append(reinterpret_cast<const char*>(&value.data.i64), sizeof(int64_t));
+                        break;
+                    case VMDataType::BOOLEAN:
+                        key.push_back(value.data.boolean ? 1 : 0);
+                        break;
+                    case VMDataType::STRING:
+                        key.append(value.data.string.data, value.data.string.length);
+                        break;
+                    case VMDataType::UNDEFINED:
+                        break;
+                    default:
+                        key.append(reinterpret_cast<const char*>(&value.data.ptr), sizeof(void*));
+                        break;
+                }
+                return key;
+            }
+        }
+
         // Scope implementation
         void Scope::DefineSymbol(const std::string& name, const Symbol& symbol) {
             m_symbols[name] = symbol;
@@ -41,6 +143,11 @@ namespace AetherVisor {
             return nullptr;
         }
 
+        Symbol* Scope::LookupLocalSymbol(const std::string& name) {
+            auto it = m_symbols.find(name);
+            return it != m_symbols.end() ? &it->second : nullptr;
+        }
+
         // CompilationContext implementation
         CompilationContext::CompilationContext() {
             global_scope = std::make_unique<Scope>();
@@ -58,8 +165,14 @@ namespace AetherVisor {
             security.max_stack_depth = 1000;
             
             enable_optimization = true;
+            optimization_level = OptimizationLevel::AGGRESSIVE;
             enable_obfuscation = true;
             enable_encryption = true;
+
+            profile_key = 0;
+            compile_threads = 0;
+            function_index = -1;
+            local_count = 0;
         }
 
         // Compiler implementation
@@ -90,14 +203,7 @@ namespace AetherVisor {
                     return false;
                 }
 
-                // Phase 4: Optimization
-                if (context.enable_optimization) {
-                    OptimizeConstantFolding(ast.get());
-                    OptimizeDeadCodeElimination(ast.get());
-                    OptimizeInlining(ast.get(), context);
-                }
-
-                // Phase 5: Code Generation
+                // Phase 4-5: Code Generation, optimising each fragment in SSA form
                 if (!Generate(ast.get(), context)) {
                     context.errors = m_errors;
                     return false;
@@ -116,7 +222,13 @@ namespace AetherVisor {
                     InsertAntiAnalysis(context.bytecode);
                 }
 
-                // Phase 7: Final Optimization (stubbed/no-op here)
+                // Phase 7: Bytecode optimisation, profile-guided when the profile matches
+                context.profile_key = CompiledModule::Checksum(context.bytecode.data(), context.bytecode.size());
+                context.profile_addresses.clear();
+                context.inverted_branches.clear();
+                if (context.enable_optimization) {
+                    OptimizeBytecode(context);
+                }
 
                 context.errors = m_errors;
                 context.warnings = m_warnings;
@@ -130,7 +242,7 @@ namespace AetherVisor {
         }
 
         std::vector<uint8_t> Compiler::GetBytecode(const CompilationContext& context) {
-            return context.bytecode;
+            return CompiledModule::Serialize(context);
         }
 
         // Advanced tokenizer with full language support
@@ -343,6 +455,7 @@ namespace AetherVisor {
         // Advanced recursive descent parser
         std::unique_ptr<ASTNode> Compiler::Parse(const std::vector<Token>& tokens) {
             size_t pos = 0;
+            m_nesting_depth = 0;
             return ParseProgram(tokens, pos);
         }
 
@@ -405,44 +518,2174 @@ namespace AetherVisor {
         }
 
         void Compiler::ReportError(const std::string& message, size_t line, size_t column) {
-            std::string error = XorS("Error");
-            if (line > 0) {
-                error += " at line " + std::to_string(line);
-                if (column > 0) {
-                    error += ", column " + std::to_string(column);
-                }
-            }
-            error += ": " + message;
-            m_errors.push_back(error);
+            m_errors.push_back(FormatDiagnostic(XorS("Error"), message, line, column));
         }
 
         void Compiler::ReportWarning(const std::string& message, size_t line, size_t column) {
-            std::string warning = XorS("Warning");
+            m_warnings.push_back(FormatDiagnostic(XorS("Warning"), message, line, column));
+        }
+
+        std::string Compiler::FormatDiagnostic(const std::string& kind, const std::string& message, size_t line, size_t column) {
+            std::string diagnostic = kind;
             if (line > 0) {
-                warning += " at line " + std::to_string(line);
+                diagnostic += " at line " + std::to_string(line);
                 if (column > 0) {
-                    warning += ", column " + std::to_string(column);
+                    diagnostic += ", column " + std::to_string(column);
                 }
             }
-            warning += ": " + message;
-            m_warnings.push_back(warning);
+            diagnostic += ": " + message;
+            return diagnostic;
         }
 
-        // Stub implementations for large methods (will be implemented separately)
+        // Every nested statement or expression counts towards the nesting limit
         std::unique_ptr<ASTNode> Compiler::ParseStatement(const std::vector<Token>& tokens, size_t& pos) {
-            // Simplified implementation
-            if (pos < tokens.size()) pos++;
-            return std::make_unique<ASTNode>(ASTNodeType::EXPRESSION_STMT);
+            SkipNewlines(tokens, pos);
+            const Token& token = PeekToken(tokens, pos);
+            if (!CheckNesting(m_nesting_depth + 1, token.line, token.column)) return nullptr;
+
+            m_nesting_depth++;
+            auto stmt = ParseStatementBody(tokens, pos);
+            m_nesting_depth--;
+            return stmt;
+        }
+
+        std::unique_ptr<ASTNode> Compiler::ParseExpression(const std::vector<Token>& tokens, size_t& pos) {
+            const Token& token = PeekToken(tokens, pos);
+            if (!CheckNesting(m_nesting_depth + 1, token.line, token.column)) return nullptr;
+
+            m_nesting_depth++;
+            auto expr = ParseExpressionBody(tokens, pos);
+            m_nesting_depth--;
+            return expr;
+        }
+
+        bool Compiler::CheckNesting(size_t depth, size_t line, size_t column) {
+            if (depth <= kMaxNestingDepth) {
+                return true;
+            }
+            ReportError(XorS("Nesting too deep"), line, column);
+            return false;
+        }
+
+        // Recursive descent statement parser
+        std::unique_ptr<ASTNode> Compiler::ParseStatementBody(const std::vector<Token>& tokens, size_t& pos) {
+            SkipNewlines(tokens, pos);
+            const Token& token = PeekToken(tokens, pos);
+
+            switch (token.type) {
+                case TokenType::FUNCTION:
+                    return ParseFunctionDecl(tokens, pos);
+                case TokenType::VAR:
+                case TokenType::CONST_KW:
+                    return ParseVariableDecl(tokens, pos);
+                case TokenType::IF:
+                    return ParseIfStatement(tokens, pos);
+                case TokenType::WHILE:
+                    return ParseWhileStatement(tokens, pos);
+                case TokenType::FOR:
+                    return ParseForStatement(tokens, pos);
+                case TokenType::TRY:
+                    return ParseTryCatch(tokens, pos);
+
+                case TokenType::LBRACE: {
+                    auto block = std::make_unique<ASTNode>(ASTNodeType::BLOCK_STMT, token.line, token.column);
+                    pos++;
+                    while (true) {
+                        SkipNewlines(tokens, pos);
+                        const Token& next = PeekToken(tokens, pos);
+                        if (next.type == TokenType::RBRACE) {
+                            pos++;
+                            break;
+                        }
+                        if (next.type == TokenType::EOF_TOKEN) {
+                            ReportError(XorS("Expected '}' to close block"), next.line, next.column);
+                            return nullptr;
+                        }
+                        auto stmt = ParseStatement(tokens, pos);
+                        if (!stmt) return nullptr;
+                        block->children.push_back(std::move(stmt));
+                    }
+                    return block;
+                }
+
+                case TokenType::RETURN:
+                case TokenType::THROW: {
+                    auto stmt = std::make_unique<ASTNode>(
+                        token.type == TokenType::RETURN ? ASTNodeType::RETURN_STMT : ASTNodeType::THROW_STMT,
+                        token.line, token.column);
+                    pos++;
+                    if (!IsStatementEnd(PeekToken(tokens, pos).type)) {
+                        auto value = ParseExpression(tokens, pos);
+                        if (!value) return nullptr;
+                        stmt->children.push_back(std::move(value));
+                    } else if (stmt->type == ASTNodeType::THROW_STMT) {
+                        ReportError(XorS("Expected expression after 'throw'"), token.line, token.column);
+                        return nullptr;
+                    }
+                    if (!ExpectStatementEnd(tokens, pos)) return nullptr;
+                    return stmt;
+                }
+
+                case TokenType::SEMICOLON:
+                    pos++;
+                    return std::make_unique<ASTNode>(ASTNodeType::BLOCK_STMT, token.line, token.column);
+
+                default: {
+                    auto stmt = std::make_unique<ASTNode>(ASTNodeType::EXPRESSION_STMT, token.line, token.column);
+                    auto expr = ParseExpression(tokens, pos);
+                    if (!expr) return nullptr;
+                    stmt->children.push_back(std::move(expr));
+                    if (!ExpectStatementEnd(tokens, pos)) return nullptr;
+                    return stmt;
+                }
+            }
+        }
+
+        // Table-driven Pratt parser. Operators, prefix operators and parentheses are
+        // handled with explicit stacks in a single loop; the height of every operand
+        // is tracked so the tree stays within the nesting limit of the later walks.
+        std::unique_ptr<ASTNode> Compiler::ParseExpressionBody(const std::vector<Token>& tokens, size_t& pos) {
+            PrattState state{tokens, pos};
+
+            while (true) {
+                if (state.expect_operand || state.open_groups > 0) {
+                    SkipNewlines(tokens, pos);
+                }
+                const Token& token = PeekToken(tokens, pos);
+
+                if (state.expect_operand) {
+                    const ParseRule& rule = GetParseRule(token.type);
+                    if (!rule.nud) {
+                        ReportError(std::string(XorS("Unexpected token: ")) + token.value, token.line, token.column);
+                        return nullptr;
+                    }
+                    pos++;
+                    if (!(this->*rule.nud)(state, token)) return nullptr;
+                    continue;
+                }
+
+                if (token.type == TokenType::RPAREN && state.open_groups > 0) {
+                    pos++;
+                    while (!state.operators.back().is_group) {
+                        if (!ReducePrattOperator(state)) return nullptr;
+                    }
+                    state.operators.pop_back();
+                    state.open_groups--;
+                    if (!ParsePostfix(state)) return nullptr;
+                    continue;
+                }
+
+                const ParseRule& rule = GetParseRule(token.type);
+                if (!rule.led) {
+                    break;
+                }
+                pos++;
+                if (!(this->*rule.led)(state, token)) return nullptr;
+            }
+
+            if (state.open_groups > 0) {
+                const Token& token = PeekToken(tokens, pos);
+                ReportError(XorS("Expected ')' after expression"), token.line, token.column);
+                return nullptr;
+            }
+
+            while (!state.operators.empty()) {
+                if (!ReducePrattOperator(state)) return nullptr;
+            }
+            return PopOperand(state, m_expression_height);
+        }
+
+        constexpr std::array<Compiler::ParseRule, Compiler::kTokenTypeCount> Compiler::BuildParseRules() {
+            std::array<ParseRule, kTokenTypeCount> rules{};
+            auto set = [&rules](TokenType type, NudHandler nud, LedHandler led, int precedence, bool right_associative) {
+                rules[static_cast<size_t>(type)] = ParseRule{nud, led, precedence, right_associative};
+            };
+
+            // Operands and prefix forms
+            set(TokenType::INTEGER, &Compiler::NudLiteral, nullptr, 0, false);
+            set(TokenType::FLOAT, &Compiler::NudLiteral, nullptr, 0, false);
+            set(TokenType::STRING, &Compiler::NudLiteral, nullptr, 0, false);
+            set(TokenType::TRUE_LIT, &Compiler::NudLiteral, nullptr, 0, false);
+            set(TokenType::FALSE_LIT, &Compiler::NudLiteral, nullptr, 0, false);
+            set(TokenType::NULL_TOKEN, &Compiler::NudLiteral, nullptr, 0, false);
+            set(TokenType::IDENTIFIER, &Compiler::NudIdentifier, nullptr, 0, false);
+            set(TokenType::LPAREN, &Compiler::NudGroup, nullptr, 0, false);
+            set(TokenType::NOT, &Compiler::NudPrefix, nullptr, kPrefixPrecedence, true);
+            set(TokenType::BIT_NOT, &Compiler::NudPrefix, nullptr, kPrefixPrecedence, true);
+
+            // '-' is both a prefix and an infix operator
+            set(TokenType::MINUS, &Compiler::NudPrefix, &Compiler::LedInfix, 10, false);
+
+            // Infix operators, higher binds tighter
+            set(TokenType::ASSIGN, nullptr, &Compiler::LedInfix, 1, true);
+            set(TokenType::PLUS_ASSIGN, nullptr, &Compiler::LedInfix, 1, true);
+            set(TokenType::MINUS_ASSIGN, nullptr, &Compiler::LedInfix, 1, true);
+            set(TokenType::OR, nullptr, &Compiler::LedInfix, 2, false);
+            set(TokenType::AND, nullptr, &Compiler::LedInfix, 3, false);
+            set(TokenType::BIT_OR, nullptr, &Compiler::LedInfix, 4, false);
+            set(TokenType::BIT_XOR, nullptr, &Compiler::LedInfix, 5, false);
+            set(TokenType::BIT_AND, nullptr, &Compiler::LedInfix, 6, false);
+            set(TokenType::EQUAL, nullptr, &Compiler::LedInfix, 7, false);
+            set(TokenType::NOT_EQUAL, nullptr, &Compiler::LedInfix, 7, false);
+            set(TokenType::LESS_THAN, nullptr, &Compiler::LedInfix, 8, false);
+            set(TokenType::GREATER_THAN, nullptr, &Compiler::LedInfix, 8, false);
+            set(TokenType::LESS_EQUAL, nullptr, &Compiler::LedInfix, 8, false);
+            set(TokenType::GREATER_EQUAL, nullptr, &Compiler::LedInfix, 8, false);
+            set(TokenType::SHL, nullptr, &Compiler::LedInfix, 9, false);
+            set(TokenType::SHR, nullptr, &Compiler::LedInfix, 9, false);
+            set(TokenType::PLUS, nullptr, &Compiler::LedInfix, 10, false);
+            set(TokenType::MULTIPLY, nullptr, &Compiler::LedInfix, 11, false);
+            set(TokenType::DIVIDE, nullptr, &Compiler::LedInfix, 11, false);
+            set(TokenType::MODULO, nullptr, &Compiler::LedInfix, 11, false);
+            return rules;
+        }
+
+        const Compiler::ParseRule& Compiler::GetParseRule(TokenType type) {
+            static constexpr std::array<ParseRule, kTokenTypeCount> rules = BuildParseRules();
+            return rules[static_cast<size_t>(type)];
+        }
+
+        bool Compiler::NudLiteral(PrattState& state, const Token& token) {
+            auto literal = std::make_unique<ASTNode>(ASTNodeType::LITERAL, token.line, token.column);
+            literal->value = token.value;
+            literal->token = token.type;
+            if (!PushOperand(state, std::move(literal), 1)) return false;
+            state.expect_operand = false;
+            return ParsePostfix(state);
+        }
+
+        bool Compiler::NudIdentifier(PrattState& state, const Token& token) {
+            const std::vector<Token>& tokens = state.tokens;
+            size_t& pos = state.pos;
+
+            if (PeekToken(tokens, pos).type != TokenType::LPAREN) {
+                auto identifier = std::make_unique<ASTNode>(ASTNodeType::IDENTIFIER, token.line, token.column);
+                identifier->value = token.value;
+                if (!PushOperand(state, std::move(identifier), 1)) return false;
+                state.expect_operand = false;
+                return ParsePostfix(state);
+            }
+
+            auto call = std::make_unique<ASTNode>(ASTNodeType::FUNCTION_CALL, token.line, token.column);
+            call->value = token.value;
+            size_t height = 1;
+            pos++;
+            SkipNewlines(tokens, pos);
+            if (PeekToken(tokens, pos).type != TokenType::RPAREN) {
+                while (true) {
+                    auto arg = ParseExpression(tokens, pos);
+                    if (!arg) return false;
+                    height = std::max(height, m_expression_height + 1);
+                    call->children.push_back(std::move(arg));
+                    SkipNewlines(tokens, pos);
+                    if (PeekToken(tokens, pos).type != TokenType::COMMA) break;
+                    pos++;
+                }
+            }
+            if (!Expect(tokens, pos, TokenType::RPAREN, XorS("Expected ')' after arguments"))) return false;
+
+            if (!PushOperand(state, std::move(call), height)) return false;
+            state.expect_operand = false;
+            return ParsePostfix(state);
+        }
+
+        bool Compiler::NudGroup(PrattState& state, const Token& token) {
+            if (!CheckNesting(m_nesting_depth + state.open_groups + 1, token.line, token.column)) return false;
+            PrattOperator group{};
+            group.token = &token;
+            group.is_group = true;
+            state.operators.push_back(group);
+            state.open_groups++;
+            return true;
+        }
+
+        bool Compiler::NudPrefix(PrattState& state, const Token& token) {
+            PrattOperator prefix{};
+            prefix.token = &token;
+            prefix.precedence = kPrefixPrecedence;
+            prefix.is_prefix = true;
+            state.operators.push_back(prefix);
+            return true;
+        }
+
+        bool Compiler::LedInfix(PrattState& state, const Token& token) {
+            const ParseRule& rule = GetParseRule(token.type);
+
+            // Fold everything on the stack that binds at least as tightly as this operator
+            while (!state.operators.empty()) {
+                const PrattOperator& top = state.operators.back();
+                if (top.is_group) break;
+                if (top.precedence < rule.precedence) break;
+                if (top.precedence == rule.precedence && rule.right_associative) break;
+                if (!ReducePrattOperator(state)) return false;
+            }
+
+            PrattOperator infix{};
+            infix.token = &token;
+            infix.precedence = rule.precedence;
+            state.operators.push_back(infix);
+            state.expect_operand = true;
+            return true;
+        }
+
+        bool Compiler::ReducePrattOperator(PrattState& state) {
+            PrattOperator op = state.operators.back();
+            state.operators.pop_back();
+            const Token& token = *op.token;
+
+            if (op.is_prefix) {
+                auto node = std::make_unique<ASTNode>(ASTNodeType::UNARY_OP, token.line, token.column);
+                node->value = token.value;
+                node->token = token.type;
+                size_t height = 0;
+                node->children.push_back(PopOperand(state, height));
+                return PushOperand(state, std::move(node), height + 1);
+            }
+
+            size_t right_height = 0;
+            size_t left_height = 0;
+            auto right = PopOperand(state, right_height);
+            auto left = PopOperand(state, left_height);
+
+            bool is_assignment = token.type == TokenType::ASSIGN ||
+                                 token.type == TokenType::PLUS_ASSIGN ||
+                                 token.type == TokenType::MINUS_ASSIGN;
+            if (is_assignment && left->type != ASTNodeType::IDENTIFIER && left->type != ASTNodeType::ARRAY_ACCESS) {
+                ReportError(XorS("Invalid assignment target"), token.line, token.column);
+                return false;
+            }
+
+            auto node = std::make_unique<ASTNode>(is_assignment ? ASTNodeType::ASSIGNMENT : ASTNodeType::BINARY_OP,
+                                                  token.line, token.column);
+            node->value = token.value;
+            node->token = token.type;
+            node->children.push_back(std::move(left));
+            node->children.push_back(std::move(right));
+            return PushOperand(state, std::move(node), std::max(left_height, right_height) + 1);
+        }
+
+        bool Compiler::PushOperand(PrattState& state, std::unique_ptr<ASTNode> node, size_t height) {
+            if (!CheckNesting(m_nesting_depth + height, node->line, node->column)) return false;
+            state.operands.push_back(std::move(node));
+            state.heights.push_back(height);
+            return true;
+        }
+
+        std::unique_ptr<ASTNode> Compiler::PopOperand(PrattState& state, size_t& height) {
+            auto node = std::move(state.operands.back());
+            state.operands.pop_back();
+            height = state.heights.back();
+            state.heights.pop_back();
+            return node;
+        }
+
+        // Postfix index and member access on the most recent operand
+        bool Compiler::ParsePostfix(PrattState& state) {
+            const std::vector<Token>& tokens = state.tokens;
+            size_t& pos = state.pos;
+
+            while (true) {
+                const Token& next = PeekToken(tokens, pos);
+                if (next.type == TokenType::LBRACKET) {
+                    pos++;
+                    auto index = ParseExpression(tokens, pos);
+                    if (!index) return false;
+                    if (!Expect(tokens, pos, TokenType::RBRACKET, XorS("Expected ']' after index"))) return false;
+
+                    const size_t index_height = m_expression_height;
+                    size_t height = 0;
+                    auto access = std::make_unique<ASTNode>(ASTNodeType::ARRAY_ACCESS, next.line, next.column);
+                    access->children.push_back(PopOperand(state, height));
+                    access->children.push_back(std::move(index));
+                    if (!PushOperand(state, std::move(access), std::max(height, index_height) + 1)) return false;
+                } else if (next.type == TokenType::DOT) {
+                    pos++;
+                    const Token& member = PeekToken(tokens, pos);
+                    if (member.type != TokenType::IDENTIFIER) {
+                        ReportError(XorS("Expected member name after '.'"), member.line, member.column);
+                        return false;
+                    }
+                    pos++;
+
+                    auto access = std::make_unique<ASTNode>(ASTNodeType::MEMBER_ACCESS, next.line, next.column);
+                    access->value = member.value;
+                    size_t height = 0;
+                    access->children.push_back(PopOperand(state, height));
+                    if (!PushOperand(state, std::move(access), height + 1)) return false;
+                } else {
+                    return true;
+                }
+            }
+        }
+
+        std::unique_ptr<ASTNode> Compiler::ParseFunctionDecl(const std::vector<Token>& tokens, size_t& pos) {
+            const Token& keyword = tokens[pos++];
+            const Token& name = PeekToken(tokens, pos);
+            if (name.type != TokenType::IDENTIFIER) {
+                ReportError(XorS("Expected function name"), name.line, name.column);
+                return nullptr;
+            }
+            pos++;
+
+            auto func = std::make_unique<ASTNode>(ASTNodeType::FUNCTION_DECL, keyword.line, keyword.column);
+            func->value = name.value;
+
+            if (!Expect(tokens, pos, TokenType::LPAREN, XorS("Expected '(' after function name"))) return nullptr;
+            if (PeekToken(tokens, pos).type != TokenType::RPAREN) {
+                while (true) {
+                    const Token& param = PeekToken(tokens, pos);
+                    if (param.type != TokenType::IDENTIFIER) {
+                        ReportError(XorS("Expected parameter name"), param.line, param.column);
+                        return nullptr;
+                    }
+                    pos++;
+                    auto node = std::make_unique<ASTNode>(ASTNodeType::IDENTIFIER, param.line, param.column);
+                    node->value = param.value;
+                    func->children.push_back(std::move(node));
+                    if (PeekToken(tokens, pos).type != TokenType::COMMA) break;
+                    pos++;
+                }
+            }
+            if (!Expect(tokens, pos, TokenType::RPAREN, XorS("Expected ')' after parameters"))) return nullptr;
+
+            SkipNewlines(tokens, pos);
+            if (PeekToken(tokens, pos).type != TokenType::LBRACE) {
+                const Token& token = PeekToken(tokens, pos);
+                ReportError(XorS("Expected '{' before function body"), token.line, token.column);
+                return nullptr;
+            }
+            auto body = ParseStatement(tokens, pos);
+            if (!body) return nullptr;
+            func->children.push_back(std::move(body));
+            return func;
+        }
+
+        std::unique_ptr<ASTNode> Compiler::ParseVariableDecl(const std::vector<Token>& tokens, size_t& pos) {
+            const Token& keyword = tokens[pos++];
+            const Token& name = PeekToken(tokens, pos);
+            if (name.type != TokenType::IDENTIFIER) {
+                ReportError(XorS("Expected variable name"), name.line, name.column);
+                return nullptr;
+            }
+            pos++;
+
+            auto decl = std::make_unique<ASTNode>(ASTNodeType::VAR_DECL, keyword.line, keyword.column);
+            decl->value = name.value;
+            decl->token = keyword.type;
+
+            if (PeekToken(tokens, pos).type == TokenType::ASSIGN) {
+                pos++;
+                SkipNewlines(tokens, pos);
+                auto init = ParseExpression(tokens, pos);
+                if (!init) return nullptr;
+                decl->children.push_back(std::move(init));
+            } else if (keyword.type == TokenType::CONST_KW) {
+                ReportError(XorS("Constant declaration requires an initializer"), name.line, name.column);
+                return nullptr;
+            }
+
+            if (!ExpectStatementEnd(tokens, pos)) return nullptr;
+            return decl;
+        }
+
+        std::unique_ptr<ASTNode> Compiler::ParseIfStatement(const std::vector<Token>& tokens, size_t& pos) {
+            const Token& keyword = tokens[pos++];
+            auto stmt = std::make_unique<ASTNode>(ASTNodeType::IF_STMT, keyword.line, keyword.column);
+
+            if (!Expect(tokens, pos, TokenType::LPAREN, XorS("Expected '(' after 'if'"))) return nullptr;
+            auto condition = ParseExpression(tokens, pos);
+            if (!condition) return nullptr;
+            if (!Expect(tokens, pos, TokenType::RPAREN, XorS("Expected ')' after condition"))) return nullptr;
+
+            auto then_branch = ParseStatement(tokens, pos);
+            if (!then_branch) return nullptr;
+            stmt->children.push_back(std::move(condition));
+            stmt->children.push_back(std::move(then_branch));
+
+            size_t lookahead = pos;
+            SkipNewlines(tokens, lookahead);
+            if (PeekToken(tokens, lookahead).type == TokenType::ELSE) {
+                pos = lookahead + 1;
+                auto else_branch = ParseStatement(tokens, pos);
+                if (!else_branch) return nullptr;
+                stmt->children.push_back(std::move(else_branch));
+            }
+            return stmt;
+        }
+
+        std::unique_ptr<ASTNode> Compiler::ParseWhileStatement(const std::vector<Token>& tokens, size_t& pos) {
+            const Token& keyword = tokens[pos++];
+            auto stmt = std::make_unique<ASTNode>(ASTNodeType::WHILE_STMT, keyword.line, keyword.column);
+
+            if (!Expect(tokens, pos, TokenType::LPAREN, XorS("Expected '(' after 'while'"))) return nullptr;
+            auto condition = ParseExpression(tokens, pos);
+            if (!condition) return nullptr;
+            if (!Expect(tokens, pos, TokenType::RPAREN, XorS("Expected ')' after condition"))) return nullptr;
+
+            auto body = ParseStatement(tokens, pos);
+            if (!body) return nullptr;
+            stmt->children.push_back(std::move(condition));
+            stmt->children.push_back(std::move(body));
+            return stmt;
+        }
+
+        // for (init; condition; update) body -- missing clauses become empty blocks
+        std::unique_ptr<ASTNode> Compiler::ParseForStatement(const std::vector<Token>& tokens, size_t& pos) {
+            const Token& keyword = tokens[pos++];
+            auto stmt = std::make_unique<ASTNode>(ASTNodeType::FOR_STMT, keyword.line, keyword.column);
+
+            if (!Expect(tokens, pos, TokenType::LPAREN, XorS("Expected '(' after 'for'"))) return nullptr;
+
+            std::unique_ptr<ASTNode> init;
+            if (PeekToken(tokens, pos).type == TokenType::SEMICOLON) {
+                init = std::make_unique<ASTNode>(ASTNodeType::BLOCK_STMT, keyword.line, keyword.column);
+                pos++;
+            } else {
+                init = ParseStatement(tokens, pos);
+                if (!init) return nullptr;
+            }
+
+            std::unique_ptr<ASTNode> condition;
+            if (PeekToken(tokens, pos).type != TokenType::SEMICOLON) {
+                condition = ParseExpression(tokens, pos);
+                if (!condition) return nullptr;
+            } else {
+                condition = std::make_unique<ASTNode>(ASTNodeType::LITERAL, keyword.line, keyword.column);
+                condition->value = "true";
+                condition->token = TokenType::TRUE_LIT;
+            }
+            if (!Expect(tokens, pos, TokenType::SEMICOLON, XorS("Expected ';' after loop condition"))) return nullptr;
+
+            auto update = std::make_unique<ASTNode>(ASTNodeType::BLOCK_STMT, keyword.line, keyword.column);
+            if (PeekToken(tokens, pos).type != TokenType::RPAREN) {
+                auto expr = ParseExpression(tokens, pos);
+                if (!expr) return nullptr;
+                auto expr_stmt = std::make_unique<ASTNode>(ASTNodeType::EXPRESSION_STMT, expr->line, expr->column);
+                expr_stmt->children.push_back(std::move(expr));
+                update->children.push_back(std::move(expr_stmt));
+            }
+            if (!Expect(tokens, pos, TokenType::RPAREN, XorS("Expected ')' after for clauses"))) return nullptr;
+
+            auto body = ParseStatement(tokens, pos);
+            if (!body) return nullptr;
+
+            stmt->children.push_back(std::move(init));
+            stmt->children.push_back(std::move(condition));
+            stmt->children.push_back(std::move(update));
+            stmt->children.push_back(std::move(body));
+            return stmt;
+        }
+
+        // try { } catch (name) { } -- children: try block, catch variable, catch block
+        std::unique_ptr<ASTNode> Compiler::ParseTryCatch(const std::vector<Token>& tokens, size_t& pos) {
+            const Token& keyword = tokens[pos++];
+            auto stmt = std::make_unique<ASTNode>(ASTNodeType::TRY_CATCH, keyword.line, keyword.column);
+
+            SkipNewlines(tokens, pos);
+            if (PeekToken(tokens, pos).type != TokenType::LBRACE) {
+                ReportError(XorS("Expected '{' after 'try'"), keyword.line, keyword.column);
+                return nullptr;
+            }
+            auto try_block = ParseStatement(tokens, pos);
+            if (!try_block) return nullptr;
+
+            SkipNewlines(tokens, pos);
+            if (!Expect(tokens, pos, TokenType::CATCH, XorS("Expected 'catch' after try block"))) return nullptr;
+
+            auto variable = std::make_unique<ASTNode>(ASTNodeType::IDENTIFIER, keyword.line, keyword.column);
+            if (PeekToken(tokens, pos).type == TokenType::LPAREN) {
+                pos++;
+                const Token& name = PeekToken(tokens, pos);
+                if (name.type != TokenType::IDENTIFIER) {
+                    ReportError(XorS("Expected catch variable name"), name.line, name.column);
+                    return nullptr;
+                }
+                variable->value = name.value;
+                pos++;
+                if (!Expect(tokens, pos, TokenType::RPAREN, XorS("Expected ')' after catch variable"))) return nullptr;
+            }
+
+            SkipNewlines(tokens, pos);
+            if (PeekToken(tokens, pos).type != TokenType::LBRACE) {
+                ReportError(XorS("Expected '{' after 'catch'"), keyword.line, keyword.column);
+                return nullptr;
+            }
+            auto catch_block = ParseStatement(tokens, pos);
+            if (!catch_block) return nullptr;
+
+            stmt->children.push_back(std::move(try_block));
+            stmt->children.push_back(std::move(variable));
+            stmt->children.push_back(std::move(catch_block));
+            return stmt;
+        }
+
+        bool Compiler::Expect(const std::vector<Token>& tokens, size_t& pos, TokenType type, const std::string& message) {
+            const Token& token = PeekToken(tokens, pos);
+            if (token.type != type) {
+                ReportError(message, token.line, token.column);
+                return false;
+            }
+            pos++;
+            return true;
+        }
+
+        bool Compiler::ExpectStatementEnd(const std::vector<Token>& tokens, size_t& pos) {
+            const Token& token = PeekToken(tokens, pos);
+            if (token.type == TokenType::SEMICOLON || token.type == TokenType::NEWLINE) {
+                pos++;
+                return true;
+            }
+            if (token.type == TokenType::RBRACE || token.type == TokenType::EOF_TOKEN) {
+                return true;
+            }
+            ReportError(std::string(XorS("Expected ';' but found: ")) + token.value, token.line, token.column);
+            return false;
+        }
+
+        bool Compiler::IsStatementEnd(TokenType type) {
+            return type == TokenType::SEMICOLON || type == TokenType::NEWLINE ||
+                   type == TokenType::RBRACE || type == TokenType::EOF_TOKEN;
+        }
+
+        const Token& Compiler::PeekToken(const std::vector<Token>& tokens, size_t pos) {
+            // Tokenize always terminates the stream with EOF_TOKEN
+            return pos < tokens.size() ? tokens[pos] : tokens.back();
+        }
+
+        void Compiler::SkipNewlines(const std::vector<Token>& tokens, size_t& pos) {
+            while (pos < tokens.size() && tokens[pos].type == TokenType::NEWLINE) {
+                pos++;
+            }
+        }
+
+        // Semantic analysis: global declarations are collected serially, then every
+        // fragment (top-level code and each top-level function) is resolved in parallel
+        bool Compiler::Analyze(ASTNode* ast, CompilationContext& context) {
+            if (!ast || ast->type != ASTNodeType::PROGRAM) {
+                ReportError(XorS("Analyze expects a program node"));
+                return false;
+            }
+
+            if (!BuildFragments(ast, context)) {
+                return false;
+            }
+
+            ParallelFor(context.fragments.size(), context.compile_threads, [this, &context](size_t index) {
+                CompilationContext& fragment = *context.fragments[index];
+                try {
+                    AnalyzeFragment(fragment);
+                } catch (const std::exception& e) {
+                    fragment.errors.push_back(std::string(XorS("Analysis failed: ")) + e.what());
+                }
+            });
+
+            // Merge diagnostics in source order so output does not depend on scheduling
+            bool success = true;
+            for (const auto& fragment : context.fragments) {
+                m_errors.insert(m_errors.end(), fragment->errors.begin(), fragment->errors.end());
+                m_warnings.insert(m_warnings.end(), fragment->warnings.begin(), fragment->warnings.end());
+                success = success && fragment->errors.empty();
+                fragment->errors.clear();
+                fragment->warnings.clear();
+            }
+            return ResolveSymbols(context) && success;
+        }
+
+        bool Compiler::BuildFragments(ASTNode* ast, CompilationContext& context) {
+            context.fragments.clear();
+            context.functions.clear();
+
+            auto main_fragment = std::make_unique<CompilationContext>();
+            main_fragment->function_index = -1;
+            context.fragments.push_back(std::move(main_fragment));
+
+            // Function table indices follow declaration order
+            for (auto& child : ast->children) {
+                if (child->type != ASTNodeType::FUNCTION_DECL) {
+                    context.fragments[0]->unit_nodes.push_back(child.get());
+                    DeclareGlobals(child.get(), context);
+                    continue;
+                }
+
+                if (context.global_scope->LookupLocalSymbol(child->value)) {
+                    ReportError(std::string(XorS("Duplicate declaration: ")) + child->value, child->line, child->column);
+                    continue;
+                }
+
+                VMFunction function{};
+                function.param_count = static_cast<uint32_t>(child->children.size() - 1);
+                function.is_native = false;
+                function.native_ptr = nullptr;
+                std::strncpy(function.name, child->value.c_str(), sizeof(function.name) - 1);
+
+                Symbol symbol{};
+                symbol.name = child->value;
+                symbol.type = VMDataType::FUNCTION;
+                symbol.address = static_cast<uint32_t>(context.functions.size());
+                symbol.is_global = true;
+                symbol.is_function = true;
+                context.global_scope->DefineSymbol(child->value, symbol);
+                child->symbol = context.global_scope->LookupLocalSymbol(child->value);
+
+                auto fragment = std::make_unique<CompilationContext>();
+                fragment->function_index = static_cast<int32_t>(context.functions.size());
+                fragment->unit_nodes.push_back(child.get());
+                context.fragments.push_back(std::move(fragment));
+                context.functions.push_back(function);
+            }
+
+            for (auto& fragment : context.fragments) {
+                fragment->current_scope = context.global_scope.get();
+                fragment->enable_optimization = context.enable_optimization;
+            }
+            return m_errors.empty();
         }
 
-        bool Compiler::Analyze(ASTNode* ast, CompilationContext& context) { return true; }
-        bool Compiler::Generate(ASTNode* ast, CompilationContext& context) { 
-            context.bytecode.push_back(static_cast<uint8_t>(VMOpcode::HALT));
-            return true; 
+        // Top-level variables live in global slots wherever they are declared outside a function.
+        // A const declared once, directly at the top level, with a literal is
+        // read as that literal, so flags fold inside functions too.
+        void Compiler::DeclareGlobals(ASTNode* node, CompilationContext& context, bool top_level) {
+            if (!node || node->type == ASTNodeType::FUNCTION_DECL) {
+                return;
+            }
+
+            ASTNode* declared = nullptr;
+            if (node->type == ASTNodeType::VAR_DECL) {
+                declared = node;
+            } else if (node->type == ASTNodeType::TRY_CATCH && !node->children[1]->value.empty()) {
+                declared = node->children[1].get();
+            }
+
+            if (declared) {
+                Symbol* existing = context.global_scope->LookupLocalSymbol(declared->value);
+                if (existing && existing->is_function) {
+                    ReportError(std::string(XorS("Duplicate declaration: ")) + declared->value, declared->line, declared->column);
+                } else if (existing) {
+                    existing->initializer = nullptr;
+                } else {
+                    Symbol symbol{};
+                    symbol.name = declared->value;
+                    symbol.type = VMDataType::UNDEFINED;
+                    symbol.address = context.global_scope->AllocateAddress();
+                    symbol.is_global = true;
+                    symbol.is_constant = declared->token == TokenType::CONST_KW;
+                    if (top_level && symbol.is_constant && declared == node && !node->children.empty() &&
+                        node->children[0]->type == ASTNodeType::LITERAL) {
+                        symbol.initializer = node->children[0].get();
+                    }
+                    context.global_scope->DefineSymbol(declared->value, symbol);
+                }
+            }
+
+            for (auto& child : node->children) {
+                DeclareGlobals(child.get(), context, false);
+            }
         }
-        void Compiler::OptimizeConstantFolding(ASTNode* ast) {}
-        void Compiler::OptimizeDeadCodeElimination(ASTNode* ast) {}
-        void Compiler::OptimizeInlining(ASTNode* ast, CompilationContext& context) {}
+
+        bool Compiler::AnalyzeFragment(CompilationContext& fragment) {
+            ASTNode* root = fragment.unit_nodes.empty() ? nullptr : fragment.unit_nodes.front();
+
+            if (fragment.function_index >= 0) {
+                // Parameters occupy the first local slots
+                fragment.scopes.push_back(std::make_unique<Scope>(fragment.current_scope));
+                fragment.current_scope = fragment.scopes.back().get();
+
+                for (size_t i = 0; i + 1 < root->children.size(); ++i) {
+                    ASTNode* param = root->children[i].get();
+                    if (fragment.current_scope->LookupLocalSymbol(param->value)) {
+                        ReportError(fragment, std::string(XorS("Duplicate parameter: ")) + param->value, param);
+                        continue;
+                    }
+                    Symbol symbol{};
+                    symbol.name = param->value;
+                    symbol.type = VMDataType::UNDEFINED;
+                    symbol.address = fragment.local_count++;
+                    fragment.current_scope->DefineSymbol(param->value, symbol);
+                    param->symbol = fragment.current_scope->LookupLocalSymbol(param->value);
+                }
+
+                AnalyzeNode(root->children.back().get(), fragment);
+            } else {
+                for (ASTNode* node : fragment.unit_nodes) {
+                    AnalyzeNode(node, fragment);
+                }
+            }
+
+            return fragment.errors.empty() && CheckTypes(fragment);
+        }
+
+        bool Compiler::AnalyzeNode(ASTNode* node, CompilationContext& context) {
+            if (!node) return true;
+            const bool in_function = context.function_index >= 0;
+
+            switch (node->type) {
+                case ASTNodeType::FUNCTION_DECL:
+                    ReportError(context, XorS("Nested function declarations are not supported"), node);
+                    return false;
+
+                case ASTNodeType::BLOCK_STMT: {
+                    if (!in_function) break;
+                    context.scopes.push_back(std::make_unique<Scope>(context.current_scope));
+                    Scope* saved = context.current_scope;
+                    context.current_scope = context.scopes.back().get();
+                    for (auto& child : node->children) {
+                        AnalyzeNode(child.get(), context);
+                    }
+                    context.current_scope = saved;
+                    return true;
+                }
+
+                case ASTNodeType::VAR_DECL: {
+                    // Initializer is resolved before the name comes into scope
+                    for (auto& child : node->children) {
+                        AnalyzeNode(child.get(), context);
+                    }
+                    if (!in_function) {
+                        node->symbol = context.current_scope->LookupSymbol(node->value);
+                        return node->symbol != nullptr;
+                    }
+                    if (context.current_scope->LookupLocalSymbol(node->value)) {
+                        ReportError(context, std::string(XorS("Duplicate declaration: ")) + node->value, node);
+                        return false;
+                    }
+                    Symbol symbol{};
+                    symbol.name = node->value;
+                    symbol.type = VMDataType::UNDEFINED;
+                    symbol.address = context.local_count++;
+                    symbol.is_constant = node->token == TokenType::CONST_KW;
+                    context.current_scope->DefineSymbol(node->value, symbol);
+                    node->symbol = context.current_scope->LookupLocalSymbol(node->value);
+                    return true;
+                }
+
+                case ASTNodeType::IDENTIFIER: {
+                    node->symbol = context.current_scope->LookupSymbol(node->value);
+                    if (!node->symbol) {
+                        ReportError(context, std::string(XorS("Undefined identifier: ")) + node->value, node);
+                        return false;
+                    }
+                    if (node->symbol->is_function) {
+                        ReportError(context, std::string(XorS("Function used as a value: ")) + node->value, node);
+                        return false;
+                    }
+                    return true;
+                }
+
+                case ASTNodeType::ASSIGNMENT: {
+                    ASTNode* target = node->children[0].get();
+                    for (auto& child : node->children) {
+                        AnalyzeNode(child.get(), context);
+                    }
+                    if (target->type == ASTNodeType::IDENTIFIER && target->symbol && target->symbol->is_constant) {
+                        ReportError(context, std::string(XorS("Assignment to constant: ")) + target->value, node);
+                        return false;
+                    }
+                    return true;
+                }
+
+                case ASTNodeType::FUNCTION_CALL: {
+                    for (auto& child : node->children) {
+                        AnalyzeNode(child.get(), context);
+                    }
+                    // Unresolved names are bound to registered native functions at runtime
+                    Symbol* symbol = context.current_scope->LookupSymbol(node->value);
+                    if (symbol && !symbol->is_function) {
+                        ReportError(context, std::string(XorS("Not a function: ")) + node->value, node);
+                        return false;
+                    }
+                    node->symbol = symbol;
+                    return true;
+                }
+
+                case ASTNodeType::MEMBER_ACCESS:
+                    ReportError(context, XorS("Member access is not supported"), node);
+                    return false;
+
+                case ASTNodeType::TRY_CATCH: {
+                    AnalyzeNode(node->children[0].get(), context);
+                    ASTNode* variable = node->children[1].get();
+                    if (!variable->value.empty()) {
+                        if (in_function) {
+                            context.scopes.push_back(std::make_unique<Scope>(context.current_scope));
+                            Scope* saved = context.current_scope;
+                            context.current_scope = context.scopes.back().get();
+                            Symbol symbol{};
+                            symbol.name = variable->value;
+                            symbol.type = VMDataType::UNDEFINED;
+                            symbol.address = context.local_count++;
+                            context.current_scope->DefineSymbol(variable->value, symbol);
+                            variable->symbol = context.current_scope->LookupLocalSymbol(variable->value);
+                            AnalyzeNode(node->children[2].get(), context);
+                            context.current_scope = saved;
+                            return true;
+                        }
+                        variable->symbol = context.current_scope->LookupSymbol(variable->value);
+                        if (!variable->symbol) {
+                            ReportError(context, std::string(XorS("Undefined catch variable: ")) + variable->value, variable);
+                        }
+                    }
+                    AnalyzeNode(node->children[2].get(), context);
+                    return true;
+                }
+
+                default:
+                    break;
+            }
+
+            for (auto& child : node->children) {
+                AnalyzeNode(child.get(), context);
+            }
+            return true;
+        }
+
+        // Annotates every expression in the fragment with its proven type and
+        // records the type of each store. Locals are private to the fragment, so
+        // their summary type is settled here; globals are settled by ResolveSymbols.
+        bool Compiler::CheckTypes(CompilationContext& fragment) {
+            TypeEnvironment env;
+            ASTNode* root = fragment.unit_nodes.empty() ? nullptr : fragment.unit_nodes.front();
+
+            if (fragment.function_index >= 0) {
+                for (size_t i = 0; i + 1 < root->children.size(); ++i) {
+                    RecordStore(root->children[i]->symbol, VMDataType::UNDEFINED, env, fragment);
+                }
+                InferStatement(root->children.back().get(), env, fragment);
+            } else {
+                for (ASTNode* node : fragment.unit_nodes) {
+                    InferStatement(node, env, fragment);
+                }
+            }
+
+            std::unordered_map<Symbol*, VMDataType> summary;
+            for (const auto& store : fragment.symbol_stores) {
+                if (store.first->is_global) continue;
+                auto inserted = summary.emplace(store.first, store.second);
+                if (!inserted.second) {
+                    inserted.first->second = JoinTypes(inserted.first->second, store.second);
+                }
+            }
+            for (const auto& entry : summary) {
+                entry.first->type = entry.second;
+            }
+            return fragment.errors.empty();
+        }
+
+        // Globals can be stored from any fragment; their summary is merged serially
+        bool Compiler::ResolveSymbols(CompilationContext& context) {
+            std::unordered_map<Symbol*, VMDataType> summary;
+            for (auto& fragment : context.fragments) {
+                for (const auto& store : fragment->symbol_stores) {
+                    if (!store.first->is_global) continue;
+                    auto inserted = summary.emplace(store.first, store.second);
+                    if (!inserted.second) {
+                        inserted.first->second = JoinTypes(inserted.first->second, store.second);
+                    }
+                }
+                fragment->symbol_stores.clear();
+            }
+            for (const auto& entry : summary) {
+                entry.first->type = entry.second;
+            }
+            return true;
+        }
+
+        void Compiler::InferStatement(ASTNode* stmt, TypeEnvironment& env, CompilationContext& fragment) {
+            if (!stmt) return;
+
+            switch (stmt->type) {
+                case ASTNodeType::VAR_DECL: {
+                    VMDataType type = stmt->children.empty()
+                        ? VMDataType::UNDEFINED
+                        : InferExpression(stmt->children[0].get(), env, fragment);
+                    RecordStore(stmt->symbol, type, env, fragment);
+                    break;
+                }
+
+                case ASTNodeType::EXPRESSION_STMT:
+                case ASTNodeType::RETURN_STMT:
+                case ASTNodeType::THROW_STMT:
+                    if (!stmt->children.empty()) {
+                        InferExpression(stmt->children[0].get(), env, fragment);
+                    }
+                    break;
+
+                case ASTNodeType::IF_STMT: {
+                    InferExpression(stmt->children[0].get(), env, fragment);
+                    TypeEnvironment else_env = env;
+                    InferStatement(stmt->children[1].get(), env, fragment);
+                    if (stmt->children.size() > 2) {
+                        InferStatement(stmt->children[2].get(), else_env, fragment);
+                    }
+                    JoinEnvironments(env, else_env);
+                    break;
+                }
+
+                // Loops are re-analysed until the entry environment is stable; each
+                // round can only drop entries, so this terminates. The final round
+                // leaves the annotations that hold on every iteration.
+                case ASTNodeType::WHILE_STMT:
+                case ASTNodeType::FOR_STMT: {
+                    const bool is_for = stmt->type == ASTNodeType::FOR_STMT;
+                    if (is_for) {
+                        InferStatement(stmt->children[0].get(), env, fragment);
+                    }
+                    ASTNode* condition = is_for ? stmt->children[1].get() : stmt->children[0].get();
+                    ASTNode* body = is_for ? stmt->children[3].get() : stmt->children[1].get();
+
+                    TypeEnvironment entry = env;
+                    while (true) {
+                        TypeEnvironment exit_env = entry;
+                        InferExpression(condition, exit_env, fragment);
+                        TypeEnvironment back_edge = exit_env;
+                        InferStatement(body, back_edge, fragment);
+                        if (is_for) {
+                            InferStatement(stmt->children[2].get(), back_edge, fragment);
+                        }
+
+                        TypeEnvironment next = entry;
+                        JoinEnvironments(next, back_edge);
+                        if (next == entry) {
+                            env = std::move(exit_env);
+                            break;
+                        }
+                        entry = std::move(next);
+                    }
+                    break;
+                }
+
+                // The handler can be entered from any point in the body
+                case ASTNodeType::TRY_CATCH: {
+                    TypeEnvironment handler_env = env;
+                    InvalidateStores(stmt->children[0].get(), handler_env);
+                    InferStatement(stmt->children[0].get(), env, fragment);
+                    RecordStore(stmt->children[1]->symbol, VMDataType::UNDEFINED, handler_env, fragment);
+                    InferStatement(stmt->children[2].get(), handler_env, fragment);
+                    JoinEnvironments(env, handler_env);
+                    break;
+                }
+
+                default:
+                    for (auto& child : stmt->children) {
+                        InferStatement(child.get(), env, fragment);
+                    }
+                    break;
+            }
+        }
+
+        VMDataType Compiler::InferExpression(ASTNode* expr, TypeEnvironment& env, CompilationContext& fragment) {
+            VMDataType type = VMDataType::UNDEFINED;
+
+            switch (expr->type) {
+                case ASTNodeType::LITERAL:
+                    switch (expr->token) {
+                        case TokenType::INTEGER: {
+                            long long value = std::stoll(expr->value);
+                            type = value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max()
+                                ? VMDataType::INT32 : VMDataType::INT64;
+                            break;
+                        }
+                        case TokenType::FLOAT: type = VMDataType::FLOAT64; break;
+                        case TokenType::STRING: type = VMDataType::STRING; break;
+                        case TokenType::TRUE_LIT:
+                        case TokenType::FALSE_LIT: type = VMDataType::INT32; break;
+                        default: break;
+                    }
+                    break;
+
+                case ASTNodeType::IDENTIFIER: {
+                    auto it = env.find(expr->symbol);
+                    if (it != env.end()) {
+                        type = it->second;
+                    }
+                    break;
+                }
+
+                case ASTNodeType::UNARY_OP: {
+                    VMDataType operand = InferExpression(expr->children[0].get(), env, fragment);
+                    if (expr->token == TokenType::NOT) {
+                        type = VMDataType::INT32;
+                    } else if (operand == VMDataType::STRING) {
+                        ReportWarning(fragment, XorS("Operator cannot be applied to a string"), expr);
+                    } else if (operand == VMDataType::INT32 || operand == VMDataType::INT64 ||
+                               (operand == VMDataType::FLOAT64 && expr->token == TokenType::MINUS)) {
+                        type = operand;
+                    }
+                    break;
+                }
+
+                case ASTNodeType::BINARY_OP: {
+                    VMDataType left = InferExpression(expr->children[0].get(), env, fragment);
+                    if (expr->token == TokenType::AND || expr->token == TokenType::OR) {
+                        // The right operand only runs on one path
+                        TypeEnvironment right_env = env;
+                        VMDataType right = InferExpression(expr->children[1].get(), right_env, fragment);
+                        JoinEnvironments(env, right_env);
+                        type = JoinTypes(left, right);
+                        break;
+                    }
+                    VMDataType right = InferExpression(expr->children[1].get(), env, fragment);
+                    type = BinaryResultType(expr->token, left, right);
+                    if (type == VMDataType::UNDEFINED && expr->token != TokenType::PLUS &&
+                        (left == VMDataType::STRING || right == VMDataType::STRING)) {
+                        ReportWarning(fragment, XorS("Operator cannot be applied to a string"), expr);
+                    }
+                    break;
+                }
+
+                case ASTNodeType::ASSIGNMENT: {
+                    ASTNode* target = expr->children[0].get();
+                    const bool compound = expr->token != TokenType::ASSIGN;
+                    if (target->type == ASTNodeType::ARRAY_ACCESS) {
+                        InferExpression(target->children[0].get(), env, fragment);
+                        InferExpression(target->children[1].get(), env, fragment);
+                        target->value_type = VMDataType::UNDEFINED;
+                    } else if (compound) {
+                        // The target is read before the right-hand side runs
+                        InferExpression(target, env, fragment);
+                    }
+
+                    VMDataType value = InferExpression(expr->children[1].get(), env, fragment);
+                    if (compound) {
+                        TokenType op = expr->token == TokenType::PLUS_ASSIGN ? TokenType::PLUS : TokenType::MINUS;
+                        type = BinaryResultType(op, target->value_type, value);
+                    } else {
+                        type = value;
+                    }
+
+                    if (target->type == ASTNodeType::IDENTIFIER) {
+                        RecordStore(target->symbol, type, env, fragment);
+                    }
+                    break;
+                }
+
+                case ASTNodeType::FUNCTION_CALL:
+                    for (auto& arg : expr->children) {
+                        InferExpression(arg.get(), env, fragment);
+                    }
+                    // A script function may store to any global
+                    if (expr->symbol) {
+                        for (auto it = env.begin(); it != env.end();) {
+                            it = it->first->is_global ? env.erase(it) : std::next(it);
+                        }
+                    }
+                    break;
+
+                default:
+                    for (auto& child : expr->children) {
+                        InferExpression(child.get(), env, fragment);
+                    }
+                    break;
+            }
+
+            expr->value_type = type;
+            return type;
+        }
+
+        void Compiler::RecordStore(Symbol* symbol, VMDataType type, TypeEnvironment& env, CompilationContext& fragment) {
+            if (!symbol) return;
+            fragment.symbol_stores.emplace_back(symbol, type);
+            if (type == VMDataType::UNDEFINED) {
+                env.erase(symbol);
+            } else {
+                env[symbol] = type;
+            }
+        }
+
+        VMDataType Compiler::JoinTypes(VMDataType a, VMDataType b) {
+            return a == b ? a : VMDataType::UNDEFINED;
+        }
+
+        void Compiler::JoinEnvironments(TypeEnvironment& into, const TypeEnvironment& other) {
+            for (auto it = into.begin(); it != into.end();) {
+                auto match = other.find(it->first);
+                it = (match == other.end() || match->second != it->second) ? into.erase(it) : std::next(it);
+            }
+        }
+
+        // Drops every fact the node could overwrite
+        void Compiler::InvalidateStores(const ASTNode* node, TypeEnvironment& env) {
+            if (!node) return;
+
+            if (node->type == ASTNodeType::VAR_DECL && node->symbol) {
+                env.erase(node->symbol);
+            } else if (node->type == ASTNodeType::ASSIGNMENT && node->children[0]->symbol) {
+                env.erase(node->children[0]->symbol);
+            } else if (node->type == ASTNodeType::TRY_CATCH && node->children[1]->symbol) {
+                env.erase(node->children[1]->symbol);
+            } else if (node->type == ASTNodeType::FUNCTION_CALL && node->symbol) {
+                for (auto it = env.begin(); it != env.end();) {
+                    it = it->first->is_global ? env.erase(it) : std::next(it);
+                }
+            }
+
+            for (const auto& child : node->children) {
+                InvalidateStores(child.get(), env);
+            }
+        }
+
+        // Mirrors the VM's generic operator semantics
+        VMDataType Compiler::BinaryResultType(TokenType op, VMDataType left, VMDataType right) {
+            auto is_integer = [](VMDataType type) { return type == VMDataType::INT32 || type == VMDataType::INT64; };
+            auto is_number = [&is_integer](VMDataType type) { return is_integer(type) || type == VMDataType::FLOAT64; };
+
+            switch (op) {
+                case TokenType::EQUAL:
+                case TokenType::NOT_EQUAL:
+                case TokenType::LESS_THAN:
+                case TokenType::GREATER_THAN:
+                case TokenType::LESS_EQUAL:
+                case TokenType::GREATER_EQUAL:
+                    return VMDataType::INT32;
+
+                case TokenType::PLUS:
+                    if (left == VMDataType::STRING || right == VMDataType::STRING) {
+                        return VMDataType::STRING;
+                    }
+                    [[fallthrough]];
+                case TokenType::MINUS:
+                case TokenType::MULTIPLY:
+                case TokenType::DIVIDE:
+                case TokenType::MODULO:
+                    if (!is_number(left) || !is_number(right)) return VMDataType::UNDEFINED;
+                    if (left == VMDataType::FLOAT64 || right == VMDataType::FLOAT64) return VMDataType::FLOAT64;
+                    return left == VMDataType::INT32 && right == VMDataType::INT32 ? VMDataType::INT32 : VMDataType::INT64;
+
+                case TokenType::BIT_AND:
+                case TokenType::BIT_OR:
+                case TokenType::BIT_XOR:
+                case TokenType::SHL:
+                case TokenType::SHR:
+                    if (!is_integer(left) || !is_integer(right)) return VMDataType::UNDEFINED;
+                    return left == VMDataType::INT32 && right == VMDataType::INT32 ? VMDataType::INT32 : VMDataType::INT64;
+
+                default:
+                    return VMDataType::UNDEFINED;
+            }
+        }
+
+        // Code generation: fragments are generated in parallel against their own
+        // bytecode buffer and constant pool, then linked in source order
+        bool Compiler::Generate(ASTNode* ast, CompilationContext& context) {
+            if (context.fragments.empty()) {
+                ReportError(XorS("Generate called before Analyze"));
+                return false;
+            }
+
+            ParallelFor(context.fragments.size(), context.compile_threads, [this, &context](size_t index) {
+                CompilationContext& fragment = *context.fragments[index];
+                try {
+                    GenerateFragment(fragment);
+                } catch (const std::exception& e) {
+                    fragment.errors.push_back(std::string(XorS("Code generation failed: ")) + e.what());
+                }
+            });
+
+            bool success = true;
+            for (const auto& fragment : context.fragments) {
+                m_errors.insert(m_errors.end(), fragment->errors.begin(), fragment->errors.end());
+                m_warnings.insert(m_warnings.end(), fragment->warnings.begin(), fragment->warnings.end());
+                success = success && fragment->errors.empty();
+            }
+
+            success = success && LinkFragments(context);
+            context.fragments.clear();
+            return success;
+        }
+
+        void Compiler::GenerateFragment(CompilationContext& fragment) {
+            SSAFunction function;
+            SSABuildState state{ function, fragment, function.CreateBlock(), 0, {} };
+            function.SealBlock(state.block);
+
+            if (fragment.function_index >= 0) {
+                ASTNode* decl = fragment.unit_nodes.front();
+                CollectHandlerLocals(decl, false, state.memory_symbols);
+                for (size_t i = 0; i + 1 < decl->children.size(); ++i) {
+                    Symbol* param = decl->children[i]->symbol;
+                    if (param && !state.memory_symbols.count(param)) {
+                        function.WriteVariable(param, state.block, function.CreateParameter(param->address));
+                    }
+                }
+                BuildStatement(decl->children.back().get(), state);
+                Terminate(VMOpcode::RET, {}, {}, state);
+            } else {
+                for (ASTNode* node : fragment.unit_nodes) {
+                    BuildStatement(node, state);
+                }
+                Terminate(VMOpcode::HALT, {}, {}, state);
+            }
+
+            if (fragment.enable_optimization) {
+                SSAOptimizer::Optimize(function);
+            }
+            LowerSSA(function, fragment);
+        }
+
+        // Deterministic link: concatenate in source order, rebase absolute addresses
+        // and renumber fragment-local constant indices into the shared pool
+        bool Compiler::LinkFragments(CompilationContext& context) {
+            context.bytecode.clear();
+            context.constant_pool.clear();
+            context.constant_lookup.clear();
+            context.address_relocations.clear();
+            context.constant_relocations.clear();
+            context.constant_indices.clear();
+            context.line_table.clear();
+
+            // Merge fragment pools; constants repeated across fragments are stored once
+            std::vector<std::vector<uint32_t>> constant_maps(context.fragments.size());
+            for (size_t i = 0; i < context.fragments.size(); ++i) {
+                for (const auto& constant : context.fragments[i]->constant_pool) {
+                    constant_maps[i].push_back(AddConstant(constant.value, context));
+                }
+            }
+
+            // Group the pool by type so the module can store each pool packed; the
+            // stable sort keeps first-use order within a pool
+            std::vector<uint32_t> order(context.constant_pool.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::stable_sort(order.begin(), order.end(), [&context](uint32_t a, uint32_t b) {
+                return GetConstantPool(context.constant_pool[a].value.type) < GetConstantPool(context.constant_pool[b].value.type);
+            });
+
+            std::vector<uint32_t> final_index(order.size());
+            std::vector<VMConstant> grouped;
+            grouped.reserve(order.size());
+            for (uint32_t i = 0; i < order.size(); ++i) {
+                final_index[order[i]] = i;
+                grouped.push_back(context.constant_pool[order[i]]);
+            }
+            context.constant_pool = std::move(grouped);
+            context.constant_lookup.clear();
+            for (uint32_t i = 0; i < context.constant_pool.size(); ++i) {
+                context.constant_lookup.emplace(ConstantKey(context.constant_pool[i].value), i);
+            }
+
+            for (size_t f = 0; f < context.fragments.size(); ++f) {
+                CompilationContext& fragment = *context.fragments[f];
+
+                std::vector<uint32_t> wide_offsets;
+                for (size_t i = 0; i < fragment.constant_relocations.size(); ++i) {
+                    fragment.constant_indices[i] = final_index[constant_maps[f][fragment.constant_indices[i]]];
+                    if (fragment.constant_indices[i] > 0xFFFF) {
+                        wide_offsets.push_back(fragment.constant_relocations[i]);
+                    }
+                }
+                if (!wide_offsets.empty()) {
+                    WidenConstantOperands(fragment, wide_offsets);
+                }
+
+                const uint32_t code_base = static_cast<uint32_t>(context.bytecode.size());
+
+                if (fragment.function_index >= 0) {
+                    VMFunction& function = context.functions[fragment.function_index];
+                    function.address = code_base;
+                    function.local_count = fragment.local_count;
+                }
+
+                context.bytecode.insert(context.bytecode.end(), fragment.bytecode.begin(), fragment.bytecode.end());
+
+                for (uint32_t offset : fragment.address_relocations) {
+                    uint32_t patched = code_base + offset;
+                    PatchAddress(patched, ReadUInt32(context.bytecode, patched) + code_base, context);
+                    context.address_relocations.push_back(patched);
+                }
+
+                for (size_t i = 0; i < fragment.constant_relocations.size(); ++i) {
+                    uint32_t patched = code_base + fragment.constant_relocations[i];
+                    uint32_t index = fragment.constant_indices[i];
+                    if (index > 0xFFFF) {
+                        PatchAddress(patched, index, context);
+                    } else {
+                        context.bytecode[patched] = static_cast<uint8_t>(index & 0xFF);
+                        context.bytecode[patched + 1] = static_cast<uint8_t>((index >> 8) & 0xFF);
+                    }
+                    context.constant_relocations.push_back(patched);
+                    context.constant_indices.push_back(index);
+                }
+
+                for (auto& storage : fragment.string_storage) {
+                    context.string_storage.push_back(std::move(storage));
+                }
+                for (const auto& entry : fragment.line_table) {
+                    context.line_table.emplace_back(entry.first + code_base, entry.second);
+                }
+            }
+
+            return true;
+        }
+
+        // Rewrites the PUSH_CONST / CALL_NATIVE instructions whose index operand
+        // starts at each of the given (ascending) offsets into their 32-bit index
+        // forms, shifting every fragment-relative offset and address after them
+        void Compiler::WidenConstantOperands(CompilationContext& fragment, const std::vector<uint32_t>& offsets) {
+            auto shift = [&offsets](uint32_t offset) {
+                auto preceding = std::lower_bound(offsets.begin(), offsets.end(), offset) - offsets.begin();
+                return offset + 2 * static_cast<uint32_t>(preceding);
+            };
+
+            std::vector<uint8_t> code;
+            code.reserve(fragment.bytecode.size() + 2 * offsets.size());
+            uint32_t copied = 0;
+            for (uint32_t offset : offsets) {
+                code.insert(code.end(), fragment.bytecode.begin() + copied, fragment.bytecode.begin() + offset + 2);
+                code.push_back(0);
+                code.push_back(0);
+                copied = offset + 2;
+
+                uint8_t& opcode = code[code.size() - 5];
+                opcode = static_cast<uint8_t>(static_cast<VMOpcode>(opcode) == VMOpcode::CALL_NATIVE
+                    ? VMOpcode::CALL_NATIVE_W : VMOpcode::PUSH_CONST_W);
+            }
+            code.insert(code.end(), fragment.bytecode.begin() + copied, fragment.bytecode.end());
+            fragment.bytecode = std::move(code);
+
+            for (uint32_t& offset : fragment.address_relocations) {
+                offset = shift(offset);
+                PatchAddress(offset, shift(ReadUInt32(fragment.bytecode, offset)), fragment);
+            }
+            for (uint32_t& offset : fragment.constant_relocations) {
+                offset = shift(offset);
+            }
+            for (auto& entry : fragment.line_table) {
+                entry.first = shift(entry.first);
+            }
+        }
+
+        void Compiler::BuildStatement(ASTNode* stmt, SSABuildState& state) {
+            if (stmt->type != ASTNodeType::BLOCK_STMT) {
+                state.line = static_cast<uint32_t>(stmt->line);
+            }
+            SSAFunction& function = state.function;
+
+            switch (stmt->type) {
+                case ASTNodeType::BLOCK_STMT:
+                    for (auto& child : stmt->children) {
+                        BuildStatement(child.get(), state);
+                    }
+                    break;
+
+                case ASTNodeType::VAR_DECL:
+                    if (!stmt->children.empty()) {
+                        WriteSymbol(stmt->symbol, BuildExpression(stmt->children[0].get(), state), state);
+                    }
+                    break;
+
+                // Unused results are popped, or dropped entirely when the value is pure
+                case ASTNodeType::EXPRESSION_STMT:
+                    BuildExpression(stmt->children[0].get(), state);
+                    break;
+
+                case ASTNodeType::IF_STMT: {
+                    SSABlock* then_block = function.CreateBlock();
+                    SSABlock* else_block = stmt->children.size() > 2 ? function.CreateBlock() : nullptr;
+                    SSABlock* join = function.CreateBlock();
+                    BuildCondition(stmt->children[0].get(), then_block, else_block ? else_block : join, state);
+
+                    function.SealBlock(then_block);
+                    state.block = then_block;
+                    BuildStatement(stmt->children[1].get(), state);
+                    Terminate(VMOpcode::JMP, {}, { join }, state);
+
+                    if (else_block) {
+                        function.SealBlock(else_block);
+                        state.block = else_block;
+                        BuildStatement(stmt->children[2].get(), state);
+                        Terminate(VMOpcode::JMP, {}, { join }, state);
+                    }
+                    function.SealBlock(join);
+                    state.block = join;
+                    break;
+                }
+
+                // The header stays unsealed until the back edge exists, so variables
+                // read in the condition pick up a phi for the loop-carried value
+                case ASTNodeType::WHILE_STMT:
+                case ASTNodeType::FOR_STMT: {
+                    const bool is_for = stmt->type == ASTNodeType::FOR_STMT;
+                    if (is_for) {
+                        BuildStatement(stmt->children[0].get(), state);
+                        state.line = static_cast<uint32_t>(stmt->line);
+                    }
+                    SSABlock* header = function.CreateBlock();
+                    SSABlock* body = function.CreateBlock();
+                    SSABlock* exit = function.CreateBlock();
+                    Terminate(VMOpcode::JMP, {}, { header }, state);
+
+                    state.block = header;
+                    BuildCondition(stmt->children[is_for ? 1 : 0].get(), body, exit, state);
+
+                    function.SealBlock(body);
+                    state.block = body;
+                    BuildStatement(stmt->children[is_for ? 3 : 1].get(), state);
+                    if (is_for) {
+                        BuildStatement(stmt->children[2].get(), state);
+                    }
+                    Terminate(VMOpcode::JMP, {}, { header }, state);
+
+                    function.SealBlock(header);
+                    function.SealBlock(exit);
+                    state.block = exit;
+                    break;
+                }
+
+                case ASTNodeType::RETURN_STMT:
+                    if (state.fragment.function_index < 0) {
+                        Terminate(VMOpcode::HALT, {}, {}, state);
+                    } else if (stmt->children.empty()) {
+                        Terminate(VMOpcode::RET, {}, {}, state);
+                    } else {
+                        Terminate(VMOpcode::RET_VAL, { BuildExpression(stmt->children[0].get(), state) }, {}, state);
+                    }
+                    break;
+
+                case ASTNodeType::THROW_STMT:
+                    Terminate(VMOpcode::THROW, { BuildExpression(stmt->children[0].get(), state) }, {}, state);
+                    break;
+
+                // TRY -> body; FINALLY -> join, and handler: CATCH; store -> join
+                case ASTNodeType::TRY_CATCH: {
+                    SSABlock* body = function.CreateBlock();
+                    SSABlock* handler = function.CreateBlock();
+                    SSABlock* join = function.CreateBlock();
+                    Terminate(VMOpcode::TRY, {}, { body, handler }, state);
+                    function.SealBlock(body);
+                    function.SealBlock(handler);
+
+                    state.block = body;
+                    BuildStatement(stmt->children[0].get(), state);
+                    function.Append(state.block, VMOpcode::FINALLY, {}, VMDataType::UNDEFINED, state.line);
+                    Terminate(VMOpcode::JMP, {}, { join }, state);
+
+                    state.block = handler;
+                    state.line = static_cast<uint32_t>(stmt->line);
+                    SSAValue* exception = function.Append(handler, VMOpcode::CATCH, {}, VMDataType::UNDEFINED, state.line);
+                    ASTNode* variable = stmt->children[1].get();
+                    if (variable->symbol) {
+                        WriteSymbol(variable->symbol, exception, state);
+                    }
+                    BuildStatement(stmt->children[2].get(), state);
+                    Terminate(VMOpcode::JMP, {}, { join }, state);
+
+                    function.SealBlock(join);
+                    state.block = join;
+                    break;
+                }
+
+                default:
+                    ReportError(state.fragment, XorS("Unsupported statement"), stmt);
+                    break;
+            }
+        }
+
+        SSAValue* Compiler::BuildExpression(ASTNode* expr, SSABuildState& state) {
+            SSAFunction& function = state.function;
+
+            switch (expr->type) {
+                case ASTNodeType::LITERAL:
+                    switch (expr->token) {
+                        case TokenType::INTEGER: {
+                            long long value = std::stoll(expr->value);
+                            if (value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max()) {
+                                return function.CreateConstant(VMValue(static_cast<int32_t>(value)));
+                            }
+                            return function.CreateConstant(VMValue(static_cast<int64_t>(value)));
+                        }
+                        case TokenType::FLOAT:
+                            return function.CreateConstant(VMValue(std::stod(expr->value)));
+                        case TokenType::STRING:
+                            return function.CreateStringConstant(expr->value);
+                        case TokenType::TRUE_LIT:
+                        case TokenType::FALSE_LIT:
+                            return function.CreateConstant(VMValue(static_cast<int32_t>(expr->token == TokenType::TRUE_LIT ? 1 : 0)));
+                        default:
+                            return function.CreateConstant(VMValue());
+                    }
+
+                case ASTNodeType::IDENTIFIER:
+                    return ReadSymbol(expr->symbol, expr->value_type, state);
+
+                case ASTNodeType::UNARY_OP: {
+                    SSAValue* operand = BuildExpression(expr->children[0].get(), state);
+                    VMOpcode opcode;
+                    switch (expr->token) {
+                        case TokenType::MINUS: opcode = VMOpcode::NEG; break;
+                        case TokenType::NOT: opcode = VMOpcode::NOT; break;
+                        default: opcode = VMOpcode::BIT_NOT; break;
+                    }
+                    return function.Append(state.block, opcode, { operand }, expr->value_type, state.line);
+                }
+
+                case ASTNodeType::BINARY_OP: {
+                    if (expr->token == TokenType::AND || expr->token == TokenType::OR) {
+                        return BuildShortCircuit(expr, state);
+                    }
+
+                    ASTNode* left = expr->children[0].get();
+                    ASTNode* right = expr->children[1].get();
+                    VMDataType operand_type;
+                    VMOpcode opcode = SelectBinaryOpcode(expr->token, left->value_type, right->value_type, operand_type);
+                    if (opcode == VMOpcode::NOP) {
+                        ReportError(state.fragment, std::string(XorS("Unsupported operator: ")) + expr->value, expr);
+                        return function.CreateConstant(VMValue());
+                    }
+                    SSAValue* lhs = BuildConversion(BuildExpression(left, state), left->value_type, operand_type, state);
+                    SSAValue* rhs = BuildConversion(BuildExpression(right, state), right->value_type, operand_type, state);
+                    return function.Append(state.block, opcode, { lhs, rhs }, expr->value_type, state.line);
+                }
+
+                // An assignment's value is the value stored
+                case ASTNodeType::ASSIGNMENT: {
+                    ASTNode* target = expr->children[0].get();
+                    ASTNode* value = expr->children[1].get();
+                    const bool is_array = target->type == ASTNodeType::ARRAY_ACCESS;
+                    if (!is_array && !target->symbol) {
+                        ReportError(state.fragment, XorS("Invalid assignment target"), target);
+                        return function.CreateConstant(VMValue());
+                    }
+
+                    SSAValue* array = nullptr;
+                    SSAValue* index = nullptr;
+                    if (is_array) {
+                        array = BuildExpression(target->children[0].get(), state);
+                        index = BuildExpression(target->children[1].get(), state);
+                    }
+
+                    SSAValue* result;
+                    if (expr->token == TokenType::ASSIGN) {
+                        result = BuildExpression(value, state);
+                    } else {
+                        SSAValue* current = is_array
+                            ? function.Append(state.block, VMOpcode::ARRAY_GET, { array, index }, target->value_type, state.line)
+                            : ReadSymbol(target->symbol, target->value_type, state);
+                        TokenType op = expr->token == TokenType::PLUS_ASSIGN ? TokenType::PLUS : TokenType::MINUS;
+                        VMDataType operand_type;
+                        VMOpcode opcode = SelectBinaryOpcode(op, target->value_type, value->value_type, operand_type);
+                        SSAValue* lhs = BuildConversion(current, target->value_type, operand_type, state);
+                        SSAValue* rhs = BuildConversion(BuildExpression(value, state), value->value_type, operand_type, state);
+                        result = function.Append(state.block, opcode, { lhs, rhs }, expr->value_type, state.line);
+                    }
+
+                    if (is_array) {
+                        return function.Append(state.block, VMOpcode::ARRAY_SET, { array, index, result }, expr->value_type, state.line);
+                    }
+                    WriteSymbol(target->symbol, result, state);
+                    return result;
+                }
+
+                case ASTNodeType::FUNCTION_CALL:
+                    return BuildFunctionCall(expr, state);
+
+                case ASTNodeType::ARRAY_ACCESS: {
+                    SSAValue* array = BuildExpression(expr->children[0].get(), state);
+                    SSAValue* index = BuildExpression(expr->children[1].get(), state);
+                    return function.Append(state.block, VMOpcode::ARRAY_GET, { array, index }, expr->value_type, state.line);
+                }
+
+                default:
+                    ReportError(state.fragment, XorS("Unsupported expression"), expr);
+                    return function.CreateConstant(VMValue());
+            }
+        }
+
+        // Conditions branch directly instead of materialising &&, || and ! results
+        void Compiler::BuildCondition(ASTNode* expr, SSABlock* if_true, SSABlock* if_false, SSABuildState& state) {
+            if (expr->type == ASTNodeType::BINARY_OP && (expr->token == TokenType::AND || expr->token == TokenType::OR)) {
+                SSABlock* next = state.function.CreateBlock();
+                if (expr->token == TokenType::AND) {
+                    BuildCondition(expr->children[0].get(), next, if_false, state);
+                } else {
+                    BuildCondition(expr->children[0].get(), if_true, next, state);
+                }
+                state.function.SealBlock(next);
+                state.block = next;
+                BuildCondition(expr->children[1].get(), if_true, if_false, state);
+                return;
+            }
+
+            if (expr->type == ASTNodeType::UNARY_OP && expr->token == TokenType::NOT) {
+                BuildCondition(expr->children[0].get(), if_false, if_true, state);
+                return;
+            }
+
+            SSAValue* condition = BuildExpression(expr, state);
+            Terminate(VMOpcode::JMP_IF_ZERO, { condition }, { if_true, if_false }, state);
+        }
+
+        // The left operand is the result when it decides the outcome
+        SSAValue* Compiler::BuildShortCircuit(ASTNode* expr, SSABuildState& state) {
+            SSAFunction& function = state.function;
+            SSAValue* left = BuildExpression(expr->children[0].get(), state);
+
+            SSABlock* right_block = function.CreateBlock();
+            SSABlock* join = function.CreateBlock();
+            if (expr->token == TokenType::AND) {
+                Terminate(VMOpcode::JMP_IF_ZERO, { left }, { right_block, join }, state);
+            } else {
+                Terminate(VMOpcode::JMP_IF_ZERO, { left }, { join, right_block }, state);
+            }
+
+            function.SealBlock(right_block);
+            state.block = right_block;
+            SSAValue* right = BuildExpression(expr->children[1].get(), state);
+            Terminate(VMOpcode::JMP, {}, { join }, state);
+
+            function.SealBlock(join);
+            state.block = join;
+            return function.TryRemoveTrivialPhi(function.CreatePhi(join, { left, right }, expr->value_type));
+        }
+
+        // Script functions: CALL <u16 function index>. Anything else is resolved by
+        // name at runtime: CALL_NATIVE <u16 name constant> <u8 argument count>
+        SSAValue* Compiler::BuildFunctionCall(ASTNode* call, SSABuildState& state) {
+            std::vector<SSAValue*> arguments;
+            arguments.reserve(call->children.size());
+            for (auto& arg : call->children) {
+                arguments.push_back(BuildExpression(arg.get(), state));
+            }
+
+            if (call->symbol) {
+                return state.function.Append(state.block, VMOpcode::CALL, arguments, call->value_type, state.line, call->symbol->address);
+            }
+
+            if (call->children.size() > 0xFF) {
+                ReportError(state.fragment, XorS("Too many arguments to native function"), call);
+                return state.function.CreateConstant(VMValue());
+            }
+
+            SSAValue* native = state.function.Append(state.block, VMOpcode::CALL_NATIVE, arguments, call->value_type, state.line,
+                                                     static_cast<uint32_t>(call->children.size()));
+            native->text = call->value;
+            return native;
+        }
+
+        SSAValue* Compiler::BuildConversion(SSAValue* value, VMDataType from, VMDataType to, SSABuildState& state) {
+            if (from == VMDataType::INT32 && to == VMDataType::FLOAT64) {
+                return state.function.Append(state.block, VMOpcode::CAST_FLOAT, { value }, VMDataType::FLOAT64, state.line);
+            }
+            return value;
+        }
+
+        // Globals and handler-visible locals are memory; every other local is an SSA variable
+        SSAValue* Compiler::ReadSymbol(Symbol* symbol, VMDataType type, SSABuildState& state) {
+            if (symbol->initializer) {
+                return BuildExpression(symbol->initializer, state);
+            }
+            if (symbol->is_global) {
+                return state.function.Append(state.block, VMOpcode::LOAD_GLOBAL, {}, type, state.line, symbol->address);
+            }
+            if (state.memory_symbols.count(symbol)) {
+                return state.function.Append(state.block, VMOpcode::LOAD_LOCAL, {}, type, state.line, symbol->address);
+            }
+            return state.function.ReadVariable(symbol, state.block);
+        }
+
+        void Compiler::WriteSymbol(Symbol* symbol, SSAValue* value, SSABuildState& state) {
+            if (symbol->is_global) {
+                state.function.Append(state.block, VMOpcode::STORE_GLOBAL, { value }, VMDataType::UNDEFINED, state.line, symbol->address);
+            } else if (state.memory_symbols.count(symbol)) {
+                state.function.Append(state.block, VMOpcode::STORE_LOCAL, { value }, VMDataType::UNDEFINED, state.line, symbol->address);
+            } else {
+                state.function.WriteVariable(symbol, state.block, value);
+            }
+        }
+
+        // Ends the open block. Code after a return or throw goes into a fresh block
+        // with no predecessors, which is dropped before emission.
+        void Compiler::Terminate(VMOpcode opcode, const std::vector<SSAValue*>& operands, const std::vector<SSABlock*>& successors, SSABuildState& state) {
+            state.function.Append(state.block, opcode, operands, VMDataType::UNDEFINED, state.line);
+            for (SSABlock* successor : successors) {
+                state.function.AddEdge(state.block, successor);
+            }
+            if (successors.empty()) {
+                state.block = state.function.CreateBlock();
+                state.function.SealBlock(state.block);
+            }
+        }
+
+        // Stack bytecode from SSA. Slots for values that cannot stay on the operand
+        // stack come after the function's own locals, or from the global scope for
+        // top-level code.
+        void Compiler::LowerSSA(SSAFunction& function, CompilationContext& fragment) {
+            const SSAStackSchedule schedule = SSAStackSchedule::Build(function);
+            SSALowerState state{ schedule, fragment, std::vector<uint32_t>(function.GetValueCount(), 0), fragment.function_index < 0 };
+
+            for (uint32_t id = 0; id < function.GetValueCount(); ++id) {
+                if (!schedule.needs_slot[id]) continue;
+                state.slots[id] = state.global_slots ? fragment.current_scope->AllocateAddress() : fragment.local_count++;
+                if (state.slots[id] > 0xFFFF) {
+                    ReportError(fragment, XorS("Too many variable slots"), nullptr);
+                    return;
+                }
+            }
+
+            std::vector<uint32_t> block_address(function.GetBlocks().size(), 0);
+            std::vector<std::pair<uint32_t, const SSABlock*>> jumps;     // Operand offset, target block
+            auto emit_jump = [&](VMOpcode opcode, const SSABlock* target) {
+                EmitJump(opcode, 0, fragment);
+                jumps.emplace_back(GetCurrentAddress(fragment) - 4, target);
+            };
+
+            for (size_t i = 0; i < schedule.layout.size(); ++i) {
+                SSABlock* block = schedule.layout[i];
+                const SSABlock* next = i + 1 < schedule.layout.size() ? schedule.layout[i + 1] : nullptr;
+                block_address[block->id] = GetCurrentAddress(fragment);
+
+                for (SSAValue* instruction : block->instructions) {
+                    if (instruction->IsTerminator() || schedule.on_stack[instruction->id]) continue;
+                    EmitLine(instruction->line, fragment);
+                    EmitSSAValue(instruction, state);
+                    if (!instruction->HasResult()) continue;
+                    if (schedule.needs_slot[instruction->id]) {
+                        EmitSlotAccess(true, state.slots[instruction->id], state);
+                    } else {
+                        EmitOpcode(VMOpcode::POP, fragment);
+                    }
+                }
+
+                SSAValue* terminator = block->GetTerminator();
+                EmitLine(terminator->line, fragment);
+
+                // Phi copies: every incoming value is pushed before any slot is written
+                if (block->successors.size() == 1 && !block->successors.front()->phis.empty()) {
+                    const SSABlock* successor = block->successors.front();
+                    const size_t index = static_cast<size_t>(
+                        std::find(successor->predecessors.begin(), successor->predecessors.end(), block) - successor->predecessors.begin());
+                    for (SSAValue* phi : successor->phis) {
+                        EmitSSAOperand(phi->operands[index], state);
+                    }
+                    for (auto it = successor->phis.rbegin(); it != successor->phis.rend(); ++it) {
+                        EmitSlotAccess(true, state.slots[(*it)->id], state);
+                    }
+                }
+
+                switch (terminator->opcode) {
+                    case VMOpcode::JMP:
+                        if (block->successors[0] != next) {
+                            emit_jump(VMOpcode::JMP, block->successors[0]);
+                        }
+                        break;
+
+                    case VMOpcode::JMP_IF_ZERO:
+                        EmitSSAOperand(terminator->operands[0], state);
+                        if (block->successors[0] == next) {
+                            emit_jump(VMOpcode::JMP_IF_ZERO, block->successors[1]);
+                        } else if (block->successors[1] == next) {
+                            emit_jump(VMOpcode::JMP_IF_NOT_ZERO, block->successors[0]);
+                        } else {
+                            emit_jump(VMOpcode::JMP_IF_ZERO, block->successors[1]);
+                            emit_jump(VMOpcode::JMP, block->successors[0]);
+                        }
+                        break;
+
+                    case VMOpcode::TRY:
+                        emit_jump(VMOpcode::TRY, block->successors[1]);
+                        if (block->successors[0] != next) {
+                            emit_jump(VMOpcode::JMP, block->successors[0]);
+                        }
+                        break;
+
+                    default:
+                        EmitSSAValue(terminator, state);
+                        break;
+                }
+            }
+
+            for (const auto& jump : jumps) {
+                PatchAddress(jump.first, block_address[jump.second->id], fragment);
+            }
+        }
+
+        // Emits an instruction together with the operand trees scheduled beneath it
+        void Compiler::EmitSSAValue(SSAValue* value, SSALowerState& state) {
+            CompilationContext& fragment = state.fragment;
+            for (SSAValue* operand : value->operands) {
+                EmitSSAOperand(operand, state);
+            }
+
+            switch (value->opcode) {
+                case VMOpcode::LOAD_LOCAL:
+                case VMOpcode::STORE_LOCAL:
+                case VMOpcode::LOAD_GLOBAL:
+                case VMOpcode::STORE_GLOBAL:
+                case VMOpcode::CALL:
+                    EmitOpcode(value->opcode, fragment);
+                    EmitOperand16(static_cast<uint16_t>(value->immediate), fragment);
+                    break;
+
+                case VMOpcode::CALL_NATIVE: {
+                    uint32_t index = AddStringConstant(value->text, fragment);
+                    EmitOpcode(VMOpcode::CALL_NATIVE, fragment);
+                    fragment.constant_relocations.push_back(GetCurrentAddress(fragment));
+                    fragment.constant_indices.push_back(index);
+                    EmitOperand16(0, fragment); // Pool index is assigned at link time
+                    fragment.bytecode.push_back(static_cast<uint8_t>(value->immediate));
+                    break;
+                }
+
+                default:
+                    EmitOpcode(value->opcode, fragment);
+                    break;
+            }
+        }
+
+        void Compiler::EmitSSAOperand(SSAValue* value, SSALowerState& state) {
+            CompilationContext& fragment = state.fragment;
+            switch (value->kind) {
+                case SSAValueKind::CONSTANT:
+                    if (value->constant.type == VMDataType::INT32) {
+                        EmitOpcode(VMOpcode::PUSH_INT, fragment);
+                        EmitOperand(static_cast<uint32_t>(value->constant.data.i32), fragment);
+                    } else if (value->constant.type == VMDataType::STRING) {
+                        EmitConstant(AddStringConstant(value->text, fragment), fragment);
+                    } else {
+                        EmitConstant(AddConstant(value->constant, fragment), fragment);
+                    }
+                    break;
+
+                case SSAValueKind::PARAMETER:
+                    EmitOpcode(VMOpcode::LOAD_LOCAL, fragment);
+                    EmitOperand16(static_cast<uint16_t>(value->immediate), fragment);
+                    break;
+
+                default:
+                    if (state.schedule.on_stack[value->id]) {
+                        EmitSSAValue(value, state);
+                    } else {
+                        EmitSlotAccess(false, state.slots[value->id], state);
+                    }
+                    break;
+            }
+        }
+
+        void Compiler::EmitSlotAccess(bool store, uint32_t slot, SSALowerState& state) {
+            VMOpcode opcode = state.global_slots
+                ? (store ? VMOpcode::STORE_GLOBAL : VMOpcode::LOAD_GLOBAL)
+                : (store ? VMOpcode::STORE_LOCAL : VMOpcode::LOAD_LOCAL);
+            EmitOpcode(opcode, state.fragment);
+            EmitOperand16(static_cast<uint16_t>(slot), state.fragment);
+        }
+
+        void Compiler::EmitLine(uint32_t line, CompilationContext& context) {
+            if (line == 0 || (!context.line_table.empty() && context.line_table.back().second == line)) return;
+            const uint32_t offset = GetCurrentAddress(context);
+            if (!context.line_table.empty() && context.line_table.back().first == offset) {
+                context.line_table.back().second = line;
+            } else {
+                context.line_table.emplace_back(offset, line);
+            }
+        }
+
+        // Bytecode emission (little-endian operands)
+        void Compiler::EmitOpcode(VMOpcode opcode, CompilationContext& context) {
+            context.bytecode.push_back(static_cast<uint8_t>(opcode));
+        }
+
+        void Compiler::EmitOperand(uint32_t operand, CompilationContext& context) {
+            context.bytecode.push_back(operand & 0xFF);
+            context.bytecode.push_back((operand >> 8) & 0xFF);
+            context.bytecode.push_back((operand >> 16) & 0xFF);
+            context.bytecode.push_back((operand >> 24) & 0xFF);
+        }
+
+        void Compiler::EmitOperand16(uint16_t operand, CompilationContext& context) {
+            context.bytecode.push_back(operand & 0xFF);
+            context.bytecode.push_back((operand >> 8) & 0xFF);
+        }
+
+        void Compiler::EmitJump(VMOpcode opcode, uint32_t target, CompilationContext& context) {
+            EmitOpcode(opcode, context);
+            context.address_relocations.push_back(GetCurrentAddress(context));
+            EmitOperand(target, context);
+        }
+
+        // Emits the 16-bit form; LinkFragments widens it if the final index needs more
+        void Compiler::EmitConstant(uint32_t index, CompilationContext& context) {
+            EmitOpcode(VMOpcode::PUSH_CONST, context);
+            context.constant_relocations.push_back(GetCurrentAddress(context));
+            context.constant_indices.push_back(index);
+            EmitOperand16(0, context);
+        }
+
+        // Uses a type-specialised opcode when both operand types are proven, with
+        // INT32 operands widened to FLOAT64 when mixed with one. operand_type is
+        // the type the operands must be converted to (UNDEFINED for generic opcodes).
+        // Returns NOP for operators without a bytecode form.
+        VMOpcode Compiler::SelectBinaryOpcode(TokenType op, VMDataType left, VMDataType right, VMDataType& operand_type) {
+            struct OperatorForms {
+                TokenType token;
+                VMOpcode generic;
+                VMOpcode int32;
+                VMOpcode float64;
+            };
+            static constexpr OperatorForms kForms[] = {
+                { TokenType::PLUS, VMOpcode::ADD, VMOpcode::ADD_I32, VMOpcode::ADD_F64 },
+                { TokenType::MINUS, VMOpcode::SUB, VMOpcode::SUB_I32, VMOpcode::SUB_F64 },
+                { TokenType::MULTIPLY, VMOpcode::MUL, VMOpcode::MUL_I32, VMOpcode::MUL_F64 },
+                { TokenType::DIVIDE, VMOpcode::DIV, VMOpcode::DIV_I32, VMOpcode::DIV_F64 },
+                { TokenType::MODULO, VMOpcode::MOD, VMOpcode::MOD_I32, VMOpcode::NOP },
+                { TokenType::EQUAL, VMOpcode::CMP_EQ, VMOpcode::CMP_EQ_I32, VMOpcode::CMP_EQ_F64 },
+                { TokenType::NOT_EQUAL, VMOpcode::CMP_NE, VMOpcode::CMP_NE_I32, VMOpcode::CMP_NE_F64 },
+                { TokenType::LESS_THAN, VMOpcode::CMP_LT, VMOpcode::CMP_LT_I32, VMOpcode::CMP_LT_F64 },
+                { TokenType::GREATER_THAN, VMOpcode::CMP_GT, VMOpcode::CMP_GT_I32, VMOpcode::CMP_GT_F64 },
+                { TokenType::LESS_EQUAL, VMOpcode::CMP_LE, VMOpcode::CMP_LE_I32, VMOpcode::CMP_LE_F64 },
+                { TokenType::GREATER_EQUAL, VMOpcode::CMP_GE, VMOpcode::CMP_GE_I32, VMOpcode::CMP_GE_F64 },
+                { TokenType::BIT_AND, VMOpcode::BIT_AND, VMOpcode::NOP, VMOpcode::NOP },
+                { TokenType::BIT_OR, VMOpcode::BIT_OR, VMOpcode::NOP, VMOpcode::NOP },
+                { TokenType::BIT_XOR, VMOpcode::BIT_XOR, VMOpcode::NOP, VMOpcode::NOP },
+                { TokenType::SHL, VMOpcode::SHL, VMOpcode::NOP, VMOpcode::NOP },
+                { TokenType::SHR, VMOpcode::SHR, VMOpcode::NOP, VMOpcode::NOP },
+            };
+
+            operand_type = VMDataType::UNDEFINED;
+            const OperatorForms* forms = nullptr;
+            for (const auto& entry : kForms) {
+                if (entry.token == op) {
+                    forms = &entry;
+                    break;
+                }
+            }
+            if (!forms) {
+                return VMOpcode::NOP;
+            }
+
+            if (op == TokenType::PLUS && left == VMDataType::STRING && right == VMDataType::STRING) {
+                operand_type = VMDataType::STRING;
+                return VMOpcode::STR_CONCAT;
+            }
+
+            const bool left_number = left == VMDataType::INT32 || left == VMDataType::FLOAT64;
+            const bool right_number = right == VMDataType::INT32 || right == VMDataType::FLOAT64;
+            if (left_number && right_number) {
+                const bool is_int = left == VMDataType::INT32 && right == VMDataType::INT32;
+                VMOpcode specialised = is_int ? forms->int32 : forms->float64;
+                if (specialised != VMOpcode::NOP) {
+                    operand_type = is_int ? VMDataType::INT32 : VMDataType::FLOAT64;
+                    return specialised;
+                }
+            }
+            return forms->generic;
+        }
+
+        void Compiler::EmitInstruction(VMOpcode opcode, uint32_t op1, uint32_t op2, uint32_t op3, CompilationContext& context) {
+            EmitOpcode(opcode, context);
+            EmitOperand(op1, context);
+            EmitOperand(op2, context);
+            EmitOperand(op3, context);
+        }
+
+        uint32_t Compiler::AddConstant(const VMValue& value, CompilationContext& context) {
+            auto inserted = context.constant_lookup.emplace(ConstantKey(value), static_cast<uint32_t>(context.constant_pool.size()));
+            if (!inserted.second) {
+                return inserted.first->second;
+            }
+
+            VMConstant constant;
+            constant.type = value.type;
+            constant.value = value;
+            constant.is_encrypted = false;
+            constant.access_count = 0;
+            context.constant_pool.push_back(constant);
+            return inserted.first->second;
+        }
+
+        // Only allocates backing storage the first time a string is seen
+        uint32_t Compiler::AddStringConstant(const std::string& text, CompilationContext& context) {
+            VMValue value;
+            value.type = VMDataType::STRING;
+            value.data.string.data = const_cast<char*>(text.c_str());
+            value.data.string.length = text.size();
+
+            auto it = context.constant_lookup.find(ConstantKey(value));
+            if (it != context.constant_lookup.end()) {
+                return it->second;
+            }
+
+            auto storage = std::make_unique<char[]>(text.size() + 1);
+            std::memcpy(storage.get(), text.c_str(), text.size() + 1);
+            value.data.string.data = storage.get();
+            context.string_storage.push_back(std::move(storage));
+            return AddConstant(value, context);
+        }
+
+        uint32_t Compiler::GetCurrentAddress(const CompilationContext& context) {
+            return static_cast<uint32_t>(context.bytecode.size());
+        }
+
+        void Compiler::PatchAddress(uint32_t address, uint32_t value, CompilationContext& context) {
+            if (address + 4 > context.bytecode.size()) return;
+            context.bytecode[address] = value & 0xFF;
+            context.bytecode[address + 1] = (value >> 8) & 0xFF;
+            context.bytecode[address + 2] = (value >> 16) & 0xFF;
+            context.bytecode[address + 3] = (value >> 24) & 0xFF;
+        }
+
+        void Compiler::ReportError(CompilationContext& fragment, const std::string& message, const ASTNode* node) {
+            fragment.errors.push_back(FormatDiagnostic(XorS("Error"), message, node ? node->line : 0, node ? node->column : 0));
+        }
+
+        void Compiler::ReportWarning(CompilationContext& fragment, const std::string& message, const ASTNode* node) {
+            fragment.warnings.push_back(FormatDiagnostic(XorS("Warning"), message, node ? node->line : 0, node ? node->column : 0));
+        }
+
+        // Runs the bytecode optimiser over the linked code, with the profile when
+        // it was collected from this code. Function and line tables follow the
+        // new addresses, and the inverse map lets the VM report counts against
+        // the code the profile is keyed by.
+        void Compiler::OptimizeBytecode(CompilationContext& context) {
+            BytecodeOptimizer optimizer;
+            optimizer.SetFunctions(context.functions);
+            optimizer.SetGlobalCount(context.global_scope->GetAddressCount());
+            if (context.profile && !context.profile->Empty() && context.profile->code_key == context.profile_key) {
+                optimizer.SetProfile(*context.profile);
+            }
+            std::vector<uint8_t> optimized = optimizer.Optimize(context.bytecode, context.optimization_level);
+            const std::map<uint32_t, uint32_t>& translation = optimizer.GetAddressTranslation();
+            if (translation.empty()) {
+                return; // Optimize kept its input
+            }
+            for (const auto& function : context.functions) {
+                if (translation.find(function.address) == translation.end()) {
+                    ReportWarning(XorS("Bytecode optimisation skipped: function entry was not preserved"));
+                    return;
+                }
+            }
+
+            // Inlining grows the frames of the callers
+            const std::vector<VMFunction>& optimized_functions = optimizer.GetFunctions();
+            for (size_t i = 0; i < context.functions.size(); ++i) {
+                context.functions[i].address = translation.at(context.functions[i].address);
+                context.functions[i].local_count = optimized_functions[i].local_count;
+            }
+
+            // Removed instructions translate to the live one after them, so the
+            // last original address for each new one is the instruction itself.
+            // Block layout moves code, so every instruction takes its own line.
+            std::map<uint32_t, uint32_t> profiled;
+            std::map<uint32_t, uint32_t> line_at;
+            auto line = context.line_table.begin();
+            for (const auto& [original, moved] : translation) {
+                if (moved >= optimized.size()) continue;
+                profiled[moved] = original;
+                while (line != context.line_table.end() && line->first <= original) ++line;
+                if (line != context.line_table.begin()) line_at[moved] = std::prev(line)->second;
+            }
+
+            std::vector<std::pair<uint32_t, uint32_t>> lines;
+            for (const auto& [offset, number] : line_at) {
+                if (lines.empty() || lines.back().second != number) lines.emplace_back(offset, number);
+            }
+            context.line_table = std::move(lines);
+            context.profile_addresses.assign(profiled.begin(), profiled.end());
+
+            // Profiles count these branches' outcomes the way the profiled code has them
+            for (uint32_t original : optimizer.GetInvertedBranches()) {
+                context.inverted_branches.push_back(translation.at(original));
+            }
+            std::sort(context.inverted_branches.begin(), context.inverted_branches.end());
+            context.bytecode = std::move(optimized);
+        }
+
         void Compiler::ApplyObfuscation(std::vector<uint8_t>& bytecode) {}
         void Compiler::EncryptConstants(CompilationContext& context) {}
         void Compiler::InsertAntiAnalysis(std::vector<uint8_t>& bytecode) {}
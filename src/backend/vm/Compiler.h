@@ -1,14 +1,17 @@
 #pragma once
 
 #include "VMOpcodes.h"
+#include "ExecutionProfile.h"
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include <stack>
 #include <queue>
 #include <cstdint>
 #include <cstddef>
+#include <array>
 
 // Forward declarations to avoid circular dependencies
 namespace AetherVisor {
@@ -19,6 +22,12 @@ namespace AetherVisor {
         struct VMFunction;
         struct VMSecurityContext;
         enum class VMOpcode : uint8_t;
+        enum class OptimizationLevel;
+        struct Symbol;
+        struct SSAValue;
+        struct SSABlock;
+        class SSAFunction;
+        struct SSAStackSchedule;
     }
 }
 
@@ -97,21 +106,25 @@ namespace AetherVisor {
             size_t column;
             std::vector<std::unique_ptr<ASTNode>> children;
             std::string value; // For literals and identifiers
+            TokenType token;   // Operator or literal token kind
+            Symbol* symbol;    // Resolved during semantic analysis
+            VMDataType value_type; // Inferred result type, UNDEFINED when not proven
             
             ASTNode(ASTNodeType t, size_t l = 0, size_t c = 0)
-                : type(t), line(l), column(c) {}
+                : type(t), line(l), column(c), token(TokenType::UNKNOWN), symbol(nullptr), value_type(VMDataType::UNDEFINED) {}
             virtual ~ASTNode() = default;
         };
 
         // Symbol table entry
         struct Symbol {
             std::string name;
-            VMDataType type;
+            VMDataType type;      // Join of every type stored to it, UNDEFINED if mixed or unknown
             uint32_t address;     // Stack offset or global address
             bool is_global;
             bool is_function;
             bool is_constant;
             VMValue default_value;
+            ASTNode* initializer; // Literal of a top-level const declared once; reads use it instead of the slot
         };
 
         // Scope for symbol management
@@ -121,7 +134,10 @@ namespace AetherVisor {
             
             void DefineSymbol(const std::string& name, const Symbol& symbol);
             Symbol* LookupSymbol(const std::string& name);
+            Symbol* LookupLocalSymbol(const std::string& name);
             uint32_t AllocateAddress() { return m_next_address++; }
+            const std::unordered_map<std::string, Symbol>& GetSymbols() const { return m_symbols; }
+            uint32_t GetAddressCount() const { return m_next_address; }
             
         private:
             Scope* m_parent;
@@ -141,9 +157,36 @@ namespace AetherVisor {
             
             // Security settings
             VMSecurityContext security;
-            bool enable_optimization;
+            bool enable_optimization;       // SSA passes during Generate, BytecodeOptimizer after linking
+            OptimizationLevel optimization_level;   // BytecodeOptimizer level, AGGRESSIVE by default
             bool enable_obfuscation;
             bool enable_encryption;
+
+            // Profile-guided optimisation. A profile whose code_key matches the
+            // generated code is handed to BytecodeOptimizer in the last phase;
+            // the module then maps its addresses back so new profiles keep the key.
+            std::shared_ptr<const ExecutionProfile> profile;
+            uint32_t profile_key;                                       // Checksum of the code before that phase
+            std::vector<std::pair<uint32_t, uint32_t>> profile_addresses; // (final offset, profiled offset), empty when unchanged
+            std::vector<uint32_t> inverted_branches;                    // Final offsets of conditional branches whose sense was flipped
+
+            // Parallel compilation: index 0 is top-level code, then one
+            // fragment per top-level FUNCTION_DECL in source order
+            uint32_t compile_threads;   // 0 = hardware concurrency, 1 = serial
+            std::vector<std::unique_ptr<CompilationContext>> fragments;
+
+            // Fragment state (only used when this context is a fragment)
+            std::vector<ASTNode*> unit_nodes;               // Statements compiled into this fragment
+            int32_t function_index;                         // -1 for top-level code
+            uint32_t local_count;
+            std::vector<std::unique_ptr<Scope>> scopes;
+            std::vector<uint32_t> address_relocations;      // Offsets of absolute 32-bit code addresses
+            std::vector<uint32_t> constant_relocations;     // Offsets of constant pool index operands
+            std::vector<uint32_t> constant_indices;         // Pool index for each constant relocation
+            std::vector<std::unique_ptr<char[]>> string_storage; // Backing store for string constants
+            std::vector<std::pair<uint32_t, uint32_t>> line_table; // (code offset, source line), sorted by offset
+            std::unordered_map<std::string, uint32_t> constant_lookup; // Constant bytes -> pool index
+            std::vector<std::pair<Symbol*, VMDataType>> symbol_stores; // Inferred type of each store
             
             CompilationContext();
         };
@@ -156,7 +199,7 @@ namespace AetherVisor {
 
             // Main compilation interface
             bool Compile(const std::string& source_code, CompilationContext& context);
-            std::vector<uint8_t> GetBytecode(const CompilationContext& context);
+            std::vector<uint8_t> GetBytecode(const CompilationContext& context);   // Serialized CompiledModule image
             
             // Individual compilation phases
             std::vector<Token> Tokenize(const std::string& source);
@@ -164,11 +207,6 @@ namespace AetherVisor {
             bool Analyze(ASTNode* ast, CompilationContext& context);
             bool Generate(ASTNode* ast, CompilationContext& context);
             
-            // Optimization passes
-            void OptimizeConstantFolding(ASTNode* ast);
-            void OptimizeDeadCodeElimination(ASTNode* ast);
-            void OptimizeInlining(ASTNode* ast, CompilationContext& context);
-            
             // Security features
             void ApplyObfuscation(std::vector<uint8_t>& bytecode);
             void EncryptConstants(CompilationContext& context);
@@ -182,6 +220,8 @@ namespace AetherVisor {
         private:
             std::vector<std::string> m_errors;
             std::vector<std::string> m_warnings;
+            size_t m_nesting_depth = 0;     // Statements and expressions being parsed
+            size_t m_expression_height = 0; // AST height of the last parsed expression
             
             // Lexical analysis
             bool IsAlpha(char c);
@@ -193,10 +233,9 @@ namespace AetherVisor {
             // Parsing helpers
             std::unique_ptr<ASTNode> ParseProgram(const std::vector<Token>& tokens, size_t& pos);
             std::unique_ptr<ASTNode> ParseStatement(const std::vector<Token>& tokens, size_t& pos);
+            std::unique_ptr<ASTNode> ParseStatementBody(const std::vector<Token>& tokens, size_t& pos);
             std::unique_ptr<ASTNode> ParseExpression(const std::vector<Token>& tokens, size_t& pos);
-            std::unique_ptr<ASTNode> ParseBinaryExpression(const std::vector<Token>& tokens, size_t& pos, int min_precedence);
-            std::unique_ptr<ASTNode> ParseUnaryExpression(const std::vector<Token>& tokens, size_t& pos);
-            std::unique_ptr<ASTNode> ParsePrimaryExpression(const std::vector<Token>& tokens, size_t& pos);
+            std::unique_ptr<ASTNode> ParseExpressionBody(const std::vector<Token>& tokens, size_t& pos);
             std::unique_ptr<ASTNode> ParseFunctionDecl(const std::vector<Token>& tokens, size_t& pos);
             std::unique_ptr<ASTNode> ParseVariableDecl(const std::vector<Token>& tokens, size_t& pos);
             std::unique_ptr<ASTNode> ParseIfStatement(const std::vector<Token>& tokens, size_t& pos);
@@ -204,36 +243,138 @@ namespace AetherVisor {
             std::unique_ptr<ASTNode> ParseForStatement(const std::vector<Token>& tokens, size_t& pos);
             std::unique_ptr<ASTNode> ParseTryCatch(const std::vector<Token>& tokens, size_t& pos);
             
-            int GetOperatorPrecedence(TokenType type);
-            bool IsRightAssociative(TokenType type);
+            // Pratt expression parsing: operand and operator stacks for a single loop
+            struct PrattOperator {
+                const Token* token;
+                int precedence;
+                bool is_prefix;
+                bool is_group;      // Open parenthesis marker
+            };
+
+            struct PrattState {
+                const std::vector<Token>& tokens;
+                size_t& pos;
+                std::vector<std::unique_ptr<ASTNode>> operands{};
+                std::vector<size_t> heights{};      // AST height of each operand
+                std::vector<PrattOperator> operators{};
+                size_t open_groups = 0;
+                bool expect_operand = true;
+            };
+
+            using NudHandler = bool (Compiler::*)(PrattState& state, const Token& token);
+            using LedHandler = bool (Compiler::*)(PrattState& state, const Token& token);
+
+            struct ParseRule {
+                NudHandler nud;         // Token starts an expression
+                LedHandler led;         // Token continues an expression
+                int precedence;         // Binding power of the infix form
+                bool right_associative;
+            };
+
+            static constexpr size_t kTokenTypeCount = static_cast<size_t>(TokenType::UNKNOWN) + 1;
+            static constexpr int kPrefixPrecedence = 12;
+            // Deeper ASTs would overflow a 1 MB stack in the recursive analysis and code generation walks
+            static constexpr size_t kMaxNestingDepth = 256;
+
+            static const ParseRule& GetParseRule(TokenType type);
+            static constexpr std::array<ParseRule, kTokenTypeCount> BuildParseRules();
+            bool NudLiteral(PrattState& state, const Token& token);
+            bool NudIdentifier(PrattState& state, const Token& token);
+            bool NudGroup(PrattState& state, const Token& token);
+            bool NudPrefix(PrattState& state, const Token& token);
+            bool LedInfix(PrattState& state, const Token& token);
+            bool ReducePrattOperator(PrattState& state);
+            bool PushOperand(PrattState& state, std::unique_ptr<ASTNode> node, size_t height);
+            std::unique_ptr<ASTNode> PopOperand(PrattState& state, size_t& height);
+            bool CheckNesting(size_t depth, size_t line, size_t column);
+            bool ParsePostfix(PrattState& state);
+            bool Expect(const std::vector<Token>& tokens, size_t& pos, TokenType type, const std::string& message);
+            bool ExpectStatementEnd(const std::vector<Token>& tokens, size_t& pos);
+            static bool IsStatementEnd(TokenType type);
+            static const Token& PeekToken(const std::vector<Token>& tokens, size_t pos);
+            static void SkipNewlines(const std::vector<Token>& tokens, size_t& pos);
+            
+            // Parallel compilation
+            bool BuildFragments(ASTNode* ast, CompilationContext& context);
+            bool AnalyzeFragment(CompilationContext& fragment);
+            void GenerateFragment(CompilationContext& fragment);
+            bool LinkFragments(CompilationContext& context);
+            void WidenConstantOperands(CompilationContext& fragment, const std::vector<uint32_t>& offsets);
+            void DeclareGlobals(ASTNode* node, CompilationContext& context, bool top_level = true);
             
             // Semantic analysis
             bool AnalyzeNode(ASTNode* node, CompilationContext& context);
-            bool CheckTypes(ASTNode* node, CompilationContext& context);
-            bool ResolveSymbols(ASTNode* node, CompilationContext& context);
+            bool CheckTypes(CompilationContext& fragment);
+            bool ResolveSymbols(CompilationContext& context);
+
+            // Type inference: flow-sensitive within a fragment. A symbol missing from
+            // the environment has no proven type at that point.
+            using TypeEnvironment = std::unordered_map<const Symbol*, VMDataType>;
+            void InferStatement(ASTNode* stmt, TypeEnvironment& env, CompilationContext& fragment);
+            VMDataType InferExpression(ASTNode* expr, TypeEnvironment& env, CompilationContext& fragment);
+            void RecordStore(Symbol* symbol, VMDataType type, TypeEnvironment& env, CompilationContext& fragment);
+            static VMDataType JoinTypes(VMDataType a, VMDataType b);
+            static void JoinEnvironments(TypeEnvironment& into, const TypeEnvironment& other);
+            static void InvalidateStores(const ASTNode* node, TypeEnvironment& env);
+            static VMDataType BinaryResultType(TokenType op, VMDataType left, VMDataType right);
             
-            // Code generation
-            void GenerateNode(ASTNode* node, CompilationContext& context);
-            void GenerateExpression(ASTNode* expr, CompilationContext& context);
-            void GenerateStatement(ASTNode* stmt, CompilationContext& context);
-            void GenerateFunctionCall(ASTNode* call, CompilationContext& context);
+            // Code generation: each fragment is lowered to SSA, optimised there,
+            // and scheduled back onto the operand stack
+            struct SSABuildState {
+                SSAFunction& function;
+                CompilationContext& fragment;
+                SSABlock* block;                                    // Open block receiving instructions
+                uint32_t line;
+                std::unordered_set<const Symbol*> memory_symbols;   // Locals kept in their frame slot
+            };
+
+            struct SSALowerState {
+                const SSAStackSchedule& schedule;
+                CompilationContext& fragment;
+                std::vector<uint32_t> slots;                        // Indexed by value id
+                bool global_slots;                                  // Top-level code has no frame
+            };
+
+            void BuildStatement(ASTNode* stmt, SSABuildState& state);
+            SSAValue* BuildExpression(ASTNode* expr, SSABuildState& state);
+            void BuildCondition(ASTNode* expr, SSABlock* if_true, SSABlock* if_false, SSABuildState& state);
+            SSAValue* BuildShortCircuit(ASTNode* expr, SSABuildState& state);
+            SSAValue* BuildFunctionCall(ASTNode* call, SSABuildState& state);
+            SSAValue* BuildConversion(SSAValue* value, VMDataType from, VMDataType to, SSABuildState& state);
+            SSAValue* ReadSymbol(Symbol* symbol, VMDataType type, SSABuildState& state);
+            void WriteSymbol(Symbol* symbol, SSAValue* value, SSABuildState& state);
+            void Terminate(VMOpcode opcode, const std::vector<SSAValue*>& operands, const std::vector<SSABlock*>& successors, SSABuildState& state);
+            void LowerSSA(SSAFunction& function, CompilationContext& fragment);
+            void EmitSSAValue(SSAValue* value, SSALowerState& state);
+            void EmitSSAOperand(SSAValue* value, SSALowerState& state);
+            void EmitSlotAccess(bool store, uint32_t slot, SSALowerState& state);
+            void EmitLine(uint32_t line, CompilationContext& context);
             
             // Bytecode emission
             void EmitOpcode(VMOpcode opcode, CompilationContext& context);
             void EmitOperand(uint32_t operand, CompilationContext& context);
+            void EmitOperand16(uint16_t operand, CompilationContext& context);
+            void EmitJump(VMOpcode opcode, uint32_t target, CompilationContext& context);
+            void EmitConstant(uint32_t index, CompilationContext& context);
+            static VMOpcode SelectBinaryOpcode(TokenType op, VMDataType left, VMDataType right, VMDataType& operand_type);
             void EmitInstruction(VMOpcode opcode, uint32_t op1, uint32_t op2, uint32_t op3, CompilationContext& context);
             uint32_t AddConstant(const VMValue& value, CompilationContext& context);
+            uint32_t AddStringConstant(const std::string& text, CompilationContext& context);
             uint32_t GetCurrentAddress(const CompilationContext& context);
             void PatchAddress(uint32_t address, uint32_t value, CompilationContext& context);
             
             // Advanced features
             void GenerateJIT(ASTNode* node, CompilationContext& context);
             void InsertProfilingCode(CompilationContext& context);
+            void OptimizeBytecode(CompilationContext& context);
             void ApplySecurityMeasures(CompilationContext& context);
             
             // Error reporting
             void ReportError(const std::string& message, size_t line = 0, size_t column = 0);
             void ReportWarning(const std::string& message, size_t line = 0, size_t column = 0);
+            static std::string FormatDiagnostic(const std::string& kind, const std::string& message, size_t line, size_t column);
+            static void ReportError(CompilationContext& fragment, const std::string& message, const ASTNode* node);
+            static void ReportWarning(CompilationContext& fragment, const std::string& message, const ASTNode* node);
         };
 
     } // namespace VM
@@ -0,0 +1,177 @@
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "ExecutionProfile.h"
+#include "../security/XorStr.h"
+#include "BytecodeOptimizer.h"
+#include "CompiledModule.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+namespace AetherVisor {
+    namespace VM {
+
+        namespace {
+            // Profile file layout (little-endian):
+            //   ProfileFileHeader | ProfileBlockEntry[block_count] | ProfileBranchEntry[branch_count]
+            constexpr uint8_t kProfileMagic[4] = { 0xAE, 0x7E, 0x9F, 0x01 };
+            constexpr uint16_t kProfileFormatVersion = 1;
+
+            struct ProfileFileHeader {
+                uint8_t magic[4];
+                uint16_t version;
+                uint16_t reserved;
+                uint32_t code_key;
+                uint32_t block_count;
+                uint32_t branch_count;
+                uint32_t checksum;          // FNV-1a of the entries
+            };
+
+            struct ProfileBlockEntry {
+                uint32_t address;
+                uint32_t count;
+            };
+
+            struct ProfileBranchEntry {
+                uint32_t address;
+                uint32_t taken;
+                uint32_t not_taken;
+            };
+
+            static_assert(sizeof(ProfileFileHeader) == 24, "ProfileFileHeader layout changed");
+
+            uint32_t SaturatingAdd(uint32_t a, uint32_t b) {
+                return a > std::numeric_limits<uint32_t>::max() - b ? std::numeric_limits<uint32_t>::max() : a + b;
+            }
+
+            template <typename T>
+            void AppendPod(std::vector<uint8_t>& out, const T& value) {
+                const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+                out.insert(out.end(), bytes, bytes + sizeof(T));
+            }
+        }
+
+        void ExecutionProfile::Merge(const ExecutionProfile& other) {
+            for (const auto& [address, count] : other.block_counts) {
+                uint32_t& total = block_counts[address];
+                total = SaturatingAdd(total, count);
+            }
+            for (const auto& [address, branch] : other.branches) {
+                BranchProfile& total = branches[address];
+                total.taken = SaturatingAdd(total.taken, branch.taken);
+                total.not_taken = SaturatingAdd(total.not_taken, branch.not_taken);
+            }
+        }
+
+        bool ExecutionProfile::Save(const std::string& path) const {
+            std::vector<uint8_t> entries;
+            entries.reserve(block_counts.size() * sizeof(ProfileBlockEntry) + branches.size() * sizeof(ProfileBranchEntry));
+            for (const auto& [address, count] : block_counts) {
+                AppendPod(entries, ProfileBlockEntry{ address, count });
+            }
+            for (const auto& [address, branch] : branches) {
+                AppendPod(entries, ProfileBranchEntry{ address, branch.taken, branch.not_taken });
+            }
+
+            ProfileFileHeader header{};
+            std::memcpy(header.magic, kProfileMagic, sizeof(kProfileMagic));
+            header.version = kProfileFormatVersion;
+            header.code_key = code_key;
+            header.block_count = static_cast<uint32_t>(block_counts.size());
+            header.branch_count = static_cast<uint32_t>(branches.size());
+            header.checksum = CompiledModule::Checksum(entries.data(), entries.size());
+
+            // Written beside the live file and renamed over it, so a VM that is
+            // reading the old profile never sees a partial one
+            const std::string temporary = path + XorS(".tmp");
+            {
+                std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+                if (!file) {
+                    return false;
+                }
+                file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                file.write(reinterpret_cast<const char*>(entries.data()), static_cast<std::streamsize>(entries.size()));
+                if (!file) {
+                    return false;
+                }
+            }
+            std::remove(path.c_str());
+            return std::rename(temporary.c_str(), path.c_str()) == 0;
+        }
+
+        bool ExecutionProfile::Load(const std::string& path, ExecutionProfile& profile, std::string* error) {
+            profile = ExecutionProfile{};
+
+            std::ifstream file(path, std::ios::binary);
+            if (!file) {
+                if (error) *error = XorS("Failed to open profile file");
+                return false;
+            }
+
+            ProfileFileHeader header{};
+            if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+                std::memcmp(header.magic, kProfileMagic, sizeof(kProfileMagic)) != 0) {
+                if (error) *error = XorS("Not a profile file");
+                return false;
+            }
+            if (header.version != kProfileFormatVersion) {
+                if (error) *error = XorS("Unsupported profile version");
+                return false;
+            }
+
+            const uint64_t size = static_cast<uint64_t>(header.block_count) * sizeof(ProfileBlockEntry) +
+                                  static_cast<uint64_t>(header.branch_count) * sizeof(ProfileBranchEntry);
+            if (size > std::numeric_limits<uint32_t>::max()) {
+                if (error) *error = XorS("Invalid profile size");
+                return false;
+            }
+            std::vector<uint8_t> entries(static_cast<size_t>(size));
+            if (!file.read(reinterpret_cast<char*>(entries.data()), static_cast<std::streamsize>(entries.size())) ||
+                CompiledModule::Checksum(entries.data(), entries.size()) != header.checksum) {
+                if (error) *error = XorS("Profile checksum mismatch");
+                return false;
+            }
+
+            const uint8_t* cursor = entries.data();
+            for (uint32_t i = 0; i < header.block_count; ++i, cursor += sizeof(ProfileBlockEntry)) {
+                ProfileBlockEntry entry;
+                std::memcpy(&entry, cursor, sizeof(entry));
+                profile.block_counts[entry.address] = entry.count;
+            }
+            for (uint32_t i = 0; i < header.branch_count; ++i, cursor += sizeof(ProfileBranchEntry)) {
+                ProfileBranchEntry entry;
+                std::memcpy(&entry, cursor, sizeof(entry));
+                profile.branches[entry.address] = BranchProfile{ entry.taken, entry.not_taken };
+            }
+            profile.code_key = header.code_key;
+            return true;
+        }
+
+        std::string ExecutionProfile::GetSidecarPath(const std::string& module_path) {
+            return module_path + XorS(".prof");
+        }
+
+        std::vector<uint32_t> ExecutionProfile::FindBlockStarts(const std::vector<uint8_t>& code,
+                                                                const std::vector<uint32_t>& entry_points,
+                                                                std::vector<uint32_t>* block_lengths) {
+            std::vector<uint32_t> starts;
+            if (block_lengths) block_lengths->clear();
+            BytecodeProgram program;
+            if (code.empty() || !program.Decode(code, entry_points)) {
+                return starts;
+            }
+
+            for (uint32_t i = 0; i < program.Size(); ++i) {
+                if (program.IsBlockStart(i)) {
+                    starts.push_back(program[i].address);
+                    if (block_lengths) block_lengths->push_back(0);
+                }
+                if (block_lengths) ++block_lengths->back();
+            }
+            return starts;
+        }
+
+    } // namespace VM
+} // namespace AetherVisor
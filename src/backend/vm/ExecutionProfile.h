@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <cstdint>
+
+namespace AetherVisor {
+    namespace VM {
+
+        struct BranchProfile {
+            uint32_t taken = 0;
+            uint32_t not_taken = 0;
+        };
+
+        // Execution counts collected by the VM, in the format BytecodeOptimizer
+        // consumes. Addresses are offsets into the code as the compiler emitted it
+        // before profile-guided optimisation, so a profile stays valid for every
+        // rebuild of the same code whatever layout the last build chose.
+        struct ExecutionProfile {
+            uint32_t code_key = 0;                          // CompiledModule::Checksum of that code
+            std::map<uint32_t, uint32_t> block_counts;      // Basic block start -> executions
+            std::map<uint32_t, BranchProfile> branches;     // Conditional branch -> outcomes
+
+            bool Empty() const { return block_counts.empty() && branches.empty(); }
+
+            // Adds the counts of a profile of the same code, saturating
+            void Merge(const ExecutionProfile& other);
+
+            // Binary file next to the compiled module; see GetSidecarPath
+            bool Save(const std::string& path) const;
+            static bool Load(const std::string& path, ExecutionProfile& profile, std::string* error = nullptr);
+            static std::string GetSidecarPath(const std::string& module_path);
+
+            // Basic block starts in address order, split the same way as
+            // BytecodeOptimizer's control flow graph, with each block's length
+            // in instructions when requested
+            static std::vector<uint32_t> FindBlockStarts(const std::vector<uint8_t>& code,
+                                                         const std::vector<uint32_t>& entry_points,
+                                                         std::vector<uint32_t>* block_lengths = nullptr);
+        };
+
+    } // namespace VM
+} // namespace AetherVisor
@@ -0,0 +1,51 @@
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "JITAssembler.h"
+#include "../security/XorStr.h"
+#include <stdexcept>
+
+namespace AetherVisor {
+    namespace VM {
+
+        void JITAssembler::EmitByte(uint8_t byte) {
+            machine_code.push_back(byte);
+        }
+
+        void JITAssembler::EmitWord(uint16_t word) {
+            machine_code.push_back(word & 0xFF);
+            machine_code.push_back((word >> 8) & 0xFF);
+        }
+
+        void JITAssembler::EmitDWord(uint32_t dword) {
+            machine_code.push_back(dword & 0xFF);
+            machine_code.push_back((dword >> 8) & 0xFF);
+            machine_code.push_back((dword >> 16) & 0xFF);
+            machine_code.push_back((dword >> 24) & 0xFF);
+        }
+
+        void JITAssembler::EmitQWord(uint64_t qword) {
+            EmitDWord(static_cast<uint32_t>(qword));
+            EmitDWord(static_cast<uint32_t>(qword >> 32));
+        }
+
+        void JITAssembler::EmitInstruction(const std::vector<uint8_t>& instruction) {
+            machine_code.insert(machine_code.end(), instruction.begin(), instruction.end());
+        }
+
+        void JITAssembler::EmitLabel(uint32_t label_id) {
+            label_map[label_id] = static_cast<uint32_t>(machine_code.size());
+        }
+
+        void JITAssembler::ApplyRelocations() {
+            for (const Relocation& relocation : relocations) {
+                auto target = label_map.find(relocation.label);
+                if (target == label_map.end()) {
+                    throw std::runtime_error(XorS("Jump to an undefined label"));
+                }
+                PatchRelocation(relocation, target->second);
+            }
+        }
+
+    } // namespace VM
+} // namespace AetherVisor
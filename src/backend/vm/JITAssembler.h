@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <cstdint>
+
+namespace AetherVisor {
+    namespace VM {
+
+        // What code generation needs of a target, whatever it is: a code
+        // buffer with labels and branch relocations, and the operations the
+        // region driver emits around the per-instruction code. Backends keep
+        // the JITContext pinned in a callee-saved register throughout and
+        // may clobber their own scratch registers in any operation.
+        struct JITAssembler {
+            std::vector<uint8_t> machine_code;
+            std::map<uint32_t, uint32_t> label_map; // label -> machine code offset; bytecode addresses label themselves
+            uint32_t next_label = 0x80000000;       // Labels above every bytecode address
+
+            virtual ~JITAssembler() = default;
+
+            void EmitByte(uint8_t byte);
+            void EmitWord(uint16_t word);
+            void EmitDWord(uint32_t dword);
+            void EmitQWord(uint64_t qword);
+            void EmitInstruction(const std::vector<uint8_t>& instruction);
+            void EmitLabel(uint32_t label_id);
+            uint32_t NewLabel() { return next_label++; }
+
+            // Resolves every branch to its label; throws on an undefined label
+            // or a branch the target cannot encode
+            void ApplyRelocations();
+
+            // Entered as JITFunction(context, entry): saves what the ABI
+            // preserves, reserves 8-byte spill slots and jumps to the entry
+            virtual void EmitPrologue(uint32_t spill_slots) = 0;
+            virtual void EmitEpilogue() = 0;                            // Returns 0
+            virtual void EmitJump(uint32_t target_label) = 0;
+
+            // Calls JITContext::step for pc, branching when it returns nonzero
+            virtual void EmitStep(uint32_t pc, uint32_t stopped_label) = 0;
+            // Calls JITContext::call for the native call at pc with the cache
+            // of call site number cache, branching when it returns nonzero
+            virtual void EmitNativeCall(uint32_t pc, uint32_t cache, uint32_t stopped_label) = 0;
+            // Charges the budget, branching when it runs out
+            virtual void EmitBlockCharge(uint32_t length, uint32_t exhausted_label) = 0;
+            virtual void EmitRefund(uint32_t count) = 0;
+            virtual void EmitSetPc(uint32_t address) = 0;
+            // Counts an iteration of the loop at header, branching when the
+            // tier-up countdown runs out
+            virtual void EmitCountBackEdge(uint32_t header, uint32_t countdown_label) = 0;
+
+        protected:
+            struct Relocation {
+                uint32_t offset;                    // Of the instruction or field to patch
+                uint32_t label;
+                uint8_t kind;                       // Backend-defined
+            };
+            std::vector<Relocation> relocations;
+
+            void AddRelocation(uint32_t offset, uint32_t label, uint8_t kind) { relocations.push_back({ offset, label, kind }); }
+            virtual void PatchRelocation(const Relocation& relocation, uint32_t target) = 0;
+        };
+
+    } // namespace VM
+} // namespace AetherVisor
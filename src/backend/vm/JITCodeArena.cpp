@@ -0,0 +1,313 @@
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "JITCodeArena.h"
+#include "../security/XorStr.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace AetherVisor {
+    namespace VM {
+
+        namespace {
+            // Fill for freed code, so a stale jump into it faults
+#if defined(_M_ARM64) || defined(__aarch64__)
+            constexpr uint8_t TRAP = 0x00;          // udf #0
+#else
+            constexpr uint8_t TRAP = 0xCC;          // int3
+#endif
+
+            size_t RoundUp(size_t size, size_t granularity) {
+                return (size + granularity - 1) / granularity * granularity;
+            }
+        }
+
+        JITCodeArena& JITCodeArena::GetInstance() {
+            static JITCodeArena instance;
+            return instance;
+        }
+
+        JITCodeArena::JITCodeArena() : m_page_size(4096), m_dual_mapping(true), m_protection_changes(0) {
+#ifdef _WIN32
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            m_page_size = info.dwPageSize;
+#else
+            const long page_size = sysconf(_SC_PAGESIZE);
+            if (page_size > 0) {
+                m_page_size = static_cast<size_t>(page_size);
+            }
+#endif
+        }
+
+        JITCodeArena::~JITCodeArena() {
+            for (auto& chunk : m_chunks) {
+                UnmapChunk(*chunk);
+            }
+        }
+
+        void* JITCodeArena::Install(const uint8_t* code, size_t size) {
+            if (!code || size == 0) {
+                return nullptr;
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Chunk* chunk = nullptr;
+            size_t offset = 0;
+            if (!Allocate(size, chunk, offset)) {
+                return nullptr;
+            }
+
+            uint8_t* executable = chunk->executable + offset;
+            if (chunk->writable) {
+                std::memcpy(chunk->writable + offset, code, size);
+            } else {
+                // The block's pages are read-write until sealed; one call covers them all
+                std::memcpy(executable, code, size);
+                if (!Protect(*chunk, offset, RoundUp(size, m_page_size), true)) {
+                    std::memset(executable, TRAP, size);
+                    Release(*chunk, offset, RoundUp(size, m_page_size));
+                    return nullptr;
+                }
+            }
+            // x86 keeps instruction fetch coherent with stores; AArch64 needs the
+            // data cleaned and the instruction cache invalidated, by the
+            // addresses code runs at even when it was written through the alias
+#ifdef _WIN32
+            FlushInstructionCache(GetCurrentProcess(), executable, size);
+#elif !defined(__x86_64__) && !defined(__i386__)
+            __builtin___clear_cache(reinterpret_cast<char*>(executable), reinterpret_cast<char*>(executable + size));
+#endif
+            return executable;
+        }
+
+        void JITCodeArena::Free(void* memory, size_t size) {
+            if (!memory || size == 0) {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Chunk* chunk = FindChunk(memory);
+            if (!chunk) {
+                return;
+            }
+
+            size_t offset = static_cast<size_t>(static_cast<uint8_t*>(memory) - chunk->executable);
+            size_t block = RoundUp(size, Granularity(*chunk));
+            if (chunk->writable) {
+                std::memset(chunk->writable + offset, TRAP, block);
+            } else if (Protect(*chunk, offset, block, false)) {
+                std::memset(chunk->executable + offset, TRAP, block);
+            } else {
+                return;                             // Still sealed; leak the block rather than hand it out
+            }
+            Release(*chunk, offset, block);
+        }
+
+        void JITCodeArena::Release(Chunk& chunk, size_t offset, size_t block) {
+            chunk.used -= block;
+
+            // Coalesce with the free neighbours, then give the tail back to the bump pointer
+            auto next = chunk.free_blocks.lower_bound(offset);
+            if (next != chunk.free_blocks.end() && offset + block == next->first) {
+                block += next->second;
+                next = chunk.free_blocks.erase(next);
+            }
+            if (next != chunk.free_blocks.begin()) {
+                auto previous = std::prev(next);
+                if (previous->first + previous->second == offset) {
+                    offset = previous->first;
+                    block += previous->second;
+                    chunk.free_blocks.erase(previous);
+                }
+            }
+            if (offset + block == chunk.top) {
+                chunk.top = offset;
+            } else {
+                chunk.free_blocks[offset] = block;
+            }
+
+            if (chunk.used == 0 && m_chunks.size() > 1) {
+                auto it = std::find_if(m_chunks.begin(), m_chunks.end(),
+                                       [&chunk](const std::unique_ptr<Chunk>& owned) { return owned.get() == &chunk; });
+                UnmapChunk(chunk);
+                m_chunks.erase(it);
+            }
+        }
+
+        JITCodeArena::Statistics JITCodeArena::GetStatistics() const {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Statistics statistics = {};
+            statistics.dual_mapped = m_dual_mapping;
+            statistics.chunks = m_chunks.size();
+            for (const auto& chunk : m_chunks) {
+                statistics.reserved_bytes += chunk->size;
+                statistics.used_bytes += chunk->used;
+            }
+            statistics.protection_changes = m_protection_changes;
+            return statistics;
+        }
+
+        JITCodeArena::Chunk* JITCodeArena::FindChunk(const void* memory) {
+            const uint8_t* address = static_cast<const uint8_t*>(memory);
+            for (auto& chunk : m_chunks) {
+                if (address >= chunk->executable && address < chunk->executable + chunk->size) {
+                    return chunk.get();
+                }
+            }
+            return nullptr;
+        }
+
+        bool JITCodeArena::Allocate(size_t size, Chunk*& chunk, size_t& offset) {
+            // First fit among freed blocks, then the bump pointer of the newest chunks
+            for (auto& candidate : m_chunks) {
+                const size_t block = RoundUp(size, Granularity(*candidate));
+                for (auto it = candidate->free_blocks.begin(); it != candidate->free_blocks.end(); ++it) {
+                    if (it->second < block) {
+                        continue;
+                    }
+                    offset = it->first;
+                    if (it->second > block) {
+                        candidate->free_blocks[offset + block] = it->second - block;
+                    }
+                    candidate->free_blocks.erase(it);
+                    candidate->used += block;
+                    chunk = candidate.get();
+                    return true;
+                }
+            }
+            for (auto it = m_chunks.rbegin(); it != m_chunks.rend(); ++it) {
+                Chunk& candidate = **it;
+                const size_t block = RoundUp(size, Granularity(candidate));
+                if (candidate.size - candidate.top >= block) {
+                    offset = candidate.top;
+                    candidate.top += block;
+                    candidate.used += block;
+                    chunk = &candidate;
+                    return true;
+                }
+            }
+
+            // Oversized code gets a chunk of its own
+            std::unique_ptr<Chunk> created = MapChunk(std::max(CHUNK_SIZE, RoundUp(size, m_page_size)));
+            if (!created) {
+                return false;
+            }
+            const size_t block = RoundUp(size, Granularity(*created));
+            offset = 0;
+            created->top = block;
+            created->used = block;
+            chunk = created.get();
+            m_chunks.push_back(std::move(created));
+            return true;
+        }
+
+        std::unique_ptr<JITCodeArena::Chunk> JITCodeArena::MapChunk(size_t size) {
+            auto chunk = std::make_unique<Chunk>();
+            chunk->executable = nullptr;
+            chunk->writable = nullptr;
+            chunk->size = size;
+            chunk->top = 0;
+            chunk->used = 0;
+            chunk->mapping = nullptr;
+
+#ifdef _WIN32
+            if (m_dual_mapping) {
+                HANDLE section = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_EXECUTE_READWRITE | SEC_COMMIT,
+                                                    static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+                                                    static_cast<DWORD>(size), nullptr);
+                if (section) {
+                    void* writable = MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, size);
+                    void* executable = MapViewOfFile(section, FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, size);
+                    if (writable && executable) {
+                        chunk->writable = static_cast<uint8_t*>(writable);
+                        chunk->executable = static_cast<uint8_t*>(executable);
+                        chunk->mapping = section;
+                        return chunk;
+                    }
+                    if (writable) UnmapViewOfFile(writable);
+                    if (executable) UnmapViewOfFile(executable);
+                    CloseHandle(section);
+                }
+                m_dual_mapping = false;
+            }
+
+            void* memory = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+            if (!memory) {
+                return nullptr;
+            }
+            chunk->executable = static_cast<uint8_t*>(memory);
+#else
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+            if (m_dual_mapping) {
+                const int descriptor = memfd_create(XorS("aether-jit"), MFD_CLOEXEC);
+                if (descriptor >= 0) {
+                    if (ftruncate(descriptor, static_cast<off_t>(size)) == 0) {
+                        void* writable = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+                        void* executable = mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_SHARED, descriptor, 0);
+                        if (writable != MAP_FAILED && executable != MAP_FAILED) {
+                            close(descriptor);
+                            chunk->writable = static_cast<uint8_t*>(writable);
+                            chunk->executable = static_cast<uint8_t*>(executable);
+                            return chunk;
+                        }
+                        if (writable != MAP_FAILED) munmap(writable, size);
+                        if (executable != MAP_FAILED) munmap(executable, size);
+                    }
+                    close(descriptor);
+                }
+                m_dual_mapping = false;
+            }
+#else
+            m_dual_mapping = false;
+#endif
+
+            void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) {
+                return nullptr;
+            }
+            chunk->executable = static_cast<uint8_t*>(memory);
+#endif
+            return chunk;
+        }
+
+        void JITCodeArena::UnmapChunk(Chunk& chunk) {
+#ifdef _WIN32
+            if (chunk.writable) {
+                UnmapViewOfFile(chunk.writable);
+                UnmapViewOfFile(chunk.executable);
+                CloseHandle(chunk.mapping);
+            } else {
+                VirtualFree(chunk.executable, 0, MEM_RELEASE);
+            }
+#else
+            if (chunk.writable) {
+                munmap(chunk.writable, chunk.size);
+            }
+            munmap(chunk.executable, chunk.size);
+#endif
+            chunk.executable = nullptr;
+            chunk.writable = nullptr;
+        }
+
+        bool JITCodeArena::Protect(Chunk& chunk, size_t offset, size_t size, bool executable) {
+            ++m_protection_changes;
+#ifdef _WIN32
+            DWORD previous = 0;
+            return VirtualProtect(chunk.executable + offset, size, executable ? PAGE_EXECUTE_READ : PAGE_READWRITE,
+                                  &previous) != 0;
+#else
+            return mprotect(chunk.executable + offset, size,
+                            executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE) == 0;
+#endif
+        }
+
+    } // namespace VM
+} // namespace AetherVisor
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+namespace AetherVisor {
+    namespace VM {
+
+        // Code space for compiled functions. Chunks are reserved in bulk and
+        // functions are bump-allocated from them, aligned, so small functions
+        // share pages and cost no system call. Code is never writable and
+        // executable at once: where the OS allows it, a chunk is mapped twice,
+        // a writable view to copy code in and an executable view to run it;
+        // otherwise each allocation gets whole pages that are sealed
+        // read-execute once written. Freed blocks are coalesced and reused
+        // first-fit, and chunks that empty are given back. Safe from any thread.
+        class JITCodeArena {
+        public:
+            static JITCodeArena& GetInstance();
+
+            // Copies code in and returns its executable address, or null
+            void* Install(const uint8_t* code, size_t size);
+            void Free(void* memory, size_t size);
+
+            struct Statistics {
+                bool dual_mapped;
+                size_t chunks;
+                size_t reserved_bytes;
+                size_t used_bytes;                  // Allocated, after alignment
+                uint64_t protection_changes;        // mprotect / VirtualProtect calls
+            };
+            Statistics GetStatistics() const;
+
+        private:
+            JITCodeArena();
+            ~JITCodeArena();
+            JITCodeArena(const JITCodeArena&) = delete;
+            JITCodeArena& operator=(const JITCodeArena&) = delete;
+
+            static constexpr size_t CHUNK_SIZE = 4 * 1024 * 1024;
+            static constexpr size_t ALIGNMENT = 64;     // A cache line, for dense instruction fetch
+
+            struct Chunk {
+                uint8_t* executable;                // Executable view
+                uint8_t* writable;                  // Writable view, or null when pages are sealed in place
+                size_t size;
+                size_t top;                         // Bump offset
+                size_t used;
+                std::map<size_t, size_t> free_blocks;   // Offset -> size below top, coalesced
+                void* mapping;                      // Section handle of a dual-mapped chunk on Windows
+            };
+
+            mutable std::mutex m_mutex;
+            std::vector<std::unique_ptr<Chunk>> m_chunks;      // Allocation goes to the last with room
+            size_t m_page_size;
+            bool m_dual_mapping;                    // Cleared if the OS refuses a dual map
+            uint64_t m_protection_changes;
+
+            size_t Granularity(const Chunk& chunk) const { return chunk.writable ? ALIGNMENT : m_page_size; }
+            Chunk* FindChunk(const void* memory);
+            bool Allocate(size_t size, Chunk*& chunk, size_t& offset);
+            void Release(Chunk& chunk, size_t offset, size_t block);   // Block already filled with traps
+            std::unique_ptr<Chunk> MapChunk(size_t size);
+            void UnmapChunk(Chunk& chunk);
+            bool Protect(Chunk& chunk, size_t offset, size_t size, bool executable);
+        };
+
+    } // namespace VM
+} // namespace AetherVisor
@@ -5,23 +5,26 @@
 #include "../security/SecurityTypes.h"
 #include "../security/XorStr.h"
 #include "VMOpcodes.h"
+#include "BytecodeOptimizer.h"
+#include "VirtualMachine.h"
+#include "JITCodeArena.h"
 #include <chrono>
+#include <cstddef>
 #include <cstring>
 #include <algorithm>
-
-#ifdef _WIN32
-#include <Windows.h>
-#else
-#include <sys/mman.h>
-#include <unistd.h>
-#endif
+#include <stdexcept>
 
 namespace AetherVisor {
     namespace VM {
 
         JITCompiler::JITCompiler() 
-            : m_cache_size_bytes(0)
-            , m_initialized(false)
+            : m_initialized(false)
+            , m_code_cache(std::make_shared<const CodeCache>())
+            , m_cache_hand(m_cache_clock.end())
+            , m_cache_size_bytes(0)
+            , m_cache_hits(0)
+            , m_cache_misses(0)
+            , m_cache_evictions(0)
         {
             // Default settings
             m_settings.enable_optimizations = true;
@@ -47,18 +50,38 @@ namespace AetherVisor {
 #if !defined(_WIN32) && !defined(__linux__)
             return false; // Unsupported platform
 #endif
+#if !defined(_M_X64) && !defined(__x86_64__) && !defined(_M_ARM64) && !defined(__aarch64__)
+            return false; // Code generation targets x86-64 and AArch64
+#endif
 
             m_initialized = true;
             return true;
         }
 
+        // Whole buffers compile as one region at their own addresses. Bytecode
+        // is not rewritten first: native code has to agree with the interpreter
+        // on every address it can hand over at.
         JITCompilationResult JITCompiler::Compile(const std::vector<uint8_t>& bytecode, const std::string& function_name) {
+            return CompileRegion(bytecode.data(), static_cast<uint32_t>(bytecode.size()), 0,
+                                 static_cast<uint32_t>(bytecode.size()), function_name);
+        }
+
+        // Template compilation: each instruction becomes its fast path, or a
+        // call into the interpreter for that one instruction. Block leaders
+        // charge the instruction budget for the whole block on entry; leaving
+        // a block early through a step refunds what did not run.
+        JITCompilationResult JITCompiler::CompileRegion(const uint8_t* code, uint32_t code_size, uint32_t start, uint32_t end,
+                                                        const std::string& function_name) {
             JITCompilationResult result;
             result.success = false;
             result.executable_memory = nullptr;
             result.code_size = 0;
-            result.original_bytecode_size = bytecode.size();
+            result.original_bytecode_size = end > start ? end - start : 0;
+            result.compilation_time_ms = 0.0;
             result.optimization_level = m_settings.optimization_level;
+            result.bytecode_start = start;
+            result.bytecode_end = end;
+            result.call_sites = 0;
 
             auto start_time = std::chrono::high_resolution_clock::now();
 
@@ -67,75 +90,48 @@ namespace AetherVisor {
                 return result;
             }
 
-            if (bytecode.empty()) {
+            if (!code || start >= end) {
                 SetError(result, XorS("Empty bytecode"));
                 return result;
             }
 
-            try {
-                // Apply optimizations
-                std::vector<uint8_t> optimized_bytecode = bytecode;
-                if (m_settings.enable_optimizations) {
-                    if (m_settings.optimization_level >= 1) {
-                        optimized_bytecode = OptimizeDeadCodeElimination(optimized_bytecode);
-                    }
-                    if (m_settings.optimization_level >= 2) {
-                        optimized_bytecode = OptimizeConstantPropagation(optimized_bytecode);
-                        optimized_bytecode = OptimizeBasicBlocks(optimized_bytecode);
-                    }
-                    if (m_settings.optimization_level >= 3) {
-                        optimized_bytecode = OptimizeInstructionCombining(optimized_bytecode);
-                    }
-                }
-
-                // Generate machine code
-                JITCompiler::CodeGenerator generator;
-                EmitPrologue(generator);
-
-                // Translate bytecode to machine code
-                size_t pc = 0;
-                while (pc < optimized_bytecode.size()) {
-                    if (pc >= optimized_bytecode.size()) break;
-
-                    VMOpcode opcode = static_cast<VMOpcode>(optimized_bytecode[pc++]);
-                    uint32_t operand1 = 0, operand2 = 0, operand3 = 0;
+            if (end > code_size) {
+                SetError(result, XorS("Region exceeds the code"));
+                return result;
+            }
 
-                    // Decode operands (simplified)
-                    switch (opcode) {
-                        case VMOpcode::PUSH_INT:
-                        case VMOpcode::PUSH_FLOAT:
-                        case VMOpcode::JMP:
-                        case VMOpcode::JMP_IF_ZERO:
-                        case VMOpcode::JMP_IF_NOT_ZERO:
-                            if (pc + 4 <= optimized_bytecode.size()) {
-                                operand1 = *reinterpret_cast<const uint32_t*>(&optimized_bytecode[pc]);
-                                pc += 4;
-                            }
-                            break;
-                        default:
-                            break;
-                    }
+#if !defined(_M_X64) && !defined(__x86_64__) && !defined(_M_ARM64) && !defined(__aarch64__)
+            SetError(result, XorS("JIT code generation requires x86-64 or AArch64"));
+            return result;
+#endif
 
-                    if (!TranslateInstruction(generator, opcode, operand1, operand2, operand3)) {
-                        SetError(result, std::string(XorS("Failed to translate instruction: ")) + std::to_string(static_cast<int>(opcode)));
+            try {
+                // Cached code only needs copying into the arena
+                const CodeCacheKey key = MakeCacheKey(code, start, end);
+                std::vector<uint8_t> machine_code;
+                if (const std::shared_ptr<const CodeCacheEntry> cached = LookupCode(key, code)) {
+                    machine_code = cached->machine_code;
+                    result.entry_points = cached->entry_points;
+                    result.deopt_points = cached->deopt_points;
+                    result.pc_map = cached->pc_map;
+                    result.call_sites = cached->call_sites;
+                } else {
+                    if (!GenerateRegion(code, start, end, machine_code, result.entry_points, result.deopt_points, result.pc_map,
+                                        result.call_sites, result)) {
                         return result;
                     }
+                    CacheCompiledCode(key, code, function_name, machine_code, result.entry_points, result.deopt_points,
+                                      result.pc_map, result.call_sites);
                 }
 
-                EmitEpilogue(generator);
-                generator.ApplyRelocations();
-
-                // Allocate executable memory
-                result.code_size = generator.machine_code.size();
-                result.executable_memory = AllocateExecutableMemory(result.code_size);
+                // Copy machine code into the code arena
+                result.code_size = machine_code.size();
+                result.executable_memory = InstallExecutableCode(machine_code);
                 if (!result.executable_memory) {
                     SetError(result, XorS("Failed to allocate executable memory"));
                     return result;
                 }
-
-                // Copy machine code to executable memory
-                std::memcpy(result.executable_memory, generator.machine_code.data(), result.code_size);
-                result.native_code = generator.machine_code;
+                result.native_code = std::move(machine_code);
 
                 // Apply security measures
                 if (m_settings.enable_code_encryption) {
@@ -151,11 +147,6 @@ namespace AetherVisor {
 
                 result.success = true;
 
-                // Cache the result if a name is provided
-                if (!function_name.empty()) {
-                    CacheCompiledCode(function_name, result);
-                }
-
             } catch (const std::exception& e) {
                 SetError(result, std::string(XorS("Compilation exception: ")) + e.what());
             }
@@ -163,6 +154,167 @@ namespace AetherVisor {
             return result;
         }
 
+        // Decodes the region, then emits it in order with its out-of-line
+        // stubs after the main body
+        bool JITCompiler::GenerateRegion(const uint8_t* code, uint32_t start, uint32_t end, std::vector<uint8_t>& machine_code,
+                                         std::vector<std::pair<uint32_t, uint32_t>>& entry_points,
+                                         std::vector<JITDeoptPoint>& deopt_points,
+                                         std::vector<std::pair<uint32_t, uint32_t>>& pc_map, uint32_t& call_sites,
+                                         JITCompilationResult& result) {
+            // Decode the region once. Leaders are the region start, branch
+            // targets and whatever follows a branch, a call, a block end or
+            // JIT_EXECUTE, which the interpreter enters native code after.
+            CodeGenerator generator;
+            generator.count_back_edges = m_settings.enable_profiling;
+            std::vector<RegionInstruction> instructions;
+            std::set<uint32_t> leaders = { start };
+            for (uint32_t pc = start; pc < end;) {
+                RegionInstruction instruction{};
+                instruction.address = pc;
+                instruction.opcode = static_cast<VMOpcode>(code[pc]);
+                if (!DecodeOperands(&code[pc], end - pc, instruction.operand1, instruction.operand2)) {
+                    SetError(result, XorS("Truncated instruction operand"));
+                    return false;
+                }
+                const VMOpcodeInfo& info = GetOpcodeInfo(instruction.opcode);
+                instruction.next = pc + 1 + info.operand_size;
+                if (info.is_branch) {
+                    leaders.insert(instruction.operand1);
+                }
+                if (info.is_branch || !info.falls_through || instruction.opcode == VMOpcode::CALL ||
+                    instruction.opcode == VMOpcode::JIT_EXECUTE) {
+                    leaders.insert(instruction.next);
+                }
+                generator.instructions.insert(pc);
+                instructions.push_back(instruction);
+                pc = instruction.next;
+            }
+
+            uint32_t remaining = 0;
+            for (size_t i = instructions.size(); i-- > 0;) {
+                RegionInstruction& instruction = instructions[i];
+                instruction.is_leader = leaders.count(instruction.address) != 0;
+                instruction.block_remaining = remaining;
+                instruction.block_length = remaining + 1;
+                remaining = instruction.is_leader ? 0 : remaining + 1;
+            }
+
+            // Register loops are planned first, since their spill slots size
+            // the frame. Their headers enter the loop's code; the template code
+            // of the header runs when the entry checks fail.
+            std::vector<LoopPlan> loops = PlanLoops(instructions);
+            uint32_t spill_slots = 0;
+            for (const LoopPlan& loop : loops) {
+                generator.generic_headers[loop.header] = generator.NewLabel();
+                for (const RegionInstruction& instruction : instructions) {
+                    if (instruction.is_leader && instruction.address >= loop.header && instruction.address < loop.end) {
+                        generator.resume_labels[instruction.address] = generator.NewLabel();
+                    }
+                }
+                spill_slots = std::max(spill_slots, loop.spill_slots);
+            }
+
+            generator.exit_label = generator.NewLabel();
+            generator.deopt_label = generator.NewLabel();
+            generator.EmitPrologue(spill_slots);
+
+            std::vector<std::pair<uint32_t, const RegionInstruction*>> exhausted;
+            for (const RegionInstruction& instruction : instructions) {
+                auto generic = generator.generic_headers.find(instruction.address);
+                if (generic != generator.generic_headers.end()) {
+                    generator.EmitJump(instruction.address);
+                    generator.EmitLabel(generic->second);
+                } else {
+                    generator.EmitLabel(instruction.address);
+                }
+                if (instruction.is_leader) {
+                    exhausted.emplace_back(generator.NewLabel(), &instruction);
+                    generator.EmitBlockCharge(instruction.block_length, exhausted.back().first);
+                    auto resume = generator.resume_labels.find(instruction.address);
+                    if (resume != generator.resume_labels.end()) {
+                        generator.EmitLabel(resume->second);
+                    }
+                }
+                // Native calls step through a cache of their handler rather
+                // than looking it up by name each time
+                if (instruction.opcode == VMOpcode::CALL_NATIVE || instruction.opcode == VMOpcode::CALL_NATIVE_W) {
+                    generator.EmitNativeCall(instruction.address, generator.call_sites++,
+                                             generator.RefundLabel(instruction.block_remaining));
+                } else if (!TranslateInstruction(generator, instruction)) {
+                    generator.EmitStep(instruction.address, generator.RefundLabel(instruction.block_remaining));
+                }
+            }
+            generator.EmitJump(generator.TargetLabel(end));
+            for (LoopPlan& loop : loops) {
+                EmitLoop(generator, loop);
+            }
+            if (!generator.deopt_points.empty()) {
+                EmitDeoptStub(generator);
+            }
+
+            // Out-of-line code: slow paths first, since they add refund and
+            // exit stubs of their own
+            for (const auto& [label, instruction] : generator.slow_paths) {
+                generator.EmitLabel(label);
+                generator.EmitStep(instruction->address, generator.RefundLabel(instruction->block_remaining));
+                generator.EmitJump(generator.TargetLabel(instruction->next));
+            }
+            // Counting code returns to the VM at a loop header once the
+            // countdown runs out, so the loop can go on in the next tier
+            for (const auto& [header, label] : generator.back_edges) {
+                generator.EmitLabel(label);
+                generator.EmitCountBackEdge(header, generator.ExitLabel(header));
+                generator.EmitJump(header);
+            }
+            for (const auto& [label, leader] : exhausted) {
+                generator.EmitLabel(label);
+                generator.EmitRefund(leader->block_length);
+                generator.EmitSetPc(leader->address);
+                generator.EmitJump(generator.exit_label);
+            }
+            for (const auto& [count, label] : generator.refunds) {
+                generator.EmitLabel(label);
+                generator.EmitRefund(count);
+                generator.EmitJump(generator.exit_label);
+            }
+            for (const auto& [address, label] : generator.exits) {
+                generator.EmitLabel(label);
+                generator.EmitSetPc(address);
+                generator.EmitJump(generator.exit_label);
+            }
+            generator.EmitLabel(generator.exit_label);
+            generator.EmitEpilogue();
+            generator.ApplyRelocations();
+
+            for (const RegionInstruction& instruction : instructions) {
+                if (instruction.is_leader) {
+                    entry_points.emplace_back(instruction.address, generator.label_map[instruction.address]);
+                }
+            }
+
+            // Where the code of each instruction starts: its template code,
+            // the blocks of register loops and slow paths
+            for (const RegionInstruction& instruction : instructions) {
+                auto generic = generator.generic_headers.find(instruction.address);
+                const uint32_t label = generic != generator.generic_headers.end() ? generic->second : instruction.address;
+                pc_map.emplace_back(instruction.address, generator.label_map[label]);
+            }
+            for (const LoopPlan& loop : loops) {
+                pc_map.emplace_back(loop.header, generator.label_map[loop.header]);
+                for (const auto& [address, label] : loop.block_labels) {
+                    pc_map.emplace_back(address, generator.label_map[label]);
+                }
+            }
+            for (const auto& [label, instruction] : generator.slow_paths) {
+                pc_map.emplace_back(instruction->address, generator.label_map[label]);
+            }
+            std::stable_sort(pc_map.begin(), pc_map.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+            machine_code = std::move(generator.machine_code);
+            deopt_points = std::move(generator.deopt_points);
+            call_sites = generator.call_sites;
+            return true;
+        }
+
         int JITCompiler::Execute(const JITCompilationResult& compiled_code, void* vm_context, void* args) {
             if (!compiled_code.success || !compiled_code.executable_memory) {
                 return -1;
@@ -181,33 +333,97 @@ namespace AetherVisor {
             }
         }
 
-        bool JITCompiler::CacheCompiledCode(const std::string& key, const JITCompilationResult& result) {
-            if (m_cache_size_bytes + result.code_size > m_settings.max_code_cache_size) {
-                // Simple cache eviction - remove oldest entries
-                ClearCodeCache();
+        // FNV-1a over the region's bytes; the bounds, settings and the loops
+        // speculation was given up on complete the key
+        JITCompiler::CodeCacheKey JITCompiler::MakeCacheKey(const uint8_t* code, uint32_t start, uint32_t end) const {
+            CodeCacheKey key;
+            key.hash = 0xCBF29CE484222325ull;
+            for (uint32_t pc = start; pc < end; pc++) {
+                key.hash = (key.hash ^ code[pc]) * 0x100000001B3ull;
             }
-
-            auto cached_result = std::make_unique<JITCompilationResult>(result);
-            m_cache_size_bytes += result.code_size;
-            m_code_cache[key] = std::move(cached_result);
-            return true;
+            {
+                std::lock_guard<std::mutex> lock(m_speculation_mutex);
+                for (auto it = m_unspeculated_loops.lower_bound(start); it != m_unspeculated_loops.end() && *it < end; ++it) {
+                    key.hash = (key.hash ^ *it) * 0x100000001B3ull;
+                }
+            }
+            key.start = start;
+            key.end = end;
+            key.settings = m_settings.optimization_level | (m_settings.enable_optimizations ? 0x100 : 0) |
+                           (m_settings.enable_profiling ? 0x200 : 0) | (m_settings.enable_security_checks ? 0x400 : 0);
+            return key;
         }
 
-        JITCompilationResult* JITCompiler::GetCachedCode(const std::string& key) {
-            auto it = m_code_cache.find(key);
-            if (it != m_code_cache.end()) {
-                return it->second.get();
+        std::shared_ptr<const JITCompiler::CodeCacheEntry> JITCompiler::LookupCode(const CodeCacheKey& key, const uint8_t* code) const {
+            const std::shared_ptr<const CodeCache> cache = m_code_cache.load();
+            auto it = cache->find(key);
+            if (it == cache->end() || std::memcmp(it->second->bytecode.data(), code + key.start, key.end - key.start) != 0) {
+                m_cache_misses++;
+                return nullptr;
             }
-            return nullptr;
+            it->second->referenced.store(true, std::memory_order_relaxed);
+            m_cache_hits++;
+            return it->second;
         }
 
-        void JITCompiler::ClearCodeCache() {
-            for (auto& pair : m_code_cache) {
-                if (pair.second && pair.second->executable_memory) {
-                    FreeExecutableMemory(pair.second->executable_memory, pair.second->code_size);
+        void JITCompiler::CacheCompiledCode(const CodeCacheKey& key, const uint8_t* code, const std::string& name,
+                                            const std::vector<uint8_t>& machine_code,
+                                            const std::vector<std::pair<uint32_t, uint32_t>>& entry_points,
+                                            const std::vector<JITDeoptPoint>& deopt_points,
+                                            const std::vector<std::pair<uint32_t, uint32_t>>& pc_map, uint32_t call_sites) {
+            auto entry = std::make_shared<CodeCacheEntry>();
+            entry->key = key;
+            entry->name = name;
+            entry->bytecode.assign(code + key.start, code + key.end);
+            entry->machine_code = machine_code;
+            entry->entry_points = entry_points;
+            entry->deopt_points = deopt_points;
+            entry->pc_map = pc_map;
+            entry->call_sites = call_sites;
+            entry->bytes = entry->bytecode.size() + entry->machine_code.size() +
+                           (entry->entry_points.size() + entry->pc_map.size()) * sizeof(entry->entry_points[0]);
+            for (const JITDeoptPoint& point : deopt_points) {
+                entry->bytes += sizeof(point) + point.stack.size() * sizeof(JITDeoptValue) + point.slots.size() * sizeof(JITDeoptSlot);
+            }
+            entry->referenced = false;
+            if (entry->bytes > m_settings.max_code_cache_size) {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(m_cache_mutex);
+            auto cache = std::make_shared<CodeCache>(*m_code_cache.load());
+            if (cache->count(key)) {
+                return;                             // Compiled concurrently, or a colliding region
+            }
+
+            size_t size = m_cache_size_bytes.load();
+            while (size + entry->bytes > m_settings.max_code_cache_size && !m_cache_clock.empty()) {
+                if (m_cache_hand == m_cache_clock.end()) {
+                    m_cache_hand = m_cache_clock.begin();
+                }
+                const std::shared_ptr<const CodeCacheEntry>& victim = *m_cache_hand;
+                if (victim->referenced.exchange(false, std::memory_order_relaxed)) {
+                    ++m_cache_hand;
+                    continue;
                 }
+                size -= victim->bytes;
+                cache->erase(victim->key);
+                m_cache_hand = m_cache_clock.erase(m_cache_hand);
+                m_cache_evictions++;
             }
-            m_code_cache.clear();
+
+            // New entries go behind the hand, the last it will visit
+            (*cache)[key] = entry;
+            m_cache_clock.insert(m_cache_hand, entry);
+            m_cache_size_bytes = size + entry->bytes;
+            m_code_cache.store(std::shared_ptr<const CodeCache>(std::move(cache)));
+        }
+
+        void JITCompiler::ClearCodeCache() {
+            std::lock_guard<std::mutex> lock(m_cache_mutex);
+            m_code_cache.store(std::make_shared<const CodeCache>());
+            m_cache_clock.clear();
+            m_cache_hand = m_cache_clock.end();
             m_cache_size_bytes = 0;
         }
 
@@ -215,47 +431,24 @@ namespace AetherVisor {
             return m_cache_size_bytes;
         }
 
-        void* JITCompiler::AllocateExecutableMemory(size_t size) {
-#ifdef _WIN32
-            return AllocateExecutableMemoryWindows(size);
-#else
-            return AllocateExecutableMemoryPosix(size);
-#endif
-        }
-
-        void JITCompiler::FreeExecutableMemory(void* memory, size_t size) {
-#ifdef _WIN32
-            FreeExecutableMemoryWindows(memory, size);
-#else
-            FreeExecutableMemoryPosix(memory, size);
-#endif
+        JITCacheStatistics JITCompiler::GetCacheStatistics() const {
+            JITCacheStatistics statistics;
+            statistics.entries = m_code_cache.load()->size();
+            statistics.bytes = m_cache_size_bytes;
+            statistics.capacity = m_settings.max_code_cache_size;
+            statistics.hits = m_cache_hits;
+            statistics.misses = m_cache_misses;
+            statistics.evictions = m_cache_evictions;
+            return statistics;
         }
 
-#ifdef _WIN32
-        void* JITCompiler::AllocateExecutableMemoryWindows(size_t size) {
-            return VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+        void* JITCompiler::InstallExecutableCode(const std::vector<uint8_t>& code) {
+            return JITCodeArena::GetInstance().Install(code.data(), code.size());
         }
 
-        void JITCompiler::FreeExecutableMemoryWindows(void* memory, size_t size) {
-            if (memory) {
-                VirtualFree(memory, 0, MEM_RELEASE);
-            }
-        }
-#else
-        void* JITCompiler::AllocateExecutableMemoryPosix(size_t size) {
-            void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-            if (memory == MAP_FAILED) {
-                return nullptr;
-            }
-            return memory;
-        }
-
-        void JITCompiler::FreeExecutableMemoryPosix(void* memory, size_t size) {
-            if (memory) {
-                munmap(memory, size);
-            }
+        void JITCompiler::FreeExecutableMemory(void* memory, size_t size) {
+            JITCodeArena::GetInstance().Free(memory, size);
         }
-#endif
 
         // Optimization implementations (simplified)
         std::vector<uint8_t> JITCompiler::OptimizeBasicBlocks(const std::vector<uint8_t>& bytecode) {
@@ -271,26 +464,10 @@ namespace AetherVisor {
         }
 
         std::vector<uint8_t> JITCompiler::OptimizeDeadCodeElimination(const std::vector<uint8_t>& bytecode) {
-            // Dead code elimination
-            // This is a simplified implementation
-            std::vector<uint8_t> optimized;
-            
-            for (size_t i = 0; i < bytecode.size(); ++i) {
-                VMOpcode opcode = static_cast<VMOpcode>(bytecode[i]);
-                
-                // Simple dead code elimination - remove consecutive NOPs
-                if (opcode == VMOpcode::NOP) {
-                    // Skip consecutive NOPs, keep only one
-                    bool has_previous_nop = i > 0 && static_cast<VMOpcode>(bytecode[i-1]) == VMOpcode::NOP;
-                    if (!has_previous_nop) {
-                        optimized.push_back(bytecode[i]);
-                    }
-                } else {
-                    optimized.push_back(bytecode[i]);
-                }
-            }
-            
-            return optimized;
+            // Decoded by instruction, so operand bytes are never taken for NOPs
+            // and jumps are relocated around what is removed
+            BytecodeOptimizer optimizer;
+            return optimizer.EliminateDeadCode(bytecode);
         }
 
         std::vector<uint8_t> JITCompiler::OptimizeInstructionCombining(const std::vector<uint8_t>& bytecode) {
@@ -299,156 +476,650 @@ namespace AetherVisor {
             return bytecode;
         }
 
-        // Code generation helpers
-        void JITCompiler::CodeGenerator::EmitByte(uint8_t byte) {
-            machine_code.push_back(byte);
-        }
-
-        void JITCompiler::CodeGenerator::EmitWord(uint16_t word) {
-            machine_code.push_back(word & 0xFF);
-            machine_code.push_back((word >> 8) & 0xFF);
-        }
-
-        void JITCompiler::CodeGenerator::EmitDWord(uint32_t dword) {
-            machine_code.push_back(dword & 0xFF);
-            machine_code.push_back((dword >> 8) & 0xFF);
-            machine_code.push_back((dword >> 16) & 0xFF);
-            machine_code.push_back((dword >> 24) & 0xFF);
-        }
-
-        void JITCompiler::CodeGenerator::EmitInstruction(const std::vector<uint8_t>& instruction) {
-            machine_code.insert(machine_code.end(), instruction.begin(), instruction.end());
-        }
-
-        void JITCompiler::CodeGenerator::ApplyRelocations() {
-            for (const auto& relocation : relocations) {
-                uint32_t offset = relocation.first;
-                uint32_t target = relocation.second;
-                
-                if (offset + 4 <= machine_code.size()) {
-                    *reinterpret_cast<uint32_t*>(&machine_code[offset]) = target;
-                }
-            }
-        }
-
-        void JITCompiler::EmitPrologue(CodeGenerator& gen) {
-            // x86-64 function prologue
-            // push rbp
-            gen.EmitByte(0x55);
-            // mov rbp, rsp
-            gen.EmitByte(0x48);
-            gen.EmitByte(0x89);
-            gen.EmitByte(0xE5);
-        }
-
-        void JITCompiler::EmitEpilogue(CodeGenerator& gen) {
-            // x86-64 function epilogue
-            // mov rsp, rbp
-            gen.EmitByte(0x48);
-            gen.EmitByte(0x89);
-            gen.EmitByte(0xEC);
-            // pop rbp
-            gen.EmitByte(0x5D);
-            // ret
-            gen.EmitByte(0xC3);
-        }
-
-        bool JITCompiler::TranslateInstruction(CodeGenerator& gen, VMOpcode opcode, 
-                                             uint32_t operand1, uint32_t operand2, uint32_t operand3) {
-            // Simplified instruction translation
-            switch (opcode) {
-                case VMOpcode::PUSH_INT:
-                    EmitStackOperation(gen, opcode, operand1);
-                    break;
-                    
-                case VMOpcode::ADD:
-                case VMOpcode::SUB:
-                case VMOpcode::MUL:
-                case VMOpcode::DIV:
-                    EmitArithmetic(gen, opcode);
-                    break;
-                    
-                case VMOpcode::CMP_EQ:
-                case VMOpcode::CMP_GT:
-                case VMOpcode::CMP_LT:
-                    EmitComparison(gen, opcode);
-                    break;
-                    
-                case VMOpcode::JMP:
-                case VMOpcode::JMP_IF_ZERO:
-                case VMOpcode::JMP_IF_NOT_ZERO:
-                    EmitControlFlow(gen, opcode, operand1);
-                    break;
-                    
-                case VMOpcode::NOP:
-                    // x86 NOP
-                    gen.EmitByte(0x90);
-                    break;
-                    
-                case VMOpcode::HALT:
-                    // Simple implementation - just return
-                    gen.EmitByte(0xC3); // ret
-                    break;
-                    
-                default:
-                    // For unsupported opcodes, emit a call to interpreter fallback
-                    // This is a simplified approach
-                    gen.EmitByte(0x90); // NOP for now
-                    break;
+        uint32_t JITCompiler::CodeGenerator::TargetLabel(uint32_t address) {
+            return instructions.count(address) ? address : ExitLabel(address);
+        }
+
+        uint32_t JITCompiler::CodeGenerator::ExitLabel(uint32_t address) {
+            auto it = exits.find(address);
+            if (it == exits.end()) {
+                it = exits.emplace(address, NewLabel()).first;
             }
-            
-            return true;
+            return it->second;
+        }
+
+        uint32_t JITCompiler::CodeGenerator::BranchLabel(const RegionInstruction& branch) {
+            const uint32_t target = branch.operand1;
+            if (!count_back_edges || target > branch.address || !instructions.count(target)) {
+                return TargetLabel(target);
+            }
+            auto it = back_edges.find(target);
+            if (it == back_edges.end()) {
+                it = back_edges.emplace(target, NewLabel()).first;
+            }
+            return it->second;
+        }
+
+        uint32_t JITCompiler::CodeGenerator::ResumeLabel(uint32_t address) {
+            auto it = resume_labels.find(address);
+            return it != resume_labels.end() ? it->second : address;
+        }
+
+        uint32_t JITCompiler::CodeGenerator::RefundLabel(uint32_t remaining) {
+            if (remaining == 0) {
+                return exit_label;
+            }
+            auto it = refunds.find(remaining);
+            if (it == refunds.end()) {
+                it = refunds.emplace(remaining, NewLabel()).first;
+            }
+            return it->second;
+        }
+
+        namespace {
+            // Binary operations of register loops: the operand type both sides
+            // must have, the result type, and whether it is a comparison
+            bool LoopOperandTypes(VMOpcode opcode, VMDataType& operand, VMDataType& result, bool& compare) {
+                operand = result = VMDataType::INT32;
+                compare = false;
+                switch (opcode) {
+                    case VMOpcode::ADD: case VMOpcode::SUB: case VMOpcode::MUL:
+                    case VMOpcode::BIT_AND: case VMOpcode::BIT_OR: case VMOpcode::BIT_XOR:
+                    case VMOpcode::ADD_I32: case VMOpcode::SUB_I32: case VMOpcode::MUL_I32:
+                        return true;
+                    case VMOpcode::ADD_F64: case VMOpcode::SUB_F64: case VMOpcode::MUL_F64: case VMOpcode::DIV_F64:
+                        operand = result = VMDataType::FLOAT64;
+                        return true;
+                    default:
+                        break;
+                }
+                compare = true;
+                if (opcode >= VMOpcode::CMP_EQ_F64 && opcode <= VMOpcode::CMP_LE_F64) {
+                    operand = VMDataType::FLOAT64;
+                    return true;
+                }
+                return (opcode >= VMOpcode::CMP_EQ && opcode <= VMOpcode::CMP_LE) ||
+                       (opcode >= VMOpcode::CMP_EQ_I32 && opcode <= VMOpcode::CMP_LE_I32);
+            }
+
+            // Opcodes register loops compile; anything else leaves the loop
+            bool IsLoopOpcode(VMOpcode opcode) {
+                switch (opcode) {
+                    case VMOpcode::PUSH_INT:
+                    case VMOpcode::PUSH_DOUBLE:
+                    case VMOpcode::POP:
+                    case VMOpcode::DUP:
+                    case VMOpcode::SWAP:
+                    case VMOpcode::LOAD_LOCAL:
+                    case VMOpcode::STORE_LOCAL:
+                    case VMOpcode::LOAD_GLOBAL:
+                    case VMOpcode::STORE_GLOBAL:
+                    case VMOpcode::JMP:
+                    case VMOpcode::JMP_IF_ZERO:
+                    case VMOpcode::JMP_IF_NOT_ZERO:
+                    case VMOpcode::NOP:
+                    case VMOpcode::JIT_EXECUTE:
+                        return true;
+                    default:
+                        break;
+                }
+                VMDataType operand, result;
+                bool compare;
+                return LoopOperandTypes(opcode, operand, result, compare);
+            }
+
+            bool IsCheckedArithmetic(VMOpcode opcode) {
+                switch (opcode) {
+                    case VMOpcode::ADD: case VMOpcode::SUB: case VMOpcode::MUL:
+                    case VMOpcode::ADD_I32: case VMOpcode::SUB_I32: case VMOpcode::MUL_I32:
+                        return true;
+                    default:
+                        return false;
+                }
+            }
+
         }
 
-        void JITCompiler::EmitStackOperation(CodeGenerator& gen, VMOpcode opcode, uint32_t operand) {
-            // Simplified stack operations
-            switch (opcode) {
-                case VMOpcode::PUSH_INT:
-                    // push immediate value
-                    gen.EmitByte(0x68); // push imm32
-                    gen.EmitDWord(operand);
-                    break;
-                default:
-                    break;
+        // Loops are found by their back-edges and planned outermost first;
+        // a loop that cannot be planned, or that speculation was given up
+        // on, leaves its inner loops to try
+        std::vector<JITCompiler::LoopPlan> JITCompiler::PlanLoops(const std::vector<RegionInstruction>& instructions) {
+            std::vector<LoopPlan> plans;
+            if (!m_settings.enable_optimizations || m_settings.optimization_level < 2 || m_settings.enable_profiling) {
+                return plans;
+            }
+#if !defined(_M_X64) && !defined(__x86_64__)
+            return plans;                   // Register loops are emitted for x86-64 only
+#endif
+
+            std::map<uint32_t, size_t> index_of;
+            for (size_t i = 0; i < instructions.size(); i++) {
+                index_of[instructions[i].address] = i;
+            }
+            std::map<size_t, size_t> loops;         // Header -> furthest back-edge, by index
+            for (size_t i = 0; i < instructions.size(); i++) {
+                const RegionInstruction& instruction = instructions[i];
+                const bool branch = instruction.opcode == VMOpcode::JMP || instruction.opcode == VMOpcode::JMP_IF_ZERO ||
+                                    instruction.opcode == VMOpcode::JMP_IF_NOT_ZERO;
+                auto header = index_of.find(instruction.operand1);
+                if (branch && instruction.operand1 <= instruction.address && header != index_of.end()) {
+                    size_t& last = loops[header->second];
+                    last = std::max(last, i);
+                }
+            }
+
+            std::set<uint32_t> unspeculated;
+            {
+                std::lock_guard<std::mutex> lock(m_speculation_mutex);
+                unspeculated = m_unspeculated_loops;
+            }
+            size_t covered = 0;
+            for (const auto& [first, last] : loops) {
+                if (first < covered || unspeculated.count(instructions[first].address)) {
+                    continue;
+                }
+                LoopPlan plan;
+                if (PlanLoop(instructions, first, last, plan)) {
+                    plans.push_back(std::move(plan));
+                    covered = last + 1;
+                }
             }
+            return plans;
         }
 
-        void JITCompiler::EmitArithmetic(CodeGenerator& gen, VMOpcode opcode) {
-            // Simplified arithmetic operations
-            // These would need to interact with the VM's stack properly
-            switch (opcode) {
-                case VMOpcode::ADD:
-                    // pop rax; pop rbx; add rax, rbx; push rax
-                    gen.EmitByte(0x58); // pop rax
-                    gen.EmitByte(0x5B); // pop rbx
-                    gen.EmitByte(0x48); gen.EmitByte(0x01); gen.EmitByte(0xD8); // add rax, rbx
-                    gen.EmitByte(0x50); // push rax
-                    break;
-                default:
-                    break;
+        bool JITCompiler::PlanLoop(const std::vector<RegionInstruction>& instructions, size_t first, size_t last, LoopPlan& plan) {
+            plan.header = instructions[first].address;
+            plan.end = instructions[last].next;
+            plan.max_depth = 0;
+            plan.spill_slots = 0;
+            if (!InferLoopTypes(instructions, first, last, plan) || !BuildLoopOperations(instructions, first, last, plan)) {
+                return false;
             }
+            AllocateLoopRegisters(plan);
+            return true;
         }
 
-        void JITCompiler::EmitComparison(CodeGenerator& gen, VMOpcode opcode) {
-            // Simplified comparison operations
-            gen.EmitByte(0x90); // NOP placeholder
+        // A slot takes the type of what the loop stores to it, or else of the
+        // first typed use of a value loaded from it. Slots nothing decides are
+        // taken to be INT32, which entry checks like any other.
+        bool JITCompiler::InferLoopTypes(const std::vector<RegionInstruction>& instructions, size_t first, size_t last,
+                                         LoopPlan& plan) {
+            struct Abstract {
+                VMDataType type;                    // UNDEFINED: the type of slot, not known yet
+                uint32_t slot;
+            };
+
+            auto index_of = [&instructions, first, last](uint32_t address) {     // Within the loop's instructions
+                return static_cast<size_t>(std::lower_bound(instructions.begin() + first, instructions.begin() + last + 1, address,
+                    [](const RegionInstruction& instruction, uint32_t value) { return instruction.address < value; }) - instructions.begin());
+            };
+            auto find_slot = [&plan](uint32_t index, bool global) {
+                for (uint32_t i = 0; i < plan.slots.size(); i++) {
+                    if (plan.slots[i].index == index && plan.slots[i].global == global) {
+                        return i;
+                    }
+                }
+                plan.slots.push_back({ index, global, VMDataType::UNDEFINED, false, false, 0 });
+                return static_cast<uint32_t>(plan.slots.size() - 1);
+            };
+
+            bool changed = true;
+            auto constrain = [&plan, &changed](uint32_t slot, VMDataType type) {
+                if (plan.slots[slot].type == VMDataType::UNDEFINED) {
+                    plan.slots[slot].type = type;
+                    changed = true;
+                    return true;
+                }
+                return plan.slots[slot].type == type;
+            };
+            auto require = [&constrain](const Abstract& value, VMDataType type) {
+                return value.type == VMDataType::UNDEFINED ? constrain(value.slot, type) : value.type == type;
+            };
+
+            while (changed) {
+                changed = false;
+                std::map<uint32_t, std::vector<Abstract>> entries = { { plan.header, {} } };
+                std::set<uint32_t> pending = { plan.header };
+                while (!pending.empty()) {
+                    const uint32_t leader = *pending.begin();
+                    pending.erase(pending.begin());
+                    std::vector<Abstract> stack = entries[leader];
+                    auto edge = [&](uint32_t target) {
+                        if (target >= plan.header && target < plan.end && entries.emplace(target, stack).second) {
+                            pending.insert(target);
+                        }
+                    };
+
+                    for (size_t i = index_of(leader); i <= last; i++) {
+                        const RegionInstruction& instruction = instructions[i];
+                        if (instruction.address != leader && instruction.is_leader) {
+                            edge(instruction.address);
+                            break;
+                        }
+                        if (!IsLoopOpcode(instruction.opcode)) {
+                            break;
+                        }
+
+                        VMDataType operand, result;
+                        bool compare;
+                        if (LoopOperandTypes(instruction.opcode, operand, result, compare)) {
+                            if (stack.size() < 2) {
+                                return false;
+                            }
+                            const Abstract right = stack.back();
+                            stack.pop_back();
+                            const Abstract left = stack.back();
+                            stack.pop_back();
+                            if (!require(left, operand) || !require(right, operand)) {
+                                return false;
+                            }
+                            stack.push_back({ result, 0 });
+                            continue;
+                        }
+
+                        bool ends_block = false;
+                        switch (instruction.opcode) {
+                            case VMOpcode::PUSH_INT:
+                                stack.push_back({ VMDataType::INT32, 0 });
+                                break;
+                            case VMOpcode::PUSH_DOUBLE:
+                                stack.push_back({ VMDataType::FLOAT64, 0 });
+                                break;
+                            case VMOpcode::POP:
+                                if (stack.empty()) return false;
+                                stack.pop_back();
+                                break;
+                            case VMOpcode::DUP:
+                                if (stack.empty()) return false;
+                                stack.push_back(stack.back());
+                                break;
+                            case VMOpcode::SWAP:
+                                if (stack.size() < 2) return false;
+                                std::swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+                                break;
+                            case VMOpcode::LOAD_LOCAL:
+                            case VMOpcode::LOAD_GLOBAL: {
+                                const uint32_t slot = find_slot(instruction.operand1, instruction.opcode == VMOpcode::LOAD_GLOBAL);
+                                stack.push_back({ plan.slots[slot].type, slot });
+                                break;
+                            }
+                            case VMOpcode::STORE_LOCAL:
+                            case VMOpcode::STORE_GLOBAL: {
+                                if (stack.empty()) return false;
+                                const uint32_t slot = find_slot(instruction.operand1, instruction.opcode == VMOpcode::STORE_GLOBAL);
+                                const Abstract value = stack.back();
+                                stack.pop_back();
+                                if (value.type != VMDataType::UNDEFINED) {
+                                    if (!constrain(slot, value.type)) return false;
+                                } else if (plan.slots[slot].type != VMDataType::UNDEFINED) {
+                                    if (!constrain(value.slot, plan.slots[slot].type)) return false;
+                                }
+                                break;
+                            }
+                            case VMOpcode::JMP:
+                                edge(instruction.operand1);
+                                ends_block = true;
+                                break;
+                            case VMOpcode::JMP_IF_ZERO:
+                            case VMOpcode::JMP_IF_NOT_ZERO:
+                                if (stack.empty() || !require(stack.back(), VMDataType::INT32)) return false;
+                                stack.pop_back();
+                                edge(instruction.operand1);
+                                break;
+                            default:
+                                break;
+                        }
+                        if (ends_block) {
+                            break;
+                        }
+                    }
+                }
+            }
+
+            for (LoopSlot& slot : plan.slots) {
+                if (slot.type == VMDataType::UNDEFINED) {
+                    slot.type = VMDataType::INT32;
+                }
+            }
+            return true;
+        }
+
+        // Values on the stack at a block boundary move into the carried value
+        // for their depth and type, so no other value outlives its block. A
+        // slot loaded onto the stack is the slot's own value until the slot is
+        // stored to, which copies it first.
+        bool JITCompiler::BuildLoopOperations(const std::vector<RegionInstruction>& instructions, size_t first, size_t last,
+                                              LoopPlan& plan) {
+            auto index_of = [&instructions, first, last](uint32_t address) {     // Within the loop's instructions
+                return static_cast<size_t>(std::lower_bound(instructions.begin() + first, instructions.begin() + last + 1, address,
+                    [](const RegionInstruction& instruction, uint32_t value) { return instruction.address < value; }) - instructions.begin());
+            };
+            auto new_value = [&plan](VMDataType type, bool carried) {
+                plan.values.push_back({ type, carried, { true, 0, 0 } });
+                return static_cast<uint32_t>(plan.values.size() - 1);
+            };
+            auto find_slot = [&plan](uint32_t index, bool global) {
+                for (uint32_t i = 0; i < plan.slots.size(); i++) {
+                    if (plan.slots[i].index == index && plan.slots[i].global == global) {
+                        return i;
+                    }
+                }
+                return NO_EXIT;
+            };
+            auto operation = [](LoopOperation::Kind kind, uint32_t address) {
+                LoopOperation result{};
+                result.kind = kind;
+                result.opcode = VMOpcode::NOP;
+                result.address = address;
+                result.result = result.left = result.right = NO_EXIT;
+                result.exit = NO_EXIT;
+                return result;
+            };
+            auto add_exit = [&plan](LoopExit::Kind kind, uint32_t address, uint32_t refund, const std::vector<uint32_t>& stack) {
+                plan.exits.push_back({ kind, address, refund, stack });
+                return static_cast<uint32_t>(plan.exits.size() - 1);
+            };
+
+            for (LoopSlot& slot : plan.slots) {
+                slot.value = new_value(slot.type, true);
+            }
+            std::map<std::pair<uint32_t, VMDataType>, uint32_t> boundary;
+            auto boundary_value = [&](uint32_t depth, VMDataType type) {
+                auto it = boundary.find({ depth, type });
+                if (it == boundary.end()) {
+                    it = boundary.emplace(std::make_pair(depth, type), new_value(type, true)).first;
+                }
+                return it->second;
+            };
+
+            std::map<uint32_t, std::vector<VMDataType>> entries = { { plan.header, {} } };
+            std::set<uint32_t> pending = { plan.header };
+            bool loops = false;
+
+            while (!pending.empty()) {
+                const uint32_t leader = *pending.begin();
+                pending.erase(pending.begin());
+                const std::vector<VMDataType> types = entries[leader];
+                std::vector<uint32_t> stack;
+                for (uint32_t depth = 0; depth < types.size(); depth++) {
+                    stack.push_back(boundary_value(depth, types[depth]));
+                }
+
+                const size_t start = index_of(leader);
+                LoopOperation block = operation(LoopOperation::Kind::BLOCK, leader);
+                block.immediate = instructions[start].block_length;
+                block.exit = add_exit(LoopExit::Kind::BUDGET, leader, instructions[start].block_length, stack);
+                plan.operations.push_back(block);
+
+                // Internal edges carry the stack into the target's boundary
+                // values; edges out of the loop exit with it
+                auto edge = [&](LoopOperation& branch, uint32_t target) {
+                    if (target < plan.header || target >= plan.end) {
+                        branch.exit = add_exit(LoopExit::Kind::BRANCH, target, 0, stack);
+                        return true;
+                    }
+                    std::vector<VMDataType> target_types;
+                    for (uint32_t value : stack) {
+                        target_types.push_back(plan.values[value].type);
+                    }
+                    auto known = entries.find(target);
+                    if (known == entries.end()) {
+                        entries.emplace(target, target_types);
+                        pending.insert(target);
+                    } else if (known->second != target_types) {
+                        return false;
+                    }
+                    loops = loops || target == plan.header;
+                    branch.address = target;
+                    for (uint32_t depth = 0; depth < stack.size(); depth++) {
+                        const uint32_t to = boundary_value(depth, target_types[depth]);
+                        if (to != stack[depth]) {
+                            branch.moves.emplace_back(to, stack[depth]);
+                        }
+                    }
+                    return true;
+                };
+                auto jump = [&](uint32_t target) {
+                    LoopOperation branch = operation(LoopOperation::Kind::JUMP, target);
+                    if (!edge(branch, target)) {
+                        return false;
+                    }
+                    if (branch.exit != NO_EXIT) {
+                        branch.kind = LoopOperation::Kind::EXIT;
+                    }
+                    plan.operations.push_back(branch);
+                    return true;
+                };
+
+                bool terminated = false;
+                for (size_t i = start; i <= last && !terminated; i++) {
+                    const RegionInstruction& instruction = instructions[i];
+                    if (i != start && instruction.is_leader) {
+                        if (!jump(instruction.address)) return false;
+                        terminated = true;
+                        break;
+                    }
+                    if (!IsLoopOpcode(instruction.opcode)) {
+                        LoopOperation leave = operation(LoopOperation::Kind::EXIT, instruction.address);
+                        leave.exit = add_exit(LoopExit::Kind::RESUME, instruction.address, 0, stack);
+                        plan.operations.push_back(leave);
+                        terminated = true;
+                        break;
+                    }
+
+                    VMDataType operand, result;
+                    bool compare;
+                    if (LoopOperandTypes(instruction.opcode, operand, result, compare)) {
+                        if (stack.size() < 2) return false;
+                        const uint32_t right = stack[stack.size() - 1];
+                        const uint32_t left = stack[stack.size() - 2];
+                        if (plan.values[left].type != operand || plan.values[right].type != operand) {
+                            return false;
+                        }
+                        LoopOperation arithmetic = operation(compare ? LoopOperation::Kind::COMPARE : LoopOperation::Kind::ARITHMETIC,
+                                                             instruction.address);
+                        arithmetic.opcode = instruction.opcode;
+                        arithmetic.left = left;
+                        arithmetic.right = right;
+                        if (IsCheckedArithmetic(instruction.opcode)) {
+                            arithmetic.exit = add_exit(LoopExit::Kind::DEOPT, instruction.address, instruction.block_remaining + 1, stack);
+                        }
+                        stack.resize(stack.size() - 2);
+                        arithmetic.result = new_value(result, false);
+                        stack.push_back(arithmetic.result);
+                        plan.operations.push_back(arithmetic);
+                        continue;
+                    }
+
+                    switch (instruction.opcode) {
+                        case VMOpcode::PUSH_INT:
+                        case VMOpcode::PUSH_DOUBLE: {
+                            const bool is_double = instruction.opcode == VMOpcode::PUSH_DOUBLE;
+                            LoopOperation constant = operation(LoopOperation::Kind::CONSTANT, instruction.address);
+                            constant.result = new_value(is_double ? VMDataType::FLOAT64 : VMDataType::INT32, false);
+                            constant.immediate = is_double ? (instruction.operand1 | static_cast<uint64_t>(instruction.operand2) << 32)
+                                                           : instruction.operand1;
+                            stack.push_back(constant.result);
+                            plan.operations.push_back(constant);
+                            break;
+                        }
+                        case VMOpcode::POP:
+                            if (stack.empty()) return false;
+                            stack.pop_back();
+                            break;
+                        case VMOpcode::DUP:
+                            if (stack.empty()) return false;
+                            stack.push_back(stack.back());
+                            break;
+                        case VMOpcode::SWAP:
+                            if (stack.size() < 2) return false;
+                            std::swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+                            break;
+                        case VMOpcode::LOAD_LOCAL:
+                        case VMOpcode::LOAD_GLOBAL:
+                            stack.push_back(plan.slots[find_slot(instruction.operand1, instruction.opcode == VMOpcode::LOAD_GLOBAL)].value);
+                            break;
+                        case VMOpcode::STORE_LOCAL:
+                        case VMOpcode::STORE_GLOBAL: {
+                            if (stack.empty()) return false;
+                            const uint32_t slot = find_slot(instruction.operand1, instruction.opcode == VMOpcode::STORE_GLOBAL);
+                            LoopSlot& target = plan.slots[slot];
+                            const uint32_t value = stack.back();
+                            stack.pop_back();
+                            if (plan.values[value].type != target.type) return false;
+                            if (std::find(stack.begin(), stack.end(), target.value) != stack.end()) {
+                                LoopOperation copy = operation(LoopOperation::Kind::MOVE, instruction.address);
+                                copy.left = target.value;
+                                copy.result = new_value(target.type, false);
+                                std::replace(stack.begin(), stack.end(), target.value, copy.result);
+                                plan.operations.push_back(copy);
+                            }
+                            if (value != target.value) {
+                                LoopOperation move = operation(LoopOperation::Kind::MOVE, instruction.address);
+                                move.left = value;
+                                move.result = target.value;
+                                plan.operations.push_back(move);
+                                target.stored = true;
+                            }
+                            LoopOperation store = operation(LoopOperation::Kind::STORE, instruction.address);
+                            store.left = target.value;
+                            store.immediate = slot;
+                            plan.operations.push_back(store);
+                            break;
+                        }
+                        case VMOpcode::JMP:
+                            if (!jump(instruction.operand1)) return false;
+                            terminated = true;
+                            break;
+                        case VMOpcode::JMP_IF_ZERO:
+                        case VMOpcode::JMP_IF_NOT_ZERO: {
+                            if (stack.empty() || plan.values[stack.back()].type != VMDataType::INT32) return false;
+                            LoopOperation branch = operation(LoopOperation::Kind::BRANCH, instruction.address);
+                            branch.left = stack.back();
+                            branch.on_zero = instruction.opcode == VMOpcode::JMP_IF_ZERO;
+                            stack.pop_back();
+
+                            // An INT32 comparison used only by the branch sets the flags for it
+                            LoopOperation& previous = plan.operations.back();
+                            if (previous.kind == LoopOperation::Kind::COMPARE && previous.result == branch.left &&
+                                plan.values[previous.left].type == VMDataType::INT32 &&
+                                std::find(stack.begin(), stack.end(), branch.left) == stack.end()) {
+                                branch.fused = true;
+                                branch.opcode = previous.opcode;
+                                branch.left = previous.left;
+                                branch.right = previous.right;
+                                plan.operations.pop_back();
+                            }
+                            if (!edge(branch, instruction.operand1)) return false;
+                            plan.operations.push_back(branch);
+                            break;
+                        }
+                        default:
+                            break;
+                    }
+                    plan.max_depth = std::max(plan.max_depth, static_cast<uint32_t>(stack.size()));
+                }
+
+                if (!terminated && !jump(instructions[last].next)) {
+                    return false;
+                }
+            }
+            if (!loops) {
+                return false;
+            }
+
+            // Slots live into the header are checked and loaded on entry and
+            // written back on exit; the rest are written through as they are
+            // stored, since the VM may look at them after any exit
+            std::vector<size_t> starts;
+            for (size_t i = 0; i < plan.operations.size(); i++) {
+                if (plan.operations[i].kind == LoopOperation::Kind::BLOCK) {
+                    starts.push_back(i);
+                }
+            }
+            std::vector<bool> is_slot(plan.values.size(), false);
+            for (const LoopSlot& slot : plan.slots) {
+                is_slot[slot.value] = true;
+            }
+            std::map<uint32_t, std::set<uint32_t>> exposed, defined, live;
+            std::map<uint32_t, std::vector<uint32_t>> successors;
+            for (size_t b = 0; b < starts.size(); b++) {
+                const uint32_t address = plan.operations[starts[b]].address;
+                const size_t end = b + 1 < starts.size() ? starts[b + 1] : plan.operations.size();
+                for (size_t i = starts[b]; i < end; i++) {
+                    const LoopOperation& op = plan.operations[i];
+                    std::vector<uint32_t> uses = { op.left, op.right };
+                    if (op.exit != NO_EXIT) {
+                        uses.insert(uses.end(), plan.exits[op.exit].stack.begin(), plan.exits[op.exit].stack.end());
+                    }
+                    for (const auto& move : op.moves) {
+                        uses.push_back(move.second);
+                    }
+                    for (uint32_t use : uses) {
+                        if (use != NO_EXIT && is_slot[use] && !defined[address].count(use)) {
+                            exposed[address].insert(use);
+                        }
+                    }
+                    if (op.result != NO_EXIT && is_slot[op.result]) {
+                        defined[address].insert(op.result);
+                    }
+                    if ((op.kind == LoopOperation::Kind::JUMP || op.kind == LoopOperation::Kind::BRANCH) &&
+                        op.exit == NO_EXIT && op.address != plan.header) {
+                        successors[address].push_back(op.address);
+                    }
+                }
+            }
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                for (size_t b = starts.size(); b-- > 0;) {
+                    const uint32_t address = plan.operations[starts[b]].address;
+                    std::set<uint32_t> in = exposed[address];
+                    for (uint32_t successor : successors[address]) {
+                        for (uint32_t value : live[successor]) {
+                            if (!defined[address].count(value)) {
+                                in.insert(value);
+                            }
+                        }
+                    }
+                    if (in != live[address]) {
+                        live[address] = std::move(in);
+                        changed = true;
+                    }
+                }
+            }
+            for (LoopSlot& slot : plan.slots) {
+                slot.live_in = live[plan.header].count(slot.value) != 0;
+            }
+            return true;
         }
 
-        void JITCompiler::EmitControlFlow(CodeGenerator& gen, VMOpcode opcode, uint32_t operand) {
-            // Simplified control flow operations
-            gen.EmitByte(0x90); // NOP placeholder
+        void JITCompiler::DisableSpeculation(uint32_t loop_header) {
+            std::lock_guard<std::mutex> lock(m_speculation_mutex);
+            m_unspeculated_loops.insert(loop_header);
         }
 
-        void JITCompiler::EmitMemoryOperation(CodeGenerator& gen, VMOpcode opcode, uint32_t operand) {
-            // Simplified memory operations
-            gen.EmitByte(0x90); // NOP placeholder
+        void JITCompiler::ResetSpeculation() {
+            std::lock_guard<std::mutex> lock(m_speculation_mutex);
+            m_unspeculated_loops.clear();
         }
 
-        void JITCompiler::EmitSecurityCheck(CodeGenerator& gen, VMOpcode opcode) {
-            if (m_settings.enable_security_checks) {
-                // Emit anti-tampering checks
-                gen.EmitByte(0x90); // NOP placeholder
+        VMValue JITCompiler::RecoverDeoptValue(const JITContext& context, const JITDeoptValue& value) {
+            uint64_t bits = 0;
+            switch (value.location) {
+                case JITDeoptValue::Location::REGISTER: bits = context.deopt_registers[value.index]; break;
+                case JITDeoptValue::Location::FLOAT_REGISTER: bits = context.deopt_float_registers[value.index]; break;
+                default: std::memcpy(&bits, context.deopt_spills + value.index * 8, sizeof(bits)); break;
+            }
+
+            VMValue result;
+            result.type = value.type;
+            if (value.type == VMDataType::FLOAT64) {
+                std::memcpy(&result.data.f64, &bits, sizeof(double));
+            } else {
+                result.data.i32 = static_cast<int32_t>(bits);
             }
+            return result;
         }
 
         bool JITCompiler::VerifyCodeIntegrity(const JITCompilationResult& result) {
@@ -495,6 +1166,87 @@ namespace AetherVisor {
             m_profiling_data.clear();
         }
 
+        // JITCompileQueue implementation
+        JITCompileQueue::JITCompileQueue()
+            : m_busy(false)
+            , m_stopping(false)
+            , m_finished(nullptr)
+        {
+            m_thread = std::thread(&JITCompileQueue::Run, this);
+        }
+
+        JITCompileQueue::~JITCompileQueue() {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopping = true;
+                m_pending.clear();
+            }
+            m_wake.notify_one();
+            m_thread.join();
+            Cancel();
+        }
+
+        void JITCompileQueue::Submit(const Request& request) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_pending.push_back(request);
+            }
+            m_wake.notify_one();
+        }
+
+        std::vector<JITCompileQueue::Finished> JITCompileQueue::TakeFinished() {
+            std::vector<Finished> finished;
+            FinishedNode* node = m_finished.exchange(nullptr, std::memory_order_acquire);
+            while (node) {
+                finished.push_back(std::move(node->finished));
+                FinishedNode* next = node->next;
+                delete node;
+                node = next;
+            }
+            std::reverse(finished.begin(), finished.end());
+            return finished;
+        }
+
+        void JITCompileQueue::Cancel() {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_pending.clear();
+                m_idle.wait(lock, [this]() { return !m_busy; });
+            }
+            for (Finished& finished : TakeFinished()) {
+                if (finished.result.executable_memory) {
+                    JITCompiler::FreeExecutableMemory(finished.result.executable_memory, finished.result.code_size);
+                }
+            }
+        }
+
+        void JITCompileQueue::Run() {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (true) {
+                m_wake.wait(lock, [this]() { return m_stopping || !m_pending.empty(); });
+                if (m_stopping) {
+                    return;
+                }
+                const Request request = m_pending.front();
+                m_pending.pop_front();
+                m_busy = true;
+                lock.unlock();
+
+                // Published with release, so the code is complete before the
+                // execution thread can see it
+                FinishedNode* node = new FinishedNode{ { request, request.compiler->CompileRegion(
+                    request.code, request.code_size, request.start, request.end) }, nullptr };
+                node->next = m_finished.load(std::memory_order_relaxed);
+                while (!m_finished.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                                         std::memory_order_relaxed)) {
+                }
+
+                lock.lock();
+                m_busy = false;
+                m_idle.notify_all();
+            }
+        }
+
         // JITFunctionRegistry implementation
         JITFunctionRegistry& JITFunctionRegistry::GetInstance() {
             static JITFunctionRegistry instance;
@@ -511,34 +1263,42 @@ namespace AetherVisor {
             entry.metadata = metadata;
             entry.registration_time = std::chrono::steady_clock::now();
 
-            m_functions[name] = entry;
+            std::lock_guard<std::mutex> lock(m_write_mutex);
+            auto functions = std::make_shared<FunctionMap>(*m_functions.load());
+            (*functions)[name] = entry;
+            m_functions.store(std::shared_ptr<const FunctionMap>(std::move(functions)));
             return true;
         }
 
         JITFunction JITFunctionRegistry::GetFunction(const std::string& name) {
-            auto it = m_functions.find(name);
-            if (it != m_functions.end()) {
+            const std::shared_ptr<const FunctionMap> functions = m_functions.load();
+            auto it = functions->find(name);
+            if (it != functions->end()) {
                 return it->second.function;
             }
             return nullptr;
         }
 
         bool JITFunctionRegistry::UnregisterFunction(const std::string& name) {
-            auto it = m_functions.find(name);
-            if (it != m_functions.end()) {
-                m_functions.erase(it);
-                return true;
+            std::lock_guard<std::mutex> lock(m_write_mutex);
+            const std::shared_ptr<const FunctionMap> current = m_functions.load();
+            if (!current->count(name)) {
+                return false;
             }
-            return false;
+            auto functions = std::make_shared<FunctionMap>(*current);
+            functions->erase(name);
+            m_functions.store(std::shared_ptr<const FunctionMap>(std::move(functions)));
+            return true;
         }
 
         void JITFunctionRegistry::ClearRegistry() {
-            m_functions.clear();
+            std::lock_guard<std::mutex> lock(m_write_mutex);
+            m_functions.store(std::make_shared<const FunctionMap>());
         }
 
         std::vector<std::string> JITFunctionRegistry::GetRegisteredFunctions() const {
             std::vector<std::string> names;
-            for (const auto& pair : m_functions) {
+            for (const auto& pair : *m_functions.load()) {
                 names.push_back(pair.first);
             }
             return names;
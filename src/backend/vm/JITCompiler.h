@@ -1,16 +1,60 @@
 #pragma once
 
 #include "VMOpcodes.h"
+#include "RegisterAllocator.h"
+#include "X64Assembler.h"
+#include "A64Assembler.h"
 #include "../security/XorStr.h"
 #include <vector>
+#include <cstddef>
 #include <map>
 #include <memory>
 #include <functional>
 #include <chrono>
+#include <set>
+#include <initializer_list>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <unordered_map>
 
 namespace AetherVisor {
     namespace VM {
 
+        // Deoptimisation metadata. Speculative code guards what it assumes;
+        // when a guard fails, the state the interpreter would have at the
+        // guard's pc is rebuilt from where the code keeps it, and the
+        // interpreter resumes there.
+        struct JITDeoptValue {
+            enum class Location : uint8_t {
+                REGISTER,               // A general register, by encoding
+                FLOAT_REGISTER,         // An xmm register
+                SPILL_SLOT              // An 8-byte slot of the native frame
+            } location;
+            VMDataType type;
+            uint32_t index;
+        };
+        struct JITDeoptSlot {
+            uint32_t index;
+            bool global;
+            JITDeoptValue value;
+        };
+        enum class JITDeoptReason : uint8_t {
+            ENTRY_CHECK,                // Slot types or bounds at a loop header; the template code takes over
+            OVERFLOW                    // Checked INT32 arithmetic; the interpreter raises it
+        };
+        struct JITDeoptPoint {
+            JITDeoptReason reason;
+            uint32_t pc;                // Where the interpreter resumes
+            uint32_t loop;              // Header of the speculative loop, which the VM counts failures by
+            uint32_t refund;            // Instructions charged to the budget but not run
+            std::vector<JITDeoptValue> stack;   // Pushed onto the value stack, bottom first
+            std::vector<JITDeoptSlot> slots;    // Written back to locals and globals
+        };
+
         // JIT compilation result
         struct JITCompilationResult {
             bool success;
@@ -23,21 +67,117 @@ namespace AetherVisor {
             size_t original_bytecode_size;
             double compilation_time_ms;
             uint32_t optimization_level;
+
+            // Bytecode range compiled, in the module's own addresses, and the
+            // block leaders native code can be entered at: (address, native offset)
+            uint32_t bytecode_start;
+            uint32_t bytecode_end;
+            std::vector<std::pair<uint32_t, uint32_t>> entry_points;
+            std::vector<JITDeoptPoint> deopt_points;    // Indexed by the point native code passes
+            std::vector<std::pair<uint32_t, uint32_t>> pc_map;  // (address, native offset) by offset, for profilers
+            uint32_t call_sites;                        // Native calls, each with a JITInlineCache, numbered in address order
         };
 
-        // JIT function entry point
+        // JIT function entry point. Compiled regions take a JITContext and the
+        // native address of the entry point to start at.
         typedef int(*JITFunction)(void* vm_context, void* args);
 
+        class ValueStack;
+        struct JITContext;
+
+        // A native call site's binding, kept by the VM beside the code. It
+        // holds while the VM's native function generation is unchanged.
+        struct JITInlineCache {
+            uint64_t generation;        // 0 while unbound
+            const void* target;         // The VM's handler
+        };
+
+        // Runs the instruction at pc in the interpreter on behalf of native code.
+        // Returns 0 when execution goes on with the next instruction; otherwise
+        // native code returns and the VM resumes at context->pc.
+        typedef int(*JITStepFunction)(JITContext* context, uint32_t pc);
+
+        // Steps the native call at pc through its call site's cache, which
+        // it binds on a miss
+        typedef int(*JITCallFunction)(JITContext* context, uint32_t pc, JITInlineCache* cache);
+
+        // Rebuilds the interpreter's state at a failed guard from the
+        // registers and frame native code saved in the context
+        typedef void(*JITDeoptFunction)(JITContext* context, uint32_t point);
+
+        // State the VM shares with native code, pinned in a register while it
+        // runs: rbx on x86-64, x19 on AArch64.
+        // Native code reads these fields afresh after every step, which keeps
+        // them current.
+        struct JITContext {
+            ValueStack* stack;          // The VM's value stack, pinned in r12 on x86-64
+            VMValue* locals;            // Innermost frame's slots; null in top-level code
+            VMValue* globals;
+            uint32_t local_count;
+            uint32_t global_count;
+            int64_t budget;             // Instructions left; each block is charged on entry
+            int64_t tier_countdown;     // Loop iterations left before counting code returns for a tier-up
+            uint32_t* loop_counts;      // Iterations per loop header, by bytecode address
+            uint32_t pc;                // Where the VM resumes when native code returns
+            JITStepFunction step;
+            JITCallFunction call;
+            JITInlineCache* call_caches;    // The running region's, by call site
+            JITDeoptFunction deopt;
+            void* vm;
+
+            // Saved at a failed guard, for deopt to read
+            uint64_t deopt_registers[16];       // By encoding
+            uint64_t deopt_float_registers[16];
+            const uint8_t* deopt_spills;        // Spill slot 0 of the native frame
+        };
+
+        constexpr int32_t CONTEXT_STACK = offsetof(JITContext, stack);
+        constexpr int32_t CONTEXT_LOCALS = offsetof(JITContext, locals);
+        constexpr int32_t CONTEXT_GLOBALS = offsetof(JITContext, globals);
+        constexpr int32_t CONTEXT_LOCAL_COUNT = offsetof(JITContext, local_count);
+        constexpr int32_t CONTEXT_GLOBAL_COUNT = offsetof(JITContext, global_count);
+        constexpr int32_t CONTEXT_BUDGET = offsetof(JITContext, budget);
+        constexpr int32_t CONTEXT_TIER_COUNTDOWN = offsetof(JITContext, tier_countdown);
+        constexpr int32_t CONTEXT_LOOP_COUNTS = offsetof(JITContext, loop_counts);
+        constexpr int32_t CONTEXT_PC = offsetof(JITContext, pc);
+        constexpr int32_t CONTEXT_STEP = offsetof(JITContext, step);
+        constexpr int32_t CONTEXT_CALL = offsetof(JITContext, call);
+        constexpr int32_t CONTEXT_CALL_CACHES = offsetof(JITContext, call_caches);
+        constexpr int32_t CONTEXT_DEOPT = offsetof(JITContext, deopt);
+        constexpr int32_t CONTEXT_DEOPT_REGISTERS = offsetof(JITContext, deopt_registers);
+        constexpr int32_t CONTEXT_DEOPT_FLOAT_REGISTERS = offsetof(JITContext, deopt_float_registers);
+        constexpr int32_t CONTEXT_DEOPT_SPILLS = offsetof(JITContext, deopt_spills);
+
+        // Code is generated for the host. Template code and register loops
+        // are x86-64 only; AArch64 runs the baseline tier, which steps through
+        // everything but jumps.
+#if defined(_M_ARM64) || defined(__aarch64__)
+        using JITHostAssembler = A64Assembler;
+#else
+        using JITHostAssembler = X64Assembler;
+#endif
+
         // JIT compiler settings
         struct JITSettings {
             bool enable_optimizations;
             bool enable_security_checks;
-            bool enable_profiling;
+            bool enable_profiling;      // Count loop iterations in native code, for tiering
             uint32_t optimization_level; // 0-3
             size_t max_code_cache_size;
             bool enable_code_encryption;
         };
 
+        // Code cache counters. Hits and misses count region compiles; bytes
+        // cover each entry's machine code, address tables and key bytecode.
+        struct JITCacheStatistics {
+            size_t entries;
+            size_t bytes;
+            size_t capacity;
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t evictions;
+        };
+
         // Advanced JIT Compiler for VM bytecode to native code
         class JITCompiler {
         public:
@@ -50,19 +190,34 @@ namespace AetherVisor {
             // Compile bytecode to native code
             JITCompilationResult Compile(const std::vector<uint8_t>& bytecode, 
                                        const std::string& function_name = "");
+
+            // Compile code[start, end) of a module's code. Native code keeps the
+            // module's addresses, so it hands over to the interpreter and back at
+            // any block leader; control leaving the region returns to the VM.
+            // A region compiled before with the same bytecode and settings is
+            // copied from the code cache instead of generated again.
+            JITCompilationResult CompileRegion(const uint8_t* code, uint32_t code_size, uint32_t start, uint32_t end,
+                                             const std::string& function_name = "");
             
             // Execute JIT compiled function
             int Execute(const JITCompilationResult& compiled_code, void* vm_context, void* args);
             
-            // Code cache management
-            bool CacheCompiledCode(const std::string& key, const JITCompilationResult& result);
-            JITCompilationResult* GetCachedCode(const std::string& key);
+            // Code cache management. The cache holds at most
+            // max_code_cache_size bytes and evicts one entry at a time.
             void ClearCodeCache();
             size_t GetCacheSizeBytes() const;
+            JITCacheStatistics GetCacheStatistics() const;
+
+            // Speculation. Loops whose guards keep failing are compiled from
+            // then on as template code only; headers are module addresses.
+            void DisableSpeculation(uint32_t loop_header);
+            void ResetSpeculation();
+            static VMValue RecoverDeoptValue(const JITContext& context, const JITDeoptValue& value);
             
-            // Memory management
-            void* AllocateExecutableMemory(size_t size);
-            void FreeExecutableMemory(void* memory, size_t size);
+            // Memory management. Code lives in the shared JITCodeArena, never
+            // writable and executable at once; returns null when out of space.
+            static void* InstallExecutableCode(const std::vector<uint8_t>& code);
+            static void FreeExecutableMemory(void* memory, size_t size);
             
             // Optimization passes
             std::vector<uint8_t> OptimizeBasicBlocks(const std::vector<uint8_t>& bytecode);
@@ -82,39 +237,209 @@ namespace AetherVisor {
 
         private:
             JITSettings m_settings;
-            std::map<std::string, std::unique_ptr<JITCompilationResult>> m_code_cache;
-            size_t m_cache_size_bytes;
             bool m_initialized;
-            
-            // Code generation
-            struct CodeGenerator {
+
+            // Cached code is keyed by a hash of the region's bytecode, its
+            // bounds, which native code embeds, and the settings that shape
+            // code generation. Entries keep the bytecode to rule out collisions.
+            struct CodeCacheKey {
+                uint64_t hash;
+                uint32_t start;
+                uint32_t end;
+                uint32_t settings;
+
+                bool operator==(const CodeCacheKey& other) const {
+                    return hash == other.hash && start == other.start && end == other.end && settings == other.settings;
+                }
+            };
+            struct CodeCacheKeyHash {
+                size_t operator()(const CodeCacheKey& key) const { return static_cast<size_t>(key.hash); }
+            };
+            struct CodeCacheEntry {
+                CodeCacheKey key;
+                std::string name;
+                std::vector<uint8_t> bytecode;
                 std::vector<uint8_t> machine_code;
-                std::map<uint32_t, uint32_t> label_map; // bytecode address -> machine code offset
-                std::vector<std::pair<uint32_t, uint32_t>> relocations; // (offset, target)
-                
-                void EmitByte(uint8_t byte);
-                void EmitWord(uint16_t word);
-                void EmitDWord(uint32_t dword);
-                void EmitInstruction(const std::vector<uint8_t>& instruction);
-                void EmitLabel(uint32_t label_id);
-                void EmitJump(uint32_t target_label);
-                void EmitCall(uint32_t target_label);
-                void ApplyRelocations();
+                std::vector<std::pair<uint32_t, uint32_t>> entry_points;
+                std::vector<JITDeoptPoint> deopt_points;
+                std::vector<std::pair<uint32_t, uint32_t>> pc_map;
+                uint32_t call_sites;
+                size_t bytes;
+                mutable std::atomic<bool> referenced;   // Set by lookups, cleared by the clock hand
             };
+
+            // Copy-on-write: readers load the current map without taking
+            // m_cache_mutex; writers copy it under the mutex and publish the copy.
+            // Eviction is CLOCK: the hand sweeps entries in insertion order,
+            // sparing each one looked up since its last visit once.
+            using CodeCache = std::unordered_map<CodeCacheKey, std::shared_ptr<const CodeCacheEntry>, CodeCacheKeyHash>;
+            using CacheClock = std::list<std::shared_ptr<const CodeCacheEntry>>;
+            std::atomic<std::shared_ptr<const CodeCache>> m_code_cache;
+            CacheClock m_cache_clock;               // Guarded by m_cache_mutex
+            CacheClock::iterator m_cache_hand;
+            std::mutex m_cache_mutex;
+            std::atomic<size_t> m_cache_size_bytes;
+            mutable std::atomic<uint64_t> m_cache_hits;
+            mutable std::atomic<uint64_t> m_cache_misses;
+            std::atomic<uint64_t> m_cache_evictions;
+
+            mutable std::mutex m_speculation_mutex;  // Compiles may run on the compile thread
+            std::set<uint32_t> m_unspeculated_loops;
+
+            CodeCacheKey MakeCacheKey(const uint8_t* code, uint32_t start, uint32_t end) const;
+            std::shared_ptr<const CodeCacheEntry> LookupCode(const CodeCacheKey& key, const uint8_t* code) const;
+            void CacheCompiledCode(const CodeCacheKey& key, const uint8_t* code, const std::string& name,
+                                   const std::vector<uint8_t>& machine_code,
+                                   const std::vector<std::pair<uint32_t, uint32_t>>& entry_points,
+                                   const std::vector<JITDeoptPoint>& deopt_points,
+                                   const std::vector<std::pair<uint32_t, uint32_t>>& pc_map, uint32_t call_sites);
             
-            // x86-64 instruction encoding helpers
-            void EmitPrologue(CodeGenerator& gen);
-            void EmitEpilogue(CodeGenerator& gen);
-            void EmitStackOperation(CodeGenerator& gen, VMOpcode opcode, uint32_t operand);
-            void EmitArithmetic(CodeGenerator& gen, VMOpcode opcode);
-            void EmitComparison(CodeGenerator& gen, VMOpcode opcode);
-            void EmitControlFlow(CodeGenerator& gen, VMOpcode opcode, uint32_t operand);
-            void EmitMemoryOperation(CodeGenerator& gen, VMOpcode opcode, uint32_t operand);
+            // One decoded instruction of the region being compiled
+            struct RegionInstruction {
+                uint32_t address;
+                uint32_t next;                  // Address of the following instruction
+                VMOpcode opcode;
+                uint32_t operand1;
+                uint32_t operand2;
+                bool is_leader;
+                uint32_t block_length;          // Instructions in the block, on leaders
+                uint32_t block_remaining;       // Instructions after this one in its block
+            };
+
+            // Code generation: the host's assembler and what the region
+            // driver keeps track of
+            struct CodeGenerator : JITHostAssembler {
+                std::set<uint32_t> instructions;        // Addresses compiled in this region
+                std::map<uint32_t, uint32_t> exits;     // Addresses outside it -> label of their exit stub
+                std::vector<std::pair<uint32_t, const RegionInstruction*>> slow_paths;
+                std::map<uint32_t, uint32_t> refunds;   // Block instructions not run -> label of their exit stub
+                std::map<uint32_t, uint32_t> back_edges;    // Loop headers -> label of their counting stub
+                std::map<uint32_t, uint32_t> resume_labels; // Leaders -> label after their block charge
+                std::map<uint32_t, uint32_t> generic_headers;   // Register loop headers -> their template code
+                bool count_back_edges = false;
+                uint32_t exit_label = 0;
+                uint32_t deopt_label = 0;               // The guards' shared call into JITContext::deopt
+                std::vector<JITDeoptPoint> deopt_points;
+                uint32_t call_sites = 0;
+
+                uint32_t TargetLabel(uint32_t address);     // The instruction, or an exit to the VM
+                uint32_t ExitLabel(uint32_t address);       // Always an exit to the VM
+                uint32_t BranchLabel(const RegionInstruction& branch);     // Through the counting stub on back-edges
+                uint32_t RefundLabel(uint32_t remaining);
+                uint32_t ResumeLabel(uint32_t address);     // Template code of an instruction whose block is charged
+            };
+
+            // Optimising tier. Loops are compiled a second time from a small IR
+            // in which locals, globals and stack temporaries are values in
+            // registers, allocated by linear scan. The IR is specialised to the
+            // INT32 and FLOAT64 types inferred from the loop; entry at the header
+            // checks them against the slots and falls back to the template code.
+            // Whatever the IR does not cover leaves for the template code of the
+            // same instruction, with the VM's stack and slots written back.
+            // Failed entry checks and overflow are guards with deopt points.
+            struct LoopValue {
+                VMDataType type;                // INT32 or FLOAT64
+                bool carried;                   // A slot or a stack entry across blocks: live through the whole loop
+                LinearScanAllocator::Location location;
+            };
+            struct LoopSlot {
+                uint32_t index;
+                bool global;
+                VMDataType type;
+                bool live_in;                   // Read before written in some iteration: checked and loaded on entry
+                bool stored;
+                uint32_t value;
+            };
+            struct LoopExit {
+                enum class Kind : uint8_t {
+                    RESUME,                     // Template code of the instruction at address
+                    BRANCH,                     // A jump leaving the loop for address
+                    BUDGET,                     // Back to the VM at a block leader, refunding its charge
+                    DEOPT                       // A failed guard: the VM rebuilds the interpreter's state
+                } kind;
+                uint32_t address;
+                uint32_t refund;
+                std::vector<uint32_t> stack;    // Values the VM stack holds above its entry depth, bottom first
+            };
+            struct LoopOperation {
+                enum class Kind : uint8_t {
+                    BLOCK,                      // A leader: charges the block, exit on an exhausted budget
+                    CONSTANT,
+                    MOVE,
+                    ARITHMETIC,                 // Checked forms exit on overflow
+                    COMPARE,
+                    STORE,                      // Writes a slot through to the VM
+                    BRANCH,                     // Conditional, on a value or a fused INT32 comparison
+                    JUMP,
+                    EXIT
+                } kind;
+                VMOpcode opcode;
+                uint32_t address;               // Bytecode instruction, or the target of BRANCH and JUMP
+                uint32_t result;
+                uint32_t left;
+                uint32_t right;
+                uint64_t immediate;             // CONSTANT bits, BLOCK length, STORE slot
+                bool on_zero;                   // BRANCH taken when the condition is zero
+                bool fused;                     // BRANCH on left opcode right
+                uint32_t exit;                  // Index into exits, or NO_EXIT
+                std::vector<std::pair<uint32_t, uint32_t>> moves;  // (to, from) onto the target's stack, for internal edges
+            };
+            struct LoopPlan {
+                uint32_t header;
+                uint32_t end;
+                uint32_t max_depth;
+                uint32_t spill_slots;
+                std::vector<LoopValue> values;
+                std::vector<LoopSlot> slots;
+                std::vector<LoopExit> exits;
+                std::vector<LoopOperation> operations;
+                std::map<uint32_t, uint32_t> block_labels;
+            };
+            static constexpr uint32_t NO_EXIT = 0xFFFFFFFF;
+            
+            // x86-64 template code, in JITCompilerX64.cpp
+            void EmitStackOperation(CodeGenerator& gen, const RegionInstruction& instruction, uint32_t slow_path);
+            void EmitArithmetic(CodeGenerator& gen, VMOpcode opcode, uint32_t slow_path);
+            void EmitComparison(CodeGenerator& gen, VMOpcode opcode, uint32_t slow_path);
+            void EmitControlFlow(CodeGenerator& gen, const RegionInstruction& instruction, uint32_t slow_path);
+            void EmitMemoryOperation(CodeGenerator& gen, VMOpcode opcode, uint32_t operand, uint32_t slow_path);
             void EmitSecurityCheck(CodeGenerator& gen, VMOpcode opcode);
+
+            // Value stack access through r12; rax holds the stack top
+            void EmitLoadTop(CodeGenerator& gen);
+            void EmitStoreTop(CodeGenerator& gen);
+            void EmitRequireValues(CodeGenerator& gen, uint32_t count, uint32_t slow_path);
+            void EmitRequireRoom(CodeGenerator& gen, uint32_t slow_path);
+            void EmitCopyValue(CodeGenerator& gen, uint8_t to, int32_t to_offset, uint8_t from, int32_t from_offset);
             
-            // Instruction translation
-            bool TranslateInstruction(CodeGenerator& gen, VMOpcode opcode, 
-                                    uint32_t operand1, uint32_t operand2, uint32_t operand3);
+            // Register loops: the outermost loops of the region that plan
+            // successfully, then emission after the template code
+            std::vector<LoopPlan> PlanLoops(const std::vector<RegionInstruction>& instructions);
+            bool PlanLoop(const std::vector<RegionInstruction>& instructions, size_t first, size_t last, LoopPlan& plan);
+            bool InferLoopTypes(const std::vector<RegionInstruction>& instructions, size_t first, size_t last, LoopPlan& plan);
+            bool BuildLoopOperations(const std::vector<RegionInstruction>& instructions, size_t first, size_t last, LoopPlan& plan);
+            void AllocateLoopRegisters(LoopPlan& plan);
+            void EmitLoop(CodeGenerator& gen, LoopPlan& plan);
+            static void EmitLoopOperand(CodeGenerator& gen, std::initializer_list<uint8_t> opcode, uint8_t reg,
+                                        const LinearScanAllocator::Location& location, bool wide = false, uint8_t prefix = 0);
+            static void EmitLoopMove(CodeGenerator& gen, VMDataType type, const LinearScanAllocator::Location& to,
+                                     const LinearScanAllocator::Location& from);
+            void EmitLoopMoves(CodeGenerator& gen, const LoopPlan& plan, const std::vector<std::pair<uint32_t, uint32_t>>& moves);
+            void EmitLoopExit(CodeGenerator& gen, const LoopPlan& plan, const LoopExit& exit);
+            void EmitLoopOperation(CodeGenerator& gen, const LoopPlan& plan, const LoopOperation& operation, size_t index,
+                                   std::vector<std::pair<uint32_t, uint32_t>>& stubs);
+            void EmitDeoptStub(CodeGenerator& gen);
+
+            // Generates code[start, end) into machine_code; false with the
+            // error set on result when the region cannot be compiled
+            bool GenerateRegion(const uint8_t* code, uint32_t start, uint32_t end, std::vector<uint8_t>& machine_code,
+                                std::vector<std::pair<uint32_t, uint32_t>>& entry_points,
+                                std::vector<JITDeoptPoint>& deopt_points, std::vector<std::pair<uint32_t, uint32_t>>& pc_map,
+                                uint32_t& call_sites, JITCompilationResult& result);
+
+            // Instruction translation, per target. Emits the instruction's inline
+            // fast path, or returns false to leave it to the interpreter.
+            bool TranslateInstruction(CodeGenerator& gen, const RegionInstruction& instruction);
             
             // Optimization analysis
             struct BasicBlock {
@@ -136,15 +461,6 @@ namespace AetherVisor {
             void DecryptCode(std::vector<uint8_t>& code);
             void InsertAntiTamperingChecks(CodeGenerator& gen);
             
-            // Platform-specific code
-#ifdef _WIN32
-            void* AllocateExecutableMemoryWindows(size_t size);
-            void FreeExecutableMemoryWindows(void* memory, size_t size);
-#else
-            void* AllocateExecutableMemoryPosix(size_t size);
-            void FreeExecutableMemoryPosix(void* memory, size_t size);
-#endif
-            
             // Error handling
             void SetError(JITCompilationResult& result, const std::string& error);
             
@@ -152,7 +468,59 @@ namespace AetherVisor {
             mutable std::map<std::string, double> m_profiling_data;
         };
 
-        // JIT function registry for managing compiled functions
+        // Background compiler. Requests are compiled in order on one worker
+        // thread; finished code is handed back on a lock-free list that the
+        // execution thread takes at its own safe points, so it never waits
+        // for a compile. The compilers and code must outlive their requests.
+        class JITCompileQueue {
+        public:
+            struct Request {
+                JITCompiler* compiler;
+                const uint8_t* code;
+                uint32_t code_size;
+                uint32_t start;
+                uint32_t end;
+                uint32_t region;            // Identify the request to the caller
+                uint32_t tier;
+            };
+            struct Finished {
+                Request request;
+                JITCompilationResult result;
+            };
+
+            JITCompileQueue();
+            ~JITCompileQueue();
+            JITCompileQueue(const JITCompileQueue&) = delete;
+            JITCompileQueue& operator=(const JITCompileQueue&) = delete;
+
+            void Submit(const Request& request);
+            bool HasFinished() const { return m_finished.load(std::memory_order_acquire) != nullptr; }
+            std::vector<Finished> TakeFinished();   // Oldest first; the caller owns the code
+
+            // Drops queued requests and waits out the one being compiled, freeing
+            // whatever code was not taken
+            void Cancel();
+
+        private:
+            struct FinishedNode {
+                Finished finished;
+                FinishedNode* next;
+            };
+
+            std::thread m_thread;
+            std::mutex m_mutex;
+            std::condition_variable m_wake;         // Requests queued, or stopping
+            std::condition_variable m_idle;         // Nothing being compiled
+            std::deque<Request> m_pending;
+            bool m_busy;
+            bool m_stopping;
+            std::atomic<FinishedNode*> m_finished;  // Newest first
+
+            void Run();
+        };
+
+        // JIT function registry for managing compiled functions. Lookups read
+        // a snapshot without taking m_write_mutex; changes publish a new one.
         class JITFunctionRegistry {
         public:
             static JITFunctionRegistry& GetInstance();
@@ -171,7 +539,9 @@ namespace AetherVisor {
                 std::chrono::time_point<std::chrono::steady_clock> registration_time;
             };
             
-            std::map<std::string, FunctionEntry> m_functions;
+            using FunctionMap = std::map<std::string, FunctionEntry>;
+            std::atomic<std::shared_ptr<const FunctionMap>> m_functions{ std::make_shared<const FunctionMap>() };
+            std::mutex m_write_mutex;
         };
 
     } // namespace VM
@@ -0,0 +1,41 @@
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "JITCompiler.h"
+#include "../security/XorStr.h"
+#include "VMOpcodes.h"
+
+// AArch64 runs the baseline tier: jumps within the region are direct and
+// every other instruction steps through the interpreter. Loops are never
+// planned here, so register loops and deopt stubs have nothing to emit.
+#if defined(_M_ARM64) || defined(__aarch64__)
+
+namespace AetherVisor {
+    namespace VM {
+
+        bool JITCompiler::TranslateInstruction(CodeGenerator& gen, const RegionInstruction& instruction) {
+            switch (instruction.opcode) {
+                case VMOpcode::NOP:
+                case VMOpcode::JIT_EXECUTE:     // Already native
+                    return true;
+                case VMOpcode::JMP:
+                    gen.EmitJump(gen.BranchLabel(instruction));
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        void JITCompiler::AllocateLoopRegisters(LoopPlan& /*plan*/) {
+        }
+
+        void JITCompiler::EmitLoop(CodeGenerator& /*gen*/, LoopPlan& /*plan*/) {
+        }
+
+        void JITCompiler::EmitDeoptStub(CodeGenerator& /*gen*/) {
+        }
+
+    } // namespace VM
+} // namespace AetherVisor
+
+#endif
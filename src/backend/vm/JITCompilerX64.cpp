@@ -0,0 +1,961 @@
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "JITCompiler.h"
+#include "../security/XorStr.h"
+#include "VMOpcodes.h"
+#include "VirtualMachine.h"
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+
+// x86-64 template code and register loops. The region driver and the loop
+// planner in JITCompiler.cpp are shared by every target.
+#if defined(_M_X64) || defined(__x86_64__)
+
+namespace AetherVisor {
+    namespace VM {
+
+        using namespace X64;
+
+        namespace {
+            // What register loops allocate; rax, rcx, rdx, xmm0 and xmm1 stay
+            // scratch. The loops make no calls, so caller-saved registers are free.
+#ifdef _WIN32
+            const std::vector<uint8_t> LOOP_GENERAL_REGISTERS = { 8, 9, 10, 11 };
+            const std::vector<uint8_t> LOOP_FLOAT_REGISTERS = { 2, 3, 4, 5 };
+#else
+            const std::vector<uint8_t> LOOP_GENERAL_REGISTERS = { RSI, RDI, 8, 9, 10, 11 };
+            const std::vector<uint8_t> LOOP_FLOAT_REGISTERS = { 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+#endif
+
+            constexpr int32_t SpillOffset(uint32_t slot) {
+                return FRAME_SIZE + static_cast<int32_t>(slot) * 8;
+            }
+
+            constexpr int32_t VALUE_SIZE = sizeof(VMValue);
+            constexpr int32_t VALUE_TYPE = offsetof(VMValue, type);
+            constexpr int32_t VALUE_DATA = offsetof(VMValue, data);
+            static_assert(VALUE_SIZE % 16 == 0 && VALUE_SIZE < 128, "values are moved in 16-byte chunks and stepped by imm8");
+
+            uint8_t IntegerCondition(VMOpcode opcode) {
+                switch (opcode) {
+                    case VMOpcode::CMP_NE: case VMOpcode::CMP_NE_I32: return CC_NE;
+                    case VMOpcode::CMP_GT: case VMOpcode::CMP_GT_I32: return CC_G;
+                    case VMOpcode::CMP_GE: case VMOpcode::CMP_GE_I32: return CC_GE;
+                    case VMOpcode::CMP_LT: case VMOpcode::CMP_LT_I32: return CC_L;
+                    case VMOpcode::CMP_LE: case VMOpcode::CMP_LE_I32: return CC_LE;
+                    default: return CC_E;
+                }
+            }
+
+            LinearScanAllocator::RegisterClass ClassOf(VMDataType type) {
+                return type == VMDataType::FLOAT64 ? LinearScanAllocator::RegisterClass::FLOAT
+                                                   : LinearScanAllocator::RegisterClass::GENERAL;
+            }
+
+            JITDeoptValue DeoptValue(VMDataType type, const LinearScanAllocator::Location& location) {
+                if (location.spilled) {
+                    return { JITDeoptValue::Location::SPILL_SLOT, type, location.slot };
+                }
+                return { type == VMDataType::FLOAT64 ? JITDeoptValue::Location::FLOAT_REGISTER : JITDeoptValue::Location::REGISTER,
+                         type, location.reg };
+            }
+
+            bool SameLocation(VMDataType a_type, const LinearScanAllocator::Location& a,
+                              VMDataType b_type, const LinearScanAllocator::Location& b) {
+                if (a.spilled || b.spilled) {
+                    return a.spilled && b.spilled && a.slot == b.slot;
+                }
+                return a.reg == b.reg && ClassOf(a_type) == ClassOf(b_type);
+            }
+        }
+
+        bool JITCompiler::TranslateInstruction(CodeGenerator& gen, const RegionInstruction& instruction) {
+            switch (instruction.opcode) {
+                case VMOpcode::NOP:
+                case VMOpcode::JIT_EXECUTE:     // Already native
+                    return true;
+                case VMOpcode::JMP:
+                    EmitControlFlow(gen, instruction, 0);
+                    return true;
+                default:
+                    break;
+            }
+
+            // Unoptimised code steps through everything else
+            if (!m_settings.enable_optimizations || m_settings.optimization_level == 0) {
+                return false;
+            }
+
+            auto slow_path = [&gen, &instruction]() {
+                const uint32_t label = gen.NewLabel();
+                gen.slow_paths.emplace_back(label, &instruction);
+                return label;
+            };
+
+            switch (instruction.opcode) {
+                case VMOpcode::PUSH_INT:
+                case VMOpcode::PUSH_FLOAT:
+                case VMOpcode::PUSH_DOUBLE:
+                case VMOpcode::POP:
+                case VMOpcode::DUP:
+                case VMOpcode::SWAP:
+                    EmitStackOperation(gen, instruction, slow_path());
+                    return true;
+
+                case VMOpcode::LOAD_LOCAL:
+                case VMOpcode::STORE_LOCAL:
+                case VMOpcode::LOAD_GLOBAL:
+                case VMOpcode::STORE_GLOBAL:
+                    EmitMemoryOperation(gen, instruction.opcode, instruction.operand1, slow_path());
+                    return true;
+
+                case VMOpcode::ADD:
+                case VMOpcode::SUB:
+                case VMOpcode::MUL:
+                case VMOpcode::BIT_AND:
+                case VMOpcode::BIT_OR:
+                case VMOpcode::BIT_XOR:
+                case VMOpcode::ADD_I32:
+                case VMOpcode::SUB_I32:
+                case VMOpcode::MUL_I32:
+                case VMOpcode::ADD_F64:
+                case VMOpcode::SUB_F64:
+                case VMOpcode::MUL_F64:
+                case VMOpcode::DIV_F64:
+                    EmitArithmetic(gen, instruction.opcode, slow_path());
+                    return true;
+
+                case VMOpcode::CMP_EQ:
+                case VMOpcode::CMP_NE:
+                case VMOpcode::CMP_GT:
+                case VMOpcode::CMP_GE:
+                case VMOpcode::CMP_LT:
+                case VMOpcode::CMP_LE:
+                case VMOpcode::CMP_EQ_I32:
+                case VMOpcode::CMP_NE_I32:
+                case VMOpcode::CMP_GT_I32:
+                case VMOpcode::CMP_GE_I32:
+                case VMOpcode::CMP_LT_I32:
+                case VMOpcode::CMP_LE_I32:
+                case VMOpcode::CMP_EQ_F64:
+                case VMOpcode::CMP_NE_F64:
+                case VMOpcode::CMP_GT_F64:
+                case VMOpcode::CMP_GE_F64:
+                case VMOpcode::CMP_LT_F64:
+                case VMOpcode::CMP_LE_F64:
+                    EmitComparison(gen, instruction.opcode, slow_path());
+                    return true;
+
+                case VMOpcode::JMP_IF_ZERO:
+                case VMOpcode::JMP_IF_NOT_ZERO:
+                    EmitControlFlow(gen, instruction, slow_path());
+                    return true;
+
+                default:
+                    return false;
+            }
+        }
+
+        void JITCompiler::EmitLoadTop(CodeGenerator& gen) {
+            gen.EmitMemory({ 0x8B }, RAX, R12, ValueStack::TopOffset(), true);         // mov rax, [r12 + top]
+        }
+
+        void JITCompiler::EmitStoreTop(CodeGenerator& gen) {
+            gen.EmitMemory({ 0x89 }, RAX, R12, ValueStack::TopOffset(), true);         // mov [r12 + top], rax
+        }
+
+        void JITCompiler::EmitRequireValues(CodeGenerator& gen, uint32_t count, uint32_t slow_path) {
+            if (count == 1) {
+                gen.EmitMemory({ 0x3B }, RAX, R12, ValueStack::BaseOffset(), true);    // cmp rax, [r12 + base]
+                gen.EmitJumpIf(CC_BE, slow_path);
+                return;
+            }
+            gen.EmitMemory({ 0x8D }, RCX, RAX, -static_cast<int32_t>(count) * VALUE_SIZE, true);   // lea rcx, [rax - count values]
+            gen.EmitMemory({ 0x3B }, RCX, R12, ValueStack::BaseOffset(), true);        // cmp rcx, [r12 + base]
+            gen.EmitJumpIf(CC_B, slow_path);
+        }
+
+        void JITCompiler::EmitRequireRoom(CodeGenerator& gen, uint32_t slow_path) {
+            gen.EmitMemory({ 0x3B }, RAX, R12, ValueStack::LimitOffset(), true);       // cmp rax, [r12 + limit]
+            gen.EmitJumpIf(CC_AE, slow_path);
+        }
+
+        void JITCompiler::EmitCopyValue(CodeGenerator& gen, uint8_t to, int32_t to_offset, uint8_t from, int32_t from_offset) {
+            for (int32_t chunk = 0; chunk < VALUE_SIZE; chunk += 16) {
+                gen.EmitMemory({ 0x0F, 0x10 }, XMM0, from, from_offset + chunk);       // movups xmm0, [from]
+                gen.EmitMemory({ 0x0F, 0x11 }, XMM0, to, to_offset + chunk);           // movups [to], xmm0
+            }
+        }
+
+        // Pushes and pops update the VM's stack in place. A push needs a free
+        // slot below the limit; growing the stack is left to the interpreter.
+        void JITCompiler::EmitStackOperation(CodeGenerator& gen, const RegionInstruction& instruction, uint32_t slow_path) {
+            EmitLoadTop(gen);
+            switch (instruction.opcode) {
+                case VMOpcode::PUSH_INT:
+                case VMOpcode::PUSH_FLOAT:
+                    EmitRequireRoom(gen, slow_path);
+                    gen.EmitMemory({ 0xC6 }, 0, RAX, VALUE_TYPE);                       // mov byte [rax + type], type
+                    gen.EmitByte(static_cast<uint8_t>(instruction.opcode == VMOpcode::PUSH_INT ? VMDataType::INT32 : VMDataType::FLOAT32));
+                    gen.EmitMemory({ 0xC7 }, 0, RAX, VALUE_DATA);                       // mov dword [rax + data], immediate
+                    gen.EmitDWord(instruction.operand1);
+                    gen.EmitRegister({ 0x83 }, 0, RAX, true);                           // add rax, value
+                    gen.EmitByte(VALUE_SIZE);
+                    break;
+                case VMOpcode::PUSH_DOUBLE:
+                    EmitRequireRoom(gen, slow_path);
+                    gen.EmitMemory({ 0xC6 }, 0, RAX, VALUE_TYPE);
+                    gen.EmitByte(static_cast<uint8_t>(VMDataType::FLOAT64));
+                    gen.EmitByte(0x48);                                                 // mov rcx, immediate
+                    gen.EmitByte(0xB8 | RCX);
+                    gen.EmitQWord(instruction.operand1 | static_cast<uint64_t>(instruction.operand2) << 32);
+                    gen.EmitMemory({ 0x89 }, RCX, RAX, VALUE_DATA, true);               // mov [rax + data], rcx
+                    gen.EmitRegister({ 0x83 }, 0, RAX, true);
+                    gen.EmitByte(VALUE_SIZE);
+                    break;
+                case VMOpcode::POP:
+                    EmitRequireValues(gen, 1, slow_path);
+                    gen.EmitRegister({ 0x83 }, 5, RAX, true);                           // sub rax, value
+                    gen.EmitByte(VALUE_SIZE);
+                    break;
+                case VMOpcode::DUP:
+                    EmitRequireValues(gen, 1, slow_path);
+                    EmitRequireRoom(gen, slow_path);
+                    EmitCopyValue(gen, RAX, 0, RAX, -VALUE_SIZE);
+                    gen.EmitRegister({ 0x83 }, 0, RAX, true);
+                    gen.EmitByte(VALUE_SIZE);
+                    break;
+                case VMOpcode::SWAP:
+                    EmitRequireValues(gen, 2, slow_path);
+                    for (int32_t chunk = 0; chunk < VALUE_SIZE; chunk += 16) {
+                        gen.EmitMemory({ 0x0F, 0x10 }, XMM0, RAX, chunk - 2 * VALUE_SIZE);
+                        gen.EmitMemory({ 0x0F, 0x10 }, XMM1, RAX, chunk - VALUE_SIZE);
+                        gen.EmitMemory({ 0x0F, 0x11 }, XMM1, RAX, chunk - 2 * VALUE_SIZE);
+                        gen.EmitMemory({ 0x0F, 0x11 }, XMM0, RAX, chunk - VALUE_SIZE);
+                    }
+                    return;
+                default:
+                    return;
+            }
+            EmitStoreTop(gen);
+        }
+
+        // Typed operands are trusted as the interpreter trusts them; the generic
+        // forms take the inline path only for INT32 pairs. Overflow goes to the
+        // interpreter, which raises it.
+        void JITCompiler::EmitArithmetic(CodeGenerator& gen, VMOpcode opcode, uint32_t slow_path) {
+            const int32_t left = -2 * VALUE_SIZE;
+            const int32_t right = -VALUE_SIZE;
+
+            EmitLoadTop(gen);
+            EmitRequireValues(gen, 2, slow_path);
+
+            uint8_t sse = 0;
+            switch (opcode) {
+                case VMOpcode::ADD_F64: sse = 0x58; break;
+                case VMOpcode::SUB_F64: sse = 0x5C; break;
+                case VMOpcode::MUL_F64: sse = 0x59; break;
+                case VMOpcode::DIV_F64: sse = 0x5E; break;
+                default: break;
+            }
+
+            if (sse) {
+                gen.EmitMemory({ 0x0F, 0x10 }, XMM0, RAX, left + VALUE_DATA, false, 0xF2);    // movsd xmm0, [left]
+                gen.EmitMemory({ 0x0F, sse }, XMM0, RAX, right + VALUE_DATA, false, 0xF2);    // op xmm0, [right]
+                gen.EmitMemory({ 0x0F, 0x11 }, XMM0, RAX, left + VALUE_DATA, false, 0xF2);    // movsd [left], xmm0
+                gen.EmitMemory({ 0xC6 }, 0, RAX, left + VALUE_TYPE);
+                gen.EmitByte(static_cast<uint8_t>(VMDataType::FLOAT64));
+            } else {
+                const bool typed = opcode == VMOpcode::ADD_I32 || opcode == VMOpcode::SUB_I32 || opcode == VMOpcode::MUL_I32;
+                if (!typed) {
+                    gen.EmitMemory({ 0x80 }, 7, RAX, left + VALUE_TYPE);                    // cmp byte [left], INT32
+                    gen.EmitByte(static_cast<uint8_t>(VMDataType::INT32));
+                    gen.EmitJumpIf(CC_NE, slow_path);
+                    gen.EmitMemory({ 0x80 }, 7, RAX, right + VALUE_TYPE);                   // cmp byte [right], INT32
+                    gen.EmitByte(static_cast<uint8_t>(VMDataType::INT32));
+                    gen.EmitJumpIf(CC_NE, slow_path);
+                }
+
+                gen.EmitMemory({ 0x8B }, RDX, RAX, left + VALUE_DATA);                      // mov edx, [left]
+                bool checked = true;
+                switch (opcode) {
+                    case VMOpcode::ADD:
+                    case VMOpcode::ADD_I32: gen.EmitMemory({ 0x03 }, RDX, RAX, right + VALUE_DATA); break;
+                    case VMOpcode::SUB:
+                    case VMOpcode::SUB_I32: gen.EmitMemory({ 0x2B }, RDX, RAX, right + VALUE_DATA); break;
+                    case VMOpcode::MUL:
+                    case VMOpcode::MUL_I32: gen.EmitMemory({ 0x0F, 0xAF }, RDX, RAX, right + VALUE_DATA); break;
+                    case VMOpcode::BIT_AND: gen.EmitMemory({ 0x23 }, RDX, RAX, right + VALUE_DATA); checked = false; break;
+                    case VMOpcode::BIT_OR: gen.EmitMemory({ 0x0B }, RDX, RAX, right + VALUE_DATA); checked = false; break;
+                    default: gen.EmitMemory({ 0x33 }, RDX, RAX, right + VALUE_DATA); checked = false; break;
+                }
+                if (checked) {
+                    gen.EmitJumpIf(CC_O, slow_path);
+                }
+                gen.EmitMemory({ 0x89 }, RDX, RAX, left + VALUE_DATA);                      // mov [left], edx
+                gen.EmitMemory({ 0xC6 }, 0, RAX, left + VALUE_TYPE);
+                gen.EmitByte(static_cast<uint8_t>(VMDataType::INT32));
+            }
+
+            gen.EmitRegister({ 0x83 }, 5, RAX, true);
+            gen.EmitByte(VALUE_SIZE);
+            EmitStoreTop(gen);
+        }
+
+        // Results are INT32 1 or 0. Unordered doubles compare false except for
+        // CMP_NE, matching the C++ operators the interpreter uses.
+        void JITCompiler::EmitComparison(CodeGenerator& gen, VMOpcode opcode, uint32_t slow_path) {
+            const int32_t left = -2 * VALUE_SIZE;
+            const int32_t right = -VALUE_SIZE;
+
+            EmitLoadTop(gen);
+            EmitRequireValues(gen, 2, slow_path);
+
+            VMOpcode generic = opcode;
+            bool is_double = false;
+            if (opcode >= VMOpcode::CMP_EQ_F64 && opcode <= VMOpcode::CMP_LE_F64) {
+                generic = static_cast<VMOpcode>(static_cast<uint8_t>(VMOpcode::CMP_EQ) +
+                                                static_cast<uint8_t>(opcode) - static_cast<uint8_t>(VMOpcode::CMP_EQ_F64));
+                is_double = true;
+            } else if (opcode >= VMOpcode::CMP_EQ_I32 && opcode <= VMOpcode::CMP_LE_I32) {
+                generic = static_cast<VMOpcode>(static_cast<uint8_t>(VMOpcode::CMP_EQ) +
+                                                static_cast<uint8_t>(opcode) - static_cast<uint8_t>(VMOpcode::CMP_EQ_I32));
+            } else {
+                gen.EmitMemory({ 0x80 }, 7, RAX, left + VALUE_TYPE);
+                gen.EmitByte(static_cast<uint8_t>(VMDataType::INT32));
+                gen.EmitJumpIf(CC_NE, slow_path);
+                gen.EmitMemory({ 0x80 }, 7, RAX, right + VALUE_TYPE);
+                gen.EmitByte(static_cast<uint8_t>(VMDataType::INT32));
+                gen.EmitJumpIf(CC_NE, slow_path);
+            }
+
+            if (is_double) {
+                // Less-than forms compare the other way round so that every
+                // ordered test is an above condition, which is false when unordered
+                const bool swapped = generic == VMOpcode::CMP_LT || generic == VMOpcode::CMP_LE;
+                gen.EmitMemory({ 0x0F, 0x10 }, XMM0, RAX, (swapped ? right : left) + VALUE_DATA, false, 0xF2);   // movsd xmm0, [first]
+                gen.EmitMemory({ 0x0F, 0x2E }, XMM0, RAX, (swapped ? left : right) + VALUE_DATA, false, 0x66);   // ucomisd xmm0, [second]
+                switch (generic) {
+                    case VMOpcode::CMP_EQ:
+                        gen.EmitRegister({ 0x0F, 0x90 | CC_E }, 0, RDX);
+                        gen.EmitRegister({ 0x0F, 0x90 | CC_NP }, 0, RCX);
+                        gen.EmitRegister({ 0x20 }, RCX, RDX);                               // and dl, cl
+                        break;
+                    case VMOpcode::CMP_NE:
+                        gen.EmitRegister({ 0x0F, 0x90 | CC_NE }, 0, RDX);
+                        gen.EmitRegister({ 0x0F, 0x90 | CC_P }, 0, RCX);
+                        gen.EmitRegister({ 0x08 }, RCX, RDX);                               // or dl, cl
+                        break;
+                    case VMOpcode::CMP_GT:
+                    case VMOpcode::CMP_LT:
+                        gen.EmitRegister({ 0x0F, 0x90 | CC_A }, 0, RDX);
+                        break;
+                    default:
+                        gen.EmitRegister({ 0x0F, 0x90 | CC_AE }, 0, RDX);
+                        break;
+                }
+            } else {
+                uint8_t condition = CC_E;
+                switch (generic) {
+                    case VMOpcode::CMP_NE: condition = CC_NE; break;
+                    case VMOpcode::CMP_GT: condition = CC_G; break;
+                    case VMOpcode::CMP_GE: condition = CC_GE; break;
+                    case VMOpcode::CMP_LT: condition = CC_L; break;
+                    case VMOpcode::CMP_LE: condition = CC_LE; break;
+                    default: break;
+                }
+                gen.EmitMemory({ 0x8B }, RDX, RAX, left + VALUE_DATA);                      // mov edx, [left]
+                gen.EmitMemory({ 0x3B }, RDX, RAX, right + VALUE_DATA);                     // cmp edx, [right]
+                gen.EmitRegister({ 0x0F, static_cast<uint8_t>(0x90 | condition) }, 0, RDX); // setcc dl
+            }
+
+            gen.EmitRegister({ 0x0F, 0xB6 }, RDX, RDX);                                     // movzx edx, dl
+            gen.EmitMemory({ 0x89 }, RDX, RAX, left + VALUE_DATA);
+            gen.EmitMemory({ 0xC6 }, 0, RAX, left + VALUE_TYPE);
+            gen.EmitByte(static_cast<uint8_t>(VMDataType::INT32));
+            gen.EmitRegister({ 0x83 }, 5, RAX, true);
+            gen.EmitByte(VALUE_SIZE);
+            EmitStoreTop(gen);
+        }
+
+        // Jumps within the region are direct, apart from counted back-edges;
+        // anything else returns to the VM at the target. Conditions other than
+        // INT32 are tested by the interpreter.
+        void JITCompiler::EmitControlFlow(CodeGenerator& gen, const RegionInstruction& instruction, uint32_t slow_path) {
+            const uint32_t target = gen.BranchLabel(instruction);
+            if (instruction.opcode == VMOpcode::JMP) {
+                gen.EmitJump(target);
+                return;
+            }
+
+            EmitLoadTop(gen);
+            EmitRequireValues(gen, 1, slow_path);
+            gen.EmitMemory({ 0x80 }, 7, RAX, VALUE_TYPE - VALUE_SIZE);                      // cmp byte [top], INT32
+            gen.EmitByte(static_cast<uint8_t>(VMDataType::INT32));
+            gen.EmitJumpIf(CC_NE, slow_path);
+            gen.EmitRegister({ 0x83 }, 5, RAX, true);
+            gen.EmitByte(VALUE_SIZE);
+            EmitStoreTop(gen);
+            gen.EmitMemory({ 0x83 }, 7, RAX, VALUE_DATA);                                   // cmp dword [popped], 0
+            gen.EmitByte(0);
+            gen.EmitJumpIf(instruction.opcode == VMOpcode::JMP_IF_ZERO ? CC_E : CC_NE, target);
+        }
+
+        // Locals and globals are read through the context, which the VM keeps
+        // current; slots past the end are left to the interpreter
+        void JITCompiler::EmitMemoryOperation(CodeGenerator& gen, VMOpcode opcode, uint32_t operand, uint32_t slow_path) {
+            const bool local = opcode == VMOpcode::LOAD_LOCAL || opcode == VMOpcode::STORE_LOCAL;
+            const int32_t slot = static_cast<int32_t>(operand) * VALUE_SIZE;
+
+            gen.EmitMemory({ 0x81 }, 7, RBX, local ? CONTEXT_LOCAL_COUNT : CONTEXT_GLOBAL_COUNT);   // cmp dword [rbx + count], slot
+            gen.EmitDWord(operand);
+            gen.EmitJumpIf(CC_BE, slow_path);
+            gen.EmitMemory({ 0x8B }, RCX, RBX, local ? CONTEXT_LOCALS : CONTEXT_GLOBALS, true);     // mov rcx, [rbx + slots]
+            EmitLoadTop(gen);
+
+            if (opcode == VMOpcode::LOAD_LOCAL || opcode == VMOpcode::LOAD_GLOBAL) {
+                EmitRequireRoom(gen, slow_path);
+                EmitCopyValue(gen, RAX, 0, RCX, slot);
+                gen.EmitRegister({ 0x83 }, 0, RAX, true);
+            } else {
+                EmitRequireValues(gen, 1, slow_path);
+                EmitCopyValue(gen, RCX, slot, RAX, -VALUE_SIZE);
+                gen.EmitRegister({ 0x83 }, 5, RAX, true);
+            }
+            gen.EmitByte(VALUE_SIZE);
+            EmitStoreTop(gen);
+        }
+
+        void JITCompiler::AllocateLoopRegisters(LoopPlan& plan) {
+            LinearScanAllocator allocator(LOOP_GENERAL_REGISTERS, LOOP_FLOAT_REGISTERS);
+            const uint32_t end = static_cast<uint32_t>(plan.operations.size());
+            std::vector<uint32_t> intervals(plan.values.size(), NO_EXIT);
+            for (uint32_t value = 0; value < plan.values.size(); value++) {
+                if (plan.values[value].carried) {
+                    intervals[value] = allocator.AddInterval(ClassOf(plan.values[value].type), 0, end);
+                }
+            }
+            auto use = [&](uint32_t value, uint32_t position) {
+                if (value == NO_EXIT) {
+                    return;
+                }
+                if (intervals[value] == NO_EXIT) {
+                    intervals[value] = allocator.AddInterval(ClassOf(plan.values[value].type), position, position);
+                }
+                allocator.AddUse(intervals[value], position);
+            };
+
+            for (uint32_t position = 0; position < end; position++) {
+                const LoopOperation& op = plan.operations[position];
+                use(op.left, position);
+                use(op.right, position);
+                use(op.result, position);
+                if (op.exit != NO_EXIT) {
+                    for (uint32_t value : plan.exits[op.exit].stack) {
+                        use(value, position);
+                    }
+                }
+                for (const auto& [to, from] : op.moves) {
+                    use(to, position);
+                    use(from, position);
+                }
+            }
+
+            allocator.Allocate();
+            for (uint32_t value = 0; value < plan.values.size(); value++) {
+                if (intervals[value] != NO_EXIT) {
+                    plan.values[value].location = allocator.GetLocation(intervals[value]);
+                }
+            }
+            plan.spill_slots = allocator.GetSpillSlotCount();
+        }
+
+        void JITCompiler::EmitLoopOperand(CodeGenerator& gen, std::initializer_list<uint8_t> opcode, uint8_t reg,
+                                          const LinearScanAllocator::Location& location, bool wide, uint8_t prefix) {
+            if (location.spilled) {
+                gen.EmitMemory(opcode, reg, RSP, SpillOffset(location.slot), wide, prefix);
+            } else {
+                gen.EmitRegister(opcode, reg, location.reg, wide, prefix);
+            }
+        }
+
+        // Memory to memory goes through rdx, leaving rax and xmm0 to the
+        // parallel moves that break cycles with them
+        void JITCompiler::EmitLoopMove(CodeGenerator& gen, VMDataType type, const LinearScanAllocator::Location& to,
+                                       const LinearScanAllocator::Location& from) {
+            if (SameLocation(type, to, type, from)) {
+                return;
+            }
+            if (type == VMDataType::FLOAT64) {
+                if (!to.spilled && !from.spilled) {
+                    gen.EmitRegister({ 0x0F, 0x28 }, to.reg, from.reg);                 // movaps to, from
+                } else if (!to.spilled) {
+                    EmitLoopOperand(gen, { 0x0F, 0x10 }, to.reg, from, false, 0xF2);    // movsd to, [from]
+                } else if (!from.spilled) {
+                    EmitLoopOperand(gen, { 0x0F, 0x11 }, from.reg, to, false, 0xF2);    // movsd [to], from
+                } else {
+                    EmitLoopOperand(gen, { 0x8B }, RDX, from, true);
+                    EmitLoopOperand(gen, { 0x89 }, RDX, to, true);
+                }
+                return;
+            }
+            if (!to.spilled) {
+                EmitLoopOperand(gen, { 0x8B }, to.reg, from);                           // mov to, from
+            } else if (!from.spilled) {
+                EmitLoopOperand(gen, { 0x89 }, from.reg, to);
+            } else {
+                EmitLoopOperand(gen, { 0x8B }, RDX, from);
+                EmitLoopOperand(gen, { 0x89 }, RDX, to);
+            }
+        }
+
+        // A parallel move: each destination is written once every move reading
+        // it is done; cycles park one value in rax or xmm0
+        void JITCompiler::EmitLoopMoves(CodeGenerator& gen, const LoopPlan& plan,
+                                        const std::vector<std::pair<uint32_t, uint32_t>>& moves) {
+            struct Pending {
+                VMDataType type;
+                LinearScanAllocator::Location to;
+                LinearScanAllocator::Location from;
+            };
+            std::vector<Pending> pending;
+            for (const auto& [to, from] : moves) {
+                const LoopValue& target = plan.values[to];
+                if (!SameLocation(target.type, target.location, plan.values[from].type, plan.values[from].location)) {
+                    pending.push_back({ target.type, target.location, plan.values[from].location });
+                }
+            }
+
+            while (!pending.empty()) {
+                bool progress = false;
+                for (size_t i = 0; i < pending.size();) {
+                    const Pending& move = pending[i];
+                    const bool blocked = std::any_of(pending.begin(), pending.end(), [&move](const Pending& other) {
+                        return &other != &move && SameLocation(other.type, other.from, move.type, move.to);
+                    });
+                    if (blocked) {
+                        i++;
+                        continue;
+                    }
+                    EmitLoopMove(gen, move.type, move.to, move.from);
+                    pending.erase(pending.begin() + i);
+                    progress = true;
+                }
+                if (!progress) {
+                    Pending& move = pending.front();
+                    const LinearScanAllocator::Location scratch = { false, move.type == VMDataType::FLOAT64 ? XMM0 : RAX, 0 };
+                    EmitLoopMove(gen, move.type, scratch, move.to);
+                    for (Pending& other : pending) {
+                        if (SameLocation(other.type, other.from, move.type, move.to)) {
+                            other.from = scratch;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Leaving the loop: the stack the VM would hold goes onto its stack,
+        // slots kept in registers go back, then on to wherever the exit leads
+        void JITCompiler::EmitLoopExit(CodeGenerator& gen, const LoopPlan& plan, const LoopExit& exit) {
+            if (exit.kind == LoopExit::Kind::DEOPT) {
+                // The VM does the same from the deopt point instead
+                JITDeoptPoint point;
+                point.reason = JITDeoptReason::OVERFLOW;
+                point.pc = exit.address;
+                point.loop = plan.header;
+                point.refund = exit.refund;
+                for (uint32_t value : exit.stack) {
+                    point.stack.push_back(DeoptValue(plan.values[value].type, plan.values[value].location));
+                }
+                for (const LoopSlot& slot : plan.slots) {
+                    if (slot.live_in && slot.stored) {
+                        const LoopValue& value = plan.values[slot.value];
+                        point.slots.push_back({ slot.index, slot.global, DeoptValue(value.type, value.location) });
+                    }
+                }
+                gen.EmitByte(0xB8 | RAX);                                                   // mov eax, point
+                gen.EmitDWord(static_cast<uint32_t>(gen.deopt_points.size()));
+                gen.deopt_points.push_back(std::move(point));
+                gen.EmitCall(gen.deopt_label);
+                gen.EmitJump(gen.exit_label);
+                return;
+            }
+
+            if (!exit.stack.empty()) {
+                EmitLoadTop(gen);
+                for (size_t i = 0; i < exit.stack.size(); i++) {
+                    const LoopValue& value = plan.values[exit.stack[i]];
+                    const int32_t offset = static_cast<int32_t>(i) * VALUE_SIZE;
+                    gen.EmitMemory({ 0xC6 }, 0, RAX, offset + VALUE_TYPE);                  // mov byte [rax + type], type
+                    gen.EmitByte(static_cast<uint8_t>(value.type));
+                    const bool is_double = value.type == VMDataType::FLOAT64;
+                    if (value.location.spilled) {
+                        EmitLoopOperand(gen, { 0x8B }, RDX, value.location, is_double);
+                        gen.EmitMemory({ 0x89 }, RDX, RAX, offset + VALUE_DATA, is_double);
+                    } else if (is_double) {
+                        gen.EmitMemory({ 0x0F, 0x11 }, value.location.reg, RAX, offset + VALUE_DATA, false, 0xF2);
+                    } else {
+                        gen.EmitMemory({ 0x89 }, value.location.reg, RAX, offset + VALUE_DATA);
+                    }
+                }
+                gen.EmitRegister({ 0x81 }, 0, RAX, true);                                   // add rax, values
+                gen.EmitDWord(static_cast<uint32_t>(exit.stack.size() * VALUE_SIZE));
+                EmitStoreTop(gen);
+            }
+
+            for (bool global : { false, true }) {
+                bool loaded = false;
+                for (const LoopSlot& slot : plan.slots) {
+                    if (slot.global != global || !slot.live_in || !slot.stored) {
+                        continue;
+                    }
+                    if (!loaded) {
+                        gen.EmitMemory({ 0x8B }, RCX, RBX, global ? CONTEXT_GLOBALS : CONTEXT_LOCALS, true);
+                        loaded = true;
+                    }
+                    const LoopValue& value = plan.values[slot.value];
+                    const int32_t offset = static_cast<int32_t>(slot.index) * VALUE_SIZE + VALUE_DATA;
+                    const bool is_double = value.type == VMDataType::FLOAT64;
+                    if (value.location.spilled) {
+                        EmitLoopOperand(gen, { 0x8B }, RDX, value.location, is_double);
+                        gen.EmitMemory({ 0x89 }, RDX, RCX, offset, is_double);
+                    } else if (is_double) {
+                        gen.EmitMemory({ 0x0F, 0x11 }, value.location.reg, RCX, offset, false, 0xF2);
+                    } else {
+                        gen.EmitMemory({ 0x89 }, value.location.reg, RCX, offset);
+                    }
+                }
+            }
+
+            switch (exit.kind) {
+                case LoopExit::Kind::RESUME:
+                    gen.EmitJump(gen.ResumeLabel(exit.address));
+                    break;
+                case LoopExit::Kind::BRANCH:
+                    gen.EmitJump(gen.TargetLabel(exit.address));
+                    break;
+                default:
+                    gen.EmitMemory({ 0x81 }, 0, RBX, CONTEXT_BUDGET, true);                 // add qword [rbx + budget], refund
+                    gen.EmitDWord(exit.refund);
+                    gen.EmitMemory({ 0xC7 }, 0, RBX, CONTEXT_PC);                           // mov dword [rbx + pc], leader
+                    gen.EmitDWord(exit.address);
+                    gen.EmitJump(gen.exit_label);
+                    break;
+            }
+        }
+
+        void JITCompiler::EmitLoopOperation(CodeGenerator& gen, const LoopPlan& plan, const LoopOperation& operation, size_t index,
+                                            std::vector<std::pair<uint32_t, uint32_t>>& stubs) {
+            auto stub = [&gen, &stubs](uint32_t exit) {
+                stubs.emplace_back(gen.NewLabel(), exit);
+                return stubs.back().first;
+            };
+            auto location = [&plan](uint32_t value) -> const LinearScanAllocator::Location& {
+                return plan.values[value].location;
+            };
+
+            switch (operation.kind) {
+                case LoopOperation::Kind::BLOCK:
+                    gen.EmitLabel(plan.block_labels.at(operation.address));
+                    gen.EmitMemory({ 0x81 }, 5, RBX, CONTEXT_BUDGET, true);                 // sub qword [rbx + budget], length
+                    gen.EmitDWord(static_cast<uint32_t>(operation.immediate));
+                    gen.EmitJumpIf(CC_L, stub(operation.exit));
+                    break;
+
+                case LoopOperation::Kind::CONSTANT: {
+                    const LinearScanAllocator::Location& target = location(operation.result);
+                    if (plan.values[operation.result].type == VMDataType::FLOAT64) {
+                        gen.EmitByte(0x48);                                                 // mov rax, immediate
+                        gen.EmitByte(0xB8 | RAX);
+                        gen.EmitQWord(operation.immediate);
+                        if (target.spilled) {
+                            EmitLoopOperand(gen, { 0x89 }, RAX, target, true);
+                        } else {
+                            gen.EmitRegister({ 0x0F, 0x6E }, target.reg, RAX, true, 0x66);  // movq xmm, rax
+                        }
+                    } else if (target.spilled) {
+                        gen.EmitMemory({ 0xC7 }, 0, RSP, SpillOffset(target.slot));         // mov dword [spill], immediate
+                        gen.EmitDWord(static_cast<uint32_t>(operation.immediate));
+                    } else {
+                        if (target.reg & 8) {
+                            gen.EmitByte(0x41);
+                        }
+                        gen.EmitByte(0xB8 | (target.reg & 7));                              // mov reg, immediate
+                        gen.EmitDWord(static_cast<uint32_t>(operation.immediate));
+                    }
+                    break;
+                }
+
+                case LoopOperation::Kind::MOVE:
+                    EmitLoopMove(gen, plan.values[operation.result].type, location(operation.result), location(operation.left));
+                    break;
+
+                case LoopOperation::Kind::ARITHMETIC: {
+                    uint8_t sse = 0;
+                    switch (operation.opcode) {
+                        case VMOpcode::ADD_F64: sse = 0x58; break;
+                        case VMOpcode::SUB_F64: sse = 0x5C; break;
+                        case VMOpcode::MUL_F64: sse = 0x59; break;
+                        case VMOpcode::DIV_F64: sse = 0x5E; break;
+                        default: break;
+                    }
+                    if (sse) {
+                        EmitLoopOperand(gen, { 0x0F, 0x10 }, XMM0, location(operation.left), false, 0xF2);     // movsd xmm0, left
+                        EmitLoopOperand(gen, { 0x0F, sse }, XMM0, location(operation.right), false, 0xF2);     // op xmm0, right
+                        EmitLoopOperand(gen, { 0x0F, 0x11 }, XMM0, location(operation.result), false, 0xF2);   // movsd result, xmm0
+                        break;
+                    }
+                    EmitLoopOperand(gen, { 0x8B }, RAX, location(operation.left));                          // mov eax, left
+                    switch (operation.opcode) {
+                        case VMOpcode::ADD:
+                        case VMOpcode::ADD_I32: EmitLoopOperand(gen, { 0x03 }, RAX, location(operation.right)); break;
+                        case VMOpcode::SUB:
+                        case VMOpcode::SUB_I32: EmitLoopOperand(gen, { 0x2B }, RAX, location(operation.right)); break;
+                        case VMOpcode::MUL:
+                        case VMOpcode::MUL_I32: EmitLoopOperand(gen, { 0x0F, 0xAF }, RAX, location(operation.right)); break;
+                        case VMOpcode::BIT_AND: EmitLoopOperand(gen, { 0x23 }, RAX, location(operation.right)); break;
+                        case VMOpcode::BIT_OR: EmitLoopOperand(gen, { 0x0B }, RAX, location(operation.right)); break;
+                        default: EmitLoopOperand(gen, { 0x33 }, RAX, location(operation.right)); break;
+                    }
+                    if (operation.exit != NO_EXIT) {
+                        gen.EmitJumpIf(CC_O, stub(operation.exit));
+                    }
+                    EmitLoopOperand(gen, { 0x89 }, RAX, location(operation.result));                        // mov result, eax
+                    break;
+                }
+
+                case LoopOperation::Kind::COMPARE: {
+                    const bool is_double = operation.opcode >= VMOpcode::CMP_EQ_F64 && operation.opcode <= VMOpcode::CMP_LE_F64;
+                    if (is_double) {
+                        // As in EmitComparison: every ordered test is an above condition
+                        const VMOpcode generic = static_cast<VMOpcode>(static_cast<uint8_t>(VMOpcode::CMP_EQ) +
+                            static_cast<uint8_t>(operation.opcode) - static_cast<uint8_t>(VMOpcode::CMP_EQ_F64));
+                        const bool swapped = generic == VMOpcode::CMP_LT || generic == VMOpcode::CMP_LE;
+                        EmitLoopOperand(gen, { 0x0F, 0x10 }, XMM0, location(swapped ? operation.right : operation.left), false, 0xF2);
+                        EmitLoopOperand(gen, { 0x0F, 0x2E }, XMM0, location(swapped ? operation.left : operation.right), false, 0x66);
+                        switch (generic) {
+                            case VMOpcode::CMP_EQ:
+                                gen.EmitRegister({ 0x0F, 0x90 | CC_E }, 0, RDX);
+                                gen.EmitRegister({ 0x0F, 0x90 | CC_NP }, 0, RCX);
+                                gen.EmitRegister({ 0x20 }, RCX, RDX);                           // and dl, cl
+                                break;
+                            case VMOpcode::CMP_NE:
+                                gen.EmitRegister({ 0x0F, 0x90 | CC_NE }, 0, RDX);
+                                gen.EmitRegister({ 0x0F, 0x90 | CC_P }, 0, RCX);
+                                gen.EmitRegister({ 0x08 }, RCX, RDX);                           // or dl, cl
+                                break;
+                            case VMOpcode::CMP_GT:
+                            case VMOpcode::CMP_LT:
+                                gen.EmitRegister({ 0x0F, 0x90 | CC_A }, 0, RDX);
+                                break;
+                            default:
+                                gen.EmitRegister({ 0x0F, 0x90 | CC_AE }, 0, RDX);
+                                break;
+                        }
+                    } else {
+                        EmitLoopOperand(gen, { 0x8B }, RDX, location(operation.left));          // mov edx, left
+                        EmitLoopOperand(gen, { 0x3B }, RDX, location(operation.right));         // cmp edx, right
+                        gen.EmitRegister({ 0x0F, static_cast<uint8_t>(0x90 | IntegerCondition(operation.opcode)) }, 0, RDX);
+                    }
+                    gen.EmitRegister({ 0x0F, 0xB6 }, RAX, RDX);                                 // movzx eax, dl
+                    EmitLoopOperand(gen, { 0x89 }, RAX, location(operation.result));
+                    break;
+                }
+
+                case LoopOperation::Kind::STORE: {
+                    const LoopSlot& slot = plan.slots[operation.immediate];
+                    if (slot.live_in) {
+                        break;                                                              // Written back on exit
+                    }
+                    const LoopValue& value = plan.values[slot.value];
+                    const int32_t offset = static_cast<int32_t>(slot.index) * VALUE_SIZE;
+                    const bool is_double = value.type == VMDataType::FLOAT64;
+                    gen.EmitMemory({ 0x8B }, RCX, RBX, slot.global ? CONTEXT_GLOBALS : CONTEXT_LOCALS, true);
+                    gen.EmitMemory({ 0xC6 }, 0, RCX, offset + VALUE_TYPE);
+                    gen.EmitByte(static_cast<uint8_t>(value.type));
+                    if (value.location.spilled) {
+                        EmitLoopOperand(gen, { 0x8B }, RDX, value.location, is_double);
+                        gen.EmitMemory({ 0x89 }, RDX, RCX, offset + VALUE_DATA, is_double);
+                    } else if (is_double) {
+                        gen.EmitMemory({ 0x0F, 0x11 }, value.location.reg, RCX, offset + VALUE_DATA, false, 0xF2);
+                    } else {
+                        gen.EmitMemory({ 0x89 }, value.location.reg, RCX, offset + VALUE_DATA);
+                    }
+                    break;
+                }
+
+                case LoopOperation::Kind::BRANCH: {
+                    uint8_t taken;
+                    if (operation.fused) {
+                        const LinearScanAllocator::Location& left = location(operation.left);
+                        uint8_t reg = left.reg;
+                        if (left.spilled) {
+                            EmitLoopOperand(gen, { 0x8B }, RAX, left);
+                            reg = RAX;
+                        }
+                        EmitLoopOperand(gen, { 0x3B }, reg, location(operation.right));        // cmp left, right
+                        taken = IntegerCondition(operation.opcode);
+                        if (operation.on_zero) {
+                            taken ^= 1;                                                     // The inverse condition
+                        }
+                    } else {
+                        const LinearScanAllocator::Location& condition = location(operation.left);
+                        if (condition.spilled) {
+                            gen.EmitMemory({ 0x83 }, 7, RSP, SpillOffset(condition.slot));    // cmp dword [spill], 0
+                            gen.EmitByte(0);
+                        } else {
+                            gen.EmitRegister({ 0x85 }, condition.reg, condition.reg);       // test reg, reg
+                        }
+                        taken = operation.on_zero ? CC_E : CC_NE;
+                    }
+
+                    if (operation.exit != NO_EXIT) {
+                        gen.EmitJumpIf(taken, stub(operation.exit));
+                    } else if (operation.moves.empty()) {
+                        gen.EmitJumpIf(taken, plan.block_labels.at(operation.address));
+                    } else {
+                        const uint32_t skip = gen.NewLabel();
+                        gen.EmitJumpIf(taken ^ 1, skip);
+                        EmitLoopMoves(gen, plan, operation.moves);
+                        gen.EmitJump(plan.block_labels.at(operation.address));
+                        gen.EmitLabel(skip);
+                    }
+                    break;
+                }
+
+                case LoopOperation::Kind::JUMP: {
+                    EmitLoopMoves(gen, plan, operation.moves);
+                    const bool falls_through = index + 1 < plan.operations.size() &&
+                                               plan.operations[index + 1].kind == LoopOperation::Kind::BLOCK &&
+                                               plan.operations[index + 1].address == operation.address;
+                    if (!falls_through) {
+                        gen.EmitJump(plan.block_labels.at(operation.address));
+                    }
+                    break;
+                }
+
+                case LoopOperation::Kind::EXIT:
+                    EmitLoopExit(gen, plan, plan.exits[operation.exit]);
+                    break;
+            }
+        }
+
+        // Entry checks that the stack has room for the deepest the loop goes
+        // and that the slots are in range and hold what the loop was
+        // specialised for, then loads them. A failed check is a guard the VM
+        // counts before the template code of the header runs instead. Exits
+        // are emitted after the body.
+        void JITCompiler::EmitLoop(CodeGenerator& gen, LoopPlan& plan) {
+            const uint32_t guard = gen.NewLabel();
+            for (const LoopOperation& operation : plan.operations) {
+                if (operation.kind == LoopOperation::Kind::BLOCK) {
+                    plan.block_labels[operation.address] = gen.NewLabel();
+                }
+            }
+
+            gen.EmitLabel(plan.header);
+            if (plan.max_depth) {
+                EmitLoadTop(gen);
+                gen.EmitMemory({ 0x8D }, RAX, RAX, static_cast<int32_t>(plan.max_depth) * VALUE_SIZE, true);   // lea rax, [rax + deepest]
+                gen.EmitMemory({ 0x3B }, RAX, R12, ValueStack::LimitOffset(), true);                          // cmp rax, [r12 + limit]
+                gen.EmitJumpIf(CC_A, guard);
+            }
+            for (bool global : { false, true }) {
+                uint32_t highest = 0;
+                bool any = false;
+                for (const LoopSlot& slot : plan.slots) {
+                    if (slot.global == global) {
+                        highest = std::max(highest, slot.index);
+                        any = true;
+                    }
+                }
+                if (!any) {
+                    continue;
+                }
+                gen.EmitMemory({ 0x81 }, 7, RBX, global ? CONTEXT_GLOBAL_COUNT : CONTEXT_LOCAL_COUNT);       // cmp dword [rbx + count], highest
+                gen.EmitDWord(highest);
+                gen.EmitJumpIf(CC_BE, guard);
+                gen.EmitMemory({ 0x8B }, RCX, RBX, global ? CONTEXT_GLOBALS : CONTEXT_LOCALS, true);         // mov rcx, [rbx + slots]
+                for (const LoopSlot& slot : plan.slots) {
+                    if (slot.global == global && slot.live_in) {
+                        gen.EmitMemory({ 0x80 }, 7, RCX, static_cast<int32_t>(slot.index) * VALUE_SIZE + VALUE_TYPE);
+                        gen.EmitByte(static_cast<uint8_t>(slot.type));                                         // cmp byte [slot], type
+                        gen.EmitJumpIf(CC_NE, guard);
+                    }
+                }
+                for (const LoopSlot& slot : plan.slots) {
+                    if (slot.global != global || !slot.live_in) {
+                        continue;
+                    }
+                    const LoopValue& value = plan.values[slot.value];
+                    const int32_t offset = static_cast<int32_t>(slot.index) * VALUE_SIZE + VALUE_DATA;
+                    const bool is_double = value.type == VMDataType::FLOAT64;
+                    if (value.location.spilled) {
+                        gen.EmitMemory({ 0x8B }, RDX, RCX, offset, is_double);
+                        EmitLoopOperand(gen, { 0x89 }, RDX, value.location, is_double);
+                    } else if (is_double) {
+                        gen.EmitMemory({ 0x0F, 0x10 }, value.location.reg, RCX, offset, false, 0xF2);
+                    } else {
+                        gen.EmitMemory({ 0x8B }, value.location.reg, RCX, offset);
+                    }
+                }
+            }
+
+            std::vector<std::pair<uint32_t, uint32_t>> stubs;       // (label, exit)
+            for (size_t i = 0; i < plan.operations.size(); i++) {
+                EmitLoopOperation(gen, plan, plan.operations[i], i, stubs);
+            }
+
+            JITDeoptPoint point;
+            point.reason = JITDeoptReason::ENTRY_CHECK;
+            point.pc = plan.header;
+            point.loop = plan.header;
+            point.refund = 0;
+            gen.EmitLabel(guard);
+            gen.EmitByte(0xB8 | RAX);                                                       // mov eax, point
+            gen.EmitDWord(static_cast<uint32_t>(gen.deopt_points.size()));
+            gen.deopt_points.push_back(std::move(point));
+            gen.EmitCall(gen.deopt_label);
+            gen.EmitJump(gen.generic_headers.at(plan.header));
+            for (const auto& [label, exit] : stubs) {
+                gen.EmitLabel(label);
+                EmitLoopExit(gen, plan, plan.exits[exit]);
+            }
+        }
+
+        // Shared by the guards of a region and called with the point in eax.
+        // Saves the registers loops allocate and the address of the spill
+        // slots for JITContext::deopt, which may clobber the rest.
+        void JITCompiler::EmitDeoptStub(CodeGenerator& gen) {
+            gen.EmitLabel(gen.deopt_label);
+            gen.EmitRegister({ 0x83 }, 5, RSP, true);                                       // sub rsp, 40: shadow space, realigned
+            gen.EmitByte(40);
+            for (uint8_t reg : LOOP_GENERAL_REGISTERS) {
+                gen.EmitMemory({ 0x89 }, reg, RBX, CONTEXT_DEOPT_REGISTERS + reg * 8, true);
+            }
+            for (uint8_t reg : LOOP_FLOAT_REGISTERS) {
+                gen.EmitMemory({ 0x0F, 0x11 }, reg, RBX, CONTEXT_DEOPT_FLOAT_REGISTERS + reg * 8, false, 0xF2);
+            }
+            gen.EmitMemory({ 0x8D }, RCX, RSP, 48 + FRAME_SIZE, true);                      // lea rcx, [spill slots]
+            gen.EmitMemory({ 0x89 }, RCX, RBX, CONTEXT_DEOPT_SPILLS, true);
+            gen.EmitRegister({ 0x89 }, RAX, ARG1);                                          // mov arg1d, eax
+            gen.EmitRegister({ 0x89 }, RBX, ARG0, true);                                    // mov arg0, rbx
+            gen.EmitMemory({ 0xFF }, 2, RBX, CONTEXT_DEOPT);                                // call [rbx + deopt]
+            gen.EmitRegister({ 0x83 }, 0, RSP, true);                                       // add rsp, 40
+            gen.EmitByte(40);
+            gen.EmitByte(0xC3);                                                             // ret
+        }
+
+        void JITCompiler::EmitSecurityCheck(CodeGenerator& gen, VMOpcode opcode) {
+            if (m_settings.enable_security_checks) {
+                // Emit anti-tampering checks
+                gen.EmitByte(0x90); // NOP placeholder
+            }
+        }
+
+    } // namespace VM
+} // namespace AetherVisor
+
+#endif
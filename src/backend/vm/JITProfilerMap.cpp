@@ -0,0 +1,259 @@
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "JITProfilerMap.h"
+#include "../security/XorStr.h"
+#include <cstring>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace AetherVisor {
+    namespace VM {
+
+        namespace {
+            // jitdump, as tools/perf/Documentation/jitdump-specification.txt has it
+            constexpr uint32_t JITDUMP_MAGIC = 0x4A695444;
+            constexpr uint32_t JITDUMP_VERSION = 1;
+            constexpr uint32_t JIT_CODE_LOAD = 0;
+            constexpr uint32_t JIT_CODE_DEBUG_INFO = 2;
+            constexpr uint32_t JIT_CODE_CLOSE = 3;
+#if defined(__aarch64__)
+            constexpr uint32_t ELF_MACHINE = 183;       // EM_AARCH64
+#else
+            constexpr uint32_t ELF_MACHINE = 62;        // EM_X86_64
+#endif
+
+            struct JitDumpHeader {
+                uint32_t magic;
+                uint32_t version;
+                uint32_t total_size;
+                uint32_t elf_mach;
+                uint32_t pad1;
+                uint32_t pid;
+                uint64_t timestamp;
+                uint64_t flags;
+            };
+            struct JitDumpRecord {
+                uint32_t id;
+                uint32_t total_size;
+                uint64_t timestamp;
+            };
+            struct JitDumpCodeLoad {
+                JitDumpRecord record;
+                uint32_t pid;
+                uint32_t tid;
+                uint64_t vma;
+                uint64_t code_addr;
+                uint64_t code_size;
+                uint64_t code_index;
+                // Then the NUL-terminated name and the code
+            };
+            struct JitDumpDebugInfo {
+                JitDumpRecord record;
+                uint64_t code_addr;
+                uint64_t nr_entry;
+                // Then the entries
+            };
+            struct JitDumpDebugEntry {
+                uint64_t code_addr;
+                uint32_t line;
+                uint32_t discrim;
+                // Then the NUL-terminated file name
+            };
+
+            // perf's default clock for perf record -k mono
+            uint64_t Timestamp() {
+#ifdef __linux__
+                timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + static_cast<uint64_t>(now.tv_nsec);
+#else
+                return 0;
+#endif
+            }
+
+            template <typename T>
+            void Append(std::vector<uint8_t>& buffer, const T& value) {
+                const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+                buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+            }
+
+            void AppendString(std::vector<uint8_t>& buffer, const std::string& text) {
+                buffer.insert(buffer.end(), text.begin(), text.end());
+                buffer.push_back(0);
+            }
+        }
+
+        JITProfilerMap& JITProfilerMap::GetInstance() {
+            static JITProfilerMap instance;
+            return instance;
+        }
+
+        JITProfilerMap::JITProfilerMap()
+            : m_perf_map(nullptr), m_jitdump(-1), m_jitdump_marker(nullptr), m_marker_size(0), m_code_index(0) {
+        }
+
+        JITProfilerMap::~JITProfilerMap() {
+            Disable();
+        }
+
+        bool JITProfilerMap::Enable(uint32_t formats) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+#ifdef __linux__
+            if ((formats & PERF_MAP) && !m_perf_map) {
+                char path[64];
+                std::snprintf(path, sizeof(path), XorS("/tmp/perf-%d.map"), static_cast<int>(getpid()));
+                m_perf_map = std::fopen(path, "a");
+            }
+            if ((formats & JITDUMP) && m_jitdump < 0) {
+                OpenJitDump();
+            }
+#endif
+            return m_perf_map || m_jitdump >= 0;
+        }
+
+        void JITProfilerMap::Disable() {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_perf_map) {
+                std::fclose(m_perf_map);
+                m_perf_map = nullptr;
+            }
+            CloseJitDump();
+        }
+
+        bool JITProfilerMap::IsEnabled() const {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_perf_map || m_jitdump >= 0;
+        }
+
+        // Line tables go first: perf inject attaches debug info to the code
+        // load that follows it
+        void JITProfilerMap::RecordCode(const std::string& name, const void* code, size_t size,
+                                        const std::string& source, const std::vector<LineEntry>& lines) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!code || size == 0) {
+                return;
+            }
+            const uint64_t address = reinterpret_cast<uintptr_t>(code);
+
+            if (m_perf_map) {
+                std::fprintf(m_perf_map, "%llx %zx %s\n", static_cast<unsigned long long>(address), size, name.c_str());
+                std::fflush(m_perf_map);
+            }
+
+#ifdef __linux__
+            if (m_jitdump < 0) {
+                return;
+            }
+            const uint64_t timestamp = Timestamp();
+            std::vector<uint8_t> buffer;
+            if (!lines.empty()) {
+                JitDumpDebugInfo info{};
+                info.record.id = JIT_CODE_DEBUG_INFO;
+                info.record.timestamp = timestamp;
+                info.code_addr = address;
+                info.nr_entry = lines.size();
+                Append(buffer, info);
+                for (const LineEntry& line : lines) {
+                    JitDumpDebugEntry entry{};
+                    entry.code_addr = address + line.native_offset;
+                    entry.line = line.line;
+                    Append(buffer, entry);
+                    AppendString(buffer, source);
+                }
+                const uint32_t total = static_cast<uint32_t>(buffer.size());
+                std::memcpy(buffer.data() + offsetof(JitDumpRecord, total_size), &total, sizeof(total));
+                WriteJitDump(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+
+            JitDumpCodeLoad load{};
+            load.record.id = JIT_CODE_LOAD;
+            load.record.total_size = static_cast<uint32_t>(sizeof(load) + name.size() + 1 + size);
+            load.record.timestamp = timestamp;
+            load.pid = static_cast<uint32_t>(getpid());
+            load.tid = static_cast<uint32_t>(syscall(SYS_gettid));
+            load.vma = address;
+            load.code_addr = address;
+            load.code_size = size;
+            load.code_index = m_code_index++;
+            Append(buffer, load);
+            AppendString(buffer, name);
+            const uint8_t* bytes = static_cast<const uint8_t*>(code);
+            buffer.insert(buffer.end(), bytes, bytes + size);
+            WriteJitDump(buffer.data(), buffer.size());
+#endif
+        }
+
+        // perf finds the dump through the executable mapping of it it sees
+        // in the recorded process
+        bool JITProfilerMap::OpenJitDump() {
+#ifdef __linux__
+            char path[64];
+            std::snprintf(path, sizeof(path), XorS("/tmp/jit-%d.dump"), static_cast<int>(getpid()));
+            m_jitdump = open(path, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0666);
+            if (m_jitdump < 0) {
+                return false;
+            }
+            m_marker_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            void* marker = mmap(nullptr, m_marker_size, PROT_READ | PROT_EXEC, MAP_PRIVATE, m_jitdump, 0);
+            if (marker == MAP_FAILED) {
+                close(m_jitdump);
+                m_jitdump = -1;
+                return false;
+            }
+            m_jitdump_marker = marker;
+
+            JitDumpHeader header{};
+            header.magic = JITDUMP_MAGIC;
+            header.version = JITDUMP_VERSION;
+            header.total_size = sizeof(header);
+            header.elf_mach = ELF_MACHINE;
+            header.pid = static_cast<uint32_t>(getpid());
+            header.timestamp = Timestamp();
+            WriteJitDump(&header, sizeof(header));
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        void JITProfilerMap::CloseJitDump() {
+#ifdef __linux__
+            if (m_jitdump < 0) {
+                return;
+            }
+            JitDumpRecord close_record{};
+            close_record.id = JIT_CODE_CLOSE;
+            close_record.total_size = sizeof(close_record);
+            close_record.timestamp = Timestamp();
+            WriteJitDump(&close_record, sizeof(close_record));
+            munmap(m_jitdump_marker, m_marker_size);
+            close(m_jitdump);
+            m_jitdump_marker = nullptr;
+            m_jitdump = -1;
+#endif
+        }
+
+        void JITProfilerMap::WriteJitDump(const void* data, size_t size) {
+#ifdef __linux__
+            const uint8_t* bytes = static_cast<const uint8_t*>(data);
+            while (size > 0) {
+                const ssize_t written = write(m_jitdump, bytes, size);
+                if (written <= 0) {
+                    return;
+                }
+                bytes += written;
+                size -= static_cast<size_t>(written);
+            }
+#endif
+        }
+
+    } // namespace VM
+} // namespace AetherVisor
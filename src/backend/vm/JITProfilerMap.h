@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+
+namespace AetherVisor {
+    namespace VM {
+
+        // Symbols for native code, for Linux perf. The perf map,
+        // /tmp/perf-<pid>.map, names each function's code range and is read
+        // by perf report as it is. The jitdump, /tmp/jit-<pid>.dump, also
+        // carries the code and its line table: record with
+        // perf record -k mono, then perf inject --jit attributes samples to
+        // source lines. Both are process-wide and append-only; elsewhere
+        // Enable fails. Safe from any thread.
+        class JITProfilerMap {
+        public:
+            static JITProfilerMap& GetInstance();
+
+            enum Format : uint32_t {
+                PERF_MAP = 1,
+                JITDUMP = 2
+            };
+
+            // Opens the files for formats not open yet; false when none is
+            bool Enable(uint32_t formats);
+            void Disable();
+            bool IsEnabled() const;
+
+            // Lines the code from native_offset on belongs to, by offset
+            struct LineEntry {
+                uint32_t native_offset;
+                uint32_t line;
+            };
+
+            void RecordCode(const std::string& name, const void* code, size_t size,
+                            const std::string& source, const std::vector<LineEntry>& lines);
+
+        private:
+            JITProfilerMap();
+            ~JITProfilerMap();
+            JITProfilerMap(const JITProfilerMap&) = delete;
+            JITProfilerMap& operator=(const JITProfilerMap&) = delete;
+
+            mutable std::mutex m_mutex;
+            FILE* m_perf_map;
+            int m_jitdump;                          // File descriptor, or -1
+            void* m_jitdump_marker;                 // Executable mapping of the dump, which perf records
+            size_t m_marker_size;
+            uint64_t m_code_index;
+
+            bool OpenJitDump();
+            void CloseJitDump();
+            void WriteJitDump(const void* data, size_t size);
+        };
+
+    } // namespace VM
+} // namespace AetherVisor
@@ -0,0 +1,123 @@
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "RegisterAllocator.h"
+#include "../security/XorStr.h"
+#include <algorithm>
+#include <numeric>
+
+namespace AetherVisor {
+    namespace VM {
+
+        LinearScanAllocator::LinearScanAllocator(const std::vector<uint8_t>& general, const std::vector<uint8_t>& floating)
+            : m_spill_slots(0) {
+            m_registers[static_cast<size_t>(RegisterClass::GENERAL)] = general;
+            m_registers[static_cast<size_t>(RegisterClass::FLOAT)] = floating;
+        }
+
+        uint32_t LinearScanAllocator::AddInterval(RegisterClass register_class, uint32_t start, uint32_t end) {
+            Interval interval;
+            interval.register_class = register_class;
+            interval.start = start;
+            interval.end = std::max(start, end);
+            interval.uses = 0;
+            interval.location = { true, 0, 0 };
+            m_intervals.push_back(interval);
+            return static_cast<uint32_t>(m_intervals.size() - 1);
+        }
+
+        void LinearScanAllocator::AddUse(uint32_t interval, uint32_t position) {
+            Interval& target = m_intervals[interval];
+            target.start = std::min(target.start, position);
+            target.end = std::max(target.end, position);
+            target.uses++;
+        }
+
+        void LinearScanAllocator::Allocate() {
+            std::vector<uint32_t> order(m_intervals.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+                return m_intervals[a].start < m_intervals[b].start;
+            });
+
+            std::vector<uint8_t> free[2] = { m_registers[0], m_registers[1] };
+            std::vector<uint32_t> active[2];
+
+            for (uint32_t index : order) {
+                Interval& current = m_intervals[index];
+                const size_t file = static_cast<size_t>(current.register_class);
+
+                // Expire what ended, returning the registers in their original order
+                auto& live = active[file];
+                for (auto it = live.begin(); it != live.end();) {
+                    if (m_intervals[*it].end <= current.start) {
+                        free[file].push_back(m_intervals[*it].location.reg);
+                        it = live.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+                std::sort(free[file].begin(), free[file].end(), [this, file](uint8_t a, uint8_t b) {
+                    const auto& registers = m_registers[file];
+                    return std::find(registers.begin(), registers.end(), a) < std::find(registers.begin(), registers.end(), b);
+                });
+
+                if (!free[file].empty()) {
+                    current.location = { false, free[file].front(), 0 };
+                    free[file].erase(free[file].begin());
+                    live.push_back(index);
+                    continue;
+                }
+
+                // Spill whichever ends last, sparing the most used
+                uint32_t victim = index;
+                for (uint32_t candidate : live) {
+                    const Interval& other = m_intervals[candidate];
+                    const Interval& chosen = m_intervals[victim];
+                    if (other.end > chosen.end || (other.end == chosen.end && other.uses < chosen.uses)) {
+                        victim = candidate;
+                    }
+                }
+                if (victim != index) {
+                    current.location = { false, m_intervals[victim].location.reg, 0 };
+                    m_intervals[victim].location = { true, 0, 0 };
+                    std::replace(live.begin(), live.end(), victim, index);
+                } else {
+                    current.location = { true, 0, 0 };
+                }
+            }
+
+            AssignSpillSlots();
+        }
+
+        // A second scan over the spilled intervals alone, with as many slots as it takes
+        void LinearScanAllocator::AssignSpillSlots() {
+            std::vector<uint32_t> spilled;
+            for (uint32_t i = 0; i < m_intervals.size(); i++) {
+                if (m_intervals[i].location.spilled) {
+                    spilled.push_back(i);
+                }
+            }
+            std::stable_sort(spilled.begin(), spilled.end(), [this](uint32_t a, uint32_t b) {
+                return m_intervals[a].start < m_intervals[b].start;
+            });
+
+            std::vector<uint32_t> slot_ends;            // Last position held, by slot
+            m_spill_slots = 0;
+            for (uint32_t index : spilled) {
+                Interval& interval = m_intervals[index];
+                uint32_t slot = 0;
+                while (slot < slot_ends.size() && slot_ends[slot] > interval.start) {
+                    slot++;
+                }
+                if (slot == slot_ends.size()) {
+                    slot_ends.push_back(0);
+                }
+                slot_ends[slot] = interval.end;
+                interval.location.slot = slot;
+            }
+            m_spill_slots = static_cast<uint32_t>(slot_ends.size());
+        }
+
+    } // namespace VM
+} // namespace AetherVisor
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace AetherVisor {
+    namespace VM {
+
+        // Linear-scan register allocation (Poletto and Sarkar) over live
+        // intervals in a linear order of instructions. Each interval belongs to
+        // a register class with a register file of its own. When a class runs
+        // out, the interval that ends furthest away is spilled for its whole
+        // lifetime, the least used of those first; spilled intervals that do
+        // not overlap share frame slots.
+        class LinearScanAllocator {
+        public:
+            enum class RegisterClass : uint8_t { GENERAL, FLOAT };
+
+            struct Location {
+                bool spilled;
+                uint8_t reg;                // Register number, when not spilled
+                uint32_t slot;              // 8-byte spill slot, when spilled
+            };
+
+            LinearScanAllocator(const std::vector<uint8_t>& general, const std::vector<uint8_t>& floating);
+
+            // Positions are inclusive. An interval may take the register of one
+            // that ends where it starts: instructions read before they write.
+            uint32_t AddInterval(RegisterClass register_class, uint32_t start, uint32_t end);
+            void AddUse(uint32_t interval, uint32_t position);      // Extends the interval and weighs it
+
+            void Allocate();
+
+            const Location& GetLocation(uint32_t interval) const { return m_intervals[interval].location; }
+            uint32_t GetSpillSlotCount() const { return m_spill_slots; }
+
+        private:
+            struct Interval {
+                RegisterClass register_class;
+                uint32_t start;
+                uint32_t end;
+                uint32_t uses;
+                Location location;
+            };
+
+            std::vector<Interval> m_intervals;
+            std::vector<uint8_t> m_registers[2];    // By RegisterClass
+            uint32_t m_spill_slots;
+
+            void AssignSpillSlots();
+        };
+
+    } // namespace VM
+} // namespace AetherVisor
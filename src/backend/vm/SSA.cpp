@@ -0,0 +1,1712 @@
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "SSA.h"
+#include "../security/XorStr.h"
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace AetherVisor {
+    namespace VM {
+
+        namespace {
+            std::string ConstantKey(const VMValue& value, const std::string& text) {
+                std::string key(1, static_cast<char>(value.type));
+                switch (value.type) {
+                    case VMDataType::INT32:
+                    case VMDataType::FLOAT32:
+                        key.append(reinterpret_cast<const char*>(&value.data.i32), sizeof(int32_t));
+                        break;
+                    case VMDataType::INT64:
+                    case VMDataType::FLOAT64:
+                        key.append(reinterpret_cast<const char*>(&value.data.i64), sizeof(int64_t));
+                        break;
+                    case VMDataType::BOOLEAN:
+                        key.push_back(value.data.boolean ? 1 : 0);
+                        break;
+                    case VMDataType::STRING:
+                        key.append(text);
+                        break;
+                    default:
+                        break;
+                }
+                return key;
+            }
+
+            template <typename T>
+            bool CompareConstants(VMOpcode opcode, T a, T b) {
+                switch (opcode) {
+                    case VMOpcode::CMP_EQ_I32: case VMOpcode::CMP_EQ_F64: return a == b;
+                    case VMOpcode::CMP_NE_I32: case VMOpcode::CMP_NE_F64: return a != b;
+                    case VMOpcode::CMP_GT_I32: case VMOpcode::CMP_GT_F64: return a > b;
+                    case VMOpcode::CMP_GE_I32: case VMOpcode::CMP_GE_F64: return a >= b;
+                    case VMOpcode::CMP_LT_I32: case VMOpcode::CMP_LT_F64: return a < b;
+                    default: return a <= b;
+                }
+            }
+
+            void EraseFirst(std::vector<SSAValue*>& list, const SSAValue* value) {
+                auto it = std::find(list.begin(), list.end(), value);
+                if (it != list.end()) {
+                    list.erase(it);
+                }
+            }
+
+            // Reverse post-order of the reachable blocks, visiting successors[0]
+            // last so that it directly follows its block
+            std::vector<SSABlock*> ReversePostOrder(const SSAFunction& function) {
+                std::vector<SSABlock*> order;
+                std::vector<bool> visited(function.GetBlocks().size(), false);
+                std::vector<std::pair<SSABlock*, size_t>> stack;
+                stack.emplace_back(function.GetEntry(), function.GetEntry()->successors.size());
+                visited[function.GetEntry()->id] = true;
+                while (!stack.empty()) {
+                    auto& top = stack.back();
+                    if (top.second == 0) {
+                        order.push_back(top.first);
+                        stack.pop_back();
+                        continue;
+                    }
+                    SSABlock* successor = top.first->successors[--top.second];
+                    if (!visited[successor->id]) {
+                        visited[successor->id] = true;
+                        stack.emplace_back(successor, successor->successors.size());
+                    }
+                }
+                std::reverse(order.begin(), order.end());
+                return order;
+            }
+
+            // Natural loop: the header plus every block that reaches a latch
+            // without passing through the header
+            struct SSALoop {
+                SSABlock* header;
+                std::vector<SSABlock*> latches;
+                std::vector<SSABlock*> blocks;      // Reverse post-order, header first
+                std::vector<bool> contains;         // Indexed by block id
+
+                bool Contains(const SSABlock* block) const {
+                    return block && block->id < contains.size() && contains[block->id];
+                }
+                bool Contains(const SSAValue* value) const { return Contains(value->block); }
+            };
+
+            // Immediate dominators (Cooper, Harvey and Kennedy), indexed by block id
+            std::vector<SSABlock*> ComputeDominators(const SSAFunction& function, const std::vector<SSABlock*>& order) {
+                std::vector<SSABlock*> idom(function.GetBlocks().size(), nullptr);
+                std::vector<uint32_t> rank(function.GetBlocks().size(), 0);
+                for (size_t i = 0; i < order.size(); ++i) {
+                    rank[order[i]->id] = static_cast<uint32_t>(i);
+                }
+
+                auto intersect = [&idom, &rank](SSABlock* a, SSABlock* b) {
+                    while (a != b) {
+                        while (rank[a->id] > rank[b->id]) a = idom[a->id];
+                        while (rank[b->id] > rank[a->id]) b = idom[b->id];
+                    }
+                    return a;
+                };
+
+                SSABlock* entry = order.front();
+                idom[entry->id] = entry;
+                bool changed = true;
+                while (changed) {
+                    changed = false;
+                    for (size_t i = 1; i < order.size(); ++i) {
+                        SSABlock* block = order[i];
+                        SSABlock* candidate = nullptr;
+                        for (SSABlock* predecessor : block->predecessors) {
+                            if (!idom[predecessor->id]) continue;
+                            candidate = candidate ? intersect(predecessor, candidate) : predecessor;
+                        }
+                        if (candidate && idom[block->id] != candidate) {
+                            idom[block->id] = candidate;
+                            changed = true;
+                        }
+                    }
+                }
+                return idom;
+            }
+
+            bool Dominates(const std::vector<SSABlock*>& idom, const SSABlock* a, SSABlock* b) {
+                for (;;) {
+                    if (a == b) return true;
+                    SSABlock* parent = idom[b->id];
+                    if (!parent || parent == b) return false;
+                    b = parent;
+                }
+            }
+
+            // Loops ordered innermost first
+            std::vector<SSALoop> FindLoops(const SSAFunction& function) {
+                const std::vector<SSABlock*> order = ReversePostOrder(function);
+                const std::vector<SSABlock*> idom = ComputeDominators(function, order);
+
+                std::vector<SSALoop> loops;
+                for (SSABlock* block : order) {
+                    for (SSABlock* successor : block->successors) {
+                        if (!Dominates(idom, successor, block)) continue;
+                        auto it = std::find_if(loops.begin(), loops.end(),
+                            [successor](const SSALoop& loop) { return loop.header == successor; });
+                        if (it == loops.end()) {
+                            loops.push_back(SSALoop{ successor, {}, {}, {} });
+                            it = loops.end() - 1;
+                        }
+                        it->latches.push_back(block);
+                    }
+                }
+
+                for (SSALoop& loop : loops) {
+                    loop.contains.assign(function.GetBlocks().size(), false);
+                    loop.contains[loop.header->id] = true;
+                    std::vector<SSABlock*> worklist;
+                    for (SSABlock* latch : loop.latches) {
+                        if (!loop.contains[latch->id]) {
+                            loop.contains[latch->id] = true;
+                            worklist.push_back(latch);
+                        }
+                    }
+                    while (!worklist.empty()) {
+                        SSABlock* block = worklist.back();
+                        worklist.pop_back();
+                        for (SSABlock* predecessor : block->predecessors) {
+                            if (!loop.contains[predecessor->id]) {
+                                loop.contains[predecessor->id] = true;
+                                worklist.push_back(predecessor);
+                            }
+                        }
+                    }
+                    for (SSABlock* block : order) {
+                        if (loop.contains[block->id]) loop.blocks.push_back(block);
+                    }
+                }
+
+                std::stable_sort(loops.begin(), loops.end(),
+                    [](const SSALoop& a, const SSALoop& b) { return a.blocks.size() < b.blocks.size(); });
+                return loops;
+            }
+
+            // The single block outside the loop that enters its header and does
+            // nothing else, or null
+            SSABlock* FindPreheader(const SSALoop& loop) {
+                SSABlock* preheader = nullptr;
+                for (SSABlock* predecessor : loop.header->predecessors) {
+                    if (loop.Contains(predecessor)) continue;
+                    if (preheader) return nullptr;
+                    preheader = predecessor;
+                }
+                return preheader && preheader->successors.size() == 1 ? preheader : nullptr;
+            }
+
+            bool ConstantInt32(const SSAValue* value, int64_t& result) {
+                if (value->kind != SSAValueKind::CONSTANT || value->constant.type != VMDataType::INT32) return false;
+                result = value->constant.data.i32;
+                return true;
+            }
+
+            bool FitsInt32(int64_t value) {
+                return value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max();
+            }
+        }
+
+        // SSAValue implementation
+        bool SSAValue::IsTerminator() const {
+            if (kind != SSAValueKind::INSTRUCTION) return false;
+            switch (opcode) {
+                case VMOpcode::JMP:
+                case VMOpcode::JMP_IF_ZERO:
+                case VMOpcode::TRY:
+                case VMOpcode::RET:
+                case VMOpcode::RET_VAL:
+                case VMOpcode::HALT:
+                case VMOpcode::THROW:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        bool SSAValue::HasResult() const {
+            if (kind != SSAValueKind::INSTRUCTION) return true;
+            if (IsTerminator()) return false;
+            return opcode != VMOpcode::STORE_LOCAL && opcode != VMOpcode::STORE_GLOBAL && opcode != VMOpcode::FINALLY;
+        }
+
+        // Only operations that can neither throw nor change state may be dropped.
+        // Specialised opcodes are emitted for proven operand types, and CAST_FLOAT
+        // only ever widens a proven INT32.
+        bool SSAValue::HasSideEffects() const {
+            if (kind != SSAValueKind::INSTRUCTION) return false;
+            switch (opcode) {
+                case VMOpcode::LOAD_LOCAL:
+                case VMOpcode::LOAD_GLOBAL:
+                case VMOpcode::NOT:
+                case VMOpcode::CAST_FLOAT:
+                case VMOpcode::STR_CONCAT:
+                case VMOpcode::ADD_F64:
+                case VMOpcode::SUB_F64:
+                case VMOpcode::MUL_F64:
+                case VMOpcode::DIV_F64:
+                case VMOpcode::CMP_EQ_I32:
+                case VMOpcode::CMP_NE_I32:
+                case VMOpcode::CMP_GT_I32:
+                case VMOpcode::CMP_GE_I32:
+                case VMOpcode::CMP_LT_I32:
+                case VMOpcode::CMP_LE_I32:
+                case VMOpcode::CMP_EQ_F64:
+                case VMOpcode::CMP_NE_F64:
+                case VMOpcode::CMP_GT_F64:
+                case VMOpcode::CMP_GE_F64:
+                case VMOpcode::CMP_LT_F64:
+                case VMOpcode::CMP_LE_F64:
+                    return false;
+                default:
+                    return true;
+            }
+        }
+
+        // SSAFunction implementation
+        SSAFunction::SSAFunction() {
+        }
+
+        SSAValue* SSAFunction::NewValue(SSAValueKind kind) {
+            auto value = std::make_unique<SSAValue>();
+            value->kind = kind;
+            value->opcode = VMOpcode::NOP;
+            value->type = VMDataType::UNDEFINED;
+            value->id = static_cast<uint32_t>(m_values.size());
+            value->immediate = 0;
+            value->line = 0;
+            value->block = nullptr;
+            m_values.push_back(std::move(value));
+            m_removed_values.push_back(false);
+            return m_values.back().get();
+        }
+
+        SSABlock* SSAFunction::CreateBlock() {
+            auto block = std::make_unique<SSABlock>();
+            block->id = static_cast<uint32_t>(m_blocks.size());
+            block->sealed = false;
+            m_blocks.push_back(std::move(block));
+            m_removed_blocks.push_back(false);
+            return m_blocks.back().get();
+        }
+
+        SSAValue* SSAFunction::CreateConstant(const VMValue& value) {
+            auto it = m_constants.find(ConstantKey(value, std::string()));
+            if (it != m_constants.end()) {
+                return it->second;
+            }
+            SSAValue* constant = NewValue(SSAValueKind::CONSTANT);
+            constant->constant = value;
+            constant->type = value.type;
+            m_constants.emplace(ConstantKey(value, std::string()), constant);
+            return constant;
+        }
+
+        SSAValue* SSAFunction::CreateStringConstant(const std::string& text) {
+            VMValue value;
+            value.type = VMDataType::STRING;
+            value.data.string.data = nullptr;
+            value.data.string.length = text.size();
+
+            const std::string key = ConstantKey(value, text);
+            auto it = m_constants.find(key);
+            if (it != m_constants.end()) {
+                return it->second;
+            }
+            SSAValue* constant = NewValue(SSAValueKind::CONSTANT);
+            constant->constant = value;
+            constant->type = VMDataType::STRING;
+            constant->text = text;
+            m_constants.emplace(key, constant);
+            return constant;
+        }
+
+        SSAValue* SSAFunction::CreateParameter(uint32_t slot) {
+            auto it = m_parameters.find(slot);
+            if (it != m_parameters.end()) {
+                return it->second;
+            }
+            SSAValue* parameter = NewValue(SSAValueKind::PARAMETER);
+            parameter->immediate = slot;
+            m_parameters.emplace(slot, parameter);
+            return parameter;
+        }
+
+        SSAValue* SSAFunction::CreatePhi(SSABlock* block, const std::vector<SSAValue*>& operands, VMDataType type) {
+            SSAValue* phi = NewValue(SSAValueKind::PHI);
+            phi->type = type;
+            phi->block = block;
+            phi->operands = operands;
+            for (SSAValue* operand : operands) {
+                operand->users.push_back(phi);
+            }
+            block->phis.push_back(phi);
+            return phi;
+        }
+
+        SSAValue* SSAFunction::Append(SSABlock* block, VMOpcode opcode, const std::vector<SSAValue*>& operands,
+                                      VMDataType type, uint32_t line, uint32_t immediate) {
+            SSAValue* instruction = NewValue(SSAValueKind::INSTRUCTION);
+            instruction->opcode = opcode;
+            instruction->type = type;
+            instruction->immediate = immediate;
+            instruction->line = line;
+            instruction->block = block;
+            instruction->operands = operands;
+            for (SSAValue* operand : operands) {
+                operand->users.push_back(instruction);
+            }
+            block->instructions.push_back(instruction);
+            return instruction;
+        }
+
+        SSAValue* SSAFunction::InsertBefore(SSAValue* position, VMOpcode opcode, const std::vector<SSAValue*>& operands,
+                                            VMDataType type, uint32_t line, uint32_t immediate) {
+            SSABlock* block = position->block;
+            SSAValue* instruction = Append(block, opcode, operands, type, line, immediate);
+            block->instructions.pop_back();
+            block->instructions.insert(std::find(block->instructions.begin(), block->instructions.end(), position), instruction);
+            return instruction;
+        }
+
+        void SSAFunction::MoveBefore(SSAValue* instruction, SSAValue* position) {
+            EraseFirst(instruction->block->instructions, instruction);
+            std::vector<SSAValue*>& list = position->block->instructions;
+            list.insert(std::find(list.begin(), list.end(), position), instruction);
+            instruction->block = position->block;
+        }
+
+        void SSAFunction::AddEdge(SSABlock* from, SSABlock* to) {
+            from->successors.push_back(to);
+            to->predecessors.push_back(from);
+        }
+
+        void SSAFunction::WriteVariable(const void* variable, SSABlock* block, SSAValue* value) {
+            m_current_defs[variable][block] = value;
+        }
+
+        SSAValue* SSAFunction::ReadVariable(const void* variable, SSABlock* block) {
+            auto defs = m_current_defs.find(variable);
+            if (defs != m_current_defs.end()) {
+                auto it = defs->second.find(block);
+                if (it != defs->second.end()) {
+                    return Resolve(it->second);
+                }
+            }
+            return ReadVariableRecursive(variable, block);
+        }
+
+        SSAValue* SSAFunction::ReadVariableRecursive(const void* variable, SSABlock* block) {
+            SSAValue* value;
+            if (!block->sealed) {
+                // Operands are filled in when the block is sealed
+                value = CreatePhi(block, {}, VMDataType::UNDEFINED);
+                m_incomplete_phis[block].emplace_back(variable, value);
+            } else if (block->predecessors.size() == 1) {
+                value = ReadVariable(variable, block->predecessors.front());
+            } else if (block->predecessors.empty()) {
+                value = CreateConstant(VMValue());
+            } else {
+                // Break cycles by recording the phi before reading the predecessors
+                SSAValue* phi = CreatePhi(block, {}, VMDataType::UNDEFINED);
+                WriteVariable(variable, block, phi);
+                value = AddPhiOperands(variable, phi);
+            }
+            WriteVariable(variable, block, value);
+            return value;
+        }
+
+        // Operands are gathered before any are attached, so a trivial-phi removal
+        // triggered while reading a predecessor never sees this phi half built
+        SSAValue* SSAFunction::AddPhiOperands(const void* variable, SSAValue* phi) {
+            std::vector<SSAValue*> operands;
+            operands.reserve(phi->block->predecessors.size());
+            for (SSABlock* predecessor : phi->block->predecessors) {
+                operands.push_back(ReadVariable(variable, predecessor));
+            }
+
+            bool typed = false;
+            VMDataType type = VMDataType::UNDEFINED;
+            for (SSAValue*& operand : operands) {
+                operand = Resolve(operand);
+                operand->users.push_back(phi);
+                if (operand == phi) continue;
+                type = !typed || type == operand->type ? operand->type : VMDataType::UNDEFINED;
+                typed = true;
+            }
+            phi->operands = std::move(operands);
+            phi->type = type;
+            return TryRemoveTrivialPhi(phi);
+        }
+
+        void SSAFunction::SealBlock(SSABlock* block) {
+            if (block->sealed) return;
+            auto pending = m_incomplete_phis.find(block);
+            if (pending != m_incomplete_phis.end()) {
+                auto phis = std::move(pending->second);
+                m_incomplete_phis.erase(pending);
+                for (auto& entry : phis) {
+                    AddPhiOperands(entry.first, entry.second);
+                }
+            }
+            block->sealed = true;
+        }
+
+        SSAValue* SSAFunction::Resolve(SSAValue* value) const {
+            auto it = m_forwarded.find(value);
+            while (it != m_forwarded.end()) {
+                value = it->second;
+                it = m_forwarded.find(value);
+            }
+            return value;
+        }
+
+        // A phi whose operands are all one value (or itself) is that value
+        SSAValue* SSAFunction::TryRemoveTrivialPhi(SSAValue* phi) {
+            SSAValue* same = nullptr;
+            for (SSAValue* operand : phi->operands) {
+                if (operand == same || operand == phi) continue;
+                if (same) return phi;
+                same = operand;
+            }
+            if (!same) {
+                same = CreateConstant(VMValue());    // Unreachable, or read before any store
+            }
+
+            std::vector<SSAValue*> users;
+            for (SSAValue* user : phi->users) {
+                if (user != phi && std::find(users.begin(), users.end(), user) == users.end()) {
+                    users.push_back(user);
+                }
+            }
+
+            ReplaceAllUses(phi, same);
+            RemoveValue(phi);
+
+            for (SSAValue* user : users) {
+                if (user->kind == SSAValueKind::PHI && !m_removed_values[user->id]) {
+                    TryRemoveTrivialPhi(user);
+                }
+            }
+            return Resolve(same);
+        }
+
+        void SSAFunction::ReplaceAllUses(SSAValue* value, SSAValue* replacement) {
+            if (value == replacement) return;
+            std::vector<SSAValue*> users = std::move(value->users);
+            value->users.clear();
+            for (SSAValue* user : users) {
+                if (user == value) continue;   // A phi's self reference disappears with it
+                for (SSAValue*& operand : user->operands) {
+                    if (operand == value) {
+                        operand = replacement;
+                        replacement->users.push_back(user);
+                        break;
+                    }
+                }
+            }
+            m_forwarded[value] = replacement;
+        }
+
+        void SSAFunction::SetOperand(SSAValue* user, size_t index, SSAValue* value) {
+            RemoveUse(user->operands[index], user);
+            user->operands[index] = value;
+            value->users.push_back(user);
+        }
+
+        void SSAFunction::RemoveUse(SSAValue* value, SSAValue* user) {
+            EraseFirst(value->users, user);
+        }
+
+        void SSAFunction::RemoveValue(SSAValue* value) {
+            if (m_removed_values[value->id]) return;
+            for (SSAValue* operand : value->operands) {
+                RemoveUse(operand, value);
+            }
+            value->operands.clear();
+            if (value->block) {
+                auto& list = value->kind == SSAValueKind::PHI ? value->block->phis : value->block->instructions;
+                EraseFirst(list, value);
+                value->block = nullptr;
+            }
+            m_removed_values[value->id] = true;
+        }
+
+        void SSAFunction::RemoveEdge(SSABlock* from, SSABlock* to) {
+            auto pred = std::find(to->predecessors.begin(), to->predecessors.end(), from);
+            if (pred == to->predecessors.end()) return;
+            const size_t index = static_cast<size_t>(pred - to->predecessors.begin());
+            to->predecessors.erase(pred);
+
+            auto succ = std::find(from->successors.begin(), from->successors.end(), to);
+            if (succ != from->successors.end()) {
+                from->successors.erase(succ);
+            }
+
+            std::vector<SSAValue*> phis = to->phis;
+            for (SSAValue* phi : phis) {
+                RemoveUse(phi->operands[index], phi);
+                phi->operands.erase(phi->operands.begin() + index);
+            }
+            for (SSAValue* phi : phis) {
+                if (!m_removed_values[phi->id]) {
+                    TryRemoveTrivialPhi(phi);
+                }
+            }
+        }
+
+        // Successors dropped from the old terminator lose their edge; the new
+        // successor list must be a subset of the old one
+        void SSAFunction::ReplaceTerminator(SSABlock* block, VMOpcode opcode, const std::vector<SSAValue*>& operands,
+                                            const std::vector<SSABlock*>& successors) {
+            SSAValue* old = block->GetTerminator();
+            const uint32_t line = old ? old->line : 0;
+            if (old) {
+                RemoveValue(old);
+            }
+
+            std::vector<SSABlock*> kept = successors;
+            std::vector<SSABlock*> dropped;
+            for (SSABlock* successor : block->successors) {
+                auto it = std::find(kept.begin(), kept.end(), successor);
+                if (it != kept.end()) {
+                    kept.erase(it);
+                } else {
+                    dropped.push_back(successor);
+                }
+            }
+            for (SSABlock* successor : dropped) {
+                RemoveEdge(block, successor);
+            }
+            block->successors = successors;
+            Append(block, opcode, operands, VMDataType::UNDEFINED, line);
+        }
+
+        // Inserts an empty block on the edge, keeping the predecessor index so
+        // phi operands stay aligned
+        SSABlock* SSAFunction::SplitEdge(SSABlock* from, SSABlock* to) {
+            SSABlock* middle = CreateBlock();
+            middle->sealed = true;
+            *std::find(from->successors.begin(), from->successors.end(), to) = middle;
+            *std::find(to->predecessors.begin(), to->predecessors.end(), from) = middle;
+            middle->predecessors.push_back(from);
+            middle->successors.push_back(to);
+
+            SSAValue* terminator = from->GetTerminator();
+            Append(middle, VMOpcode::JMP, {}, VMDataType::UNDEFINED, terminator ? terminator->line : 0);
+            return middle;
+        }
+
+        void SSAFunction::DetachBlock(SSABlock* block) {
+            while (!block->successors.empty()) {
+                RemoveEdge(block, block->successors.front());
+            }
+            for (SSAValue* value : block->phis) {
+                for (SSAValue* operand : value->operands) RemoveUse(operand, value);
+                value->operands.clear();
+                value->block = nullptr;
+                m_removed_values[value->id] = true;
+            }
+            for (SSAValue* value : block->instructions) {
+                for (SSAValue* operand : value->operands) RemoveUse(operand, value);
+                value->operands.clear();
+                value->block = nullptr;
+                m_removed_values[value->id] = true;
+            }
+            block->phis.clear();
+            block->instructions.clear();
+            block->predecessors.clear();
+            m_removed_blocks[block->id] = true;
+        }
+
+        size_t SSAFunction::RemoveUnreachableBlocks() {
+            if (m_blocks.empty()) return 0;
+
+            std::vector<bool> reachable(m_blocks.size(), false);
+            std::vector<SSABlock*> worklist = { GetEntry() };
+            reachable[GetEntry()->id] = true;
+            while (!worklist.empty()) {
+                SSABlock* block = worklist.back();
+                worklist.pop_back();
+                for (SSABlock* successor : block->successors) {
+                    if (!reachable[successor->id]) {
+                        reachable[successor->id] = true;
+                        worklist.push_back(successor);
+                    }
+                }
+            }
+
+            // Values in dead blocks are only used by dead blocks, or by phis that
+            // lose the matching operand with the edge
+            std::vector<SSABlock*> dead;
+            for (auto& block : m_blocks) {
+                if (!reachable[block->id] && !m_removed_blocks[block->id]) {
+                    dead.push_back(block.get());
+                }
+            }
+            for (SSABlock* block : dead) {
+                while (!block->successors.empty()) {
+                    RemoveEdge(block, block->successors.front());
+                }
+            }
+            for (SSABlock* block : dead) {
+                for (SSAValue* value : block->phis) value->users.clear();
+                for (SSAValue* value : block->instructions) value->users.clear();
+                DetachBlock(block);
+            }
+            return dead.size();
+        }
+
+        void SSAFunction::RemoveBlock(SSABlock* block) {
+            m_removed_blocks[block->id] = true;
+        }
+
+        bool SSAFunction::IsRemoved(const SSAValue* value) const {
+            return m_removed_values[value->id];
+        }
+
+        bool SSAFunction::IsRemoved(const SSABlock* block) const {
+            return m_removed_blocks[block->id];
+        }
+
+        // Drops detached values and blocks and renumbers the rest densely.
+        // Construction state refers to removed values, so it is discarded too.
+        void SSAFunction::Compact() {
+            m_current_defs.clear();
+            m_incomplete_phis.clear();
+            m_forwarded.clear();
+
+            std::vector<std::unique_ptr<SSABlock>> blocks;
+            for (auto& block : m_blocks) {
+                if (!m_removed_blocks[block->id]) {
+                    block->id = static_cast<uint32_t>(blocks.size());
+                    blocks.push_back(std::move(block));
+                }
+            }
+            m_blocks = std::move(blocks);
+            m_removed_blocks.assign(m_blocks.size(), false);
+
+            std::vector<std::unique_ptr<SSAValue>> values;
+            for (auto& value : m_values) {
+                if (!m_removed_values[value->id]) {
+                    value->id = static_cast<uint32_t>(values.size());
+                    values.push_back(std::move(value));
+                }
+            }
+            m_values = std::move(values);
+            m_removed_values.assign(m_values.size(), false);
+        }
+
+        bool SSAFunction::Verify(std::string& error) const {
+            auto fail = [&error](const std::string& message, uint32_t id) {
+                error = message + std::to_string(id);
+                return false;
+            };
+
+            for (const auto& owned : m_blocks) {
+                const SSABlock* block = owned.get();
+                if (m_removed_blocks[block->id]) continue;
+
+                const SSAValue* terminator = block->GetTerminator();
+                if (!terminator) {
+                    return fail(XorS("Block without terminator: "), block->id);
+                }
+                size_t expected = 0;
+                switch (terminator->opcode) {
+                    case VMOpcode::JMP: expected = 1; break;
+                    case VMOpcode::JMP_IF_ZERO:
+                    case VMOpcode::TRY: expected = 2; break;
+                    default: break;
+                }
+                if (block->successors.size() != expected) {
+                    return fail(XorS("Successor count does not match terminator in block "), block->id);
+                }
+                for (const SSABlock* successor : block->successors) {
+                    if (std::count(successor->predecessors.begin(), successor->predecessors.end(), block) !=
+                        std::count(block->successors.begin(), block->successors.end(), successor)) {
+                        return fail(XorS("Asymmetric edge from block "), block->id);
+                    }
+                }
+
+                for (const SSAValue* phi : block->phis) {
+                    if (phi->operands.size() != block->predecessors.size()) {
+                        return fail(XorS("Phi operand count does not match predecessors: "), phi->id);
+                    }
+                }
+                for (size_t i = 0; i < block->instructions.size(); ++i) {
+                    const SSAValue* instruction = block->instructions[i];
+                    if (instruction->IsTerminator() != (i + 1 == block->instructions.size())) {
+                        return fail(XorS("Terminator in the middle of block "), block->id);
+                    }
+                    if (instruction->block != block) {
+                        return fail(XorS("Instruction owned by another block: "), instruction->id);
+                    }
+                }
+
+                auto check_uses = [this](const SSAValue* value) {
+                    for (const SSAValue* operand : value->operands) {
+                        if (m_removed_values[operand->id] ||
+                            std::count(operand->users.begin(), operand->users.end(), value) !=
+                            std::count(value->operands.begin(), value->operands.end(), operand)) {
+                            return false;
+                        }
+                    }
+                    return true;
+                };
+                for (const SSAValue* value : block->phis) {
+                    if (!check_uses(value)) return fail(XorS("Broken use list at value "), value->id);
+                }
+                for (const SSAValue* value : block->instructions) {
+                    if (!check_uses(value)) return fail(XorS("Broken use list at value "), value->id);
+                }
+            }
+            return true;
+        }
+
+        std::string SSAFunction::Dump() const {
+            std::ostringstream out;
+            auto name = [](const SSAValue* value) {
+                switch (value->kind) {
+                    case SSAValueKind::CONSTANT:
+                        switch (value->constant.type) {
+                            case VMDataType::INT32: return std::to_string(value->constant.data.i32);
+                            case VMDataType::INT64: return std::to_string(value->constant.data.i64) + "L";
+                            case VMDataType::FLOAT64: return std::to_string(value->constant.data.f64);
+                            case VMDataType::STRING: return "\"" + value->text + "\"";
+                            default: return std::string("undefined");
+                        }
+                    case SSAValueKind::PARAMETER: return "arg" + std::to_string(value->immediate);
+                    default: return "%" + std::to_string(value->id);
+                }
+            };
+
+            for (const auto& block : m_blocks) {
+                if (m_removed_blocks[block->id]) continue;
+                out << "b" << block->id << ":";
+                for (const SSABlock* predecessor : block->predecessors) out << " <- b" << predecessor->id;
+                out << "\n";
+                for (const SSAValue* phi : block->phis) {
+                    out << "  %" << phi->id << " = phi";
+                    for (const SSAValue* operand : phi->operands) out << " " << name(operand);
+                    out << "\n";
+                }
+                for (const SSAValue* instruction : block->instructions) {
+                    out << "  ";
+                    if (instruction->HasResult()) out << "%" << instruction->id << " = ";
+                    out << "op" << static_cast<int>(instruction->opcode);
+                    if (instruction->immediate) out << " #" << instruction->immediate;
+                    if (!instruction->text.empty()) out << " " << instruction->text;
+                    for (const SSAValue* operand : instruction->operands) out << " " << name(operand);
+                    for (const SSABlock* successor : block->successors) {
+                        if (instruction->IsTerminator()) out << " b" << successor->id;
+                    }
+                    out << "\n";
+                }
+            }
+            return out.str();
+        }
+
+        // SSAOptimizer implementation
+        SSAOptimizationStats SSAOptimizer::Optimize(SSAFunction& function) {
+            SSAOptimizationStats stats;
+            Simplify(function, stats);
+            if (EliminateRedundancies(function, stats)) {
+                Simplify(function, stats);
+            }
+            if (OptimizeLoops(function, stats)) {
+                Simplify(function, stats);
+            }
+            function.Compact();
+            return stats;
+        }
+
+        bool SSAOptimizer::Simplify(SSAFunction& function, SSAOptimizationStats& stats) {
+            bool any = false;
+            for (int round = 0; round < 8; ++round) {
+                bool changed = PropagateConstants(function, stats);
+                changed = SimplifyControlFlow(function, stats) || changed;
+                changed = EliminateDeadCode(function, stats) || changed;
+                if (!changed) break;
+                any = true;
+            }
+            return any;
+        }
+
+        bool SSAOptimizer::IsTruthyConstant(const SSAValue* value, bool& truthy) {
+            if (value->kind != SSAValueKind::CONSTANT) return false;
+            switch (value->constant.type) {
+                case VMDataType::INT32: truthy = value->constant.data.i32 != 0; return true;
+                case VMDataType::INT64: truthy = value->constant.data.i64 != 0; return true;
+                case VMDataType::FLOAT64: truthy = value->constant.data.f64 != 0.0; return true;
+                case VMDataType::BOOLEAN: truthy = value->constant.data.boolean; return true;
+                case VMDataType::STRING: truthy = !value->text.empty(); return true;
+                case VMDataType::UNDEFINED: truthy = false; return true;
+                default: return false;
+            }
+        }
+
+        // Evaluates an instruction over constant operands with the VM's semantics.
+        // Anything that would throw at runtime is left for the VM to report.
+        SSAValue* SSAOptimizer::FoldInstruction(SSAFunction& function, VMOpcode opcode, const std::vector<SSAValue*>& operands) {
+            if (operands.empty()) return nullptr;
+            for (const SSAValue* operand : operands) {
+                if (operand->kind != SSAValueKind::CONSTANT) return nullptr;
+            }
+
+            const SSAValue* a = operands[0];
+            const VMValue& x = a->constant;
+
+            if (operands.size() == 1) {
+                switch (opcode) {
+                    case VMOpcode::NOT: {
+                        bool truthy;
+                        return IsTruthyConstant(a, truthy) ? function.CreateConstant(VMValue(static_cast<int32_t>(truthy ? 0 : 1))) : nullptr;
+                    }
+                    case VMOpcode::CAST_FLOAT:
+                        return x.type == VMDataType::INT32 ? function.CreateConstant(VMValue(static_cast<double>(x.data.i32))) : nullptr;
+                    case VMOpcode::NEG:
+                        if (x.type == VMDataType::INT32 && x.data.i32 != std::numeric_limits<int32_t>::min()) {
+                            return function.CreateConstant(VMValue(static_cast<int32_t>(-x.data.i32)));
+                        }
+                        if (x.type == VMDataType::INT64) {
+                            return function.CreateConstant(VMValue(static_cast<int64_t>(0 - static_cast<uint64_t>(x.data.i64))));
+                        }
+                        return x.type == VMDataType::FLOAT64 ? function.CreateConstant(VMValue(-x.data.f64)) : nullptr;
+                    case VMOpcode::BIT_NOT:
+                        if (x.type == VMDataType::INT32) return function.CreateConstant(VMValue(static_cast<int32_t>(~x.data.i32)));
+                        return x.type == VMDataType::INT64 ? function.CreateConstant(VMValue(static_cast<int64_t>(~x.data.i64))) : nullptr;
+                    default:
+                        return nullptr;
+                }
+            }
+
+            if (operands.size() != 2) return nullptr;
+            const SSAValue* b = operands[1];
+            const VMValue& y = b->constant;
+
+            switch (opcode) {
+                case VMOpcode::ADD_I32:
+                case VMOpcode::SUB_I32:
+                case VMOpcode::MUL_I32:
+                case VMOpcode::DIV_I32:
+                case VMOpcode::MOD_I32: {
+                    if (x.type != VMDataType::INT32 || y.type != VMDataType::INT32) return nullptr;
+                    const int64_t l = x.data.i32;
+                    const int64_t r = y.data.i32;
+                    int64_t result;
+                    switch (opcode) {
+                        case VMOpcode::ADD_I32: result = l + r; break;
+                        case VMOpcode::SUB_I32: result = l - r; break;
+                        case VMOpcode::MUL_I32: result = l * r; break;
+                        case VMOpcode::DIV_I32:
+                            if (r == 0) return nullptr;
+                            result = l / r;
+                            break;
+                        default:
+                            if (r == 0) return nullptr;
+                            result = r == -1 ? 0 : l % r;
+                            break;
+                    }
+                    if (result < std::numeric_limits<int32_t>::min() || result > std::numeric_limits<int32_t>::max()) {
+                        return nullptr;
+                    }
+                    return function.CreateConstant(VMValue(static_cast<int32_t>(result)));
+                }
+
+                case VMOpcode::ADD_F64:
+                case VMOpcode::SUB_F64:
+                case VMOpcode::MUL_F64:
+                case VMOpcode::DIV_F64: {
+                    if (x.type != VMDataType::FLOAT64 || y.type != VMDataType::FLOAT64) return nullptr;
+                    double result;
+                    switch (opcode) {
+                        case VMOpcode::ADD_F64: result = x.data.f64 + y.data.f64; break;
+                        case VMOpcode::SUB_F64: result = x.data.f64 - y.data.f64; break;
+                        case VMOpcode::MUL_F64: result = x.data.f64 * y.data.f64; break;
+                        default: result = x.data.f64 / y.data.f64; break;
+                    }
+                    return function.CreateConstant(VMValue(result));
+                }
+
+                case VMOpcode::CMP_EQ_I32:
+                case VMOpcode::CMP_NE_I32:
+                case VMOpcode::CMP_GT_I32:
+                case VMOpcode::CMP_GE_I32:
+                case VMOpcode::CMP_LT_I32:
+                case VMOpcode::CMP_LE_I32:
+                    if (x.type != VMDataType::INT32 || y.type != VMDataType::INT32) return nullptr;
+                    return function.CreateConstant(VMValue(static_cast<int32_t>(CompareConstants(opcode, x.data.i32, y.data.i32) ? 1 : 0)));
+
+                case VMOpcode::CMP_EQ_F64:
+                case VMOpcode::CMP_NE_F64:
+                case VMOpcode::CMP_GT_F64:
+                case VMOpcode::CMP_GE_F64:
+                case VMOpcode::CMP_LT_F64:
+                case VMOpcode::CMP_LE_F64:
+                    if (x.type != VMDataType::FLOAT64 || y.type != VMDataType::FLOAT64) return nullptr;
+                    return function.CreateConstant(VMValue(static_cast<int32_t>(CompareConstants(opcode, x.data.f64, y.data.f64) ? 1 : 0)));
+
+                case VMOpcode::STR_CONCAT:
+                    if (x.type != VMDataType::STRING || y.type != VMDataType::STRING) return nullptr;
+                    return function.CreateStringConstant(a->text + b->text);
+
+                default:
+                    return nullptr;
+            }
+        }
+
+        // Sparse conditional constant propagation (Wegman and Zadeck). Values
+        // start unknown and only fall to constant or varying; a block is only
+        // evaluated once an edge that can be taken leads to it, and a phi only
+        // meets the operands of such edges. A branch on a constant therefore
+        // keeps the other side out of every join below it.
+        bool SSAOptimizer::PropagateConstants(SSAFunction& function, SSAOptimizationStats& stats) {
+            if (!function.GetEntry()) return false;
+
+            enum class Lattice : uint8_t { UNKNOWN, CONSTANT, VARYING };
+            std::vector<Lattice> state(function.GetValueCount(), Lattice::UNKNOWN);
+            std::vector<SSAValue*> constant(function.GetValueCount(), nullptr);
+            std::vector<bool> executable(function.GetBlocks().size(), false);
+            std::vector<std::vector<bool>> taken(function.GetBlocks().size());     // Per successor
+            std::vector<SSABlock*> block_worklist;
+            std::vector<SSAValue*> value_worklist;
+
+            // Constants are interned, so equal constants are the same value
+            auto get = [&](SSAValue* value, SSAValue*& known) {
+                known = nullptr;
+                if (value->kind == SSAValueKind::CONSTANT) {
+                    known = value;
+                    return Lattice::CONSTANT;
+                }
+                if (value->kind == SSAValueKind::PARAMETER || value->id >= state.size()) return Lattice::VARYING;
+                known = constant[value->id];
+                return state[value->id];
+            };
+            auto lower = [&](SSAValue* value, Lattice to, SSAValue* known) {
+                Lattice& current = state[value->id];
+                if (current == Lattice::VARYING || (current == to && constant[value->id] == known)) return;
+                if (current == Lattice::CONSTANT) to = Lattice::VARYING;   // A second constant
+                current = to;
+                constant[value->id] = to == Lattice::CONSTANT ? known : nullptr;
+                value_worklist.push_back(value);
+            };
+            auto mark_edge = [&](SSABlock* block, size_t index) {
+                if (taken[block->id][index]) return;
+                taken[block->id][index] = true;
+                SSABlock* successor = block->successors[index];
+                if (!executable[successor->id]) {
+                    executable[successor->id] = true;
+                    block_worklist.push_back(successor);
+                } else {
+                    // A new way in changes what its phis meet
+                    for (SSAValue* phi : successor->phis) value_worklist.push_back(phi);
+                }
+            };
+            auto edge_taken = [&](SSABlock* from, SSABlock* to) {
+                for (size_t k = 0; k < from->successors.size(); ++k) {
+                    if (from->successors[k] == to && taken[from->id][k]) return true;
+                }
+                return false;
+            };
+
+            auto visit = [&](SSAValue* value) {
+                SSABlock* block = value->block;
+                if (!block || !executable[block->id] || function.IsRemoved(value)) return;
+
+                if (value->kind == SSAValueKind::PHI) {
+                    Lattice result = Lattice::UNKNOWN;
+                    SSAValue* result_constant = nullptr;
+                    for (size_t k = 0; k < value->operands.size() && result != Lattice::VARYING; ++k) {
+                        if (!edge_taken(block->predecessors[k], block)) continue;
+                        SSAValue* known;
+                        const Lattice operand = get(value->operands[k], known);
+                        if (operand == Lattice::UNKNOWN) continue;
+                        if (operand == Lattice::VARYING || (result == Lattice::CONSTANT && known != result_constant)) {
+                            result = Lattice::VARYING;
+                        } else {
+                            result = Lattice::CONSTANT;
+                            result_constant = known;
+                        }
+                    }
+                    if (result != Lattice::UNKNOWN) lower(value, result, result_constant);
+                    return;
+                }
+
+                if (value->IsTerminator()) {
+                    if (value->IsInstruction(VMOpcode::JMP_IF_ZERO)) {
+                        SSAValue* known;
+                        const Lattice condition = get(value->operands[0], known);
+                        bool truthy;
+                        if (condition == Lattice::UNKNOWN) return;
+                        if (condition == Lattice::CONSTANT && IsTruthyConstant(known, truthy)) {
+                            mark_edge(block, truthy ? 0 : 1);
+                            return;
+                        }
+                    }
+                    for (size_t k = 0; k < block->successors.size(); ++k) mark_edge(block, k);
+                    return;
+                }
+                if (!value->HasResult()) return;
+
+                std::vector<SSAValue*> operands;
+                for (SSAValue* operand : value->operands) {
+                    SSAValue* known;
+                    switch (get(operand, known)) {
+                        case Lattice::UNKNOWN: return;
+                        case Lattice::VARYING: lower(value, Lattice::VARYING, nullptr); return;
+                        default: operands.push_back(known); break;
+                    }
+                }
+                SSAValue* folded = FoldInstruction(function, value->opcode, operands);
+                if (folded) {
+                    lower(value, Lattice::CONSTANT, folded);
+                } else {
+                    lower(value, Lattice::VARYING, nullptr);
+                }
+            };
+
+            for (const auto& block : function.GetBlocks()) {
+                taken[block->id].assign(block->successors.size(), false);
+            }
+            executable[function.GetEntry()->id] = true;
+            block_worklist.push_back(function.GetEntry());
+            while (!block_worklist.empty() || !value_worklist.empty()) {
+                while (!value_worklist.empty()) {
+                    SSAValue* value = value_worklist.back();
+                    value_worklist.pop_back();
+                    if (value->kind == SSAValueKind::PHI || value->kind == SSAValueKind::INSTRUCTION) visit(value);
+                    for (SSAValue* user : value->users) {
+                        if (user != value) visit(user);
+                    }
+                }
+                if (block_worklist.empty()) break;
+                SSABlock* block = block_worklist.back();
+                block_worklist.pop_back();
+                for (SSAValue* phi : block->phis) visit(phi);
+                for (SSAValue* instruction : block->instructions) visit(instruction);
+            }
+
+            // Every value proven constant is evaluated without throwing, so it can go
+            bool changed = false;
+            for (const auto& owned : function.GetBlocks()) {
+                SSABlock* block = owned.get();
+                if (function.IsRemoved(block) || !executable[block->id]) continue;
+
+                std::vector<SSAValue*> values = block->phis;
+                values.insert(values.end(), block->instructions.begin(), block->instructions.end());
+                for (SSAValue* value : values) {
+                    if (value->id >= state.size() || state[value->id] != Lattice::CONSTANT) continue;
+                    function.ReplaceAllUses(value, constant[value->id]);
+                    function.RemoveValue(value);
+                    stats.constants_folded++;
+                    changed = true;
+                }
+
+                SSAValue* terminator = block->GetTerminator();
+                if (terminator && terminator->IsInstruction(VMOpcode::JMP_IF_ZERO) && taken[block->id][0] != taken[block->id][1]) {
+                    function.ReplaceTerminator(block, VMOpcode::JMP, {}, { block->successors[taken[block->id][0] ? 0 : 1] });
+                    stats.branches_folded++;
+                    changed = true;
+                }
+            }
+            return changed;
+        }
+
+        // Removes unreachable blocks and merges a block into its only predecessor
+        // when that predecessor jumps straight to it
+        bool SSAOptimizer::SimplifyControlFlow(SSAFunction& function, SSAOptimizationStats& stats) {
+            const size_t removed = function.RemoveUnreachableBlocks();
+            stats.blocks_removed += static_cast<uint32_t>(removed);
+            bool changed = removed != 0;
+
+            for (size_t i = 0; i < function.GetBlocks().size(); ++i) {
+                SSABlock* block = function.GetBlocks()[i].get();
+                if (function.IsRemoved(block)) continue;
+
+                for (;;) {
+                    SSAValue* terminator = block->GetTerminator();
+                    if (!terminator || !terminator->IsInstruction(VMOpcode::JMP)) break;
+                    SSABlock* successor = block->successors.front();
+                    if (successor == block || successor == function.GetEntry() || successor->predecessors.size() != 1) break;
+
+                    std::vector<SSAValue*> phis = successor->phis;
+                    for (SSAValue* phi : phis) {
+                        function.ReplaceAllUses(phi, phi->operands.front());
+                        function.RemoveValue(phi);
+                    }
+                    function.RemoveValue(terminator);
+
+                    for (SSAValue* instruction : successor->instructions) {
+                        instruction->block = block;
+                        block->instructions.push_back(instruction);
+                    }
+                    successor->instructions.clear();
+
+                    block->successors = successor->successors;
+                    for (SSABlock* next : successor->successors) {
+                        std::replace(next->predecessors.begin(), next->predecessors.end(), successor, block);
+                    }
+                    successor->successors.clear();
+                    successor->predecessors.clear();
+                    function.RemoveBlock(successor);
+                    stats.blocks_merged++;
+                    changed = true;
+                }
+            }
+            return changed;
+        }
+
+        // Mark and sweep: effects and terminators are live, and so is everything
+        // they transitively use; this also catches dead phi cycles around loops
+        bool SSAOptimizer::EliminateDeadCode(SSAFunction& function, SSAOptimizationStats& stats) {
+            std::vector<bool> live(function.GetValueCount(), false);
+            std::vector<SSAValue*> worklist;
+
+            for (const auto& block : function.GetBlocks()) {
+                if (function.IsRemoved(block.get())) continue;
+                for (SSAValue* instruction : block->instructions) {
+                    if (instruction->HasSideEffects()) {
+                        live[instruction->id] = true;
+                        worklist.push_back(instruction);
+                    }
+                }
+            }
+            while (!worklist.empty()) {
+                SSAValue* value = worklist.back();
+                worklist.pop_back();
+                for (SSAValue* operand : value->operands) {
+                    if (!live[operand->id]) {
+                        live[operand->id] = true;
+                        worklist.push_back(operand);
+                    }
+                }
+            }
+
+            std::vector<SSAValue*> dead;
+            for (const auto& block : function.GetBlocks()) {
+                if (function.IsRemoved(block.get())) continue;
+                for (SSAValue* phi : block->phis) {
+                    if (!live[phi->id]) dead.push_back(phi);
+                }
+                for (SSAValue* instruction : block->instructions) {
+                    if (!live[instruction->id]) dead.push_back(instruction);
+                }
+            }
+            for (SSAValue* value : dead) {
+                value->users.clear();
+                function.RemoveValue(value);
+            }
+            stats.values_removed += static_cast<uint32_t>(dead.size());
+            return !dead.empty();
+        }
+
+        namespace {
+            // Operations whose only effect is that they may throw
+            bool ThrowsWithoutSideEffects(VMOpcode opcode) {
+                switch (opcode) {
+                    case VMOpcode::ADD_I32:
+                    case VMOpcode::SUB_I32:
+                    case VMOpcode::MUL_I32:
+                    case VMOpcode::DIV_I32:
+                    case VMOpcode::MOD_I32:
+                    case VMOpcode::ADD:
+                    case VMOpcode::SUB:
+                    case VMOpcode::MUL:
+                    case VMOpcode::DIV:
+                    case VMOpcode::MOD:
+                    case VMOpcode::NEG:
+                    case VMOpcode::BIT_AND:
+                    case VMOpcode::BIT_OR:
+                    case VMOpcode::BIT_XOR:
+                    case VMOpcode::BIT_NOT:
+                    case VMOpcode::SHL:
+                    case VMOpcode::SHR:
+                    case VMOpcode::CMP_EQ:
+                    case VMOpcode::CMP_NE:
+                    case VMOpcode::CMP_GT:
+                    case VMOpcode::CMP_GE:
+                    case VMOpcode::CMP_LT:
+                    case VMOpcode::CMP_LE:
+                        return true;
+                    default:
+                        return false;
+                }
+            }
+
+            // Moves instructions whose operands are all defined outside the loop
+            // into its preheader. Pure instructions may move from anywhere in the
+            // loop. One that can throw moves only from the header, ahead of any
+            // effect there: the header runs straight after the preheader, so the
+            // first iteration would have thrown at the same point. Loads move
+            // only when the loop never stores to the slot (a call may write any
+            // global), and only to feed another hoisted instruction, since a
+            // load kept in a slot is no cheaper than the load itself.
+            bool HoistInvariants(SSAFunction& function, const SSALoop& loop, SSABlock* preheader,
+                                 SSAOptimizationStats& stats) {
+                std::unordered_set<uint32_t> stored_locals;
+                std::unordered_set<uint32_t> stored_globals;
+                bool calls = false;
+                for (SSABlock* block : loop.blocks) {
+                    for (SSAValue* instruction : block->instructions) {
+                        switch (instruction->opcode) {
+                            case VMOpcode::STORE_LOCAL: stored_locals.insert(instruction->immediate); break;
+                            case VMOpcode::STORE_GLOBAL: stored_globals.insert(instruction->immediate); break;
+                            case VMOpcode::CALL:
+                            case VMOpcode::CALL_NATIVE: calls = true; break;
+                            default: break;
+                        }
+                    }
+                }
+
+                // Blocks are in reverse post-order, so an instruction's operands
+                // are classified before it is
+                std::vector<bool> invariant(function.GetValueCount(), false);
+                std::vector<SSAValue*> candidates;
+                for (SSABlock* block : loop.blocks) {
+                    bool in_order = block == loop.header;
+                    for (SSAValue* instruction : block->instructions) {
+                        if (instruction->IsTerminator()) break;
+
+                        const bool pure = !instruction->HasSideEffects();
+                        bool movable = pure || (in_order && ThrowsWithoutSideEffects(instruction->opcode));
+                        if (instruction->IsInstruction(VMOpcode::LOAD_LOCAL)) {
+                            movable = !stored_locals.count(instruction->immediate);
+                        } else if (instruction->IsInstruction(VMOpcode::LOAD_GLOBAL)) {
+                            movable = !calls && !stored_globals.count(instruction->immediate);
+                        }
+                        movable = movable && std::all_of(instruction->operands.begin(), instruction->operands.end(),
+                            [&](const SSAValue* operand) { return !loop.Contains(operand) || invariant[operand->id]; });
+
+                        if (movable) {
+                            invariant[instruction->id] = true;
+                            candidates.push_back(instruction);
+                        } else if (!pure) {
+                            in_order = false;
+                        }
+                    }
+                }
+
+                SSAValue* position = preheader->GetTerminator();
+                bool changed = false;
+                for (SSAValue* instruction : candidates) {
+                    const bool load = instruction->IsInstruction(VMOpcode::LOAD_LOCAL) ||
+                                      instruction->IsInstruction(VMOpcode::LOAD_GLOBAL);
+                    if (load && std::none_of(instruction->users.begin(), instruction->users.end(),
+                            [&invariant](const SSAValue* user) { return invariant[user->id]; })) continue;
+
+                    function.MoveBefore(instruction, position);
+                    stats.invariants_hoisted++;
+                    changed = true;
+                }
+                return changed;
+            }
+
+            // For a counter i = phi(C, i + S) tested against a constant bound in the
+            // header, rewrites i * K as its own induction variable phi(C*K, j + S*K).
+            // The INT32 ops are checked, so this is only done when every value i
+            // can take, scaled by K, is proven to fit; neither form can then throw.
+            bool ReduceInductionVariables(SSAFunction& function, const SSALoop& loop, SSABlock* preheader,
+                                          SSAOptimizationStats& stats) {
+                SSABlock* header = loop.header;
+                if (header->predecessors.size() != 2 || loop.latches.size() != 1) return false;
+                const size_t entry_index = header->predecessors[0] == preheader ? 0 : 1;
+                const size_t latch_index = 1 - entry_index;
+
+                SSAValue* terminator = header->GetTerminator();
+                if (!terminator || !terminator->IsInstruction(VMOpcode::JMP_IF_ZERO) ||
+                    !loop.Contains(header->successors[0]) || loop.Contains(header->successors[1])) return false;
+
+                SSAValue* condition = terminator->operands[0];
+                int64_t bound;
+                if (condition->kind != SSAValueKind::INSTRUCTION || condition->operands.size() != 2 ||
+                    !ConstantInt32(condition->operands[1], bound)) return false;
+
+                SSAValue* counter = condition->operands[0];
+                if (counter->kind != SSAValueKind::PHI || counter->block != header) return false;
+
+                int64_t initial;
+                int64_t step;
+                SSAValue* next = counter->operands[latch_index];
+                if (!ConstantInt32(counter->operands[entry_index], initial) || !next->IsInstruction(VMOpcode::ADD_I32) ||
+                    next->block == header || !loop.Contains(next)) return false;
+                if (!(next->operands[0] == counter && ConstantInt32(next->operands[1], step)) &&
+                    !(next->operands[1] == counter && ConstantInt32(next->operands[0], step))) return false;
+
+                // Every value the counter takes, including the one that fails the test
+                int64_t low;
+                int64_t high;
+                switch (condition->opcode) {
+                    case VMOpcode::CMP_LT_I32:
+                    case VMOpcode::CMP_LE_I32:
+                        if (step <= 0) return false;
+                        low = initial;
+                        high = std::max(initial, bound + step - (condition->opcode == VMOpcode::CMP_LT_I32 ? 1 : 0));
+                        break;
+                    case VMOpcode::CMP_GT_I32:
+                    case VMOpcode::CMP_GE_I32:
+                        if (step >= 0) return false;
+                        high = initial;
+                        low = std::min(initial, bound + step + (condition->opcode == VMOpcode::CMP_GT_I32 ? 1 : 0));
+                        break;
+                    default:
+                        return false;
+                }
+                if (!FitsInt32(low) || !FitsInt32(high)) return false;
+
+                // Multiplies by the same factor share one scaled variable
+                std::vector<std::pair<int64_t, std::vector<SSAValue*>>> groups;
+                for (SSAValue* user : counter->users) {
+                    if (!user->IsInstruction(VMOpcode::MUL_I32) || !loop.Contains(user)) continue;
+
+                    int64_t factor;
+                    if (!(user->operands[0] == counter && ConstantInt32(user->operands[1], factor)) &&
+                        !(user->operands[1] == counter && ConstantInt32(user->operands[0], factor))) continue;
+                    if (!FitsInt32(low * factor) || !FitsInt32(high * factor) || !FitsInt32(step * factor)) continue;
+
+                    auto group = std::find_if(groups.begin(), groups.end(),
+                        [factor](const auto& entry) { return entry.first == factor; });
+                    if (group == groups.end()) {
+                        groups.emplace_back(factor, std::vector<SSAValue*>());
+                        group = groups.end() - 1;
+                    }
+                    if (std::find(group->second.begin(), group->second.end(), user) == group->second.end()) {
+                        group->second.push_back(user);
+                    }
+                }
+
+                bool changed = false;
+                for (const auto& group : groups) {
+                    // On the stack machine a multiply is three dispatches and a read
+                    // of the scaled variable one, while stepping it costs four per
+                    // iteration, so it only pays with three or more multiplies
+                    if (group.second.size() < 3) continue;
+                    const int64_t factor = group.first;
+
+                    SSAValue* start = function.CreateConstant(VMValue(static_cast<int32_t>(initial * factor)));
+                    SSAValue* increment = function.CreateConstant(VMValue(static_cast<int32_t>(step * factor)));
+                    SSAValue* scaled = function.CreatePhi(header, { start, start }, VMDataType::INT32);
+
+                    // Stepped alongside the counter, so it is live on the same edges
+                    auto& list = next->block->instructions;
+                    SSAValue* after = *(std::find(list.begin(), list.end(), next) + 1);
+                    SSAValue* scaled_next = function.InsertBefore(after, VMOpcode::ADD_I32, { scaled, increment },
+                                                                  VMDataType::INT32, next->line);
+                    function.SetOperand(scaled, latch_index, scaled_next);
+
+                    for (SSAValue* user : group.second) {
+                        function.ReplaceAllUses(user, scaled);
+                        function.RemoveValue(user);
+                    }
+                    stats.inductions_reduced++;
+                    changed = true;
+                }
+                return changed;
+            }
+        }
+
+        // Gives every loop with a single entry edge a preheader, then hoists
+        // invariants and reduces induction variables, innermost loop first
+        bool SSAOptimizer::OptimizeLoops(SSAFunction& function, SSAOptimizationStats& stats) {
+            if (!function.GetEntry()) return false;
+
+            bool changed = false;
+            for (const SSALoop& loop : FindLoops(function)) {
+                if (FindPreheader(loop)) continue;
+                SSABlock* outside = nullptr;
+                size_t entries = 0;
+                for (SSABlock* predecessor : loop.header->predecessors) {
+                    if (!loop.Contains(predecessor)) {
+                        outside = predecessor;
+                        entries++;
+                    }
+                }
+                if (entries == 1) {
+                    function.SplitEdge(outside, loop.header);
+                    changed = true;
+                }
+            }
+
+            // Found again so that outer loops contain the new preheaders
+            for (const SSALoop& loop : FindLoops(function)) {
+                SSABlock* preheader = FindPreheader(loop);
+                if (!preheader) continue;
+                changed = HoistInvariants(function, loop, preheader, stats) || changed;
+                changed = ReduceInductionVariables(function, loop, preheader, stats) || changed;
+            }
+            return changed;
+        }
+
+        namespace {
+            // Reads whose result depends on state that stores and calls change
+            bool ReadsMemory(VMOpcode opcode) {
+                return opcode == VMOpcode::LOAD_LOCAL || opcode == VMOpcode::LOAD_GLOBAL ||
+                       opcode == VMOpcode::ARRAY_GET || opcode == VMOpcode::ARRAY_LEN;
+            }
+
+            bool IsCommutative(VMOpcode opcode) {
+                switch (opcode) {
+                    case VMOpcode::ADD_I32:
+                    case VMOpcode::MUL_I32:
+                    case VMOpcode::ADD_F64:
+                    case VMOpcode::MUL_F64:
+                    case VMOpcode::CMP_EQ_I32:
+                    case VMOpcode::CMP_NE_I32:
+                    case VMOpcode::CMP_EQ_F64:
+                    case VMOpcode::CMP_NE_F64:
+                        return true;
+                    default:
+                        return false;
+                }
+            }
+
+            // Memory as seen by a block. Every kill takes a fresh number, so two
+            // reads share a key only when nothing could have changed the slot in
+            // between; a block that is not entered from its dominator alone
+            // starts from a fresh base.
+            struct MemoryState {
+                uint32_t base = 0;
+                uint32_t globals = 0;       // Bumped by calls
+                uint32_t arrays = 0;        // Bumped by ARRAY_SET and calls
+                std::unordered_map<uint32_t, uint32_t> locals;
+                std::unordered_map<uint32_t, uint32_t> global_slots;
+            };
+
+            // Instructions emitted beneath a value on the operand stack, itself
+            // included, approximating SSAStackSchedule's claiming
+            uint32_t ExpressionCost(const SSAValue* value) {
+                uint32_t cost = 1;
+                for (const SSAValue* operand : value->operands) {
+                    const bool inline_tree = operand->kind == SSAValueKind::INSTRUCTION &&
+                                             operand->block == value->block && operand->users.size() == 1;
+                    cost += inline_tree ? ExpressionCost(operand) : 1;
+                }
+                return cost;
+            }
+        }
+
+        // Global value numbering over the dominator tree. A value is congruent to
+        // an earlier one when opcode, immediate, type and operand numbers match
+        // and, for memory reads, no store or call came in between. Congruent
+        // loads are not replaced by themselves, since a value kept in a slot
+        // costs a store plus a load per use; a repeated expression is replaced
+        // when its operand tree is bigger than that.
+        bool SSAOptimizer::EliminateRedundancies(SSAFunction& function, SSAOptimizationStats& stats) {
+            if (!function.GetEntry()) return false;
+            const std::vector<SSABlock*> order = ReversePostOrder(function);
+            const std::vector<SSABlock*> idom = ComputeDominators(function, order);
+
+            std::vector<uint32_t> number(function.GetValueCount());
+            for (uint32_t id = 0; id < number.size(); ++id) {
+                number[id] = id;
+            }
+            std::vector<bool> redundant(function.GetValueCount(), false);
+            std::vector<MemoryState> memory(function.GetBlocks().size());
+            std::unordered_map<std::string, std::vector<SSAValue*>> leaders;
+            uint32_t next_version = 0;
+            bool changed = false;
+
+            for (SSABlock* block : order) {
+                MemoryState state;
+                SSABlock* parent = idom[block->id];
+                const bool inherits = parent && parent != block && block->predecessors.size() == 1 &&
+                                      block->predecessors.front() == parent &&
+                                      !(parent->GetTerminator() && parent->GetTerminator()->IsInstruction(VMOpcode::TRY) &&
+                                        parent->successors.size() > 1 && parent->successors[1] == block);
+                if (inherits) {
+                    state = memory[parent->id];
+                } else {
+                    state.base = ++next_version;
+                }
+
+                std::vector<SSAValue*> instructions = block->instructions;
+                for (SSAValue* instruction : instructions) {
+                    const VMOpcode opcode = instruction->opcode;
+                    switch (opcode) {
+                        case VMOpcode::STORE_LOCAL: state.locals[instruction->immediate] = ++next_version; continue;
+                        case VMOpcode::STORE_GLOBAL: state.global_slots[instruction->immediate] = ++next_version; continue;
+                        case VMOpcode::ARRAY_SET: state.arrays = ++next_version; break;
+                        case VMOpcode::CALL:
+                        case VMOpcode::CALL_NATIVE:
+                            state.globals = ++next_version;
+                            state.arrays = ++next_version;
+                            continue;
+                        default: break;
+                    }
+                    if (instruction->IsTerminator() || !instruction->HasResult()) continue;
+                    const bool reads = ReadsMemory(opcode);
+                    if (instruction->HasSideEffects() && !reads && !ThrowsWithoutSideEffects(opcode) &&
+                        opcode != VMOpcode::STR_LEN) continue;
+
+                    std::vector<uint32_t> operands;
+                    for (const SSAValue* operand : instruction->operands) {
+                        operands.push_back(number[operand->id]);
+                    }
+                    if (IsCommutative(opcode)) {
+                        std::sort(operands.begin(), operands.end());
+                    }
+
+                    std::string key;
+                    auto append = [&key](uint32_t word) { key.append(reinterpret_cast<const char*>(&word), sizeof(word)); };
+                    append(static_cast<uint32_t>(opcode));
+                    append(static_cast<uint32_t>(instruction->type));
+                    append(instruction->immediate);
+                    for (uint32_t operand : operands) {
+                        append(operand);
+                    }
+                    if (reads) {
+                        append(state.base);
+                        if (opcode == VMOpcode::LOAD_LOCAL) {
+                            append(state.locals[instruction->immediate]);
+                        } else if (opcode == VMOpcode::LOAD_GLOBAL) {
+                            append(state.globals);
+                            append(state.global_slots[instruction->immediate]);
+                        } else {
+                            append(state.arrays);
+                        }
+                    }
+
+                    // Earlier values of a dominating block, or earlier in this one
+                    std::vector<SSAValue*>& candidates = leaders[key];
+                    SSAValue* leader = nullptr;
+                    for (SSAValue* candidate : candidates) {
+                        if (!function.IsRemoved(candidate) && Dominates(idom, candidate->block, block)) {
+                            leader = candidate;
+                            break;
+                        }
+                    }
+                    if (!leader) {
+                        candidates.push_back(instruction);
+                        continue;
+                    }
+                    number[instruction->id] = number[leader->id];
+                    redundant[instruction->id] = true;
+
+                    // Replacing adds a use of the leader: with no other use it
+                    // moves into a slot (store and load instead of a pop), with
+                    // one it moves off the stack (store and two loads)
+                    const size_t uses = leader->users.size();
+                    const uint32_t added = instruction->users.empty() ? 0 : uses == 0 ? 1 : uses == 1 ? 3 : 1;
+                    if (reads && instruction->operands.empty()) continue;
+                    if (ExpressionCost(instruction) <= added) continue;
+
+                    // Operand trees that only fed it repeat the leader's too, so
+                    // they can go as well even where they might have thrown
+                    std::vector<SSAValue*> removed = { instruction };
+                    function.ReplaceAllUses(instruction, leader);
+                    while (!removed.empty()) {
+                        SSAValue* value = removed.back();
+                        removed.pop_back();
+                        const std::vector<SSAValue*> operands = value->operands;
+                        function.RemoveValue(value);
+                        stats.redundancies_eliminated++;
+                        for (SSAValue* operand : operands) {
+                            if (operand->kind == SSAValueKind::INSTRUCTION && redundant[operand->id] &&
+                                operand->users.empty() && !function.IsRemoved(operand)) {
+                                removed.push_back(operand);
+                            }
+                        }
+                    }
+                    changed = true;
+                }
+                memory[block->id] = std::move(state);
+            }
+            return changed;
+        }
+
+        // SSAStackSchedule implementation
+        SSAStackSchedule SSAStackSchedule::Build(SSAFunction& function) {
+            function.RemoveUnreachableBlocks();
+
+            // A predecessor with several successors cannot hold the copies for one
+            // of them, so those edges get a block of their own
+            const size_t block_count = function.GetBlocks().size();
+            for (size_t i = 0; i < block_count; ++i) {
+                SSABlock* block = function.GetBlocks()[i].get();
+                if (function.IsRemoved(block) || block->successors.size() < 2) continue;
+                std::vector<SSABlock*> successors = block->successors;
+                for (SSABlock* successor : successors) {
+                    if (!successor->phis.empty()) {
+                        function.SplitEdge(block, successor);
+                    }
+                }
+            }
+            function.Compact();
+
+            // The taken side of a branch and a protected body fall through
+            SSAStackSchedule schedule;
+            schedule.layout = ReversePostOrder(function);
+
+            const uint32_t value_count = function.GetValueCount();
+            schedule.on_stack.assign(value_count, false);
+            schedule.needs_slot.assign(value_count, false);
+
+            // Each block is a sequence of items: its instructions, then the phi copy
+            // for its successor, then the terminator. Working backwards, an operand
+            // is claimed when it is the item immediately below the claimed range.
+            struct Item {
+                SSAValue* value;                    // Null for the phi copy
+                std::vector<SSAValue*> operands;
+            };
+            std::vector<int32_t> position(value_count, -1);
+            std::vector<Item> items;
+            std::vector<bool> claimed;
+
+            for (SSABlock* block : schedule.layout) {
+                items.clear();
+                for (SSAValue* instruction : block->instructions) {
+                    if (instruction->IsTerminator() && block->successors.size() == 1 && !block->successors.front()->phis.empty()) {
+                        SSABlock* successor = block->successors.front();
+                        const size_t index = static_cast<size_t>(
+                            std::find(successor->predecessors.begin(), successor->predecessors.end(), block) - successor->predecessors.begin());
+                        Item copy{ nullptr, {} };
+                        for (SSAValue* phi : successor->phis) {
+                            copy.operands.push_back(phi->operands[index]);
+                        }
+                        items.push_back(std::move(copy));
+                    }
+                    position[instruction->id] = static_cast<int32_t>(items.size());
+                    items.push_back(Item{ instruction, instruction->operands });
+                }
+                claimed.assign(items.size(), false);
+
+                auto claim = [&](auto& self, int32_t index) -> int32_t {
+                    int32_t low = index;
+                    const auto& operands = items[index].operands;
+                    for (size_t k = operands.size(); k-- > 0;) {
+                        SSAValue* operand = operands[k];
+                        const int32_t cursor = low - 1;
+                        if (cursor < 0) break;
+                        if (operand->kind == SSAValueKind::INSTRUCTION && operand->block == block &&
+                            position[operand->id] == cursor && !claimed[cursor] && operand->users.size() == 1) {
+                            claimed[cursor] = true;
+                            schedule.on_stack[operand->id] = true;
+                            low = self(self, cursor);
+                        }
+                    }
+                    return low;
+                };
+                for (int32_t i = static_cast<int32_t>(items.size()) - 1; i >= 0; --i) {
+                    if (!claimed[i]) {
+                        i = claim(claim, i);
+                    }
+                }
+
+                for (SSAValue* phi : block->phis) {
+                    schedule.needs_slot[phi->id] = true;
+                }
+                for (SSAValue* instruction : block->instructions) {
+                    if (instruction->HasResult() && !instruction->users.empty() && !schedule.on_stack[instruction->id]) {
+                        schedule.needs_slot[instruction->id] = true;
+                    }
+                }
+            }
+            return schedule;
+        }
+
+    } // namespace VM
+} // namespace AetherVisor
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "VMOpcodes.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+namespace AetherVisor {
+    namespace VM {
+
+        struct SSABlock;
+
+        enum class SSAValueKind : uint8_t {
+            CONSTANT,       // Literal, materialised with PUSH_INT or PUSH_CONST
+            PARAMETER,      // Incoming argument, lives in its own local slot
+            PHI,            // Join of one operand per predecessor, in predecessor order
+            INSTRUCTION     // VM operation; every block ends with a terminator
+        };
+
+        // A value in the mid-level IR. Instructions use VM opcodes directly, so
+        // lowering to stack bytecode is a scheduling problem rather than a
+        // selection problem.
+        //
+        // Terminators and their successors:
+        //   JMP              successors[0]
+        //   JMP_IF_ZERO      successors[0] when the operand is truthy, successors[1] otherwise
+        //   TRY              successors[0] is the protected body, successors[1] the handler
+        //   RET, RET_VAL, HALT, THROW   none
+        struct SSAValue {
+            SSAValueKind kind;
+            VMOpcode opcode;                // INSTRUCTION only
+            VMDataType type;                // Proven result type, UNDEFINED when unknown
+            uint32_t id;
+            uint32_t immediate;             // Slot, function index or argument count
+            uint32_t line;                  // Source line, 0 when unknown
+            VMValue constant;               // CONSTANT payload; strings keep their text below
+            std::string text;               // String constant or native function name
+            SSABlock* block;                // Null for constants and parameters
+            std::vector<SSAValue*> operands;
+            std::vector<SSAValue*> users;   // One entry per use
+
+            bool IsInstruction(VMOpcode op) const { return kind == SSAValueKind::INSTRUCTION && opcode == op; }
+            bool IsTerminator() const;
+            bool HasResult() const;
+            bool HasSideEffects() const;    // Must stay even when the result is unused
+        };
+
+        struct SSABlock {
+            uint32_t id;
+            std::vector<SSAValue*> phis;
+            std::vector<SSAValue*> instructions;    // Terminator last
+            std::vector<SSABlock*> predecessors;
+            std::vector<SSABlock*> successors;
+            bool sealed;                            // All predecessors are known
+
+            SSAValue* GetTerminator() const {
+                return !instructions.empty() && instructions.back()->IsTerminator() ? instructions.back() : nullptr;
+            }
+        };
+
+        // One function (or the top-level code) in SSA form. Values and blocks are
+        // owned by the function and addressed by pointer; removed entries are
+        // detached and reclaimed by Compact.
+        class SSAFunction {
+        public:
+            SSAFunction();
+            ~SSAFunction() = default;
+
+            SSAFunction(const SSAFunction&) = delete;
+            SSAFunction& operator=(const SSAFunction&) = delete;
+
+            // Construction
+            SSABlock* CreateBlock();
+            SSAValue* CreateConstant(const VMValue& value);
+            SSAValue* CreateStringConstant(const std::string& text);
+            SSAValue* CreateParameter(uint32_t slot);
+            SSAValue* CreatePhi(SSABlock* block, const std::vector<SSAValue*>& operands, VMDataType type);
+            SSAValue* Append(SSABlock* block, VMOpcode opcode, const std::vector<SSAValue*>& operands,
+                             VMDataType type, uint32_t line, uint32_t immediate = 0);
+            SSAValue* InsertBefore(SSAValue* position, VMOpcode opcode, const std::vector<SSAValue*>& operands,
+                                   VMDataType type, uint32_t line, uint32_t immediate = 0);
+            void AddEdge(SSABlock* from, SSABlock* to);
+
+            // On-the-fly construction (Braun et al.): variables are opaque keys, and
+            // a block is sealed once every predecessor edge has been added
+            void WriteVariable(const void* variable, SSABlock* block, SSAValue* value);
+            SSAValue* ReadVariable(const void* variable, SSABlock* block);
+            void SealBlock(SSABlock* block);
+
+            // Editing
+            void ReplaceAllUses(SSAValue* value, SSAValue* replacement);
+            void SetOperand(SSAValue* user, size_t index, SSAValue* value);
+            void MoveBefore(SSAValue* instruction, SSAValue* position);
+            void RemoveValue(SSAValue* value);
+            void RemoveEdge(SSABlock* from, SSABlock* to);
+            void ReplaceTerminator(SSABlock* block, VMOpcode opcode, const std::vector<SSAValue*>& operands,
+                                   const std::vector<SSABlock*>& successors);
+            SSAValue* TryRemoveTrivialPhi(SSAValue* phi);
+            SSABlock* SplitEdge(SSABlock* from, SSABlock* to);
+            size_t RemoveUnreachableBlocks();
+            void RemoveBlock(SSABlock* block);      // Caller has already detached its edges and values
+            void Compact();
+
+            // Inspection
+            SSABlock* GetEntry() const { return m_blocks.empty() ? nullptr : m_blocks.front().get(); }
+            const std::vector<std::unique_ptr<SSABlock>>& GetBlocks() const { return m_blocks; }
+            uint32_t GetValueCount() const { return static_cast<uint32_t>(m_values.size()); }
+            bool IsRemoved(const SSAValue* value) const;
+            bool IsRemoved(const SSABlock* block) const;
+            bool Verify(std::string& error) const;
+            std::string Dump() const;
+
+        private:
+            std::vector<std::unique_ptr<SSAValue>> m_values;
+            std::vector<std::unique_ptr<SSABlock>> m_blocks;
+            std::unordered_map<std::string, SSAValue*> m_constants;    // Interned by value bytes
+            std::unordered_map<uint32_t, SSAValue*> m_parameters;
+
+            // Construction state
+            std::unordered_map<const void*, std::unordered_map<const SSABlock*, SSAValue*>> m_current_defs;
+            std::unordered_map<const SSABlock*, std::vector<std::pair<const void*, SSAValue*>>> m_incomplete_phis;
+            std::unordered_map<const SSAValue*, SSAValue*> m_forwarded;    // Replaced value -> replacement
+            std::vector<bool> m_removed_values;
+            std::vector<bool> m_removed_blocks;
+
+            SSAValue* NewValue(SSAValueKind kind);
+            SSAValue* Resolve(SSAValue* value) const;
+            SSAValue* ReadVariableRecursive(const void* variable, SSABlock* block);
+            SSAValue* AddPhiOperands(const void* variable, SSAValue* phi);
+            void RemoveUse(SSAValue* value, SSAValue* user);
+            void DetachBlock(SSABlock* block);
+        };
+
+        // Mid-level optimisations, run between AST lowering and bytecode emission
+        struct SSAOptimizationStats {
+            uint32_t constants_folded = 0;
+            uint32_t branches_folded = 0;
+            uint32_t blocks_removed = 0;
+            uint32_t blocks_merged = 0;
+            uint32_t values_removed = 0;
+            uint32_t invariants_hoisted = 0;
+            uint32_t inductions_reduced = 0;
+            uint32_t redundancies_eliminated = 0;
+        };
+
+        class SSAOptimizer {
+        public:
+            static SSAOptimizationStats Optimize(SSAFunction& function);
+
+            static bool PropagateConstants(SSAFunction& function, SSAOptimizationStats& stats);
+            static bool SimplifyControlFlow(SSAFunction& function, SSAOptimizationStats& stats);
+            static bool EliminateDeadCode(SSAFunction& function, SSAOptimizationStats& stats);
+            static bool EliminateRedundancies(SSAFunction& function, SSAOptimizationStats& stats);
+            static bool OptimizeLoops(SSAFunction& function, SSAOptimizationStats& stats);
+
+        private:
+            static bool Simplify(SSAFunction& function, SSAOptimizationStats& stats);
+            static SSAValue* FoldInstruction(SSAFunction& function, VMOpcode opcode, const std::vector<SSAValue*>& operands);
+            static bool IsTruthyConstant(const SSAValue* value, bool& truthy);
+        };
+
+        // Stack-machine schedule used when lowering to bytecode. Critical edges
+        // into blocks with phis are split so each phi can be resolved by a
+        // parallel copy at the end of its predecessor. A value is produced
+        // directly beneath its only user when everything emitted in between
+        // belongs to the same expression tree; any other value with users is
+        // kept in a slot.
+        struct SSAStackSchedule {
+            std::vector<SSABlock*> layout;
+            std::vector<bool> on_stack;         // Indexed by value id
+            std::vector<bool> needs_slot;       // Indexed by value id
+
+            static SSAStackSchedule Build(SSAFunction& function);
+        };
+
+    } // namespace VM
+} // namespace AetherVisor
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <cstddef>
 #include <cstring>
+#include <vector>
 
 namespace AetherVisor {
     namespace VM {
@@ -14,6 +16,7 @@ namespace AetherVisor {
             PUSH_DOUBLE,    // Pushes an 8-byte double onto the stack.
             PUSH_STR,       // Pushes a null-terminated string onto the stack.
             PUSH_CONST,     // Pushes a constant from constant pool
+            PUSH_CONST_W,   // PUSH_CONST with a 32-bit pool index
             POP,            // Pops a value from the stack.
             DUP,            // Duplicates top stack value
             SWAP,           // Swaps top two stack values
@@ -53,6 +56,29 @@ namespace AetherVisor {
             CMP_LT,         // Pushes 1 if a < b, else 0
             CMP_LE,         // Pushes 1 if a <= b, else 0
 
+            // --- Type-Specialised (operand types proven by the compiler, no dispatch) ---
+            ADD_I32,        // INT32 + INT32, throws on overflow
+            SUB_I32,        // INT32 - INT32, throws on overflow
+            MUL_I32,        // INT32 * INT32, throws on overflow
+            DIV_I32,        // INT32 / INT32, truncating, throws on zero
+            MOD_I32,        // INT32 % INT32, throws on zero
+            ADD_F64,        // FLOAT64 + FLOAT64
+            SUB_F64,        // FLOAT64 - FLOAT64
+            MUL_F64,        // FLOAT64 * FLOAT64
+            DIV_F64,        // FLOAT64 / FLOAT64
+            CMP_EQ_I32,     // INT32 comparisons, push INT32 1 or 0
+            CMP_NE_I32,
+            CMP_GT_I32,
+            CMP_GE_I32,
+            CMP_LT_I32,
+            CMP_LE_I32,
+            CMP_EQ_F64,     // FLOAT64 comparisons, push INT32 1 or 0
+            CMP_NE_F64,
+            CMP_GT_F64,
+            CMP_GE_F64,
+            CMP_LT_F64,
+            CMP_LE_F64,
+
             // --- Control Flow ---
             JMP,            // Unconditional jump to a new instruction pointer.
             JMP_IF_ZERO,    // Jumps if the top of the stack is zero.
@@ -81,7 +107,7 @@ namespace AetherVisor {
 
             // --- Type Operations ---
             CAST_INT,       // Cast to integer
-            CAST_FLOAT,     // Cast to float
+            CAST_FLOAT,     // Cast to FLOAT64
             CAST_STR,       // Cast to string
             TYPE_OF,        // Get type of value
 
@@ -99,6 +125,7 @@ namespace AetherVisor {
 
             // --- Native Interoperability ---
             CALL_NATIVE,    // Calls a registered native C++ function.
+            CALL_NATIVE_W,  // CALL_NATIVE with a 32-bit name index
             LOAD_NATIVE,    // Load native library
             GET_NATIVE_FUNC,// Get native function pointer
 
@@ -125,6 +152,112 @@ namespace AetherVisor {
             DEBUG_BREAK     // Debug breakpoint
         };
 
+        // Operand layout after the opcode byte, little-endian. The trailing byte
+        // of the _ARGC forms is an argument count.
+        enum class VMOperandFormat : uint8_t {
+            NONE,
+            U16,            // Slot, pool or function index
+            U16_ARGC,       // Name pool index
+            U32,            // Immediate, wide pool index or code address
+            U32_ARGC,       // Wide name pool index
+            U64             // Raw eight bytes: a double, or a string pointer
+        };
+
+        // Encoding metadata, the single source for every decoder and encoder
+        struct VMOpcodeInfo {
+            VMOperandFormat format;
+            uint8_t operand_size;       // Bytes after the opcode
+            bool is_branch;             // Operand is a code address
+            bool falls_through;         // Execution can continue with the next instruction
+        };
+
+        constexpr std::array<VMOpcodeInfo, 256> BuildOpcodeTable() {
+            std::array<VMOpcodeInfo, 256> table{};
+            for (VMOpcodeInfo& info : table) {
+                info = VMOpcodeInfo{ VMOperandFormat::NONE, 0, false, true };
+            }
+            auto set = [&table](VMOpcode opcode, VMOperandFormat format, uint8_t size) {
+                table[static_cast<uint8_t>(opcode)].format = format;
+                table[static_cast<uint8_t>(opcode)].operand_size = size;
+            };
+
+            set(VMOpcode::PUSH_INT, VMOperandFormat::U32, 4);
+            set(VMOpcode::PUSH_FLOAT, VMOperandFormat::U32, 4);
+            set(VMOpcode::PUSH_DOUBLE, VMOperandFormat::U64, 8);
+            set(VMOpcode::PUSH_STR, VMOperandFormat::U64, 8);
+            set(VMOpcode::PUSH_CONST, VMOperandFormat::U16, 2);
+            set(VMOpcode::PUSH_CONST_W, VMOperandFormat::U32, 4);
+            set(VMOpcode::LOAD_LOCAL, VMOperandFormat::U16, 2);
+            set(VMOpcode::STORE_LOCAL, VMOperandFormat::U16, 2);
+            set(VMOpcode::LOAD_GLOBAL, VMOperandFormat::U16, 2);
+            set(VMOpcode::STORE_GLOBAL, VMOperandFormat::U16, 2);
+            set(VMOpcode::CALL, VMOperandFormat::U16, 2);
+            set(VMOpcode::CALL_NATIVE, VMOperandFormat::U16_ARGC, 3);
+            set(VMOpcode::CALL_NATIVE_W, VMOperandFormat::U32_ARGC, 5);
+            for (VMOpcode branch : { VMOpcode::JMP, VMOpcode::JMP_IF_ZERO, VMOpcode::JMP_IF_NOT_ZERO, VMOpcode::TRY }) {
+                set(branch, VMOperandFormat::U32, 4);
+                table[static_cast<uint8_t>(branch)].is_branch = true;
+            }
+            for (VMOpcode end : { VMOpcode::JMP, VMOpcode::RET, VMOpcode::RET_VAL, VMOpcode::HALT, VMOpcode::THROW }) {
+                table[static_cast<uint8_t>(end)].falls_through = false;
+            }
+            return table;
+        }
+
+        inline const VMOpcodeInfo& GetOpcodeInfo(VMOpcode opcode) {
+            static constexpr std::array<VMOpcodeInfo, 256> table = BuildOpcodeTable();
+            return table[static_cast<uint8_t>(opcode)];
+        }
+
+        // Reads the operands of the instruction whose opcode byte is code[0], with
+        // size bytes available from there. U64 operands come back as low and high
+        // halves; otherwise operand2 is the argument count. False if truncated.
+        inline bool DecodeOperands(const uint8_t* code, size_t size, uint32_t& operand, uint32_t& operand2) {
+            const VMOpcodeInfo& info = GetOpcodeInfo(static_cast<VMOpcode>(code[0]));
+            operand = operand2 = 0;
+            if (size < 1u + info.operand_size) return false;
+
+            const uint8_t* bytes = code + 1;
+            switch (info.format) {
+                case VMOperandFormat::U16:
+                case VMOperandFormat::U16_ARGC: {
+                    uint16_t narrow;
+                    std::memcpy(&narrow, bytes, sizeof(narrow));
+                    operand = narrow;
+                    if (info.format == VMOperandFormat::U16_ARGC) operand2 = bytes[2];
+                    break;
+                }
+                case VMOperandFormat::U32:
+                case VMOperandFormat::U32_ARGC:
+                case VMOperandFormat::U64:
+                    std::memcpy(&operand, bytes, sizeof(operand));
+                    if (info.format == VMOperandFormat::U32_ARGC) operand2 = bytes[4];
+                    if (info.format == VMOperandFormat::U64) std::memcpy(&operand2, bytes + 4, sizeof(operand2));
+                    break;
+                default:
+                    break;
+            }
+            return true;
+        }
+
+        // Appends an instruction in the layout DecodeOperands reads
+        inline void EncodeInstruction(VMOpcode opcode, uint32_t operand, uint32_t operand2, std::vector<uint8_t>& output) {
+            auto append = [&output](uint32_t value, size_t bytes) {
+                for (size_t k = 0; k < bytes; ++k) {
+                    output.push_back(static_cast<uint8_t>(value >> (8 * k)));
+                }
+            };
+            output.push_back(static_cast<uint8_t>(opcode));
+            switch (GetOpcodeInfo(opcode).format) {
+                case VMOperandFormat::U16: append(operand, 2); break;
+                case VMOperandFormat::U16_ARGC: append(operand, 2); append(operand2, 1); break;
+                case VMOperandFormat::U32: append(operand, 4); break;
+                case VMOperandFormat::U32_ARGC: append(operand, 4); append(operand2, 1); break;
+                case VMOperandFormat::U64: append(operand, 4); append(operand2, 4); break;
+                default: break;
+            }
+        }
+
         // Data types supported by the VM
         enum class VMDataType : uint8_t {
             INT32,
@@ -3,10 +3,16 @@
 #endif
 #include "VirtualMachine.h"
 #include "../security/XorStr.h"
+#include "JITProfilerMap.h"
 #include <algorithm>
 #include <iostream>
 #include <cstring>
 #include <limits>
+#include <cmath>
+#include <charconv>
+#include <string_view>
+#include <sstream>
+#include <iomanip>
 
 namespace AetherVisor {
     namespace VM {
@@ -22,9 +28,17 @@ namespace AetherVisor {
             , m_next_memory_address(0x10000)
             , m_memory_usage(0)
             , m_max_memory_usage(16 * 1024 * 1024) // 16MB memory limit
+            , m_int_constants(nullptr)
+            , m_int_constant_count(0)
+            , m_double_constants(nullptr)
+            , m_double_constant_count(0)
             , m_has_exception(false)
             , m_instruction_count(0)
             , m_max_instructions_per_run(1000000)
+            , m_profiling_mode(ProfilingMode::DISABLED)
+            , m_sample_period(1)
+            , m_sample_countdown(1)
+            , m_sampled_address(0)
         {
             // Initialize default security context
             m_security_context.allow_native_calls = false;
@@ -36,10 +50,18 @@ namespace AetherVisor {
             m_security_context.max_execution_time = 30000; // 30 seconds
             m_security_context.max_memory_usage = m_max_memory_usage;
             m_security_context.max_stack_depth = 1000;
+            m_value_stack.SetMaxSize(m_max_stack_size);
+            m_native_context = JITContext{};
+            m_native_region = 0;
+            m_tier_request = NO_TIER_REQUEST;
+            m_profiler_symbols = false;
+            m_native_generation = 1;
+            m_call_cache = nullptr;
         }
 
         VirtualMachine::~VirtualMachine() {
             Reset();
+            ReleaseNative();
         }
 
         bool VirtualMachine::Initialize(const VMSecurityContext& security_context) {
@@ -86,6 +108,7 @@ namespace AetherVisor {
             }
 
             m_native_functions[name] = function;
+            m_native_generation++;
             return true;
         }
 
@@ -93,6 +116,7 @@ namespace AetherVisor {
             auto it = m_native_functions.find(name);
             if (it != m_native_functions.end()) {
                 m_native_functions.erase(it);
+                m_native_generation++;
                 return true;
             }
             return false;
@@ -100,6 +124,7 @@ namespace AetherVisor {
 
         void VirtualMachine::ClearNativeFunctions() {
             m_native_functions.clear();
+            m_native_generation++;
         }
 
         bool VirtualMachine::LoadBytecode(const std::vector<uint8_t>& bytecode) {
@@ -118,10 +143,94 @@ namespace AetherVisor {
                 return false;
             }
 
-            m_bytecode = bytecode;
-            m_code_base = m_bytecode.data();
-            m_code_size = static_cast<uint32_t>(m_bytecode.size());
-            m_pc = 0;
+            std::string error;
+            std::shared_ptr<CompiledModule> module = CompiledModule::FromImage(bytecode, &error);
+            if (!module) {
+                SetError(error);
+                return false;
+            }
+
+            return LoadModule(std::move(module));
+        }
+
+        bool VirtualMachine::LoadModuleFile(const std::string& path) {
+            if (!IsValidState(VMState::READY)) {
+                SetError(XorS("VM not ready for bytecode loading"));
+                return false;
+            }
+
+            std::string error;
+            std::shared_ptr<CompiledModule> module = CompiledModule::MapFile(path, &error);
+            if (!module) {
+                SetError(error);
+                return false;
+            }
+
+            if (!LoadModule(std::move(module))) {
+                return false;
+            }
+            m_module_path = path;
+            return true;
+        }
+
+        // Code is executed in place from the module image; only the constant and
+        // function tables are decoded into VM-side structures
+        bool VirtualMachine::LoadModule(std::shared_ptr<CompiledModule> module) {
+            if (!IsValidState(VMState::READY)) {
+                SetError(XorS("VM not ready for bytecode loading"));
+                return false;
+            }
+
+            if (!module) {
+                SetError(XorS("Null module"));
+                return false;
+            }
+
+            uint32_t code_size = 0;
+            const uint8_t* code = module->GetCode(code_size);
+            if (!code || code_size == 0) {
+                SetError(module->GetLastError().empty() ? std::string(XorS("Empty bytecode")) : module->GetLastError());
+                return false;
+            }
+
+            uint32_t int_count = 0;
+            uint32_t double_count = 0;
+            const int64_t* ints = module->GetIntConstants(int_count);
+            const double* doubles = module->GetDoubleConstants(double_count);
+
+            const uint32_t boxed_base = int_count + double_count;
+            std::vector<VMValue> boxed(module->GetConstantCount() - boxed_base);
+            for (uint32_t i = 0; i < boxed.size(); ++i) {
+                if (!module->ReadConstant(boxed_base + i, boxed[i])) {
+                    SetError(module->GetLastError());
+                    return false;
+                }
+            }
+
+            std::vector<VMFunction> functions(module->GetFunctionCount());
+            for (uint32_t i = 0; i < functions.size(); ++i) {
+                if (!module->ReadFunction(i, functions[i])) {
+                    SetError(module->GetLastError());
+                    return false;
+                }
+            }
+
+            ReleaseNative();        // Nothing may still be compiling from the old code
+            m_int_constants = ints;
+            m_int_constant_count = int_count;
+            m_double_constants = doubles;
+            m_double_constant_count = double_count;
+            m_boxed_constants = std::move(boxed);
+            m_functions = std::move(functions);
+            m_module = std::move(module);
+            m_code_base = code;
+            m_code_size = code_size;
+            m_pc = m_module->GetHeader().entry_point;
+            m_module_path.clear();
+            PrepareProfile();
+            if (m_jit) {
+                CompileNative();
+            }
 
             return true;
         }
@@ -136,7 +245,7 @@ namespace AetherVisor {
                 return false;
             }
 
-            if (m_bytecode.empty()) {
+            if (m_code_size == 0) {
                 SetError(XorS("No bytecode loaded"));
                 return false;
             }
@@ -169,16 +278,24 @@ namespace AetherVisor {
                         break;
                     }
 
-                    // Execute instruction
-                    if (!ExecuteInstruction()) {
-                        if (m_state == VMState::RUNNING) {
-                            SetState(VMState::ERROR_STATE);
+                    // Native code runs whole blocks and returns here between slices
+                    uint32_t executed = 0;
+                    if (!m_native_entries.empty() && RunNative(max_instructions - instruction_count, executed)) {
+                        instruction_count += executed;
+                        m_instruction_count += executed;
+                    } else {
+                        // Execute instruction; a raised exception resumes at its handler
+                        if (!ExecuteInstruction() && !HandleException()) {
+                            if (m_state == VMState::RUNNING) {
+                                SetState(VMState::ERROR_STATE);
+                            }
+                            break;
                         }
-                        break;
-                    }
 
-                    instruction_count++;
-                    m_instruction_count++;
+                        instruction_count++;
+                        m_instruction_count++;
+                        m_tier_statistics.instructions[static_cast<size_t>(JITTier::INTERPRETER)]++;
+                    }
 
                     // Check execution time limit
                     auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -214,15 +331,16 @@ namespace AetherVisor {
             }
         }
 
+        // Keeps the loaded module so the same program can be run again
         void VirtualMachine::Reset() {
             SetState(VMState::READY);
-            m_pc = 0;
+            m_pc = m_module ? m_module->GetHeader().entry_point : 0;
             m_value_stack.clear();
             m_call_stack.clear();
             m_exception_stack.clear();
+            m_locals.clear();
             m_globals.clear();
-            m_constants.clear();
-            m_functions.clear();
+            m_runtime_strings.clear();
             
             // Securely clear allocated memory
             for (auto& pair : m_allocated_memory) {
@@ -238,8 +356,19 @@ namespace AetherVisor {
 
         void VirtualMachine::Shutdown() {
             Reset();
+            m_int_constants = nullptr;
+            m_int_constant_count = 0;
+            m_double_constants = nullptr;
+            m_double_constant_count = 0;
+            m_boxed_constants.clear();
+            m_functions.clear();
+            ReleaseNative();
+            m_code_base = nullptr;
+            m_code_size = 0;
+            m_module.reset();
             m_initialized = false;
             m_native_functions.clear();
+            m_native_generation++;
             m_allowed_native_functions.clear();
         }
 
@@ -272,6 +401,30 @@ namespace AetherVisor {
             m_value_stack.clear();
         }
 
+        void ValueStack::resize(size_t count) {
+            if (count > static_cast<size_t>(m_limit - m_base)) {
+                Grow(count);
+            }
+            for (VMValue* value = m_top; value < m_base + count; ++value) {
+                *value = VMValue();
+            }
+            m_top = m_base + count;
+        }
+
+        // Doubles the storage, but not past the stack limit, which PushValue
+        // checks before growing
+        void ValueStack::Grow(size_t required) {
+            const size_t count = size();
+            size_t capacity = std::max<size_t>({ required, m_storage.size() * 2, 256 });
+            if (m_max_size) {
+                capacity = std::min(capacity, std::max(required, m_max_size));
+            }
+            m_storage.resize(capacity);
+            m_base = m_storage.data();
+            m_top = m_base + count;
+            m_limit = m_base + capacity;
+        }
+
         uint32_t VirtualMachine::AllocateMemory(size_t size) {
             if (!m_security_context.allow_memory_alloc) {
                 LogSecurityViolation(XorS("Memory allocation not allowed"));
@@ -356,6 +509,7 @@ namespace AetherVisor {
             m_has_exception = true;
             m_current_exception.error_type = type;
             m_current_exception.pc = m_pc;
+            m_current_exception.error_value = VMValue{};
             std::strncpy(m_current_exception.message, message.c_str(), sizeof(m_current_exception.message) - 1);
             m_current_exception.message[sizeof(m_current_exception.message) - 1] = '\0';
         }
@@ -394,23 +548,660 @@ namespace AetherVisor {
             m_execution_start = std::chrono::steady_clock::now();
         }
 
-        bool VirtualMachine::VerifyBytecodeIntegrity(const std::vector<uint8_t>& bytecode) {
-            // Simple integrity check - in a real implementation, this would use
-            // cryptographic signatures and more sophisticated verification
-            if (bytecode.empty()) return false;
-            
-            // Check for minimum header
-            if (bytecode.size() < 16) return false;
-            
-            // Verify magic number (example)
-            if (bytecode[0] != 0xAE || bytecode[1] != 0x7E || 
-                bytecode[2] != 0xE7 || bytecode[3] != 0x5E) {
+        void VirtualMachine::SetProfilingMode(ProfilingMode mode, uint32_t sample_period) {
+            m_profiling_mode = mode;
+            m_sample_period = std::max<uint32_t>(sample_period, 1);
+            PrepareProfile();
+        }
+
+        void VirtualMachine::ResetProfile() {
+            std::fill(m_execution_counts.begin(), m_execution_counts.end(), 0);
+            std::fill(m_branch_counts.begin(), m_branch_counts.end(), BranchProfile{});
+            m_sample_countdown = m_sample_period;
+            m_sampled_address = m_code_size;
+        }
+
+        // Sizes the counters for the loaded module and marks its basic blocks.
+        // Done once per module so the dispatch loop only indexes arrays.
+        void VirtualMachine::PrepareProfile() {
+            m_block_lengths.clear();
+            m_execution_counts.clear();
+            m_branch_counts.clear();
+            if (m_profiling_mode == ProfilingMode::DISABLED || !m_module || m_code_size == 0) {
+                return;
+            }
+
+            std::vector<uint32_t> entry_points;
+            if (m_module->GetHeader().entry_point < m_code_size) {
+                entry_points.push_back(m_module->GetHeader().entry_point);
+            }
+            for (const VMFunction& function : m_functions) {
+                entry_points.push_back(function.address);
+            }
+
+            std::vector<uint32_t> lengths;
+            const std::vector<uint32_t> starts = ExecutionProfile::FindBlockStarts(
+                std::vector<uint8_t>(m_code_base, m_code_base + m_code_size), entry_points, &lengths);
+
+            m_block_lengths.assign(m_code_size, 0);
+            for (size_t i = 0; i < starts.size(); ++i) {
+                m_block_lengths[starts[i]] = lengths[i];
+            }
+            m_execution_counts.assign(m_code_size, 0);
+            m_branch_counts.assign(m_code_size, BranchProfile{});
+            ResetProfile();
+        }
+
+        void VirtualMachine::RecordExecution(uint32_t address) {
+            if (m_profiling_mode == ProfilingMode::COUNTING) {
+                uint32_t& count = m_execution_counts[address];
+                if (m_block_lengths[address] && count != std::numeric_limits<uint32_t>::max()) {
+                    ++count;
+                }
+            } else if (--m_sample_countdown == 0) {
+                m_sample_countdown = m_sample_period;
+                uint32_t& count = m_execution_counts[address];
+                count = count > std::numeric_limits<uint32_t>::max() - m_sample_period ?
+                        std::numeric_limits<uint32_t>::max() : count + m_sample_period;
+                m_sampled_address = address;
+            }
+        }
+
+        // Wraps a conditional branch handler; the branch was taken when execution
+        // does not continue at the next instruction
+        bool VirtualMachine::RecordBranch(uint32_t address, bool executed) {
+            if (!executed || m_profiling_mode == ProfilingMode::DISABLED) {
+                return executed;
+            }
+
+            uint32_t weight = 1;
+            if (m_profiling_mode == ProfilingMode::SAMPLING) {
+                if (m_sampled_address != address) return executed;
+                m_sampled_address = m_code_size;
+                weight = m_sample_period;
+            }
+
+            BranchProfile& branch = m_branch_counts[address];
+            uint32_t& count = m_pc != address + 1 + sizeof(uint32_t) ? branch.taken : branch.not_taken;
+            count = count > std::numeric_limits<uint32_t>::max() - weight ? std::numeric_limits<uint32_t>::max() : count + weight;
+            return executed;
+        }
+
+        ExecutionProfile VirtualMachine::ExportProfile() const {
+            ExecutionProfile profile;
+            if (!m_module || m_execution_counts.empty()) {
+                return profile;
+            }
+            profile.code_key = m_module->GetProfileKey();
+
+            // Profile-guided code reports against the layout its profile came from;
+            // instructions the optimiser added have no counterpart and are dropped
+            uint32_t map_count = 0;
+            const ModuleAddressEntry* map = m_module->GetProfileAddresses(map_count);
+            auto to_profiled = [map, map_count](uint32_t pc, uint32_t& profiled) {
+                if (!map) {
+                    profiled = pc;
+                    return true;
+                }
+                const ModuleAddressEntry* end = map + map_count;
+                const ModuleAddressEntry* it = std::lower_bound(map, end, pc,
+                    [](const ModuleAddressEntry& entry, uint32_t value) { return entry.pc < value; });
+                if (it == end || it->pc != pc) return false;
+                profiled = it->profile_pc;
+                return true;
+            };
+            auto add_block = [&](uint32_t pc, uint64_t count) {
+                uint32_t profiled;
+                if (count == 0 || !to_profiled(pc, profiled)) return;
+                uint64_t total = profile.block_counts[profiled] + count;
+                profile.block_counts[profiled] = static_cast<uint32_t>(std::min<uint64_t>(total, std::numeric_limits<uint32_t>::max()));
+            };
+
+            if (m_profiling_mode == ProfilingMode::SAMPLING) {
+                // Samples land on every instruction of a block, so a block's
+                // executions are its samples spread over its length
+                uint32_t start = m_code_size;
+                uint64_t samples = 0;
+                for (uint32_t pc = 0; pc < m_code_size; ++pc) {
+                    if (m_block_lengths[pc]) {
+                        if (start < m_code_size) add_block(start, samples / m_block_lengths[start]);
+                        start = pc;
+                        samples = 0;
+                    }
+                    samples += m_execution_counts[pc];
+                }
+                if (start < m_code_size) add_block(start, samples / m_block_lengths[start]);
+            } else {
+                for (uint32_t pc = 0; pc < m_code_size; ++pc) {
+                    add_block(pc, m_execution_counts[pc]);
+                }
+            }
+
+            for (uint32_t pc = 0; pc < m_code_size; ++pc) {
+                const BranchProfile& branch = m_branch_counts[pc];
+                uint32_t profiled;
+                if ((branch.taken || branch.not_taken) && to_profiled(pc, profiled)) {
+                    profile.branches[profiled] = m_module->IsInvertedBranch(pc) ?
+                                                 BranchProfile{ branch.not_taken, branch.taken } : branch;
+                }
+            }
+            return profile;
+        }
+
+        bool VirtualMachine::SaveProfile(const std::string& path) {
+            const std::string target = path.empty() && !m_module_path.empty() ?
+                                       ExecutionProfile::GetSidecarPath(m_module_path) : path;
+            if (target.empty()) {
+                SetError(XorS("No profile path for a module not loaded from a file"));
                 return false;
             }
-            
+            if (!m_module || m_profiling_mode == ProfilingMode::DISABLED) {
+                SetError(XorS("Profiling is not enabled"));
+                return false;
+            }
+
+            ExecutionProfile profile = ExportProfile();
+            ExecutionProfile existing;
+            if (ExecutionProfile::Load(target, existing) && existing.code_key == profile.code_key) {
+                existing.Merge(profile);
+                profile = std::move(existing);
+            }
+            if (!profile.Save(target)) {
+                SetError(XorS("Failed to write profile file"));
+                return false;
+            }
+
+            ResetProfile();
+            return true;
+        }
+
+        namespace {
+            std::unique_ptr<JITCompiler> CreateJITCompiler(uint32_t optimization_level, bool count_loops) {
+                JITSettings settings{};
+                settings.enable_optimizations = optimization_level > 0;
+                settings.enable_security_checks = true;
+                settings.enable_profiling = count_loops;
+                settings.optimization_level = optimization_level;
+                settings.max_code_cache_size = 64 * 1024 * 1024;
+                settings.enable_code_encryption = false;
+
+                auto jit = std::make_unique<JITCompiler>();
+                if (!jit->Initialize(settings)) {
+                    return nullptr;
+                }
+                return jit;
+            }
+        }
+
+        bool VirtualMachine::EnableJIT(bool enable, uint32_t optimization_level) {
+            ReleaseNative();
+            m_compile_queue.reset();
+            m_jit.reset();
+            m_baseline_jit.reset();
+            if (!enable) {
+                return true;
+            }
+
+            m_jit = CreateJITCompiler(optimization_level, false);
+            if (!m_jit) {
+                SetError(XorS("JIT not supported on this platform"));
+                return false;
+            }
+            if (m_module) {
+                CompileNative();
+            }
             return true;
         }
 
+        bool VirtualMachine::EnableTieredJIT(const JITTierSettings& settings) {
+            ReleaseNative();
+            m_compile_queue.reset();
+            m_jit.reset();
+            m_baseline_jit.reset();
+            if (settings.baseline_threshold > settings.optimized_threshold) {
+                SetError(XorS("Baseline threshold above the optimised threshold"));
+                return false;
+            }
+
+            m_jit = CreateJITCompiler(settings.optimized_level, false);
+            m_baseline_jit = CreateJITCompiler(settings.baseline_level, true);
+            if (!m_jit || !m_baseline_jit) {
+                m_jit.reset();
+                m_baseline_jit.reset();
+                SetError(XorS("JIT not supported on this platform"));
+                return false;
+            }
+            m_tier_settings = settings;
+            if (settings.background_compilation) {
+                m_compile_queue = std::make_unique<JITCompileQueue>();
+            }
+            if (m_module) {
+                CompileNative();
+            }
+            return true;
+        }
+
+        bool VirtualMachine::EnableProfilerSymbols(bool jitdump) {
+            uint32_t formats = JITProfilerMap::PERF_MAP;
+            if (jitdump) {
+                formats |= JITProfilerMap::JITDUMP;
+            }
+            if (!JITProfilerMap::GetInstance().Enable(formats)) {
+                SetError(XorS("Failed to open the profiler map"));
+                return false;
+            }
+            m_profiler_symbols = true;
+            for (const NativeRegion& region : m_native_regions) {
+                if (region.code.executable_memory) {
+                    RecordNativeSymbols(region);
+                }
+            }
+            return true;
+        }
+
+        size_t VirtualMachine::GetNativeCodeSize() const {
+            size_t size = 0;
+            for (const NativeRegion& region : m_native_regions) {
+                size += region.code.code_size;
+            }
+            return size;
+        }
+
+        std::string JITTierStatistics::Format() const {
+            static const char* const names[] = { "Interpreter", "Baseline", "Optimised" };
+            std::ostringstream out;
+            out << XorS("Tiers: baseline at ") << settings.baseline_threshold << XorS(", optimised at ")
+                << settings.optimized_threshold << XorS(", OSR ");
+            if (settings.osr_threshold) {
+                out << XorS("after ") << settings.osr_threshold << XorS(" iterations\n");
+            } else {
+                out << XorS("off\n");
+            }
+            out << std::left << std::setw(12) << XorS("Tier") << std::right << std::setw(11) << XorS("Functions")
+                << std::setw(10) << XorS("Compiles") << std::setw(12) << XorS("Compile ms")
+                << std::setw(16) << XorS("Instructions") << "\n";
+            out << std::fixed << std::setprecision(2);
+            for (size_t tier = 0; tier < 3; ++tier) {
+                out << std::left << std::setw(12) << names[tier] << std::right << std::setw(11) << functions[tier]
+                    << std::setw(10) << compilations[tier] << std::setw(12) << compile_time_ms[tier]
+                    << std::setw(16) << instructions[tier] << "\n";
+            }
+            out << XorS("OSR transitions: ") << osr_transitions << "\n";
+            out << XorS("Deoptimisations: ") << deoptimizations << XorS(", regions recompiled: ") << invalidations << "\n";
+            out << XorS("Native call cache misses: ") << call_cache_misses << "\n";
+            return out.str();
+        }
+
+        // One region per function, from its entry up to the next function or
+        // the module entry point. Without tiering every region is compiled
+        // now; a region that fails to compile stays interpreted.
+        void VirtualMachine::CompileNative() {
+            ReleaseNative();
+            m_jit->ResetSpeculation();
+
+            std::set<uint32_t> starts = { 0, m_module->GetHeader().entry_point };
+            for (const VMFunction& function : m_functions) {
+                if (!function.is_native) {
+                    starts.insert(function.address);
+                }
+            }
+            starts.erase(starts.lower_bound(m_code_size), starts.end());
+
+            m_native_entries.assign(m_code_size, NativeEntry{ 0, NO_NATIVE_ENTRY, false });
+            m_loop_counts.assign(m_code_size, 0);
+            m_deopt_counts.assign(m_code_size, 0);
+            for (auto it = starts.begin(); it != starts.end(); ++it) {
+                NativeRegion region{};
+                region.start = *it;
+                region.end = std::next(it) == starts.end() ? m_code_size : *std::next(it);
+                region.name = region.start == m_module->GetHeader().entry_point ? std::string(XorS("main")) : std::string();
+                for (const VMFunction& function : m_functions) {
+                    if (!function.is_native && function.address == region.start) {
+                        region.name.assign(function.name, strnlen(function.name, sizeof(function.name)));
+                    }
+                }
+                if (region.name.empty()) {
+                    region.name = XorS("code_") + std::to_string(region.start);
+                }
+                region.tier = JITTier::INTERPRETER;
+                region.queued = JITTier::INTERPRETER;
+                region.code.success = false;
+                region.code.executable_memory = nullptr;
+                region.code.code_size = 0;
+
+                // Loop headers are where a branch within the region goes back to
+                const uint32_t index = static_cast<uint32_t>(m_native_regions.size());
+                for (uint32_t pc = region.start; pc < region.end; ++pc) {
+                    m_native_entries[pc].region = index;
+                }
+                for (uint32_t pc = region.start; pc < region.end;) {
+                    const VMOpcode opcode = static_cast<VMOpcode>(m_code_base[pc]);
+                    uint32_t target, operand2;
+                    if (!DecodeOperands(&m_code_base[pc], region.end - pc, target, operand2)) {
+                        break;
+                    }
+                    if ((opcode == VMOpcode::JMP || opcode == VMOpcode::JMP_IF_ZERO || opcode == VMOpcode::JMP_IF_NOT_ZERO) &&
+                        target >= region.start && target <= pc) {
+                        m_native_entries[target].loop_header = true;
+                    }
+                    pc += 1 + GetOpcodeInfo(opcode).operand_size;
+                }
+                m_native_regions.push_back(std::move(region));
+            }
+
+            m_tier_statistics = JITTierStatistics{};
+            m_tier_statistics.settings = m_tier_settings;
+            m_tier_statistics.functions[static_cast<size_t>(JITTier::INTERPRETER)] = static_cast<uint32_t>(m_native_regions.size());
+            if (!m_baseline_jit) {
+                for (uint32_t index = 0; index < m_native_regions.size(); ++index) {
+                    const NativeRegion& region = m_native_regions[index];
+                    InstallNative(index, JITTier::OPTIMIZED,
+                                  m_jit->CompileRegion(m_code_base, m_code_size, region.start, region.end), false);
+                }
+            }
+        }
+
+        void VirtualMachine::ReleaseNative() {
+            if (m_compile_queue) {
+                m_compile_queue->Cancel();
+            }
+            for (NativeRegion& region : m_native_regions) {
+                if (region.code.executable_memory) {
+                    JITCompiler::FreeExecutableMemory(region.code.executable_memory, region.code.code_size);
+                }
+            }
+            m_native_regions.clear();
+            m_native_entries.clear();
+            m_loop_counts.clear();
+            m_deopt_counts.clear();
+            m_tier_request = NO_TIER_REQUEST;
+        }
+
+        // Points a region's entries at new code for a tier. A region whose
+        // compile failed keeps the code it had and stops tiering.
+        void VirtualMachine::InstallNative(uint32_t index, JITTier tier, JITCompilationResult code, bool at_loop_header) {
+            NativeRegion& region = m_native_regions[index];
+            if (!code.success) {
+                region.compile_failed = true;
+                m_tier_statistics.compilations[static_cast<size_t>(JITTier::INTERPRETER)]++;
+                return;
+            }
+
+            m_tier_statistics.compilations[static_cast<size_t>(tier)]++;
+            m_tier_statistics.compile_time_ms[static_cast<size_t>(tier)] += code.compilation_time_ms;
+            if (tier <= region.tier) {
+                JITCompiler::FreeExecutableMemory(code.executable_memory, code.code_size);   // Overtaken
+                return;
+            }
+            m_tier_statistics.functions[static_cast<size_t>(region.tier)]--;
+            m_tier_statistics.functions[static_cast<size_t>(tier)]++;
+            if (at_loop_header) {
+                m_tier_statistics.osr_transitions++;
+            }
+
+            if (region.code.executable_memory) {
+                JITCompiler::FreeExecutableMemory(region.code.executable_memory, region.code.code_size);
+            }
+            for (uint32_t pc = region.start; pc < region.end; ++pc) {
+                m_native_entries[pc].offset = NO_NATIVE_ENTRY;
+            }
+            for (const auto& [address, offset] : code.entry_points) {
+                m_native_entries[address].offset = offset;
+            }
+            region.code = std::move(code);
+            region.call_caches.assign(region.code.call_sites, JITInlineCache{});
+            region.tier = tier;
+            if (m_profiler_symbols) {
+                RecordNativeSymbols(region);
+            }
+        }
+
+        // Lines are the module's debug lines of the instructions the code
+        // starts at, one entry per change of line
+        void VirtualMachine::RecordNativeSymbols(const NativeRegion& region) {
+            std::vector<JITProfilerMap::LineEntry> lines;
+            for (const auto& [address, offset] : region.code.pc_map) {
+                const uint32_t line = m_module->LookupLine(address);
+                if (line != 0 && (lines.empty() || lines.back().line != line)) {
+                    lines.push_back({ offset, line });
+                }
+            }
+            const std::string name = XorS("aether:") + region.name +
+                                     (region.tier == JITTier::BASELINE ? XorS(" [baseline]") : XorS(" [optimised]"));
+            JITProfilerMap::GetInstance().RecordCode(name, region.code.executable_memory, region.code.code_size,
+                                                     m_module_path.empty() ? std::string(XorS("module")) : m_module_path, lines);
+        }
+
+        // Called between native runs only, so no native code of a region is
+        // running while its entries are switched over
+        void VirtualMachine::InstallFinished() {
+            for (JITCompileQueue::Finished& finished : m_compile_queue->TakeFinished()) {
+                const uint32_t index = finished.request.region;
+                const JITTier tier = static_cast<JITTier>(finished.request.tier);
+                NativeRegion& region = m_native_regions[index];
+                const bool at_loop_header = region.queued_at_loop && tier == region.queued;
+                if (tier == region.queued) {
+                    region.queued = std::max(region.tier, tier);
+                }
+                InstallNative(index, tier, std::move(finished.result), at_loop_header);
+            }
+        }
+
+        // Moves a region up to the highest tier its hotness has reached.
+        // Native code can be entered at any block leader, so code installed
+        // after a loop header asked for it takes over the running loop at its
+        // next leader. With background compilation the interpreter, or the
+        // tier below, runs meanwhile.
+        void VirtualMachine::UpdateTier(uint32_t index, bool loop_header) {
+            NativeRegion& region = m_native_regions[index];
+            if (region.compile_failed || region.queued == JITTier::OPTIMIZED) {
+                return;
+            }
+
+            JITTier tier = JITTier::INTERPRETER;
+            if (region.hotness >= m_tier_settings.optimized_threshold) {
+                tier = JITTier::OPTIMIZED;
+            } else if (region.hotness >= m_tier_settings.baseline_threshold) {
+                tier = JITTier::BASELINE;
+            }
+            if (tier <= region.queued) {
+                return;
+            }
+
+            JITCompiler* compiler = tier == JITTier::BASELINE ? m_baseline_jit.get() : m_jit.get();
+            if (!m_compile_queue) {
+                InstallNative(index, tier, compiler->CompileRegion(m_code_base, m_code_size, region.start, region.end), loop_header);
+                region.queued = region.tier;
+                return;
+            }
+            m_compile_queue->Submit({ compiler, m_code_base, m_code_size, region.start, region.end, index,
+                                      static_cast<uint32_t>(tier) });
+            region.queued = tier;
+            region.queued_at_loop = loop_header;
+        }
+
+        // Drops the code of a region whose guards failed too often. The
+        // compiler has stopped speculating on the loops at fault by now;
+        // tiered regions go back to the interpreter and tier up again, others
+        // are compiled again at once.
+        void VirtualMachine::InvalidateNative(uint32_t index) {
+            NativeRegion& region = m_native_regions[index];
+            region.invalidated = false;
+            if (region.code.executable_memory) {
+                JITCompiler::FreeExecutableMemory(region.code.executable_memory, region.code.code_size);
+            }
+            for (uint32_t pc = region.start; pc < region.end; ++pc) {
+                m_native_entries[pc].offset = NO_NATIVE_ENTRY;
+            }
+            m_tier_statistics.functions[static_cast<size_t>(region.tier)]--;
+            m_tier_statistics.functions[static_cast<size_t>(JITTier::INTERPRETER)]++;
+            m_tier_statistics.invalidations++;
+            region.code = JITCompilationResult{};
+            region.tier = JITTier::INTERPRETER;
+            region.queued = JITTier::INTERPRETER;
+
+            if (!m_baseline_jit) {
+                InstallNative(index, JITTier::OPTIMIZED, m_jit->CompileRegion(m_code_base, m_code_size, region.start, region.end), false);
+            }
+        }
+
+        // Enters native code when m_pc leads a compiled block. False, with
+        // nothing done, when the interpreter has to take the instruction.
+        // Tiering counts function entries and loop headers as they are
+        // reached here, in the interpreter and between native runs.
+        bool VirtualMachine::RunNative(uint32_t budget, uint32_t& executed) {
+            executed = 0;
+            if (m_pc >= m_native_entries.size() || m_profiling_mode != ProfilingMode::DISABLED || !m_breakpoints.empty()) {
+                return false;
+            }
+
+            if (m_compile_queue && m_compile_queue->HasFinished()) {
+                InstallFinished();
+            }
+            const NativeEntry& entry = m_native_entries[m_pc];
+            if (m_native_regions[entry.region].invalidated) {
+                InvalidateNative(entry.region);
+            }
+            if (m_baseline_jit) {
+                if (m_tier_request != NO_TIER_REQUEST) {
+                    UpdateTier(m_tier_request, false);
+                    m_tier_request = NO_TIER_REQUEST;
+                }
+                NativeRegion& region = m_native_regions[entry.region];
+                if (m_pc == region.start) {
+                    region.hotness++;
+                    UpdateTier(entry.region, false);
+                } else if (entry.loop_header) {
+                    region.hotness++;
+                    if (++m_loop_counts[m_pc] >= m_tier_settings.osr_threshold && m_tier_settings.osr_threshold != 0) {
+                        UpdateTier(entry.region, true);
+                    }
+                }
+            }
+            if (entry.offset == NO_NATIVE_ENTRY) {
+                return false;
+            }
+
+            // Baseline code counts loop iterations up to the optimised threshold
+            // and then, for OSR, comes back here at every back-edge until a
+            // loop has run long enough to switch tier. Queued code is picked
+            // up at the end of a slice instead.
+            NativeRegion& region = m_native_regions[entry.region];
+            int64_t countdown = std::numeric_limits<int64_t>::max();
+            if (region.tier == JITTier::BASELINE && region.queued == JITTier::BASELINE && !region.compile_failed) {
+                if (region.hotness < m_tier_settings.optimized_threshold) {
+                    countdown = static_cast<int64_t>(m_tier_settings.optimized_threshold - region.hotness) - 1;
+                } else if (m_tier_settings.osr_threshold != 0) {
+                    countdown = 0;
+                }
+            }
+
+            const uint32_t start = m_pc;
+            m_native_context.stack = &m_value_stack;
+            m_native_context.step = &VirtualMachine::NativeStep;
+            m_native_context.call = &VirtualMachine::NativeCall;
+            m_native_context.call_caches = region.call_caches.data();
+            m_native_context.deopt = &VirtualMachine::NativeDeopt;
+            m_native_context.vm = this;
+            m_native_context.budget = std::min(budget, NATIVE_SLICE);
+            m_native_context.tier_countdown = countdown;
+            m_native_context.loop_counts = m_loop_counts.data();
+            m_native_context.pc = start;
+            UpdateNativeContext();
+
+            m_native_region = entry.region;
+            const int64_t allowed = m_native_context.budget;
+            const JITCompilationResult& code = region.code;
+            if (m_jit->Execute(code, &m_native_context, static_cast<uint8_t*>(code.executable_memory) + entry.offset) < 0) {
+                return false;
+            }
+            executed = static_cast<uint32_t>(allowed - m_native_context.budget);
+            region.hotness += static_cast<uint64_t>(countdown - m_native_context.tier_countdown);
+            m_tier_statistics.instructions[static_cast<size_t>(region.tier)] += executed;
+            m_pc = m_native_context.pc;
+            return executed > 0 || m_pc != start || m_state != VMState::RUNNING;
+        }
+
+        void VirtualMachine::UpdateNativeContext() {
+            if (m_call_stack.empty()) {
+                m_native_context.locals = nullptr;
+                m_native_context.local_count = 0;
+            } else {
+                m_native_context.locals = m_locals.data() + m_call_stack.back().local_base;
+                m_native_context.local_count = m_call_stack.back().local_count;
+            }
+            m_native_context.globals = m_globals.data();
+            m_native_context.global_count = static_cast<uint32_t>(m_globals.size());
+        }
+
+        // The interpreter's side of a native step, with RunSecure's error
+        // handling. Nothing may unwind into native code.
+        int VirtualMachine::NativeStep(JITContext* context, uint32_t pc) {
+            VirtualMachine& vm = *static_cast<VirtualMachine*>(context->vm);
+            const uint32_t next = pc + 1 + GetOpcodeInfo(static_cast<VMOpcode>(vm.m_code_base[pc])).operand_size;
+            vm.m_pc = pc;
+            try {
+                if (!vm.ExecuteInstruction() && !vm.HandleException()) {
+                    if (vm.m_state == VMState::RUNNING) {
+                        vm.SetState(VMState::ERROR_STATE);
+                    }
+                    context->budget++;      // Charged with its block, but the interpreter does not count it
+                }
+            } catch (const std::exception& e) {
+                vm.SetError(std::string(XorS("Runtime exception: ")) + e.what());
+                vm.SetState(VMState::ERROR_STATE);
+                context->budget++;
+            }
+
+            vm.UpdateNativeContext();
+            context->pc = vm.m_pc;
+            return vm.m_state == VMState::RUNNING && vm.m_pc == next ? 0 : 1;
+        }
+
+        // A native call steps like anything else, with its call site's cache
+        // for InvokeNative to take. It is cleared here too in case the step
+        // fails before InvokeNative.
+        int VirtualMachine::NativeCall(JITContext* context, uint32_t pc, JITInlineCache* cache) {
+            VirtualMachine& vm = *static_cast<VirtualMachine*>(context->vm);
+            vm.m_call_cache = cache;
+            const int stopped = NativeStep(context, pc);
+            vm.m_call_cache = nullptr;
+            return stopped;
+        }
+
+        // A guard failed in native code: rebuilds the value stack and the slots
+        // the interpreter would have at the deopt point's pc and returns to
+        // the VM there. Native code never has frames of its own, so the
+        // innermost CallFrame is already the right one. Entry checks change
+        // nothing and the template code goes on.
+        void VirtualMachine::NativeDeopt(JITContext* context, uint32_t point) {
+            VirtualMachine& vm = *static_cast<VirtualMachine*>(context->vm);
+            NativeRegion& region = vm.m_native_regions[vm.m_native_region];
+            const JITDeoptPoint& deopt = region.code.deopt_points[point];
+
+            for (const JITDeoptValue& value : deopt.stack) {
+                vm.m_value_stack.push_back(JITCompiler::RecoverDeoptValue(*context, value));
+            }
+            for (const JITDeoptSlot& slot : deopt.slots) {
+                VMValue* slots = slot.global ? context->globals : context->locals;
+                slots[slot.index] = JITCompiler::RecoverDeoptValue(*context, slot.value);
+            }
+            context->budget += deopt.refund;
+            context->pc = deopt.pc;
+
+            vm.m_tier_statistics.deoptimizations++;
+            if (++vm.m_deopt_counts[deopt.loop] == DEOPT_LIMIT) {
+                vm.m_jit->DisableSpeculation(deopt.loop);
+                region.invalidated = true;
+            }
+        }
+
+        bool VirtualMachine::VerifyBytecodeIntegrity(const std::vector<uint8_t>& bytecode) {
+            // Structural checks (version, section bounds, checksums) are done by
+            // CompiledModule when the image is opened and its sections accessed
+            return CompiledModule::IsModuleImage(bytecode.data(), bytecode.size());
+        }
+
         // Private helper methods implementation
 
         bool VirtualMachine::ExecuteInstruction() {
@@ -419,6 +1210,11 @@ namespace AetherVisor {
                 return true;
             }
 
+            const uint32_t address = m_pc;
+            if (m_profiling_mode != ProfilingMode::DISABLED) {
+                RecordExecution(address);
+            }
+
             VMOpcode opcode;
             uint32_t operand1, operand2, operand3;
             
@@ -441,6 +1237,7 @@ namespace AetherVisor {
                 case VMOpcode::PUSH_DOUBLE: return ExecutePushDouble();
                 case VMOpcode::PUSH_STR: return ExecutePushString();
                 case VMOpcode::PUSH_CONST: return ExecutePushConst();
+                case VMOpcode::PUSH_CONST_W: return ExecutePushConstWide();
                 case VMOpcode::POP: return ExecutePop();
                 case VMOpcode::DUP: return ExecuteDup();
                 case VMOpcode::SWAP: return ExecuteSwap();
@@ -476,10 +1273,32 @@ namespace AetherVisor {
                 case VMOpcode::CMP_GE: return ExecuteCompareGreaterEqual();
                 case VMOpcode::CMP_LT: return ExecuteCompareLess();
                 case VMOpcode::CMP_LE: return ExecuteCompareLessEqual();
+
+                case VMOpcode::ADD_I32: return ExecuteInt32Arithmetic(VMOpcode::ADD);
+                case VMOpcode::SUB_I32: return ExecuteInt32Arithmetic(VMOpcode::SUB);
+                case VMOpcode::MUL_I32: return ExecuteInt32Arithmetic(VMOpcode::MUL);
+                case VMOpcode::DIV_I32: return ExecuteInt32Arithmetic(VMOpcode::DIV);
+                case VMOpcode::MOD_I32: return ExecuteInt32Arithmetic(VMOpcode::MOD);
+                case VMOpcode::ADD_F64: return ExecuteFloat64Arithmetic(VMOpcode::ADD);
+                case VMOpcode::SUB_F64: return ExecuteFloat64Arithmetic(VMOpcode::SUB);
+                case VMOpcode::MUL_F64: return ExecuteFloat64Arithmetic(VMOpcode::MUL);
+                case VMOpcode::DIV_F64: return ExecuteFloat64Arithmetic(VMOpcode::DIV);
+                case VMOpcode::CMP_EQ_I32: return ExecuteInt32Comparison(VMOpcode::CMP_EQ);
+                case VMOpcode::CMP_NE_I32: return ExecuteInt32Comparison(VMOpcode::CMP_NE);
+                case VMOpcode::CMP_GT_I32: return ExecuteInt32Comparison(VMOpcode::CMP_GT);
+                case VMOpcode::CMP_GE_I32: return ExecuteInt32Comparison(VMOpcode::CMP_GE);
+                case VMOpcode::CMP_LT_I32: return ExecuteInt32Comparison(VMOpcode::CMP_LT);
+                case VMOpcode::CMP_LE_I32: return ExecuteInt32Comparison(VMOpcode::CMP_LE);
+                case VMOpcode::CMP_EQ_F64: return ExecuteFloat64Comparison(VMOpcode::CMP_EQ);
+                case VMOpcode::CMP_NE_F64: return ExecuteFloat64Comparison(VMOpcode::CMP_NE);
+                case VMOpcode::CMP_GT_F64: return ExecuteFloat64Comparison(VMOpcode::CMP_GT);
+                case VMOpcode::CMP_GE_F64: return ExecuteFloat64Comparison(VMOpcode::CMP_GE);
+                case VMOpcode::CMP_LT_F64: return ExecuteFloat64Comparison(VMOpcode::CMP_LT);
+                case VMOpcode::CMP_LE_F64: return ExecuteFloat64Comparison(VMOpcode::CMP_LE);
                 
                 case VMOpcode::JMP: return ExecuteJump();
-                case VMOpcode::JMP_IF_ZERO: return ExecuteJumpIfZero();
-                case VMOpcode::JMP_IF_NOT_ZERO: return ExecuteJumpIfNotZero();
+                case VMOpcode::JMP_IF_ZERO: return RecordBranch(address, ExecuteJumpIfZero());
+                case VMOpcode::JMP_IF_NOT_ZERO: return RecordBranch(address, ExecuteJumpIfNotZero());
                 case VMOpcode::CALL: return ExecuteCall();
                 case VMOpcode::RET: return ExecuteReturn();
                 case VMOpcode::RET_VAL: return ExecuteReturnValue();
@@ -510,6 +1329,7 @@ namespace AetherVisor {
                 case VMOpcode::FINALLY: return ExecuteFinally();
                 
                 case VMOpcode::CALL_NATIVE: return ExecuteCallNative();
+                case VMOpcode::CALL_NATIVE_W: return ExecuteCallNativeWide();
                 case VMOpcode::LOAD_NATIVE: return ExecuteLoadNative();
                 case VMOpcode::GET_NATIVE_FUNC: return ExecuteGetNativeFunc();
                 
@@ -543,38 +1363,14 @@ namespace AetherVisor {
                 return false;
             }
 
-            opcode = static_cast<VMOpcode>(m_code_base[m_pc++]);
-            operand1 = operand2 = operand3 = 0;
-
-            // Decode operands based on instruction format
-            // This is a simplified decoder - real implementation would be more complex
-            switch (opcode) {
-                case VMOpcode::PUSH_INT:
-                case VMOpcode::PUSH_FLOAT:
-                case VMOpcode::PUSH_DOUBLE:
-                case VMOpcode::JMP:
-                case VMOpcode::JMP_IF_ZERO:
-                case VMOpcode::JMP_IF_NOT_ZERO:
-                    if (m_pc + 4 > m_code_size) return false;
-                    operand1 = *reinterpret_cast<const uint32_t*>(&m_code_base[m_pc]);
-                    m_pc += 4;
-                    break;
-                
-                case VMOpcode::LOAD_LOCAL:
-                case VMOpcode::STORE_LOCAL:
-                case VMOpcode::LOAD_GLOBAL:
-                case VMOpcode::STORE_GLOBAL:
-                case VMOpcode::PUSH_CONST:
-                    if (m_pc + 2 > m_code_size) return false;
-                    operand1 = *reinterpret_cast<const uint16_t*>(&m_code_base[m_pc]);
-                    m_pc += 2;
-                    break;
-                
-                default:
-                    // No operands for most instructions
-                    break;
+            // Operands are bounds-checked here against the shared opcode table,
+            // so the Execute* handlers read them behind m_pc without checking
+            opcode = static_cast<VMOpcode>(m_code_base[m_pc]);
+            operand3 = 0;
+            if (!DecodeOperands(&m_code_base[m_pc], m_code_size - m_pc, operand1, operand2)) {
+                return false;
             }
-
+            m_pc += 1 + GetOpcodeInfo(opcode).operand_size;
             return true;
         }
 
@@ -657,11 +1453,6 @@ namespace AetherVisor {
         // Instruction implementations (simplified - full implementation would be much larger)
 
         bool VirtualMachine::ExecutePushInt() {
-            if (m_pc + 4 > m_code_size) {
-                SetError(XorS("Insufficient bytes for PUSH_INT operand"));
-                return false;
-            }
-            
             int32_t value = *reinterpret_cast<const int32_t*>(&m_code_base[m_pc - 4]);
             VMValue vm_value;
             vm_value.type = VMDataType::INT32;
@@ -671,11 +1462,6 @@ namespace AetherVisor {
         }
 
         bool VirtualMachine::ExecutePushFloat() {
-            if (m_pc + 4 > m_code_size) {
-                SetError(XorS("Insufficient bytes for PUSH_FLOAT operand"));
-                return false;
-            }
-            
             float value = *reinterpret_cast<const float*>(&m_code_base[m_pc - 4]);
             VMValue vm_value;
             vm_value.type = VMDataType::FLOAT32;
@@ -685,32 +1471,304 @@ namespace AetherVisor {
         }
 
         bool VirtualMachine::ExecuteAdd() {
+            return ExecuteArithmetic(VMOpcode::ADD);
+        }
+
+        // Generic arithmetic: INT32 pairs keep checked 32-bit semantics, other integer
+        // pairs use wrapping INT64, any float operand promotes to FLOAT64, and ADD
+        // with a string operand concatenates
+        bool VirtualMachine::ExecuteArithmetic(VMOpcode opcode) {
             if (!CheckStackUnderflow(2)) {
-                ThrowException(VMDataType::INT32, XorS("Stack underflow in ADD"));
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in arithmetic"));
                 return false;
             }
-            
-            VMValue b = PopValue();
-            VMValue a = PopValue();
-            
-            if (a.type != VMDataType::INT32 || b.type != VMDataType::INT32) {
-                ThrowException(VMDataType::INT32, XorS("Type mismatch in ADD"));
+
+            const VMValue& a = m_value_stack[m_value_stack.size() - 2];
+            const VMValue& b = m_value_stack.back();
+
+            if (a.type == VMDataType::INT32 && b.type == VMDataType::INT32) {
+                return ExecuteInt32Arithmetic(opcode);
+            }
+
+            if (opcode == VMOpcode::ADD && (a.type == VMDataType::STRING || b.type == VMDataType::STRING)) {
+                std::string result = FormatValue(a) + FormatValue(b);
+                m_value_stack.resize(m_value_stack.size() - 2);
+                PushString(result);
+                return !HasPendingException();
+            }
+
+            auto is_integer = [](VMDataType type) { return type == VMDataType::INT32 || type == VMDataType::INT64; };
+            auto is_float = [](VMDataType type) { return type == VMDataType::FLOAT32 || type == VMDataType::FLOAT64; };
+
+            VMValue result;
+            if (is_integer(a.type) && is_integer(b.type)) {
+                const int64_t x = a.type == VMDataType::INT32 ? a.data.i32 : a.data.i64;
+                const int64_t y = b.type == VMDataType::INT32 ? b.data.i32 : b.data.i64;
+                const uint64_t ux = static_cast<uint64_t>(x);
+                const uint64_t uy = static_cast<uint64_t>(y);
+                int64_t value = 0;
+                switch (opcode) {
+                    case VMOpcode::ADD: value = static_cast<int64_t>(ux + uy); break;
+                    case VMOpcode::SUB: value = static_cast<int64_t>(ux - uy); break;
+                    case VMOpcode::MUL: value = static_cast<int64_t>(ux * uy); break;
+                    case VMOpcode::DIV:
+                    case VMOpcode::MOD:
+                        if (y == 0) {
+                            ThrowException(VMDataType::INT64, XorS("Division by zero"));
+                            return false;
+                        }
+                        if (y == -1) {
+                            value = opcode == VMOpcode::DIV ? static_cast<int64_t>(0 - ux) : 0;
+                        } else {
+                            value = opcode == VMOpcode::DIV ? x / y : x % y;
+                        }
+                        break;
+                    case VMOpcode::BIT_AND: value = x & y; break;
+                    case VMOpcode::BIT_OR: value = x | y; break;
+                    case VMOpcode::BIT_XOR: value = x ^ y; break;
+                    case VMOpcode::SHL: value = static_cast<int64_t>(ux << (y & 63)); break;
+                    case VMOpcode::SHR: value = x >> (y & 63); break;
+                    default: break;
+                }
+                result = VMValue(value);
+            } else if ((is_integer(a.type) || is_float(a.type)) && (is_integer(b.type) || is_float(b.type))) {
+                auto to_double = [](const VMValue& v) {
+                    switch (v.type) {
+                        case VMDataType::INT32: return static_cast<double>(v.data.i32);
+                        case VMDataType::INT64: return static_cast<double>(v.data.i64);
+                        case VMDataType::FLOAT32: return static_cast<double>(v.data.f32);
+                        default: return v.data.f64;
+                    }
+                };
+                const double x = to_double(a);
+                const double y = to_double(b);
+                switch (opcode) {
+                    case VMOpcode::ADD: result = VMValue(x + y); break;
+                    case VMOpcode::SUB: result = VMValue(x - y); break;
+                    case VMOpcode::MUL: result = VMValue(x * y); break;
+                    case VMOpcode::DIV: result = VMValue(x / y); break;
+                    case VMOpcode::MOD: result = VMValue(std::fmod(x, y)); break;
+                    default:
+                        ThrowException(VMDataType::FLOAT64, XorS("Bitwise operation on floating-point value"));
+                        return false;
+                }
+            } else {
+                ThrowException(a.type, XorS("Type mismatch in arithmetic"));
                 return false;
             }
-            
-            int32_t result;
-            if (!SafeAdd(a.data.i32, b.data.i32, result)) {
-                ThrowException(VMDataType::INT32, XorS("Integer overflow in ADD"));
+
+            m_value_stack.pop_back();
+            m_value_stack.back() = result;
+            return true;
+        }
+
+        bool VirtualMachine::ExecuteInt32Arithmetic(VMOpcode opcode) {
+            if (!CheckStackUnderflow(2)) {
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in arithmetic"));
                 return false;
             }
-            
-            VMValue vm_result;
-            vm_result.type = VMDataType::INT32;
-            vm_result.data.i32 = result;
-            PushValue(vm_result);
+
+            const int32_t b = m_value_stack.back().data.i32;
+            m_value_stack.pop_back();
+            VMValue& a = m_value_stack.back();
+
+            int32_t result = 0;
+            bool ok = true;
+            switch (opcode) {
+                case VMOpcode::ADD: ok = SafeAdd(a.data.i32, b, result); break;
+                case VMOpcode::SUB: ok = SafeSubtract(a.data.i32, b, result); break;
+                case VMOpcode::MUL: ok = SafeMultiply(a.data.i32, b, result); break;
+                case VMOpcode::DIV:
+                case VMOpcode::MOD:
+                    if (b == 0) {
+                        ThrowException(VMDataType::INT32, XorS("Division by zero"));
+                        return false;
+                    }
+                    if (opcode == VMOpcode::DIV) {
+                        ok = SafeDivide(a.data.i32, b, result);
+                    } else {
+                        result = b == -1 ? 0 : a.data.i32 % b;
+                    }
+                    break;
+                case VMOpcode::BIT_AND: result = a.data.i32 & b; break;
+                case VMOpcode::BIT_OR: result = a.data.i32 | b; break;
+                case VMOpcode::BIT_XOR: result = a.data.i32 ^ b; break;
+                case VMOpcode::SHL: result = static_cast<int32_t>(static_cast<uint32_t>(a.data.i32) << (b & 31)); break;
+                case VMOpcode::SHR: result = a.data.i32 >> (b & 31); break;
+                default: break;
+            }
+
+            if (!ok) {
+                ThrowException(VMDataType::INT32, XorS("Integer overflow"));
+                return false;
+            }
+
+            a.type = VMDataType::INT32;
+            a.data.i32 = result;
+            return true;
+        }
+
+        bool VirtualMachine::ExecuteFloat64Arithmetic(VMOpcode opcode) {
+            if (!CheckStackUnderflow(2)) {
+                ThrowException(VMDataType::FLOAT64, XorS("Stack underflow in arithmetic"));
+                return false;
+            }
+
+            const double b = m_value_stack.back().data.f64;
+            m_value_stack.pop_back();
+            VMValue& a = m_value_stack.back();
+
+            switch (opcode) {
+                case VMOpcode::ADD: a.data.f64 += b; break;
+                case VMOpcode::SUB: a.data.f64 -= b; break;
+                case VMOpcode::MUL: a.data.f64 *= b; break;
+                case VMOpcode::DIV: a.data.f64 /= b; break;
+                default: break;
+            }
+            a.type = VMDataType::FLOAT64;
+            return true;
+        }
+
+        namespace {
+            template <typename T>
+            bool CompareValues(VMOpcode opcode, const T& a, const T& b) {
+                switch (opcode) {
+                    case VMOpcode::CMP_EQ: return a == b;
+                    case VMOpcode::CMP_NE: return a != b;
+                    case VMOpcode::CMP_GT: return a > b;
+                    case VMOpcode::CMP_GE: return a >= b;
+                    case VMOpcode::CMP_LT: return a < b;
+                    default: return a <= b;
+                }
+            }
+        }
+
+        // Generic comparison: numbers compare by value across types, strings by
+        // content; values of unrelated types are only ever unequal
+        bool VirtualMachine::ExecuteComparison(VMOpcode opcode) {
+            if (!CheckStackUnderflow(2)) {
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in comparison"));
+                return false;
+            }
+
+            const VMValue& a = m_value_stack[m_value_stack.size() - 2];
+            const VMValue& b = m_value_stack.back();
+
+            if (a.type == VMDataType::INT32 && b.type == VMDataType::INT32) {
+                return ExecuteInt32Comparison(opcode);
+            }
+
+            auto is_integer = [](VMDataType type) { return type == VMDataType::INT32 || type == VMDataType::INT64; };
+            auto is_number = [&is_integer](VMDataType type) {
+                return is_integer(type) || type == VMDataType::FLOAT32 || type == VMDataType::FLOAT64;
+            };
+
+            bool result;
+            if (is_integer(a.type) && is_integer(b.type)) {
+                const int64_t x = a.type == VMDataType::INT32 ? a.data.i32 : a.data.i64;
+                const int64_t y = b.type == VMDataType::INT32 ? b.data.i32 : b.data.i64;
+                result = CompareValues(opcode, x, y);
+            } else if (is_number(a.type) && is_number(b.type)) {
+                auto to_double = [](const VMValue& v) {
+                    switch (v.type) {
+                        case VMDataType::INT32: return static_cast<double>(v.data.i32);
+                        case VMDataType::INT64: return static_cast<double>(v.data.i64);
+                        case VMDataType::FLOAT32: return static_cast<double>(v.data.f32);
+                        default: return v.data.f64;
+                    }
+                };
+                result = CompareValues(opcode, to_double(a), to_double(b));
+            } else if (a.type == VMDataType::STRING && b.type == VMDataType::STRING) {
+                result = CompareValues(opcode,
+                    std::string_view(a.data.string.data, a.data.string.length),
+                    std::string_view(b.data.string.data, b.data.string.length));
+            } else if (opcode == VMOpcode::CMP_EQ || opcode == VMOpcode::CMP_NE) {
+                bool equal = a.type == b.type &&
+                    (a.type == VMDataType::UNDEFINED ||
+                     (a.type == VMDataType::BOOLEAN && a.data.boolean == b.data.boolean));
+                result = (opcode == VMOpcode::CMP_EQ) == equal;
+            } else {
+                ThrowException(a.type, XorS("Type mismatch in comparison"));
+                return false;
+            }
+
+            m_value_stack.pop_back();
+            m_value_stack.back() = VMValue(static_cast<int32_t>(result ? 1 : 0));
+            return true;
+        }
+
+        bool VirtualMachine::ExecuteInt32Comparison(VMOpcode opcode) {
+            if (!CheckStackUnderflow(2)) {
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in comparison"));
+                return false;
+            }
+
+            const int32_t b = m_value_stack.back().data.i32;
+            m_value_stack.pop_back();
+            VMValue& a = m_value_stack.back();
+            a.data.i32 = CompareValues(opcode, a.data.i32, b) ? 1 : 0;
+            a.type = VMDataType::INT32;
+            return true;
+        }
+
+        bool VirtualMachine::ExecuteFloat64Comparison(VMOpcode opcode) {
+            if (!CheckStackUnderflow(2)) {
+                ThrowException(VMDataType::FLOAT64, XorS("Stack underflow in comparison"));
+                return false;
+            }
+
+            const double b = m_value_stack.back().data.f64;
+            m_value_stack.pop_back();
+            VMValue& a = m_value_stack.back();
+            a.data.i32 = CompareValues(opcode, a.data.f64, b) ? 1 : 0;
+            a.type = VMDataType::INT32;
             return true;
         }
 
+        bool VirtualMachine::IsTruthy(const VMValue& value) {
+            switch (value.type) {
+                case VMDataType::INT32: return value.data.i32 != 0;
+                case VMDataType::INT64: return value.data.i64 != 0;
+                case VMDataType::FLOAT32: return value.data.f32 != 0.0f;
+                case VMDataType::FLOAT64: return value.data.f64 != 0.0;
+                case VMDataType::BOOLEAN: return value.data.boolean;
+                case VMDataType::STRING: return value.data.string.length != 0;
+                case VMDataType::UNDEFINED: return false;
+                default: return true;
+            }
+        }
+
+        std::string VirtualMachine::FormatValue(const VMValue& value) {
+            char buffer[32];
+            switch (value.type) {
+                case VMDataType::INT32: return std::to_string(value.data.i32);
+                case VMDataType::INT64: return std::to_string(value.data.i64);
+                case VMDataType::FLOAT32:
+                case VMDataType::FLOAT64: {
+                    double number = value.type == VMDataType::FLOAT32 ? value.data.f32 : value.data.f64;
+                    auto end = std::to_chars(buffer, buffer + sizeof(buffer), number).ptr;
+                    return std::string(buffer, end);
+                }
+                case VMDataType::BOOLEAN: return value.data.boolean ? "true" : "false";
+                case VMDataType::STRING: return std::string(value.data.string.data, value.data.string.length);
+                case VMDataType::UNDEFINED: return "null";
+                default: return "[object]";
+            }
+        }
+
+        void VirtualMachine::PushString(const std::string& value) {
+            auto storage = std::make_unique<char[]>(value.size() + 1);
+            std::memcpy(storage.get(), value.c_str(), value.size() + 1);
+
+            VMValue vm_value;
+            vm_value.type = VMDataType::STRING;
+            vm_value.data.string.data = storage.get();
+            vm_value.data.string.length = value.size();
+            m_runtime_strings.push_back(std::move(storage));
+            m_memory_usage += value.size() + 1;
+            PushValue(vm_value);
+        }
+
         bool VirtualMachine::SafeAdd(int32_t a, int32_t b, int32_t& result) {
             if (a > 0 && b > std::numeric_limits<int32_t>::max() - a) {
                 return false; // Positive overflow
@@ -769,10 +1827,6 @@ namespace AetherVisor {
 
         // Placeholder implementations for other instructions
         bool VirtualMachine::ExecutePushDouble() {
-            if (m_pc + 8 > m_code_size) {
-                SetError(XorS("Insufficient bytes for PUSH_DOUBLE operand"));
-                return false;
-            }
             double value = *reinterpret_cast<const double*>(&m_code_base[m_pc - 8]);
             VMValue vm_value;
             vm_value.type = VMDataType::FLOAT64;
@@ -781,11 +1835,7 @@ namespace AetherVisor {
             return !HasPendingException();
         }
         bool VirtualMachine::ExecutePushString() {
-            // Simplified: assume null-terminated string pointer encoded in next 8 bytes
-            if (m_pc + 8 > m_code_size) {
-                SetError(XorS("Insufficient bytes for PUSH_STR operand"));
-                return false;
-            }
+            // Simplified: the operand is a pointer to a null-terminated string
             const char* strPtr = *reinterpret_cast<const char* const*>(&m_code_base[m_pc - 8]);
             if (!strPtr) {
                 VMValue undef; PushValue(undef); return true;
@@ -799,9 +1849,27 @@ namespace AetherVisor {
             return !HasPendingException();
         }
         bool VirtualMachine::ExecutePushConst() {
-            // Simplified: top of constants is pushed
-            if (m_constants.empty()) { VMValue undef; PushValue(undef); return true; }
-            PushValue(m_constants.back().value);
+            return PushConstant(*reinterpret_cast<const uint16_t*>(&m_code_base[m_pc - 2]));
+        }
+        bool VirtualMachine::ExecutePushConstWide() {
+            return PushConstant(*reinterpret_cast<const uint32_t*>(&m_code_base[m_pc - 4]));
+        }
+        bool VirtualMachine::PushConstant(uint32_t index) {
+            if (index < m_int_constant_count) {
+                PushValue(VMValue(m_int_constants[index]));
+                return !HasPendingException();
+            }
+            index -= m_int_constant_count;
+            if (index < m_double_constant_count) {
+                PushValue(VMValue(m_double_constants[index]));
+                return !HasPendingException();
+            }
+            index -= m_double_constant_count;
+            if (index >= m_boxed_constants.size()) {
+                ThrowException(VMDataType::INT32, XorS("Constant index out of range"));
+                return false;
+            }
+            PushValue(m_boxed_constants[index]);
             return !HasPendingException();
         }
         bool VirtualMachine::ExecutePop() { 
@@ -812,40 +1880,225 @@ namespace AetherVisor {
             PopValue();
             return true;
         }
-        bool VirtualMachine::ExecuteDup() { return true; }
-        bool VirtualMachine::ExecuteSwap() { return true; }
-        bool VirtualMachine::ExecuteLoadLocal() { return true; }
-        bool VirtualMachine::ExecuteStoreLocal() { return true; }
-        bool VirtualMachine::ExecuteLoadGlobal() { return true; }
-        bool VirtualMachine::ExecuteStoreGlobal() { return true; }
-        bool VirtualMachine::ExecuteSubtract() { return true; }
-        bool VirtualMachine::ExecuteMultiply() { return true; }
-        bool VirtualMachine::ExecuteDivide() { return true; }
-        bool VirtualMachine::ExecuteModulo() { return true; }
-        bool VirtualMachine::ExecuteNegate() { return true; }
+        bool VirtualMachine::ExecuteDup() {
+            if (!CheckStackUnderflow(1)) {
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in DUP"));
+                return false;
+            }
+            PushValue(VMValue(m_value_stack.back()));
+            return !HasPendingException();
+        }
+        bool VirtualMachine::ExecuteSwap() {
+            if (!CheckStackUnderflow(2)) {
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in SWAP"));
+                return false;
+            }
+            std::swap(m_value_stack[m_value_stack.size() - 2], m_value_stack.back());
+            return true;
+        }
+
+        // Local slots belong to the innermost call frame; top-level code keeps
+        // its variables in globals and has no frame
+        bool VirtualMachine::ExecuteLoadLocal() {
+            const uint16_t slot = *reinterpret_cast<const uint16_t*>(&m_code_base[m_pc - 2]);
+            if (m_call_stack.empty() || slot >= m_call_stack.back().local_count) {
+                ThrowException(VMDataType::INT32, XorS("Local slot out of range"));
+                return false;
+            }
+            PushValue(VMValue(m_locals[m_call_stack.back().local_base + slot]));
+            return !HasPendingException();
+        }
+        bool VirtualMachine::ExecuteStoreLocal() {
+            const uint16_t slot = *reinterpret_cast<const uint16_t*>(&m_code_base[m_pc - 2]);
+            if (m_call_stack.empty() || slot >= m_call_stack.back().local_count) {
+                ThrowException(VMDataType::INT32, XorS("Local slot out of range"));
+                return false;
+            }
+            if (!CheckStackUnderflow(1)) {
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in STORE_LOCAL"));
+                return false;
+            }
+            m_locals[m_call_stack.back().local_base + slot] = m_value_stack.back();
+            m_value_stack.pop_back();
+            return true;
+        }
+
+        // Globals are created by their first store; reading one that was never
+        // stored yields null
+        bool VirtualMachine::ExecuteLoadGlobal() {
+            const uint16_t slot = *reinterpret_cast<const uint16_t*>(&m_code_base[m_pc - 2]);
+            PushValue(slot < m_globals.size() ? m_globals[slot] : VMValue{});
+            return !HasPendingException();
+        }
+        bool VirtualMachine::ExecuteStoreGlobal() {
+            const uint16_t slot = *reinterpret_cast<const uint16_t*>(&m_code_base[m_pc - 2]);
+            if (!CheckStackUnderflow(1)) {
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in STORE_GLOBAL"));
+                return false;
+            }
+            if (slot >= m_globals.size()) {
+                m_globals.resize(slot + 1);
+            }
+            m_globals[slot] = m_value_stack.back();
+            m_value_stack.pop_back();
+            return true;
+        }
+        bool VirtualMachine::ExecuteSubtract() { return ExecuteArithmetic(VMOpcode::SUB); }
+        bool VirtualMachine::ExecuteMultiply() { return ExecuteArithmetic(VMOpcode::MUL); }
+        bool VirtualMachine::ExecuteDivide() { return ExecuteArithmetic(VMOpcode::DIV); }
+        bool VirtualMachine::ExecuteModulo() { return ExecuteArithmetic(VMOpcode::MOD); }
+        bool VirtualMachine::ExecuteNegate() {
+            if (!CheckStackUnderflow(1)) {
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in NEG"));
+                return false;
+            }
+            VMValue& value = m_value_stack.back();
+            switch (value.type) {
+                case VMDataType::INT32:
+                    if (value.data.i32 == std::numeric_limits<int32_t>::min()) {
+                        ThrowException(VMDataType::INT32, XorS("Integer overflow"));
+                        return false;
+                    }
+                    value.data.i32 = -value.data.i32;
+                    return true;
+                case VMDataType::INT64: value.data.i64 = static_cast<int64_t>(0 - static_cast<uint64_t>(value.data.i64)); return true;
+                case VMDataType::FLOAT32: value.data.f32 = -value.data.f32; return true;
+                case VMDataType::FLOAT64: value.data.f64 = -value.data.f64; return true;
+                default:
+                    ThrowException(value.type, XorS("Type mismatch in NEG"));
+                    return false;
+            }
+        }
         bool VirtualMachine::ExecuteIncrement() { return true; }
         bool VirtualMachine::ExecuteDecrement() { return true; }
-        bool VirtualMachine::ExecuteBitwiseAnd() { return true; }
-        bool VirtualMachine::ExecuteBitwiseOr() { return true; }
-        bool VirtualMachine::ExecuteBitwiseXor() { return true; }
-        bool VirtualMachine::ExecuteBitwiseNot() { return true; }
-        bool VirtualMachine::ExecuteShiftLeft() { return true; }
-        bool VirtualMachine::ExecuteShiftRight() { return true; }
+        bool VirtualMachine::ExecuteBitwiseAnd() { return ExecuteArithmetic(VMOpcode::BIT_AND); }
+        bool VirtualMachine::ExecuteBitwiseOr() { return ExecuteArithmetic(VMOpcode::BIT_OR); }
+        bool VirtualMachine::ExecuteBitwiseXor() { return ExecuteArithmetic(VMOpcode::BIT_XOR); }
+        bool VirtualMachine::ExecuteBitwiseNot() {
+            if (!CheckStackUnderflow(1)) {
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in BIT_NOT"));
+                return false;
+            }
+            VMValue& value = m_value_stack.back();
+            switch (value.type) {
+                case VMDataType::INT32: value.data.i32 = ~value.data.i32; return true;
+                case VMDataType::INT64: value.data.i64 = ~value.data.i64; return true;
+                default:
+                    ThrowException(value.type, XorS("Type mismatch in BIT_NOT"));
+                    return false;
+            }
+        }
+        bool VirtualMachine::ExecuteShiftLeft() { return ExecuteArithmetic(VMOpcode::SHL); }
+        bool VirtualMachine::ExecuteShiftRight() { return ExecuteArithmetic(VMOpcode::SHR); }
         bool VirtualMachine::ExecuteLogicalAnd() { return true; }
         bool VirtualMachine::ExecuteLogicalOr() { return true; }
-        bool VirtualMachine::ExecuteLogicalNot() { return true; }
-        bool VirtualMachine::ExecuteCompareEqual() { return true; }
-        bool VirtualMachine::ExecuteCompareNotEqual() { return true; }
-        bool VirtualMachine::ExecuteCompareGreater() { return true; }
-        bool VirtualMachine::ExecuteCompareGreaterEqual() { return true; }
-        bool VirtualMachine::ExecuteCompareLess() { return true; }
-        bool VirtualMachine::ExecuteCompareLessEqual() { return true; }
-        bool VirtualMachine::ExecuteJump() { return true; }
-        bool VirtualMachine::ExecuteJumpIfZero() { return true; }
-        bool VirtualMachine::ExecuteJumpIfNotZero() { return true; }
-        bool VirtualMachine::ExecuteCall() { return true; }
-        bool VirtualMachine::ExecuteReturn() { return true; }
-        bool VirtualMachine::ExecuteReturnValue() { return true; }
+        bool VirtualMachine::ExecuteLogicalNot() {
+            if (!CheckStackUnderflow(1)) {
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in NOT"));
+                return false;
+            }
+            m_value_stack.back() = VMValue(static_cast<int32_t>(IsTruthy(m_value_stack.back()) ? 0 : 1));
+            return true;
+        }
+        bool VirtualMachine::ExecuteCompareEqual() { return ExecuteComparison(VMOpcode::CMP_EQ); }
+        bool VirtualMachine::ExecuteCompareNotEqual() { return ExecuteComparison(VMOpcode::CMP_NE); }
+        bool VirtualMachine::ExecuteCompareGreater() { return ExecuteComparison(VMOpcode::CMP_GT); }
+        bool VirtualMachine::ExecuteCompareGreaterEqual() { return ExecuteComparison(VMOpcode::CMP_GE); }
+        bool VirtualMachine::ExecuteCompareLess() { return ExecuteComparison(VMOpcode::CMP_LT); }
+        bool VirtualMachine::ExecuteCompareLessEqual() { return ExecuteComparison(VMOpcode::CMP_LE); }
+        bool VirtualMachine::ExecuteJump() {
+            m_pc = *reinterpret_cast<const uint32_t*>(&m_code_base[m_pc - 4]);
+            return true;
+        }
+        bool VirtualMachine::ExecuteJumpIfZero() {
+            if (!CheckStackUnderflow(1)) {
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in JMP_IF_ZERO"));
+                return false;
+            }
+            const bool truthy = IsTruthy(m_value_stack.back());
+            m_value_stack.pop_back();
+            if (!truthy) {
+                m_pc = *reinterpret_cast<const uint32_t*>(&m_code_base[m_pc - 4]);
+            }
+            return true;
+        }
+        bool VirtualMachine::ExecuteJumpIfNotZero() {
+            if (!CheckStackUnderflow(1)) {
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in JMP_IF_NOT_ZERO"));
+                return false;
+            }
+            const bool truthy = IsTruthy(m_value_stack.back());
+            m_value_stack.pop_back();
+            if (truthy) {
+                m_pc = *reinterpret_cast<const uint32_t*>(&m_code_base[m_pc - 4]);
+            }
+            return true;
+        }
+
+        // Arguments move from the value stack into the first local slots of
+        // the new frame; the rest of the frame starts out null
+        bool VirtualMachine::ExecuteCall() {
+            const uint16_t index = *reinterpret_cast<const uint16_t*>(&m_code_base[m_pc - 2]);
+            if (index >= m_functions.size() || m_functions[index].is_native) {
+                ThrowException(VMDataType::FUNCTION, XorS("Invalid function index"));
+                return false;
+            }
+            VMFunction& function = m_functions[index];
+            if (!CheckStackUnderflow(function.param_count)) {
+                ThrowException(VMDataType::FUNCTION, XorS("Stack underflow in CALL"));
+                return false;
+            }
+            if (m_call_stack.size() >= m_security_context.max_stack_depth) {
+                ThrowException(VMDataType::FUNCTION, XorS("Call stack overflow"));
+                return false;
+            }
+
+            CallFrame frame;
+            frame.return_address = m_pc;
+            frame.local_base = static_cast<uint32_t>(m_locals.size());
+            frame.local_count = std::max(function.local_count, function.param_count);
+            frame.stack_base = static_cast<uint32_t>(m_value_stack.size() - function.param_count);
+            frame.function = &function;
+
+            m_locals.resize(m_locals.size() + frame.local_count);
+            std::copy(m_value_stack.begin() + frame.stack_base, m_value_stack.end(), m_locals.begin() + frame.local_base);
+            m_value_stack.resize(frame.stack_base);
+            m_call_stack.push_back(frame);
+            m_pc = function.address;
+            return true;
+        }
+        bool VirtualMachine::ExecuteReturn() {
+            return ReturnFromCall(VMValue{});
+        }
+        bool VirtualMachine::ExecuteReturnValue() {
+            if (!CheckStackUnderflow(1)) {
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in RET_VAL"));
+                return false;
+            }
+            const VMValue result = m_value_stack.back();
+            m_value_stack.pop_back();
+            return ReturnFromCall(result);
+        }
+
+        // Returning from top-level code ends the program. Handlers the callee
+        // installed and did not remove go with its frame.
+        bool VirtualMachine::ReturnFromCall(const VMValue& result) {
+            if (m_call_stack.empty()) {
+                SetState(VMState::HALTED);
+                return true;
+            }
+
+            const CallFrame frame = m_call_stack.back();
+            m_call_stack.pop_back();
+            while (!m_exception_stack.empty() && m_exception_stack.back().call_depth > m_call_stack.size()) {
+                m_exception_stack.pop_back();
+            }
+            m_locals.resize(frame.local_base);
+            m_value_stack.resize(std::min<size_t>(m_value_stack.size(), frame.stack_base));
+            m_pc = frame.return_address;
+            PushValue(result);
+            return !HasPendingException();
+        }
         bool VirtualMachine::ExecuteAlloc() { return true; }
         bool VirtualMachine::ExecuteFree() { return true; }
         bool VirtualMachine::ExecuteLoadMemory() { return true; }
@@ -854,19 +2107,152 @@ namespace AetherVisor {
         bool VirtualMachine::ExecuteArrayGet() { return true; }
         bool VirtualMachine::ExecuteArraySet() { return true; }
         bool VirtualMachine::ExecuteArrayLength() { return true; }
-        bool VirtualMachine::ExecuteStringConcat() { return true; }
+        bool VirtualMachine::ExecuteStringConcat() {
+            if (!CheckStackUnderflow(2)) {
+                ThrowException(VMDataType::STRING, XorS("Stack underflow in STR_CONCAT"));
+                return false;
+            }
+            // Operands are proven strings when emitted by the compiler; anything else
+            // is formatted rather than trusted, since these are pointer-carrying values
+            std::string result = FormatValue(m_value_stack[m_value_stack.size() - 2]) + FormatValue(m_value_stack.back());
+            m_value_stack.resize(m_value_stack.size() - 2);
+            PushString(result);
+            return !HasPendingException();
+        }
         bool VirtualMachine::ExecuteStringLength() { return true; }
         bool VirtualMachine::ExecuteStringSubstring() { return true; }
         bool VirtualMachine::ExecuteStringCompare() { return true; }
         bool VirtualMachine::ExecuteCastInt() { return true; }
-        bool VirtualMachine::ExecuteCastFloat() { return true; }
+        bool VirtualMachine::ExecuteCastFloat() {
+            if (!CheckStackUnderflow(1)) {
+                ThrowException(VMDataType::FLOAT64, XorS("Stack underflow in CAST_FLOAT"));
+                return false;
+            }
+            VMValue& value = m_value_stack.back();
+            switch (value.type) {
+                case VMDataType::INT32: value = VMValue(static_cast<double>(value.data.i32)); return true;
+                case VMDataType::INT64: value = VMValue(static_cast<double>(value.data.i64)); return true;
+                case VMDataType::FLOAT32: value = VMValue(static_cast<double>(value.data.f32)); return true;
+                case VMDataType::FLOAT64: return true;
+                case VMDataType::BOOLEAN: value = VMValue(value.data.boolean ? 1.0 : 0.0); return true;
+                default:
+                    ThrowException(value.type, XorS("Type mismatch in CAST_FLOAT"));
+                    return false;
+            }
+        }
         bool VirtualMachine::ExecuteCastString() { return true; }
         bool VirtualMachine::ExecuteTypeOf() { return true; }
-        bool VirtualMachine::ExecuteTry() { return true; }
+        // TRY installs the handler for its protected region and FINALLY removes
+        // it on the normal exit; CATCH starts the handler, which receives the
+        // exception value on the stack
+        bool VirtualMachine::ExecuteTry() {
+            ExceptionFrame frame;
+            frame.handler_address = *reinterpret_cast<const uint32_t*>(&m_code_base[m_pc - 4]);
+            frame.stack_size = static_cast<uint32_t>(m_value_stack.size());
+            frame.call_depth = static_cast<uint32_t>(m_call_stack.size());
+            frame.exception_type = VMDataType::UNDEFINED;
+            m_exception_stack.push_back(frame);
+            return true;
+        }
         bool VirtualMachine::ExecuteCatch() { return true; }
-        bool VirtualMachine::ExecuteThrow() { return true; }
-        bool VirtualMachine::ExecuteFinally() { return true; }
-        bool VirtualMachine::ExecuteCallNative() { return true; }
+        bool VirtualMachine::ExecuteThrow() {
+            if (!CheckStackUnderflow(1)) {
+                ThrowException(VMDataType::INT32, XorS("Stack underflow in THROW"));
+                return false;
+            }
+            const VMValue value = m_value_stack.back();
+            m_value_stack.pop_back();
+            ThrowException(value.type, FormatValue(value));
+            m_current_exception.error_value = value;
+            return false;
+        }
+        bool VirtualMachine::ExecuteFinally() {
+            if (!m_exception_stack.empty() && m_exception_stack.back().call_depth == m_call_stack.size()) {
+                m_exception_stack.pop_back();
+            }
+            return true;
+        }
+
+        // Unwinds to the innermost handler. Runtime errors reach the handler as
+        // their message, thrown values as themselves.
+        bool VirtualMachine::HandleException() {
+            if (!m_has_exception || m_state != VMState::RUNNING) {
+                return false;
+            }
+            if (m_exception_stack.empty()) {
+                SetError(std::string(XorS("Uncaught exception: ")) + m_current_exception.message);
+                return false;
+            }
+
+            const ExceptionFrame handler = m_exception_stack.back();
+            m_exception_stack.pop_back();
+            const VMValue thrown = m_current_exception.error_value;
+            const std::string message = m_current_exception.message;
+            ClearException();
+
+            if (m_call_stack.size() > handler.call_depth) {
+                m_locals.resize(m_call_stack[handler.call_depth].local_base);
+                m_call_stack.resize(handler.call_depth);
+            }
+            m_value_stack.resize(std::min<size_t>(m_value_stack.size(), handler.stack_size));
+            if (thrown.type != VMDataType::UNDEFINED) {
+                PushValue(thrown);
+            } else {
+                PushString(message);
+            }
+            m_pc = handler.handler_address;
+            return !HasPendingException();
+        }
+
+        // Natives are looked up by the name held in the string constant
+        bool VirtualMachine::ExecuteCallNative() {
+            return InvokeNative(*reinterpret_cast<const uint16_t*>(&m_code_base[m_pc - 3]), m_code_base[m_pc - 1]);
+        }
+        bool VirtualMachine::ExecuteCallNativeWide() {
+            return InvokeNative(*reinterpret_cast<const uint32_t*>(&m_code_base[m_pc - 5]), m_code_base[m_pc - 1]);
+        }
+        bool VirtualMachine::InvokeNative(uint32_t name_index, uint32_t argument_count) {
+            // Taken before anything runs, so calls a handler makes into the
+            // VM never see this call site's cache
+            JITInlineCache* const cache = m_call_cache;
+            m_call_cache = nullptr;
+            const uint32_t boxed_index = name_index - m_int_constant_count - m_double_constant_count;
+            if (name_index < m_int_constant_count + m_double_constant_count || boxed_index >= m_boxed_constants.size() ||
+                m_boxed_constants[boxed_index].type != VMDataType::STRING) {
+                ThrowException(VMDataType::NATIVE_PTR, XorS("Invalid native function name"));
+                return false;
+            }
+            // A call site's cache stands for the lookup by name while no
+            // native function has changed since it was bound
+            using NativeFunction = decltype(m_native_functions)::mapped_type;
+            const NativeFunction* function;
+            if (cache && cache->generation == m_native_generation) {
+                function = static_cast<const NativeFunction*>(cache->target);
+            } else {
+                const VMValue& name_value = m_boxed_constants[boxed_index];
+                const std::string name(name_value.data.string.data, name_value.data.string.length);
+                auto it = m_native_functions.find(name);
+                if (it == m_native_functions.end()) {
+                    ThrowException(VMDataType::NATIVE_PTR, XorS("Unknown native function: ") + name);
+                    return false;
+                }
+                function = &it->second;
+                if (cache) {
+                    cache->generation = m_native_generation;
+                    cache->target = function;
+                    m_tier_statistics.call_cache_misses++;
+                }
+            }
+            if (!CheckStackUnderflow(argument_count)) {
+                ThrowException(VMDataType::NATIVE_PTR, XorS("Stack underflow in CALL_NATIVE"));
+                return false;
+            }
+
+            std::vector<VMValue> arguments(m_value_stack.end() - argument_count, m_value_stack.end());
+            m_value_stack.resize(m_value_stack.size() - argument_count);
+            PushValue((*function)(arguments));
+            return !HasPendingException();
+        }
         bool VirtualMachine::ExecuteLoadNative() { return true; }
         bool VirtualMachine::ExecuteGetNativeFunc() { return true; }
         bool VirtualMachine::ExecuteEncrypt() { return true; }
@@ -876,8 +2262,28 @@ namespace AetherVisor {
         bool VirtualMachine::ExecuteObfuscate() { return true; }
         bool VirtualMachine::ExecuteAntiDebug() { return true; }
         bool VirtualMachine::ExecuteAntiVM() { return true; }
-        bool VirtualMachine::ExecuteJITCompile() { return true; }
-        bool VirtualMachine::ExecuteJITExecute() { return true; }
+        // Tier requests from the program itself, no-ops unless the tiered JIT
+        // is on. JIT_COMPILE asks for optimised code for the running function,
+        // JIT_EXECUTE for native code of any tier, entered right after it.
+        bool VirtualMachine::ExecuteJITCompile() {
+            RequestTierUp(m_pc - 1, m_tier_settings.optimized_threshold);
+            return true;
+        }
+
+        bool VirtualMachine::ExecuteJITExecute() {
+            RequestTierUp(m_pc - 1, m_tier_settings.baseline_threshold);
+            return true;
+        }
+
+        // Raises the region's hotness; it tiers up before the next instruction
+        void VirtualMachine::RequestTierUp(uint32_t address, uint32_t hotness) {
+            if (m_baseline_jit && address < m_native_entries.size()) {
+                m_tier_request = m_native_entries[address].region;
+                NativeRegion& region = m_native_regions[m_tier_request];
+                region.hotness = std::max<uint64_t>(region.hotness, hotness);
+            }
+        }
+
         bool VirtualMachine::ExecuteProfile() { return true; }
         bool VirtualMachine::ExecuteNop() { return true; }
         bool VirtualMachine::ExecuteHalt() { 
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "VMOpcodes.h"
+#include "CompiledModule.h"
+#include "ExecutionProfile.h"
+#include "JITCompiler.h"
 #include "../security/SecurityHardening.h"
 #include <vector>
 #include <string>
@@ -10,6 +13,7 @@
 #include <chrono>
 #include <memory>
 #include <cstdint>
+#include <cstddef>
 #include <set>
 
 // Forward declarations to avoid circular dependencies
@@ -43,18 +47,113 @@ namespace AetherVisor {
             SECURITY_VIOLATION
         };
 
+        // Execution profiling for profile-guided optimisation
+        enum class ProfilingMode {
+            DISABLED,
+            COUNTING,       // Exact basic block and branch counts
+            SAMPLING        // Every sample_period-th instruction, weighted by the period
+        };
+
+        // Execution tiers of a function under the tiered JIT
+        enum class JITTier : uint8_t {
+            INTERPRETER,
+            BASELINE,       // Call-threaded code that counts its loop iterations
+            OPTIMIZED
+        };
+
+        // Hotness is a function's calls plus its loop iterations. A function
+        // tiers up on entry once it is hot enough; with OSR a loop that has run
+        // osr_threshold iterations also switches tier at its header.
+        struct JITTierSettings {
+            uint32_t baseline_threshold = 32;
+            uint32_t optimized_threshold = 2000;
+            uint32_t osr_threshold = 500;           // 0 disables on-stack replacement
+            uint32_t baseline_level = 0;            // JITSettings::optimization_level of each tier
+            uint32_t optimized_level = 2;
+            bool background_compilation = true;     // Keep interpreting while a compiler thread works
+        };
+
+        // Since the module was loaded or the JIT enabled
+        struct JITTierStatistics {
+            JITTierSettings settings;
+            uint32_t functions[3] = {};             // Per JITTier, currently
+            uint32_t compilations[3] = {};          // Per JITTier; INTERPRETER counts failed compiles
+            uint32_t osr_transitions = 0;           // Tier-ups taken at a loop header
+            uint64_t deoptimizations = 0;           // Guards failed in speculative code
+            uint32_t invalidations = 0;             // Regions dropped for deoptimising too often
+            uint64_t call_cache_misses = 0;         // Native calls from native code that looked their handler up
+            double compile_time_ms[3] = {};
+            uint64_t instructions[3] = {};          // Executed per JITTier
+
+            std::string Format() const;
+        };
+
         // Call frame for function calls
         struct CallFrame {
             uint32_t return_address;
             uint32_t local_base;
             uint32_t local_count;
+            uint32_t stack_base;        // Value stack height below the arguments
             VMFunction* function;
         };
 
+        // Value stack kept as plain pointers so JIT code can push and pop in
+        // place; the handlers use it like a vector. Storage grows in steps up
+        // to the VM's stack limit and may move on any push that grows it.
+        class ValueStack {
+        public:
+            ValueStack() : m_base(nullptr), m_top(nullptr), m_limit(nullptr), m_max_size(0) {}
+            ValueStack(const ValueStack&) = delete;
+            ValueStack& operator=(const ValueStack&) = delete;
+
+            void SetMaxSize(size_t max_size) { m_max_size = max_size; }
+
+            size_t size() const { return static_cast<size_t>(m_top - m_base); }
+            bool empty() const { return m_top == m_base; }
+            VMValue* begin() { return m_base; }
+            VMValue* end() { return m_top; }
+            VMValue& back() { return m_top[-1]; }
+            const VMValue& back() const { return m_top[-1]; }
+            VMValue& operator[](size_t index) { return m_base[index]; }
+            const VMValue& operator[](size_t index) const { return m_base[index]; }
+
+            void push_back(const VMValue& value) {
+                if (m_top == m_limit) {
+                    const VMValue copy = value;     // value may live in the storage that moves
+                    Grow(size() + 1);
+                    *m_top++ = copy;
+                    return;
+                }
+                *m_top++ = value;
+            }
+            void pop_back() { --m_top; }
+            void resize(size_t count);
+            void clear() { m_top = m_base; }
+
+            // Field offsets for generated code
+            static int32_t BaseOffset();
+            static int32_t TopOffset();
+            static int32_t LimitOffset();
+
+        private:
+            VMValue* m_base;
+            VMValue* m_top;             // One past the top value
+            VMValue* m_limit;           // End of the storage
+            std::vector<VMValue> m_storage;
+            size_t m_max_size;
+
+            void Grow(size_t required);
+        };
+
+        inline int32_t ValueStack::BaseOffset() { return static_cast<int32_t>(offsetof(ValueStack, m_base)); }
+        inline int32_t ValueStack::TopOffset() { return static_cast<int32_t>(offsetof(ValueStack, m_top)); }
+        inline int32_t ValueStack::LimitOffset() { return static_cast<int32_t>(offsetof(ValueStack, m_limit)); }
+
         // Exception handling frame
         struct ExceptionFrame {
             uint32_t handler_address;
             uint32_t stack_size;
+            uint32_t call_depth;        // Call frames live when the handler was installed
             VMDataType exception_type;
         };
 
@@ -76,6 +175,9 @@ namespace AetherVisor {
 
             // Bytecode execution with full security
             bool LoadBytecode(const std::vector<uint8_t>& bytecode);
+            bool LoadModule(std::shared_ptr<CompiledModule> module);
+            bool LoadModuleFile(const std::string& path);
+            const std::shared_ptr<CompiledModule>& GetModule() const { return m_module; }
             bool Run();
             bool RunSecure(uint32_t max_instructions = 1000000);
             void Pause();
@@ -95,6 +197,7 @@ namespace AetherVisor {
             VMValue PeekValue(size_t offset = 0) const;
             size_t GetStackSize() const { return m_value_stack.size(); }
             void ClearStack();
+            const std::vector<VMValue>& GetGlobals() const { return m_globals; }
 
             // Memory management
             uint32_t AllocateMemory(size_t size);
@@ -123,6 +226,33 @@ namespace AetherVisor {
             std::chrono::milliseconds GetExecutionTime() const;
             void ResetPerformanceCounters();
 
+            // Profile-guided optimisation. Counters survive Reset so repeated runs
+            // accumulate; loading another module starts a new profile. SaveProfile
+            // merges into an existing profile of the same code, by default the
+            // module's sidecar file, and then clears the counters.
+            void SetProfilingMode(ProfilingMode mode, uint32_t sample_period = 61);
+            ProfilingMode GetProfilingMode() const { return m_profiling_mode; }
+            ExecutionProfile ExportProfile() const;
+            bool SaveProfile(const std::string& path = std::string());
+            void ResetProfile();
+
+            // JIT. Functions are compiled to native code that runs on the VM's
+            // own stack, locals and globals; instructions without a native fast
+            // path run in the interpreter from there. The interpreter takes over
+            // while profiling or with breakpoints set. EnableJIT compiles every
+            // function on load at one level; EnableTieredJIT starts them in the
+            // interpreter and compiles them as they get hot.
+            bool EnableJIT(bool enable, uint32_t optimization_level = 1);
+            bool EnableTieredJIT(const JITTierSettings& settings = JITTierSettings());
+            bool IsJITEnabled() const { return m_jit != nullptr; }
+            size_t GetNativeCodeSize() const;
+            const JITTierStatistics& GetTierStatistics() const { return m_tier_statistics; }
+
+            // Names native code for perf from now on, code compiled so far
+            // included: a perf map, and with jitdump the code and its source
+            // lines too. See JITProfilerMap.
+            bool EnableProfilerSymbols(bool jitdump = false);
+
             // Security features
             bool VerifyBytecodeIntegrity(const std::vector<uint8_t>& bytecode);
             void EnableSandboxMode(bool enable) { m_sandbox_mode = enable; }
@@ -142,15 +272,16 @@ namespace AetherVisor {
             bool m_sandbox_mode;
 
             // Bytecode and execution
-            std::vector<uint8_t> m_bytecode;
+            std::shared_ptr<CompiledModule> m_module;
             uint32_t m_pc; // Program counter
-            const uint8_t* m_code_base;
+            const uint8_t* m_code_base; // Points into m_module's image
             uint32_t m_code_size;
 
             // Stack management
-            std::vector<VMValue> m_value_stack;
+            ValueStack m_value_stack;
             std::vector<CallFrame> m_call_stack;
             std::vector<ExceptionFrame> m_exception_stack;
+            std::vector<VMValue> m_locals;      // Frames' local slots, each frame from its local_base
             size_t m_max_stack_size;
 
             // Memory management with security
@@ -162,9 +293,19 @@ namespace AetherVisor {
             // Native functions with enhanced security
             std::map<std::string, std::function<VMValue(const std::vector<VMValue>&)>> m_native_functions;
             std::set<std::string> m_allowed_native_functions;
-
-            // Constants and globals
-            std::vector<VMConstant> m_constants;
+            uint64_t m_native_generation;       // Changes with m_native_functions, unbinding every call site cache
+            JITInlineCache* m_call_cache;       // For the native call about to be stepped, until InvokeNative takes it
+
+            // Constants in module index order: ints, doubles, then boxed values.
+            // The packed pools are read in place from the module image.
+            const int64_t* m_int_constants;
+            uint32_t m_int_constant_count;
+            const double* m_double_constants;
+            uint32_t m_double_constant_count;
+            std::vector<VMValue> m_boxed_constants;    // Strings and other constants
+            std::vector<std::unique_ptr<char[]>> m_runtime_strings; // Strings created during execution
+
+            // Globals
             std::vector<VMValue> m_globals;
             std::vector<VMFunction> m_functions;
 
@@ -178,8 +319,78 @@ namespace AetherVisor {
             std::chrono::time_point<std::chrono::steady_clock> m_execution_start;
             uint32_t m_max_instructions_per_run;
 
+            // Profiling; counters are indexed by code offset
+            ProfilingMode m_profiling_mode;
+            uint32_t m_sample_period;
+            uint32_t m_sample_countdown;
+            uint32_t m_sampled_address;                 // Instruction the last sample landed on
+            std::vector<uint32_t> m_block_lengths;      // Instructions in the block starting here, 0 elsewhere
+            std::vector<uint32_t> m_execution_counts;   // Block entries, or samples per instruction
+            std::vector<BranchProfile> m_branch_counts;
+            std::string m_module_path;                  // Set by LoadModuleFile, for the profile sidecar
+
+            void PrepareProfile();
+            void RecordExecution(uint32_t address);
+            bool RecordBranch(uint32_t address, bool executed);
+
+            // Native code; regions are function extents of the loaded module
+            static constexpr uint32_t NATIVE_SLICE = 65536;     // Instructions per native run between the loop's checks
+            static constexpr uint32_t NO_NATIVE_ENTRY = 0xFFFFFFFF;
+            static constexpr uint32_t NO_TIER_REQUEST = 0xFFFFFFFF;
+            static constexpr uint32_t DEOPT_LIMIT = 8;          // Guard failures at a loop before it is compiled without speculation
+
+            struct NativeRegion {
+                uint32_t start;
+                uint32_t end;
+                std::string name;               // Of the function, for profilers
+                JITTier tier;
+                uint64_t hotness;               // Calls and loop iterations
+                bool compile_failed;            // Stops tiering up
+                JITTier queued;                 // Highest tier on the compile queue, else the current tier
+                bool queued_at_loop;            // Asked for at a loop header, so installing it is OSR
+                bool invalidated;               // Deoptimised too often; its code is dropped before it runs again
+                JITCompilationResult code;      // For the current tier, once compiled
+                std::vector<JITInlineCache> call_caches;    // For code's call sites
+            };
+            struct NativeEntry {
+                uint32_t region;                // Region holding the address
+                uint32_t offset;                // Into its native code, or NO_NATIVE_ENTRY
+                bool loop_header;               // Target of a back-edge within the region
+            };
+
+            std::unique_ptr<JITCompiler> m_jit;                 // Optimising tier, or the only one when not tiered
+            std::unique_ptr<JITCompiler> m_baseline_jit;        // Null when not tiered
+            JITTierSettings m_tier_settings;
+            JITTierStatistics m_tier_statistics;
+            std::vector<NativeRegion> m_native_regions;
+            std::vector<NativeEntry> m_native_entries;          // Per code offset
+            std::vector<uint32_t> m_loop_counts;                // Per code offset, counted at loop headers
+            std::vector<uint32_t> m_deopt_counts;               // Per code offset, guard failures by loop header
+            uint32_t m_tier_request;                            // Region JIT_COMPILE or JIT_EXECUTE asked to tier up
+            JITContext m_native_context;
+            uint32_t m_native_region;                           // Of the native code running
+            std::unique_ptr<JITCompileQueue> m_compile_queue;   // Destroyed before the compilers it uses
+            bool m_profiler_symbols;
+
+            void CompileNative();
+            void ReleaseNative();
+            void InstallNative(uint32_t region, JITTier tier, JITCompilationResult code, bool at_loop_header);
+            void InstallFinished();
+            void UpdateTier(uint32_t region, bool loop_header);
+            void InvalidateNative(uint32_t region);
+            void RecordNativeSymbols(const NativeRegion& region);
+            void RequestTierUp(uint32_t address, uint32_t hotness);
+            bool RunNative(uint32_t budget, uint32_t& executed);
+            void UpdateNativeContext();
+            static int NativeStep(JITContext* context, uint32_t pc);
+            static int NativeCall(JITContext* context, uint32_t pc, JITInlineCache* cache);
+            static void NativeDeopt(JITContext* context, uint32_t point);
+
             // Execution helpers
             bool ExecuteInstruction();
+            bool HandleException();
+            bool ReturnFromCall(const VMValue& result);
+            bool InvokeNative(uint32_t name_index, uint32_t argument_count);
             bool DecodeInstruction(VMOpcode& opcode, uint32_t& operand1, uint32_t& operand2, uint32_t& operand3);
             // Instruction handlers (declarations)
             bool ExecutePushInt();
@@ -187,6 +398,8 @@ namespace AetherVisor {
             bool ExecutePushDouble();
             bool ExecutePushString();
             bool ExecutePushConst();
+            bool ExecutePushConstWide();
+            bool PushConstant(uint32_t index);
             bool ExecutePop();
             bool ExecuteDup();
             bool ExecuteSwap();
@@ -244,6 +457,7 @@ namespace AetherVisor {
             bool ExecuteThrow();
             bool ExecuteFinally();
             bool ExecuteCallNative();
+            bool ExecuteCallNativeWide();
             bool ExecuteLoadNative();
             bool ExecuteGetNativeFunc();
             bool ExecuteEncrypt();
@@ -280,6 +494,17 @@ namespace AetherVisor {
             std::string PopString();
             bool PopBoolean();
 
+            // Shared bodies for the generic and type-specialised handlers. The
+            // specialised forms trust the compiler's type proof and skip dispatch.
+            bool ExecuteArithmetic(VMOpcode opcode);
+            bool ExecuteComparison(VMOpcode opcode);
+            bool ExecuteInt32Arithmetic(VMOpcode opcode);
+            bool ExecuteFloat64Arithmetic(VMOpcode opcode);
+            bool ExecuteInt32Comparison(VMOpcode opcode);
+            bool ExecuteFloat64Comparison(VMOpcode opcode);
+            static bool IsTruthy(const VMValue& value);
+            static std::string FormatValue(const VMValue& value);
+
             // Arithmetic operations with overflow checking
             bool SafeAdd(int32_t a, int32_t b, int32_t& result);
             bool SafeSubtract(int32_t a, int32_t b, int32_t& result);
@@ -0,0 +1,155 @@
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "X64Assembler.h"
+#include "../security/XorStr.h"
+#include "JITCompiler.h"
+
+namespace AetherVisor {
+    namespace VM {
+
+        using namespace X64;
+
+        void X64Assembler::EmitJump(uint32_t target_label) {
+            EmitByte(0xE9);
+            AddRelocation(static_cast<uint32_t>(machine_code.size()), target_label, 0);
+            EmitDWord(0);
+        }
+
+        void X64Assembler::EmitJumpIf(uint8_t condition, uint32_t target_label) {
+            EmitByte(0x0F);
+            EmitByte(0x80 | condition);
+            AddRelocation(static_cast<uint32_t>(machine_code.size()), target_label, 0);
+            EmitDWord(0);
+        }
+
+        void X64Assembler::EmitCall(uint32_t target_label) {
+            EmitByte(0xE8);
+            AddRelocation(static_cast<uint32_t>(machine_code.size()), target_label, 0);
+            EmitDWord(0);
+        }
+
+        // Relocations are rel32 fields, relative to the end of the field
+        void X64Assembler::PatchRelocation(const Relocation& relocation, uint32_t target) {
+            const uint32_t displacement = target - (relocation.offset + 4);
+            for (uint32_t k = 0; k < 4; ++k) {
+                machine_code[relocation.offset + k] = static_cast<uint8_t>(displacement >> (8 * k));
+            }
+        }
+
+        void X64Assembler::EmitMemory(std::initializer_list<uint8_t> opcode, uint8_t reg, uint8_t base,
+                                      int32_t displacement, bool wide, uint8_t prefix) {
+            if (prefix) {
+                EmitByte(prefix);
+            }
+            const uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((base & 8) ? 0x01 : 0);
+            if (rex != 0x40) {
+                EmitByte(rex);
+            }
+            for (uint8_t byte : opcode) {
+                EmitByte(byte);
+            }
+
+            const uint8_t mod = (displacement == 0 && (base & 7) != RBP) ? 0x00
+                              : (displacement >= -128 && displacement <= 127) ? 0x40 : 0x80;
+            EmitByte(mod | ((reg & 7) << 3) | (base & 7));
+            if ((base & 7) == RSP) {
+                EmitByte(0x24);     // SIB with no index, for rsp and r12 bases
+            }
+            if (mod == 0x40) {
+                EmitByte(static_cast<uint8_t>(displacement));
+            } else if (mod == 0x80) {
+                EmitDWord(static_cast<uint32_t>(displacement));
+            }
+        }
+
+        void X64Assembler::EmitRegister(std::initializer_list<uint8_t> opcode, uint8_t reg, uint8_t rm, bool wide,
+                                        uint8_t prefix) {
+            if (prefix) {
+                EmitByte(prefix);
+            }
+            const uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+            if (rex != 0x40) {
+                EmitByte(rex);
+            }
+            for (uint8_t byte : opcode) {
+                EmitByte(byte);
+            }
+            EmitByte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+        }
+
+        // Keeps what both ABIs need preserved and pins the context and the
+        // value stack. The frame leaves rsp 16-byte aligned with Win64 shadow
+        // space, then the spill slots of register loops.
+        void X64Assembler::EmitPrologue(uint32_t spill_slots) {
+            frame_size = FRAME_SIZE + (spill_slots + 1) / 2 * 16;
+            EmitByte(0x53);                                                 // push rbx
+            EmitByte(0x41);
+            EmitByte(0x54);                                                 // push r12
+            EmitRegister({ 0x81 }, 5, RSP, true);                           // sub rsp, frame
+            EmitDWord(frame_size);
+            EmitRegister({ 0x89 }, ARG0, RBX, true);                        // mov rbx, context
+            EmitMemory({ 0x8B }, R12, RBX, CONTEXT_STACK, true);            // mov r12, [rbx + stack]
+            EmitRegister({ 0xFF }, 4, ARG1);                                // jmp entry
+        }
+
+        void X64Assembler::EmitEpilogue() {
+            EmitRegister({ 0x31 }, RAX, RAX);                               // xor eax, eax
+            EmitRegister({ 0x81 }, 0, RSP, true);                           // add rsp, frame
+            EmitDWord(frame_size);
+            EmitByte(0x41);
+            EmitByte(0x5C);                                                 // pop r12
+            EmitByte(0x5B);                                                 // pop rbx
+            EmitByte(0xC3);                                                 // ret
+        }
+
+        void X64Assembler::EmitStep(uint32_t pc, uint32_t stopped_label) {
+            EmitRegister({ 0x89 }, RBX, ARG0, true);                        // mov arg0, rbx
+            EmitByte(0xB8 | ARG1);                                          // mov arg1d, pc
+            EmitDWord(pc);
+            EmitMemory({ 0xFF }, 2, RBX, CONTEXT_STEP);                     // call [rbx + step]
+            EmitRegister({ 0x85 }, RAX, RAX);                               // test eax, eax
+            EmitJumpIf(CC_NE, stopped_label);
+        }
+
+        void X64Assembler::EmitNativeCall(uint32_t pc, uint32_t cache, uint32_t stopped_label) {
+            EmitRegister({ 0x89 }, RBX, ARG0, true);                        // mov arg0, rbx
+            EmitByte(0xB8 | ARG1);                                          // mov arg1d, pc
+            EmitDWord(pc);
+            EmitMemory({ 0x8B }, ARG2, RBX, CONTEXT_CALL_CACHES, true);     // mov arg2, [rbx + call_caches]
+            if (cache) {
+                EmitRegister({ 0x81 }, 0, ARG2, true);                      // add arg2, cache
+                EmitDWord(cache * static_cast<uint32_t>(sizeof(JITInlineCache)));
+            }
+            EmitMemory({ 0xFF }, 2, RBX, CONTEXT_CALL);                     // call [rbx + call]
+            EmitRegister({ 0x85 }, RAX, RAX);                               // test eax, eax
+            EmitJumpIf(CC_NE, stopped_label);
+        }
+
+        void X64Assembler::EmitBlockCharge(uint32_t length, uint32_t exhausted_label) {
+            EmitMemory({ 0x81 }, 5, RBX, CONTEXT_BUDGET, true);             // sub qword [rbx + budget], length
+            EmitDWord(length);
+            EmitJumpIf(CC_L, exhausted_label);
+        }
+
+        void X64Assembler::EmitRefund(uint32_t count) {
+            EmitMemory({ 0x81 }, 0, RBX, CONTEXT_BUDGET, true);             // add qword [rbx + budget], count
+            EmitDWord(count);
+        }
+
+        void X64Assembler::EmitSetPc(uint32_t address) {
+            EmitMemory({ 0xC7 }, 0, RBX, CONTEXT_PC);                       // mov dword [rbx + pc], address
+            EmitDWord(address);
+        }
+
+        void X64Assembler::EmitCountBackEdge(uint32_t header, uint32_t countdown_label) {
+            EmitMemory({ 0x8B }, RCX, RBX, CONTEXT_LOOP_COUNTS, true);      // mov rcx, [rbx + loop_counts]
+            EmitMemory({ 0x83 }, 0, RCX, static_cast<int32_t>(header * sizeof(uint32_t)));    // add dword [rcx + header], 1
+            EmitByte(1);
+            EmitMemory({ 0x83 }, 5, RBX, CONTEXT_TIER_COUNTDOWN, true);     // sub qword [rbx + countdown], 1
+            EmitByte(1);
+            EmitJumpIf(CC_L, countdown_label);
+        }
+
+    } // namespace VM
+} // namespace AetherVisor
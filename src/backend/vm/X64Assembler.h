@@ -0,0 +1,56 @@
+#pragma once
+
+#include "JITAssembler.h"
+#include <initializer_list>
+
+namespace AetherVisor {
+    namespace VM {
+
+        namespace X64 {
+            // Registers by encoding
+            constexpr uint8_t RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7, R8 = 8, R12 = 12;
+            constexpr uint8_t XMM0 = 0, XMM1 = 1;
+
+            // Condition codes of Jcc and SETcc
+            constexpr uint8_t CC_O = 0x0, CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+                              CC_P = 0xA, CC_NP = 0xB, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF;
+
+#ifdef _WIN32
+            constexpr uint8_t ARG0 = RCX, ARG1 = RDX, ARG2 = R8;       // Win64
+#else
+            constexpr uint8_t ARG0 = RDI, ARG1 = RSI, ARG2 = RDX;      // System V
+#endif
+            constexpr uint8_t FRAME_SIZE = 40;              // After two pushes: 32 bytes of shadow space, rsp aligned
+        }
+
+        // x86-64 encodings. The context is pinned in rbx and the value stack
+        // in r12; rax, rcx and rdx are scratch.
+        struct X64Assembler : JITAssembler {
+            uint32_t frame_size = 0;                // Below the pushes: shadow space, then spill slots
+
+            void EmitJump(uint32_t target_label) override;
+            void EmitJumpIf(uint8_t condition, uint32_t target_label);
+            void EmitCall(uint32_t target_label);
+
+            // ModRM forms: a register operand against [base + displacement],
+            // or against another register
+            void EmitMemory(std::initializer_list<uint8_t> opcode, uint8_t reg, uint8_t base, int32_t displacement,
+                            bool wide = false, uint8_t prefix = 0);
+            void EmitRegister(std::initializer_list<uint8_t> opcode, uint8_t reg, uint8_t rm, bool wide = false,
+                              uint8_t prefix = 0);
+
+            void EmitPrologue(uint32_t spill_slots) override;
+            void EmitEpilogue() override;
+            void EmitStep(uint32_t pc, uint32_t stopped_label) override;
+            void EmitNativeCall(uint32_t pc, uint32_t cache, uint32_t stopped_label) override;
+            void EmitBlockCharge(uint32_t length, uint32_t exhausted_label) override;
+            void EmitRefund(uint32_t count) override;
+            void EmitSetPc(uint32_t address) override;
+            void EmitCountBackEdge(uint32_t header, uint32_t countdown_label) override;
+
+        protected:
+            void PatchRelocation(const Relocation& relocation, uint32_t target) override;
+        };
+
+    } // namespace VM
+} // namespace AetherVisor